@@ -0,0 +1,246 @@
+#ifndef ADABOOST_H
+#define ADABOOST_H
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include <tbb/tbb.h>
+
+
+
+/**
+ * Decision stump over the response of one classifier: a sample is positive when
+ * polarity * response < polarity * threshold.
+ */
+struct WeakClassifier
+{
+    int feature;
+    float threshold;
+    int polarity;
+    double error; //weighted, in the round it was chosen
+    double alpha; //vote of the stump in the strong classifier
+
+    inline bool classify(const float response) const
+    {
+        return polarity * response < polarity * threshold;
+    }
+};
+
+
+
+/**
+ * Discrete AdaBoost (Viola & Jones) over the responses of a set of classifiers on labelled
+ * samples, all kept in memory.
+ *
+ * Responses are one column of samples per classifier. The samples of each column are
+ * sorted once, so finding the best threshold of a classifier in a round is a single scan
+ * with running weight sums, and the classifiers are scanned in parallel with a TBB
+ * reduction. After each round only the weights of the samples the chosen stump got right
+ * are updated; nothing is evaluated again.
+ */
+class AdaBoost
+{
+public:
+    /**
+     * Bytes taken by the responses of features classifiers on some samples and by their
+     * presorted order, 8 per classifier and sample, plus the weights of the samples.
+     */
+    static double memory(const size_t features, const size_t samples)
+    {
+        return (double)features * samples * (sizeof(float) + sizeof(int)) + (double)samples * sizeof(double);
+    }
+
+    /**
+     * responses holds features columns of labels.size() samples; labels are 1 for positive
+     * samples and 0 for negative ones.
+     */
+    AdaBoost(const std::vector<float> & responses_,
+             const std::vector<char> & labels_,
+             const int features_) : responses(responses_),
+                                    labels(labels_),
+                                    features(features_),
+                                    samples(labels_.size()),
+                                    order((size_t)features_ * labels_.size()),
+                                    weights(labels_.size())
+    {
+        tbb::parallel_for(tbb::blocked_range<int>(0, features), Presort(this));
+
+        //Each class starts with half of the weight
+        const double positives = std::count(labels.begin(), labels.end(), 1);
+        const double negatives = samples - positives;
+        for (int s = 0; s < samples; ++s)
+        {
+            weights[s] = labels[s] ? 0.5 / positives : 0.5 / negatives;
+        }
+    }
+
+    /**
+     * Picks the stump of least weighted error and reweights the samples.
+     */
+    WeakClassifier round()
+    {
+        double totalPositive = 0, totalNegative = 0;
+        for (int s = 0; s < samples; ++s)
+        {
+            (labels[s] ? totalPositive : totalNegative) += weights[s];
+        }
+
+        FindBestStump search(this, totalPositive, totalNegative);
+        tbb::parallel_reduce(tbb::blocked_range<int>(0, features), search);
+
+        WeakClassifier best = search.best;
+        const double error = std::max(best.error, std::numeric_limits<double>::epsilon());
+        const double beta = error / (1 - error);
+        best.alpha = std::log(1 / beta);
+
+        //Samples the stump got right lose weight, then the weights are normalized
+        const float * const column = &responses[(size_t)best.feature * samples];
+        double total = 0;
+        for (int s = 0; s < samples; ++s)
+        {
+            if ( best.classify(column[s]) == (labels[s] == 1) )
+            {
+                weights[s] *= beta;
+            }
+            total += weights[s];
+        }
+        for (int s = 0; s < samples; ++s)
+        {
+            weights[s] /= total;
+        }
+
+        return best;
+    }
+
+private:
+    const std::vector<float> & responses;
+    const std::vector<char> & labels;
+    int features;
+    int samples;
+    std::vector<int> order;     //samples of each feature sorted by response
+    std::vector<double> weights;
+
+    struct ByResponse
+    {
+        const float * column;
+
+        bool operator()(const int a, const int b) const
+        {
+            return column[a] < column[b];
+        }
+    };
+
+    class Presort
+    {
+        AdaBoost * boost;
+
+    public:
+        void operator()(const tbb::blocked_range<int> range) const
+        {
+            for (int f = range.begin(); f != range.end(); ++f)
+            {
+                int * const sorted = &boost->order[(size_t)f * boost->samples];
+                for (int s = 0; s < boost->samples; ++s)
+                {
+                    sorted[s] = s;
+                }
+
+                ByResponse byResponse;
+                byResponse.column = &boost->responses[(size_t)f * boost->samples];
+                std::sort(sorted, sorted + boost->samples, byResponse);
+            }
+        }
+
+        Presort(AdaBoost * boost_) : boost(boost_) {}
+    };
+
+    /**
+     * Body of the TBB reduction that finds the stump of least weighted error.
+     */
+    class FindBestStump
+    {
+        const AdaBoost * boost;
+        double totalPositive, totalNegative;
+
+    public:
+        WeakClassifier best;
+
+        void operator()(const tbb::blocked_range<int> range)
+        {
+            for (int f = range.begin(); f != range.end(); ++f)
+            {
+                const int * const sorted = &boost->order[(size_t)f * boost->samples];
+                const float * const column = &boost->responses[(size_t)f * boost->samples];
+
+                //Weights of the samples below the threshold
+                double positiveBelow = 0, negativeBelow = 0;
+                for (int i = 0; i < boost->samples; ++i)
+                {
+                    const int s = sorted[i];
+                    (boost->labels[s] ? positiveBelow : negativeBelow) += boost->weights[s];
+
+                    //Thresholds only go between different responses
+                    if ( i + 1 < boost->samples && column[ sorted[i + 1] ] == column[s] )
+                    {
+                        continue;
+                    }
+                    const float threshold = i + 1 < boost->samples ? (column[s] + column[ sorted[i + 1] ]) / 2
+                                                                   : column[s] + 1;
+
+                    //Positives below the threshold, or positives above it
+                    const double belowError = negativeBelow + (totalPositive - positiveBelow);
+                    const double aboveError = positiveBelow + (totalNegative - negativeBelow);
+                    if (belowError < best.error)
+                    {
+                        set(f, threshold, 1, belowError);
+                    }
+                    if (aboveError < best.error)
+                    {
+                        set(f, threshold, -1, aboveError);
+                    }
+                }
+            }
+        }
+
+        void join(const FindBestStump & other)
+        {
+            if ( other.best.error < best.error
+                 || (other.best.error == best.error && other.best.feature < best.feature) )
+            {
+                best = other.best;
+            }
+        }
+
+        FindBestStump(const AdaBoost * boost_,
+                      const double totalPositive_,
+                      const double totalNegative_) : boost(boost_),
+                                                     totalPositive(totalPositive_),
+                                                     totalNegative(totalNegative_)
+        {
+            set(-1, 0, 1, std::numeric_limits<double>::max());
+        }
+
+        FindBestStump(FindBestStump & other, tbb::split) : boost(other.boost),
+                                                           totalPositive(other.totalPositive),
+                                                           totalNegative(other.totalNegative)
+        {
+            set(-1, 0, 1, std::numeric_limits<double>::max());
+        }
+
+    private:
+        void set(const int feature, const float threshold, const int polarity, const double error)
+        {
+            best.feature = feature;
+            best.threshold = threshold;
+            best.polarity = polarity;
+            best.error = error;
+            best.alpha = 0;
+        }
+    };
+};
+
+
+
+#endif // ADABOOST_H
@@ -0,0 +1,201 @@
+#ifndef BATCHED_EIGEN_H
+#define BATCHED_EIGEN_H
+
+#include <cmath>
+#include <stdexcept>
+
+#include "srfs_moments.h"
+#include "symmetric_eigen.h"
+
+
+
+#define EIGEN_BATCH 8 //most covariance matrices decomposed together
+
+
+
+/**
+ * Eigen decomposition of up to EIGEN_BATCH covariance matrices of K dimensions at once.
+ * The matrices are laid out as structures of arrays, element (i, j) of every matrix next
+ * to each other, and every cyclic Jacobi rotation is applied to all of them in a loop over
+ * the lanes the compiler turns into SIMD instructions. The rotation of each lane is picked
+ * without branches; a lane whose element is already zero gets the identity rotation.
+ *
+ * Sweeps go on until every lane converged, so each matrix ends up as close to diagonal as
+ * SymmetricEigen gets it. Lanes past the amount of matrices are padded with the identity.
+ */
+template <int K>
+class BatchedSymmetricEigen
+{
+public:
+    void solve(const SrfsMoments * const * const moments, const int count)
+    {
+        if (count < 1 || count > EIGEN_BATCH)
+        {
+            throw std::logic_error("Batch size out of range.");
+        }
+        lanes = count;
+
+        for (int l = 0; l < EIGEN_BATCH; ++l)
+        {
+            if ( l < count && (moments[l]->count < 2 || moments[l]->dimensions != K) )
+            {
+                throw std::logic_error("Number of records smaller than two or dimensions out of the batch.");
+            }
+
+            for (int i = 0; i < K; ++i)
+            {
+                for (int j = 0; j < K; ++j)
+                {
+                    covariance[i][j][l] = l < count ? moments[l]->covariance(i, j) : (i == j ? 1 : 0);
+                    a[i][j][l] = covariance[i][j][l];
+                    v[i][j][l] = i == j ? 1 : 0;
+                }
+            }
+        }
+
+        for (int sweep = 0; sweep < JACOBI_MAX_SWEEPS && !converged(); ++sweep)
+        {
+            for (int p = 0; p < K; ++p)
+            {
+                for (int q = p + 1; q < K; ++q)
+                {
+                    rotate(p, q);
+                }
+            }
+        }
+    }
+
+    /**
+     * Copies the decomposition of one of the matrices, sorted and signed as libpca does.
+     */
+    void get(const int lane, SymmetricEigen & eigen) const
+    {
+        eigen.dimensions = K;
+
+        double diagonal[MAX_RECTANGLES];
+        double vectors[MAX_RECTANGLES][MAX_RECTANGLES];
+        for (int i = 0; i < K; ++i)
+        {
+            diagonal[i] = a[i][i][lane];
+            for (int j = 0; j < K; ++j)
+            {
+                eigen.covariance[i][j] = covariance[i][j][lane];
+                vectors[i][j] = v[i][j][lane];
+            }
+        }
+
+        eigen.arrange(diagonal, vectors);
+    }
+
+private:
+    int lanes;
+    double covariance[K][K][EIGEN_BATCH];
+    double a[K][K][EIGEN_BATCH];
+    double v[K][K][EIGEN_BATCH];
+
+    bool converged() const
+    {
+        bool all = true;
+        for (int l = 0; l < lanes; ++l)
+        {
+            double diagonal = 0, offDiagonal = 0;
+            for (int p = 0; p < K; ++p)
+            {
+                diagonal += a[p][p][l] * a[p][p][l];
+                for (int q = p + 1; q < K; ++q)
+                {
+                    offDiagonal += a[p][q][l] * a[p][q][l];
+                }
+            }
+            all = all && offDiagonal <= 1e-30 * diagonal;
+        }
+        return all;
+    }
+
+    /**
+     * Zeroes element (p, q) of every lane (Numerical Recipes, 11.1).
+     */
+    void rotate(const int p, const int q)
+    {
+        double c[EIGEN_BATCH], s[EIGEN_BATCH];
+        for (int l = 0; l < EIGEN_BATCH; ++l)
+        {
+            const double apq = a[p][q][l];
+            const bool zero = apq == 0;
+            const double theta = (a[q][q][l] - a[p][p][l]) / (2 * (zero ? 1 : apq));
+            const double t = zero ? 0 : (theta >= 0 ? 1 : -1) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+            c[l] = 1 / std::sqrt(t * t + 1);
+            s[l] = t * c[l];
+        }
+
+        for (int k = 0; k < K; ++k)
+        {
+            for (int l = 0; l < EIGEN_BATCH; ++l)
+            {
+                const double akp = a[k][p][l], akq = a[k][q][l];
+                a[k][p][l] = c[l] * akp - s[l] * akq;
+                a[k][q][l] = s[l] * akp + c[l] * akq;
+            }
+        }
+        for (int k = 0; k < K; ++k)
+        {
+            for (int l = 0; l < EIGEN_BATCH; ++l)
+            {
+                const double apk = a[p][k][l], aqk = a[q][k][l];
+                a[p][k][l] = c[l] * apk - s[l] * aqk;
+                a[q][k][l] = s[l] * apk + c[l] * aqk;
+            }
+        }
+        for (int k = 0; k < K; ++k)
+        {
+            for (int l = 0; l < EIGEN_BATCH; ++l)
+            {
+                const double vkp = v[k][p][l], vkq = v[k][q][l];
+                v[k][p][l] = c[l] * vkp - s[l] * vkq;
+                v[k][q][l] = s[l] * vkp + c[l] * vkq;
+            }
+        }
+    }
+};
+
+
+
+/**
+ * Decomposes a batch of moments of K dimensions into eigens.
+ */
+template <int K>
+inline void solveBatch(const SrfsMoments * const * const moments, const int count, SymmetricEigen * const eigens)
+{
+    BatchedSymmetricEigen<K> batch;
+    batch.solve(moments, count);
+    for (int l = 0; l < count; ++l)
+    {
+        batch.get(l, eigens[l]);
+    }
+}
+
+
+
+/**
+ * Decomposes the covariances of count (up to EIGEN_BATCH) moments of the same dimensions
+ * into eigens. Two to four dimensions go through the batched solver, the rest one by one.
+ */
+inline void solveSymmetricEigens(const SrfsMoments * const * const moments, const int count, SymmetricEigen * const eigens)
+{
+    switch ( moments[0]->dimensions )
+    {
+        case 2:  solveBatch<2>(moments, count, eigens); break;
+        case 3:  solveBatch<3>(moments, count, eigens); break;
+        case 4:  solveBatch<4>(moments, count, eigens); break;
+        default:
+            for (int l = 0; l < count; ++l)
+            {
+                eigens[l].solve(*moments[l]);
+            }
+            break;
+    }
+}
+
+
+
+#endif // BATCHED_EIGEN_H
@@ -0,0 +1,456 @@
+#ifndef BOOTSTRAP_H
+#define BOOTSTRAP_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <random>
+#include <limits>
+#include <cmath>
+
+#include <tbb/tbb.h>
+
+#include "srfs_moments.h"
+#include "symmetric_eigen.h"
+#include "batched_eigen.h"
+#include "optimization_commons.h"
+
+
+
+#define BOOTSTRAP_REPLICATES 100      //resamples of the sample set, by default
+#define BOOTSTRAP_MAX_REPLICATES 1000 //most resamples that can be asked for
+#define BOOTSTRAP_SEED 5489u
+#define BOOTSTRAP_CONFIDENCE 0.95
+
+
+
+/**
+ * Poisson(1) weight of every sample in every bootstrap replicate: how many times the
+ * sample is drawn into the replicate. Each sample has its own generator, seeded with its
+ * index, so the weights do not depend on how the work is split among threads. The same
+ * replicates are used for every wavelet, which makes ranks within a replicate meaningful.
+ */
+class PoissonWeights
+{
+public:
+    PoissonWeights() : replicates_(0) {}
+
+    void generate(const int samples, const int replicates)
+    {
+        replicates_ = replicates;
+        weights.resize((size_t)samples * replicates);
+        tbb::parallel_for(tbb::blocked_range<int>(0, samples), Generate(this));
+    }
+
+    int replicates() const
+    {
+        return replicates_;
+    }
+
+    const unsigned char * sample(const int i) const
+    {
+        return &weights[(size_t)i * replicates_];
+    }
+
+private:
+    int replicates_;
+    std::vector<unsigned char> weights; //samples x replicates, replicate fastest
+
+    class Generate
+    {
+        PoissonWeights * poissonWeights;
+
+    public:
+        void operator()(const tbb::blocked_range<int> range) const
+        {
+            const int replicates = poissonWeights->replicates_;
+            for (int i = range.begin(); i != range.end(); ++i)
+            {
+                std::mt19937 generator(BOOTSTRAP_SEED + i);
+                std::poisson_distribution<int> poisson(1.0);
+                for (int r = 0; r < replicates; ++r)
+                {
+                    poissonWeights->weights[(size_t)i * replicates + r] = std::min(poisson(generator), 255);
+                }
+            }
+        }
+
+        Generate(PoissonWeights * poissonWeights_) : poissonWeights(poissonWeights_) {}
+    };
+};
+
+
+
+/**
+ * Adds each SRFS to the statistics of the sample set and, with its Poisson weights, to the
+ * statistics of every bootstrap replicate, so all of them come out of a single pass.
+ */
+class BootstrapAccumulator
+{
+public:
+    BootstrapAccumulator(SrfsMoments & moments_,
+                         std::vector<SrfsMoments> & replicates_,
+                         const PoissonWeights & weights_) : moments(moments_),
+                                                            replicates(replicates_),
+                                                            weights(weights_),
+                                                            sample(0) {}
+
+    template <int K, typename T>
+    inline void visit(const T * const srfs)
+    {
+        double values[MAX_RECTANGLES];
+        std::copy(srfs, srfs + (K > 0 ? K : moments.dimensions), values);
+
+        moments.template add<K>(values);
+
+        const unsigned char * const w = weights.sample(sample++);
+        for (int r = 0; r < weights.replicates(); ++r)
+        {
+            if (w[r])
+            {
+                replicates[r].template add<K>(values, (double)w[r]);
+            }
+        }
+    }
+
+private:
+    SrfsMoments & moments;
+    std::vector<SrfsMoments> & replicates;
+    const PoissonWeights & weights;
+    int sample;
+};
+
+
+
+/**
+ * Adds the SRFS of a wavelet over the samples to its statistics and to the statistics of
+ * the bootstrap replicates, which are reset first.
+ */
+template <typename IntegralType>
+void accumulateBootstrap(SrfsMoments & moments,
+                         std::vector<SrfsMoments> & replicates,
+                         const PoissonWeights & weights,
+                         const AbstractHaarWavelet * const wavelet,
+                         const std::vector<IntegralType> & samples)
+{
+    if (moments.count == 0)
+    {
+        moments.reset(wavelet->dimensions());
+    }
+    for (unsigned int r = 0; r < replicates.size(); ++r)
+    {
+        replicates[r].reset(wavelet->dimensions());
+    }
+
+    BootstrapAccumulator accumulator(moments, replicates, weights);
+    visitSrfs(*wavelet, samples, accumulator);
+}
+
+
+
+struct ConfidenceInterval
+{
+    double low, high;
+};
+
+
+
+/**
+ * Percentile interval of the values, which are sorted in place.
+ */
+template <typename T>
+inline ConfidenceInterval percentileInterval(T * const values, const int count)
+{
+    ConfidenceInterval interval;
+    if (count == 0)
+    {
+        interval.low = interval.high = std::numeric_limits<double>::quiet_NaN();
+        return interval;
+    }
+
+    std::sort(values, values + count);
+    interval.low = values[ (int)std::floor((1 - BOOTSTRAP_CONFIDENCE) / 2 * (count - 1)) ];
+    interval.high = values[ (int)std::ceil((1 + BOOTSTRAP_CONFIDENCE) / 2 * (count - 1)) ];
+    return interval;
+}
+
+
+
+/**
+ * What the bootstrap tells about one wavelet. The standard deviation is the one of the
+ * principal component of least variance, which the optimizers rank the wavelets by.
+ */
+struct WaveletBootstrap
+{
+    int dimensions;
+    ConfidenceInterval eigenvalues[MAX_RECTANGLES];
+    double stdDev;
+    ConfidenceInterval stdDevInterval;
+    int rank; //0 is the smallest standard deviation
+    ConfidenceInterval rankInterval;
+};
+
+
+
+/**
+ * Bootstrap of a whole sweep over the wavelets. Replicates are drawn from the samples once
+ * by prepare(), the optimizers accumulate the statistics of the replicates together with
+ * the wavelet's own and call solve() with them, and rank() then ranks the wavelets within
+ * every replicate.
+ *
+ * Unlike libpca's bootstrap, which resamples the stored records, nothing but the moments of
+ * the replicates is kept, and the samples are only visited once per wavelet. Ranking still
+ * needs the standard deviation of every wavelet in every replicate, 4 bytes each: about
+ * 3.4 GB for 8.5 million wavelets and 100 replicates. Callers check memory() first and
+ * can ask for fewer replicates.
+ */
+class SweepBootstrap
+{
+public:
+    /**
+     * Bytes prepare() and the workers need for a sweep: the Poisson weights of the samples,
+     * the results of the wavelets and, by far the largest for big wavelet sets, the
+     * standard deviation of every wavelet in every replicate, kept until rank(). Each worker
+     * also keeps the moments of the replicates of its wavelet.
+     */
+    static double memory(const int samples, const size_t waveletCount, const int replicates, const int workers)
+    {
+        return (double)samples * replicates
+             + (double)waveletCount * sizeof(WaveletBootstrap)
+             + (double)waveletCount * replicates * sizeof(float)
+             + (double)workers * replicates * (sizeof(SrfsMoments) + (MAX_RECTANGLES + 1) * sizeof(double));
+    }
+
+    /**
+     * Draws the replicates of the samples and makes room for the results of the wavelets.
+     */
+    void prepare(const int samples, const int waveletCount, const int replicates = BOOTSTRAP_REPLICATES)
+    {
+        weights.generate(samples, replicates);
+        wavelets.resize(waveletCount);
+        replicateStdDevs.resize((size_t)waveletCount * replicates);
+    }
+
+    int replicates() const
+    {
+        return weights.replicates();
+    }
+
+    template <typename IntegralType>
+    void accumulate(SrfsMoments & moments,
+                    std::vector<SrfsMoments> & replicates,
+                    const AbstractHaarWavelet * const wavelet,
+                    const std::vector<IntegralType> & samples) const
+    {
+        accumulateBootstrap(moments, replicates, weights, wavelet, samples);
+    }
+
+    /**
+     * Decomposes the covariance of every replicate of wavelet w and sets the intervals of its
+     * eigenvalues and of its ranking standard deviation. Replicates that got less than two
+     * samples are left out. scratch holds (MAX_RECTANGLES + 1) x replicates values.
+     */
+    void solve(const int w, const std::vector<SrfsMoments> & replicates, std::vector<double> & scratch)
+    {
+        const int count = replicates.size();
+        const int dimensions = replicates.front().dimensions;
+        float * const stdDevs = &replicateStdDevs[(size_t)w * count];
+
+        double * const values = &scratch[0];
+        double * const deviations = &scratch[(size_t)MAX_RECTANGLES * count];
+
+        int solved = 0;
+        for (int r = 0; r < count; )
+        {
+            const SrfsMoments * batch[EIGEN_BATCH];
+            int batchSize = 0;
+            for (; r < count && batchSize < EIGEN_BATCH; ++r)
+            {
+                if (replicates[r].count >= 2)
+                {
+                    batch[batchSize++] = &replicates[r];
+                }
+                else
+                {
+                    stdDevs[r] = std::numeric_limits<float>::quiet_NaN();
+                }
+            }
+            if (batchSize == 0)
+            {
+                continue;
+            }
+
+            SymmetricEigen eigens[EIGEN_BATCH];
+            solveSymmetricEigens(batch, batchSize, eigens);
+
+            for (int b = 0; b < batchSize; ++b)
+            {
+                for (int k = 0; k < dimensions; ++k)
+                {
+                    values[(size_t)k * count + solved] = eigens[b].values[k];
+                }
+
+                const double variance = eigens[b].projectedVariance(eigens[b].vectors[dimensions - 1]);
+                deviations[solved] = std::sqrt(std::max(variance, .0));
+                stdDevs[batch[b] - &replicates[0]] = deviations[solved];
+                ++solved;
+            }
+        }
+
+        WaveletBootstrap & bootstrap = wavelets[w];
+        bootstrap.dimensions = dimensions;
+        for (int k = 0; k < dimensions; ++k)
+        {
+            bootstrap.eigenvalues[k] = percentileInterval(&values[(size_t)k * count], solved);
+        }
+        bootstrap.stdDevInterval = percentileInterval(deviations, solved);
+    }
+
+    /**
+     * Sets the standard deviation of wavelet w over the whole sample set, which also stands
+     * in for the replicates that were left out.
+     */
+    void setStdDev(const int w, const double stdDev)
+    {
+        wavelets[w].stdDev = stdDev;
+
+        float * const stdDevs = &replicateStdDevs[(size_t)w * replicates()];
+        for (int r = 0; r < replicates(); ++r)
+        {
+            if (stdDevs[r] != stdDevs[r])
+            {
+                stdDevs[r] = stdDev;
+            }
+        }
+    }
+
+    /**
+     * Ranks the wavelets by standard deviation, on the whole sample set and within every
+     * replicate, and sets the rank intervals. The replicate standard deviations are replaced
+     * by the ranks.
+     */
+    void rank()
+    {
+        std::vector<float> stdDevs(wavelets.size());
+        for (unsigned int w = 0; w < wavelets.size(); ++w)
+        {
+            stdDevs[w] = wavelets[w].stdDev;
+        }
+        rankColumn(&stdDevs[0], 1, wavelets.size());
+        for (unsigned int w = 0; w < wavelets.size(); ++w)
+        {
+            wavelets[w].rank = stdDevs[w];
+        }
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, replicates(), 1), RankReplicates(this));
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, wavelets.size()), RankIntervals(this));
+    }
+
+    /**
+     * Writes one line per wavelet, in the order of the wavelets file: the rank, its interval,
+     * the standard deviation, its interval, the dimensions and the interval of each eigenvalue.
+     */
+    bool write(const std::string & filename) const
+    {
+        std::ofstream output(filename.c_str(), std::ios::trunc);
+        if ( !output.is_open() )
+        {
+            return false;
+        }
+
+        for (unsigned int w = 0; w < wavelets.size(); ++w)
+        {
+            const WaveletBootstrap & b = wavelets[w];
+            output << b.rank << ' ' << b.rankInterval.low << ' ' << b.rankInterval.high << ' '
+                   << b.stdDev << ' ' << b.stdDevInterval.low << ' ' << b.stdDevInterval.high << ' '
+                   << b.dimensions;
+            for (int k = 0; k < b.dimensions; ++k)
+            {
+                output << ' ' << b.eigenvalues[k].low << ' ' << b.eigenvalues[k].high;
+            }
+            output << '\n';
+        }
+
+        return output.good();
+    }
+
+private:
+    PoissonWeights weights;
+    std::vector<WaveletBootstrap> wavelets;
+    std::vector<float> replicateStdDevs; //wavelets x replicates, replicate fastest
+
+    struct ByValue
+    {
+        const float * values;
+        size_t stride;
+
+        bool operator()(const int a, const int b) const
+        {
+            return values[a * stride] < values[b * stride];
+        }
+    };
+
+    /**
+     * Replaces count values, stride apart, by their ranks.
+     */
+    static void rankColumn(float * const values, const size_t stride, const size_t count)
+    {
+        std::vector<int> order(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            order[i] = i;
+        }
+
+        ByValue byValue;
+        byValue.values = values;
+        byValue.stride = stride;
+        std::stable_sort(order.begin(), order.end(), byValue);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            values[order[i] * stride] = i;
+        }
+    }
+
+    class RankReplicates
+    {
+        SweepBootstrap * bootstrap;
+
+    public:
+        void operator()(const tbb::blocked_range<int> range) const
+        {
+            for (int r = range.begin(); r != range.end(); ++r)
+            {
+                rankColumn(&bootstrap->replicateStdDevs[r], bootstrap->replicates(), bootstrap->wavelets.size());
+            }
+        }
+
+        RankReplicates(SweepBootstrap * bootstrap_) : bootstrap(bootstrap_) {}
+    };
+
+    class RankIntervals
+    {
+        SweepBootstrap * bootstrap;
+
+    public:
+        void operator()(const tbb::blocked_range<size_t> range) const
+        {
+            const int replicates = bootstrap->replicates();
+            std::vector<float> ranks(replicates);
+            for (size_t w = range.begin(); w != range.end(); ++w)
+            {
+                std::copy(&bootstrap->replicateStdDevs[w * replicates],
+                          &bootstrap->replicateStdDevs[w * replicates] + replicates,
+                          ranks.begin());
+                bootstrap->wavelets[w].rankInterval = percentileInterval(&ranks[0], replicates);
+            }
+        }
+
+        RankIntervals(SweepBootstrap * bootstrap_) : bootstrap(bootstrap_) {}
+    };
+};
+
+
+
+#endif // BOOTSTRAP_H
@@ -0,0 +1,546 @@
+#ifndef COVARIANCE_TABLE_H
+#define COVARIANCE_TABLE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+
+#include <armadillo>
+
+#include <tbb/tbb.h>
+
+#include "haarwavelet.h"
+
+#include "detector_window.h"
+#include "wavelet_kernels.h"
+#include "srfs_moments.h"
+
+
+
+#define COVARIANCE_TABLE_MAGIC "HAARCOV2"
+#define COVARIANCE_TABLE_BLOCK 256 //samples per syrk update
+
+
+
+/**
+ * Means and covariances of the intensity normalized sums of every pair of same-size
+ * rectangles of the window, over one sample set.
+ *
+ * All rectangles of a wavelet generated under Pavani's restriction #5 have the same size,
+ * so the covariance of its SRFS is a submatrix of the table of that size. Once the table
+ * is built, the statistics of any wavelet are assembled by lookup, at a cost that does not
+ * depend on the amount of samples.
+ *
+ * The file is a header, a directory with one entry per rectangle size and, for each size,
+ * the means of the rectangles followed by the upper triangle of their covariance matrix.
+ * Rectangles of a size are indexed by position, row by row. The file is memory mapped.
+ *
+ * The header keeps a fingerprint of the integral sums the table was built from, their
+ * normalization footers included, and their precision, so a table is only reused for the
+ * very same samples.
+ */
+class CovarianceTable
+{
+public:
+    CovarianceTable() : mapping(0),
+                        length(0),
+                        header(0),
+                        entries(0),
+                        data(0) {}
+
+    ~CovarianceTable()
+    {
+        close();
+    }
+
+    bool open(const std::string & filename)
+    {
+        close();
+
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat status;
+        if ( fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(Header) )
+        {
+            ::close(fd);
+            return false;
+        }
+
+        length = status.st_size;
+        mapping = mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = 0;
+            return false;
+        }
+
+        header = (const Header *)mapping;
+        if (   std::strncmp(header->magic, COVARIANCE_TABLE_MAGIC, sizeof(header->magic)) != 0
+            || !validLayout() )
+        {
+            close();
+            return false;
+        }
+
+        entries = (const Entry *)(header + 1);
+        data = (const double *)(entries + header->sizes);
+
+        return true;
+    }
+
+    void close()
+    {
+        if (mapping)
+        {
+            munmap(mapping, length);
+        }
+        mapping = 0;
+        header = 0;
+        entries = 0;
+        data = 0;
+    }
+
+    bool isOpen() const
+    {
+        return mapping != 0;
+    }
+
+    int windowSize() const
+    {
+        return header->windowSize;
+    }
+
+    double samples() const
+    {
+        return header->samples;
+    }
+
+    unsigned long long fingerprint() const
+    {
+        return header->fingerprint;
+    }
+
+    int precision() const
+    {
+        return header->precision;
+    }
+
+    /**
+     * Order dependent hash of the integral sums of a sample set, footers included. The
+     * hashes of the samples are computed in parallel.
+     */
+    static unsigned long long fingerprint(const std::vector<cv::Mat> & integralSums)
+    {
+        std::vector<unsigned long long> hashes(integralSums.size());
+        tbb::parallel_for( tbb::blocked_range<size_t>(0, integralSums.size()), HashSamples(&integralSums, &hashes) );
+
+        unsigned long long hash = FNV_OFFSET;
+        for (size_t i = 0; i < hashes.size(); ++i)
+        {
+            hash = (hash ^ hashes[i]) * FNV_PRIME;
+        }
+        return hash;
+    }
+
+    /**
+     * Assembles the statistics of the SRFS of a wavelet. Returns false if the rectangles
+     * of the wavelet do not all have the same size, or if that size has no entry or a
+     * rectangle is not inside the window of the table, like for a wavelet generated for a
+     * bigger window.
+     */
+    bool moments(const AbstractHaarWavelet & wavelet, SrfsMoments & moments) const
+    {
+        const int dimensions = wavelet.dimensions();
+        if (dimensions < 1 || dimensions > MAX_RECTANGLES)
+        {
+            return false;
+        }
+
+        const cv::Rect first = wavelet.rect(0);
+        if (   first.width < header->minWidth || first.width > header->windowSize
+            || first.height < header->minHeight || first.height > header->windowSize )
+        {
+            return false;
+        }
+
+        const Entry & entry = entries[ entryIndex(first.width, first.height) ];
+        const int rows = entry.positions / entry.columns;
+
+        int positions[MAX_RECTANGLES];
+        for (int i = 0; i < dimensions; ++i)
+        {
+            const cv::Rect r = wavelet.rect(i);
+            if (   r.width != first.width || r.height != first.height
+                || r.x < 0 || r.x >= entry.columns || r.y < 0 || r.y >= rows )
+            {
+                return false;
+            }
+            positions[i] = r.y * entry.columns + r.x;
+        }
+
+        const double * const means = data + entry.meanOffset;
+        const double * const covariances = data + entry.covarianceOffset;
+
+        moments.reset(dimensions);
+        moments.count = header->samples;
+        for (int i = 0; i < dimensions; ++i)
+        {
+            moments.mean[i] = means[ positions[i] ];
+            for (int j = 0; j < dimensions; ++j)
+            {
+                const double covariance = covariances[ packedIndex(positions[i], positions[j], entry.positions) ];
+                moments.comoment[i][j] = covariance * (moments.count - 1);
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Computes the table of the intensity normalized rectangle sums of the samples and
+     * writes it to a file, with the fingerprint of the samples.
+     */
+    static bool build(const std::string & filename, const std::vector<cv::Mat> & integralSums, const unsigned long long fingerprint)
+    {
+        switch ( integralSums.empty() ? 0 : integralSums.front().cols - 1 )
+        {
+            case 20: return build<20>(filename, integralSums, fingerprint);
+            case 24: return build<24>(filename, integralSums, fingerprint);
+            case 32: return build<32>(filename, integralSums, fingerprint);
+            default: return false;
+        }
+    }
+
+private:
+    struct Header
+    {
+        char magic[8];
+        int windowSize;
+        int minWidth, minHeight;
+        int sizes;
+        double samples;
+        unsigned long long fingerprint; //of the integral sums
+        int precision;                  //depth of the integral sums, CV_32F or CV_64F
+    };
+
+    static const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+    static const unsigned long long FNV_PRIME = 1099511628211ULL;
+
+    struct Entry
+    {
+        int width, height;
+        int columns;   //positions of a rectangle of this size in a row of the window
+        int positions; //positions of a rectangle of this size in the window
+        long long meanOffset, covarianceOffset; //from the beginning of the data, in doubles
+    };
+
+    void * mapping;
+    size_t length;
+    const Header * header;
+    const Entry * entries;
+    const double * data;
+
+    //Not copyable: it owns the mapping
+    CovarianceTable(const CovarianceTable &);
+    CovarianceTable & operator=(const CovarianceTable &);
+
+    inline int entryIndex(const int width, const int height) const
+    {
+        return (width - header->minWidth) * (header->windowSize - header->minHeight + 1)
+             + (height - header->minHeight);
+    }
+
+    /**
+     * Checks that the directory is the one build() writes for the window size of the header,
+     * and that the file holds all of it and all the data it points to.
+     */
+    bool validLayout() const
+    {
+        const int size = header->windowSize;
+        if (   size < 1 || header->minWidth < 1 || header->minHeight < 1
+            || header->minWidth > size || header->minHeight > size
+            || header->sizes != (size - header->minWidth + 1) * (size - header->minHeight + 1)
+            || (length - sizeof(Header)) / sizeof(Entry) < (size_t)header->sizes )
+        {
+            return false;
+        }
+
+        const Entry * const directory = (const Entry *)(header + 1);
+        long long offset = 0;
+        for (int w = header->minWidth; w <= size; ++w)
+        {
+            for (int h = header->minHeight; h <= size; ++h)
+            {
+                const Entry & e = directory[ (w - header->minWidth) * (size - header->minHeight + 1) + (h - header->minHeight) ];
+                if (   e.width != w || e.height != h
+                    || e.columns != size - w + 1 || e.positions != e.columns * (size - h + 1)
+                    || e.meanOffset != offset || e.covarianceOffset != offset + e.positions )
+                {
+                    return false;
+                }
+                offset = e.covarianceOffset + (long long)e.positions * (e.positions + 1) / 2;
+            }
+        }
+
+        return length == sizeof(Header) + header->sizes * sizeof(Entry) + offset * sizeof(double);
+    }
+
+    /**
+     * Functor used by Intel TBB to hash the rows of the integral sums of each sample.
+     */
+    class HashSamples
+    {
+        const std::vector<cv::Mat> * integralSums;
+        std::vector<unsigned long long> * hashes;
+
+    public:
+        void operator()(const tbb::blocked_range<size_t> range) const
+        {
+            for (size_t i = range.begin(); i != range.end(); ++i)
+            {
+                const cv::Mat & sums = (*integralSums)[i];
+                const size_t rowBytes = sums.cols * sums.elemSize();
+
+                unsigned long long hash = FNV_OFFSET;
+                for (int r = 0; r < sums.rows; ++r)
+                {
+                    const unsigned char * const row = sums.ptr<unsigned char>(r);
+                    for (size_t b = 0; b < rowBytes; ++b)
+                    {
+                        hash = (hash ^ row[b]) * FNV_PRIME;
+                    }
+                }
+                (*hashes)[i] = hash;
+            }
+        }
+
+        HashSamples(const std::vector<cv::Mat> * integralSums_,
+                    std::vector<unsigned long long> * hashes_) : integralSums(integralSums_),
+                                                                 hashes(hashes_) {}
+    };
+
+    static inline long long packedIndex(int i, int j, const long long positions)
+    {
+        if (i > j)
+        {
+            std::swap(i, j);
+        }
+        return i * positions - (long long)i * (i - 1) / 2 + (j - i);
+    }
+
+
+
+    /**
+     * Fills the covariance table of one rectangle size. The Gram matrix of the rectangle
+     * values is accumulated a block of samples at a time (armadillo turns the product of
+     * a transposed matrix by itself into a syrk call), shifted by the means of the first
+     * block so that subtracting the mean at the end does not cancel out.
+     */
+    template <int SIZE, typename T>
+    static void fillEntry(const std::vector<cv::Mat> & integralSums, const Entry & entry, double * const tableData)
+    {
+        typedef DetectorWindow<SIZE> Window;
+
+        const int samples = integralSums.size();
+        const int positions = entry.positions;
+        const int rows = positions / entry.columns;
+        const double inverseArea = 1.0 / (entry.width * entry.height);
+
+        arma::Mat<double> gram;
+        gram.zeros(positions, positions);
+        std::vector<double> shift(positions, .0), sums(positions, .0);
+
+        arma::Mat<double> block;
+        for (int first = 0; first < samples; first += COVARIANCE_TABLE_BLOCK)
+        {
+            const int blockSize = std::min(COVARIANCE_TABLE_BLOCK, samples - first);
+            block.set_size(blockSize, positions);
+
+            for (int s = 0; s < blockSize; ++s)
+            {
+                const T * const iSum = integralSums[first + s].ptr<T>();
+                const double offset = WaveletKernel<SIZE>::normalization(iSum, INTENSITY_OFFSET);
+                const double scale = WaveletKernel<SIZE>::normalization(iSum, INTENSITY_SCALE);
+
+                for (int y = 0; y < rows; ++y)
+                {
+                    for (int x = 0; x < entry.columns; ++x)
+                    {
+                        const double sum = (double)iSum[Window::offset(x + entry.width, y + entry.height)]
+                                         - iSum[Window::offset(x + entry.width, y)]
+                                         - iSum[Window::offset(x, y + entry.height)]
+                                         + iSum[Window::offset(x, y)];
+                        block(s, y * entry.columns + x) = (sum * inverseArea - offset) * scale;
+                    }
+                }
+            }
+
+            if (first == 0)
+            {
+                for (int p = 0; p < positions; ++p)
+                {
+                    for (int s = 0; s < blockSize; ++s)
+                    {
+                        shift[p] += block(s, p);
+                    }
+                    shift[p] /= blockSize;
+                }
+            }
+
+            for (int p = 0; p < positions; ++p)
+            {
+                for (int s = 0; s < blockSize; ++s)
+                {
+                    block(s, p) -= shift[p];
+                    sums[p] += block(s, p);
+                }
+            }
+
+            gram += block.t() * block;
+        }
+
+        double * const means = tableData + entry.meanOffset;
+        double * const covariances = tableData + entry.covarianceOffset;
+        for (int i = 0; i < positions; ++i)
+        {
+            const double di = sums[i] / samples;
+            means[i] = shift[i] + di;
+            for (int j = i; j < positions; ++j)
+            {
+                const double dj = sums[j] / samples;
+                covariances[ packedIndex(i, j, positions) ] = (gram(i, j) - samples * di * dj) / (samples - 1);
+            }
+        }
+    }
+
+
+
+    /**
+     * Functor used by Intel TBB to fill the tables of the rectangle sizes in parallel.
+     */
+    template <int SIZE>
+    class FillEntries
+    {
+        const std::vector<cv::Mat> * integralSums;
+        const std::vector<Entry> * directory;
+        double * tableData;
+
+    public:
+        void operator()(const tbb::blocked_range<int> range) const
+        {
+            const bool singlePrecision = integralSums->front().depth() == CV_32F;
+            for (int i = range.begin(); i != range.end(); ++i)
+            {
+                if (singlePrecision)
+                {
+                    fillEntry<SIZE, float>(*integralSums, (*directory)[i], tableData);
+                }
+                else
+                {
+                    fillEntry<SIZE, double>(*integralSums, (*directory)[i], tableData);
+                }
+            }
+        }
+
+        FillEntries(const std::vector<cv::Mat> * integralSums_,
+                    const std::vector<Entry> * directory_,
+                    double * tableData_) : integralSums(integralSums_),
+                                           directory(directory_),
+                                           tableData(tableData_) {}
+    };
+
+
+
+    template <int SIZE>
+    static bool build(const std::string & filename, const std::vector<cv::Mat> & integralSums, const unsigned long long fingerprint)
+    {
+        typedef DetectorWindow<SIZE> Window;
+
+        Header h;
+        std::memset(&h, 0, sizeof(h));
+        std::strncpy(h.magic, COVARIANCE_TABLE_MAGIC, sizeof(h.magic));
+        h.windowSize = SIZE;
+        h.minWidth = Window::minRectWidth;
+        h.minHeight = Window::minRectHeight;
+        h.sizes = (SIZE - h.minWidth + 1) * (SIZE - h.minHeight + 1);
+        h.samples = integralSums.size();
+        h.fingerprint = fingerprint;
+        h.precision = integralSums.front().depth();
+
+        std::vector<Entry> directory(h.sizes);
+        long long offset = 0;
+        for (int w = h.minWidth; w <= SIZE; ++w)
+        {
+            for (int hh = h.minHeight; hh <= SIZE; ++hh)
+            {
+                Entry & e = directory[ (w - h.minWidth) * (SIZE - h.minHeight + 1) + (hh - h.minHeight) ];
+                e.width = w;
+                e.height = hh;
+                e.columns = SIZE - w + 1;
+                e.positions = e.columns * (SIZE - hh + 1);
+                e.meanOffset = offset;
+                e.covarianceOffset = offset + e.positions;
+                offset = e.covarianceOffset + (long long)e.positions * (e.positions + 1) / 2;
+            }
+        }
+
+        std::vector<double> tableData(offset);
+        tbb::parallel_for( tbb::blocked_range<int>(0, h.sizes),
+                           FillEntries<SIZE>(&integralSums, &directory, &tableData[0]) );
+
+        std::ofstream output(filename.c_str(), std::ios::binary | std::ios::trunc);
+        if ( !output.is_open() )
+        {
+            return false;
+        }
+        output.write((const char *)&h, sizeof(h));
+        output.write((const char *)&directory[0], directory.size() * sizeof(Entry));
+        output.write((const char *)&tableData[0], tableData.size() * sizeof(double));
+
+        return (bool)output;
+    }
+};
+
+
+
+/**
+ * Maps the table of a sample set. It is built first when the file does not exist yet, is
+ * not a whole table, or was built from other samples or in another precision.
+ */
+inline bool prepareCovarianceTable(CovarianceTable & table, const std::string & filename, const std::vector<cv::Mat> & integralSums)
+{
+    if ( integralSums.empty() )
+    {
+        return false;
+    }
+
+    const unsigned long long fingerprint = CovarianceTable::fingerprint(integralSums);
+    if (   table.open(filename)
+        && table.windowSize() == integralSums.front().cols - 1
+        && table.samples() == integralSums.size()
+        && table.precision() == integralSums.front().depth()
+        && table.fingerprint() == fingerprint )
+    {
+        return true;
+    }
+
+    table.close();
+    return CovarianceTable::build(filename, integralSums, fingerprint) && table.open(filename);
+}
+
+
+
+#endif // COVARIANCE_TABLE_H
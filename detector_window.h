@@ -0,0 +1,75 @@
+#ifndef DETECTOR_WINDOW_H
+#define DETECTOR_WINDOW_H
+
+
+
+/**
+ * Compile-time description of a square detector window of SIZE x SIZE pixels.
+ *
+ * Everything that used to be derived from the SAMPLE_SIZE macro lives here, so the
+ * generator, the checker and the evaluation kernels of a 24x24 or 32x32 detector are
+ * produced from the same source as the original 20x20 one, with constant loop bounds.
+ */
+template <int SIZE>
+struct DetectorWindow
+{
+    static const int size = SIZE;
+    static const int area = SIZE * SIZE;
+
+    //Integral images of a sample have one extra row and column of zeros
+    static const int stride = SIZE + 1;
+
+    //and are followed by one row with the normalization factors of the sample
+    static const int footer = (SIZE + 1) * stride;
+
+    static const int minRectWidth = 3;  //Minimum = 3 thanks to Pavani's restriction #6.
+    static const int minRectHeight = 3; //Minimum = 3 thanks to Pavani's restriction #6.
+
+    //Borders of the 3x3 regions of haarcheck's rectangle position histogram.
+    //For the 20x20 window x regions are 8 - 4 - 8 and y regions are 7 - 6 - 7.
+    static const int xRegionBegin = (2 * SIZE) / 5;
+    static const int xRegionEnd = SIZE - xRegionBegin;
+    static const int yRegionBegin = (7 * SIZE) / 20;
+    static const int yRegionEnd = SIZE - yRegionBegin;
+
+    /**
+     * Position of the pixel (x, y) in a continuous integral image of a sample.
+     */
+    static constexpr int offset(const int x, const int y)
+    {
+        return y * stride + x;
+    }
+};
+
+template <int SIZE> const int DetectorWindow<SIZE>::size;
+template <int SIZE> const int DetectorWindow<SIZE>::area;
+template <int SIZE> const int DetectorWindow<SIZE>::stride;
+template <int SIZE> const int DetectorWindow<SIZE>::footer;
+template <int SIZE> const int DetectorWindow<SIZE>::minRectWidth;
+template <int SIZE> const int DetectorWindow<SIZE>::minRectHeight;
+template <int SIZE> const int DetectorWindow<SIZE>::xRegionBegin;
+template <int SIZE> const int DetectorWindow<SIZE>::xRegionEnd;
+template <int SIZE> const int DetectorWindow<SIZE>::yRegionBegin;
+template <int SIZE> const int DetectorWindow<SIZE>::yRegionEnd;
+
+
+
+#define DEFAULT_WINDOW_SIZE 20
+#define SUPPORTED_WINDOW_SIZES "20, 24 or 32"
+
+
+
+/**
+ * Window sizes that have specialized code compiled in. Anything else is refused
+ * by the programs instead of silently falling back to a slow generic path.
+ */
+inline bool isSupportedWindowSize(const int size)
+{
+    return size == 20
+        || size == 24
+        || size == 32;
+}
+
+
+
+#endif // DETECTOR_WINDOW_H
@@ -0,0 +1,443 @@
+#ifndef FEATURE_MATRIX_H
+#define FEATURE_MATRIX_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+
+#include <tbb/tbb.h>
+
+#include "haarwavelet.h"
+
+#include "optimization_commons.h"
+
+
+
+#define FEATURE_MATRIX_MAGIC "HAARFVM1"
+#define FEATURE_MATRIX_FLOAT32 0
+#define FEATURE_MATRIX_INT16 1
+
+
+
+/**
+ * Feature values of every classifier on every sample, one column per classifier, so that
+ * a boosting trainer can read the response of any classifier without evaluating it again.
+ * Feature values are the SRFS projected on the weights of the classifier.
+ *
+ * The file is a header, the quantization of each column and the columns, either as floats
+ * or quantized to 16 bits with the offset and scale of the column: value = offset + scale
+ * * (q + 32767). Columns start 64 bytes aligned. The file is memory mapped, for reading
+ * with open() or for writing with create().
+ */
+class FeatureMatrix
+{
+public:
+    FeatureMatrix() : mapping(0),
+                      length(0),
+                      writable(false),
+                      header(0),
+                      quantizations(0),
+                      data(0) {}
+
+    ~FeatureMatrix()
+    {
+        close();
+    }
+
+    bool open(const std::string & filename)
+    {
+        close();
+
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat status;
+        if ( fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(Header) )
+        {
+            ::close(fd);
+            return false;
+        }
+
+        length = status.st_size;
+        mapping = mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = 0;
+            return false;
+        }
+
+        if ( !setPointers() || !validLayout() )
+        {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Creates a file for the given amount of classifiers and samples, whose columns are then
+     * written with setColumn(). The blocks of the file are allocated here, so running out of
+     * disk space fails here instead of faulting on a write to the mapping. close() tells
+     * whether the columns reached the file.
+     */
+    bool create(const std::string & filename, const int classifiers, const int samples, const int type)
+    {
+        close();
+
+        Header h;
+        std::memset(&h, 0, sizeof(h));
+        std::strncpy(h.magic, FEATURE_MATRIX_MAGIC, sizeof(h.magic));
+        h.classifiers = classifiers;
+        h.samples = samples;
+        h.type = type;
+        h.dataOffset = (sizeof(Header) + classifiers * sizeof(Quantization) + 63) / 64 * 64;
+
+        const int fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        length = h.dataOffset + (long long)classifiers * samples * elementSize(type);
+        if ( ftruncate(fd, length) != 0 || posix_fallocate(fd, 0, length) != 0 )
+        {
+            ::close(fd);
+            return false;
+        }
+
+        mapping = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            mapping = 0;
+            return false;
+        }
+
+        writable = true;
+        std::memcpy(mapping, &h, sizeof(h));
+        return setPointers();
+    }
+
+    /**
+     * Unmaps the file. A file opened with create() is synced to disk first; returns false
+     * if that or unmapping it fails.
+     */
+    bool close()
+    {
+        bool closed = true;
+        if (mapping)
+        {
+            if ( writable && msync(mapping, length, MS_SYNC) != 0 )
+            {
+                closed = false;
+            }
+            if ( munmap(mapping, length) != 0 )
+            {
+                closed = false;
+            }
+        }
+        mapping = 0;
+        writable = false;
+        header = 0;
+        quantizations = 0;
+        data = 0;
+        return closed;
+    }
+
+    bool isOpen() const
+    {
+        return mapping != 0;
+    }
+
+    int classifiers() const
+    {
+        return header->classifiers;
+    }
+
+    int samples() const
+    {
+        return header->samples;
+    }
+
+    int type() const
+    {
+        return header->type;
+    }
+
+    /**
+     * Column of a classifier in a FEATURE_MATRIX_FLOAT32 file.
+     */
+    const float * floatColumn(const int c) const
+    {
+        return (const float *)(data + c * columnLength());
+    }
+
+    /**
+     * Column of a classifier in a FEATURE_MATRIX_INT16 file, to be read with its offset and scale.
+     */
+    const short * quantizedColumn(const int c) const
+    {
+        return (const short *)(data + c * columnLength());
+    }
+
+    float offset(const int c) const
+    {
+        return quantizations[c].offset;
+    }
+
+    float scale(const int c) const
+    {
+        return quantizations[c].scale;
+    }
+
+    /**
+     * Copies the feature values of a classifier, whatever the type of the file.
+     */
+    void column(const int c, float * const values) const
+    {
+        if (header->type == FEATURE_MATRIX_INT16)
+        {
+            const short * const q = quantizedColumn(c);
+            for (int s = 0; s < header->samples; ++s)
+            {
+                values[s] = quantizations[c].offset + quantizations[c].scale * (q[s] + 32767);
+            }
+        }
+        else
+        {
+            std::copy(floatColumn(c), floatColumn(c) + header->samples, values);
+        }
+    }
+
+    /**
+     * Writes the feature values of a classifier. Different columns can be written by
+     * different threads. Fails if the file was not created with create() or has no column c.
+     */
+    bool setColumn(const int c, const float * const values)
+    {
+        if ( !writable || c < 0 || c >= header->classifiers )
+        {
+            return false;
+        }
+
+        unsigned char * const column = data + c * columnLength();
+        Quantization & quantization = ((Quantization *)quantizations)[c];
+        if (header->samples == 0)
+        {
+            return true;
+        }
+
+        if (header->type == FEATURE_MATRIX_INT16)
+        {
+            const float low = *std::min_element(values, values + header->samples);
+            const float high = *std::max_element(values, values + header->samples);
+            quantization.offset = low;
+            quantization.scale = high > low ? (high - low) / 65534 : 1;
+
+            short * const q = (short *)column;
+            for (int s = 0; s < header->samples; ++s)
+            {
+                q[s] = (short)(std::floor((values[s] - low) / quantization.scale + 0.5f) - 32767);
+            }
+        }
+        else
+        {
+            quantization.offset = 0;
+            quantization.scale = 1;
+            std::memcpy(column, values, header->samples * sizeof(float));
+        }
+        return true;
+    }
+
+private:
+    struct Header
+    {
+        char magic[8];
+        int classifiers;
+        int samples;
+        int type;
+        int reserved;
+        long long dataOffset; //from the beginning of the file, in bytes
+    };
+
+    struct Quantization
+    {
+        float offset, scale;
+    };
+
+    void * mapping;
+    size_t length;
+    bool writable;
+    const Header * header;
+    const Quantization * quantizations;
+    unsigned char * data;
+
+    //Not copyable: it owns the mapping
+    FeatureMatrix(const FeatureMatrix &);
+    FeatureMatrix & operator=(const FeatureMatrix &);
+
+    static size_t elementSize(const int type)
+    {
+        return type == FEATURE_MATRIX_INT16 ? sizeof(short) : sizeof(float);
+    }
+
+    size_t columnLength() const
+    {
+        return header->samples * elementSize(header->type);
+    }
+
+    bool setPointers()
+    {
+        header = (const Header *)mapping;
+        if (   std::strncmp(header->magic, FEATURE_MATRIX_MAGIC, sizeof(header->magic)) != 0
+            || (header->type != FEATURE_MATRIX_FLOAT32 && header->type != FEATURE_MATRIX_INT16) )
+        {
+            return false;
+        }
+
+        quantizations = (const Quantization *)(header + 1);
+        data = (unsigned char *)mapping + header->dataOffset;
+        return true;
+    }
+
+    /**
+     * Whether the counts of the header are not negative, the quantizations end before the
+     * columns and the columns end within the file.
+     */
+    bool validLayout() const
+    {
+        if ( header->classifiers < 0 || header->samples < 0 || header->dataOffset < 0 )
+        {
+            return false;
+        }
+
+        const unsigned long long quantizationsEnd = sizeof(Header) + (unsigned long long)header->classifiers * sizeof(Quantization);
+        const unsigned long long dataEnd = (unsigned long long)header->dataOffset
+                                         + (unsigned long long)columnLength() * header->classifiers;
+        return quantizationsEnd <= (unsigned long long)header->dataOffset && dataEnd <= length;
+    }
+};
+
+
+
+/**
+ * Records the feature value of each SRFS, obtained with the given weights.
+ */
+class FeatureValueRecorder
+{
+public:
+    FeatureValueRecorder(const double * const weights_,
+                         const int dimensions_,
+                         float * const values_) : weights(weights_),
+                                                  dimensions(dimensions_),
+                                                  values(values_),
+                                                  sample(0) {}
+
+    template <int K, typename T>
+    inline void visit(const T * const srfs)
+    {
+        values[sample++] = std::inner_product(weights, weights + (K > 0 ? K : dimensions), srfs, .0);
+    }
+
+private:
+    const double * weights;
+    int dimensions;
+    float * values;
+    int sample;
+};
+
+
+
+/**
+ * Functor used by Intel TBB to write the columns of the classifiers, in the order they have
+ * in the vector, to a feature matrix.
+ */
+template <typename Classifier, typename IntegralType>
+class FillFeatureColumns
+{
+    const std::vector<Classifier> * classifiers;
+    const std::vector<IntegralType> * samples;
+    FeatureMatrix * matrix;
+    std::atomic<size_t> * written; //columns setColumn wrote
+
+public:
+    void operator()(const tbb::blocked_range<size_t> range) const
+    {
+        std::vector<float> values(samples->size());
+        size_t done = 0;
+        for (size_t c = range.begin(); c != range.end(); ++c)
+        {
+            const Classifier & classifier = (*classifiers)[c];
+
+            if (classifier.dimensions() > MAX_RECTANGLES)
+            {
+                continue;
+            }
+
+            double weights[MAX_RECTANGLES];
+            for (unsigned int i = 0; i < classifier.dimensions(); ++i)
+            {
+                weights[i] = classifier.weight(i);
+            }
+
+            FeatureValueRecorder recorder(weights, classifier.dimensions(), &values[0]);
+            visitSrfs(classifier, *samples, recorder);
+            done += matrix->setColumn(c, &values[0]);
+        }
+        written->fetch_add(done);
+    }
+
+    FillFeatureColumns(const std::vector<Classifier> * classifiers_,
+                       const std::vector<IntegralType> * samples_,
+                       FeatureMatrix * matrix_,
+                       std::atomic<size_t> * written_) : classifiers(classifiers_),
+                                                         samples(samples_),
+                                                         matrix(matrix_),
+                                                         written(written_) {}
+};
+
+
+
+/**
+ * Writes the feature matrix of the classifiers over the samples to a file. Returns false
+ * if the file can't be created, if any block left a column unwritten, like the one of a
+ * classifier of more than MAX_RECTANGLES rectangles, or if the file can't be synced.
+ */
+template <typename Classifier, typename IntegralType>
+bool writeFeatureMatrix(const std::string & filename,
+                        const std::vector<Classifier> & classifiers,
+                        const std::vector<IntegralType> & samples,
+                        const int type)
+{
+    FeatureMatrix matrix;
+    if ( !matrix.create(filename, classifiers.size(), samples.size(), type) )
+    {
+        return false;
+    }
+
+    std::atomic<size_t> written(0);
+    tbb::parallel_for( tbb::blocked_range<size_t>(0, classifiers.size()),
+                       FillFeatureColumns<Classifier, IntegralType>(&classifiers, &samples, &matrix, &written) );
+
+    const bool closed = matrix.close();
+    return written == classifiers.size() && closed;
+}
+
+
+
+#endif // FEATURE_MATRIX_H
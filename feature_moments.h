@@ -0,0 +1,186 @@
+#ifndef FEATURE_MOMENTS_H
+#define FEATURE_MOMENTS_H
+
+#include <vector>
+#include <stdexcept>
+
+#include "haarwavelet.h"
+
+#include "wavelet_kernels.h"
+#include "optimization_commons.h"
+
+
+
+#define FEATURE_BLOCK 64 //feature values evaluated before they are merged into the moments
+
+
+
+/**
+ * Count, mean and sum of squared deviations (M2) of the feature values of a wavelet. Values
+ * come in blocks: the moments of a block are taken in two passes over an array, which the
+ * compiler vectorizes, and merged with Chan et al.'s formulas. Moments of disjoint sample
+ * sets, taken by different threads or from different chunks of samples, merge the same way.
+ */
+struct FeatureMoments
+{
+    double count;
+    double mean;
+    double m2;
+
+    FeatureMoments() : count(0),
+                       mean(0),
+                       m2(0) {}
+
+    void merge(const FeatureMoments & other)
+    {
+        if (other.count == 0)
+        {
+            return;
+        }
+
+        const double total = count + other.count;
+        const double delta = other.mean - mean;
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * count * other.count / total;
+        count = total;
+    }
+
+    void addBlock(const double * const values, const int n)
+    {
+        if (n == 0)
+        {
+            return;
+        }
+
+        double sum = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            sum += values[i];
+        }
+
+        FeatureMoments block;
+        block.count = n;
+        block.mean = sum / n;
+        for (int i = 0; i < n; ++i)
+        {
+            const double deviation = values[i] - block.mean;
+            block.m2 += deviation * deviation;
+        }
+
+        merge(block);
+    }
+
+    /**
+     * Population variance, as boost::accumulators' variance.
+     */
+    double variance() const
+    {
+        return count > 0 ? m2 / count : 0;
+    }
+};
+
+
+
+/**
+ * Evaluates the feature values of the wavelet, from its weights and the variance normalized
+ * SRFS, on the block of n samples that starts at first, and adds them to the moments.
+ */
+template <int SIZE, int K>
+void addFeatureBlock(const WaveletKernel<SIZE, K> & kernel,
+                     const double * const areaWeights,
+                     const double weightSum,
+                     const std::vector<Integrals> & integrals,
+                     const int first,
+                     const int n,
+                     FeatureMoments & moments)
+{
+    const double * iSums[FEATURE_BLOCK];
+    double values[FEATURE_BLOCK];
+
+    for (int s = 0; s < n; ++s)
+    {
+        iSums[s] = integrals[first + s].iSum.ptr<double>();
+    }
+    kernel.varianceNormalizedFeatures(iSums, n, areaWeights, weightSum, values);
+    moments.addBlock(values, n);
+}
+
+
+
+/**
+ * Moments of the feature values of the wavelet over both sample sets, in one sweep with a
+ * single kernel: each step takes the next FEATURE_BLOCK positive samples and the next
+ * FEATURE_BLOCK negative ones, until both sets are done. The blocks of each set are the
+ * same as in a sweep of its own, so the moments are too.
+ */
+template <int SIZE, int K>
+void accumulateFeatureMoments(const HaarWavelet & wavelet,
+                              const std::vector<Integrals> & positives,
+                              const std::vector<Integrals> & negatives,
+                              FeatureMoments & positiveMoments,
+                              FeatureMoments & negativeMoments)
+{
+    const WaveletKernel<SIZE, K> kernel(wavelet);
+
+    double areaWeights[MAX_RECTANGLES];
+    const double weightSum = kernel.areaWeights(wavelet.weights_begin(), areaWeights);
+
+    const int positiveRecords = positives.size();
+    const int negativeRecords = negatives.size();
+    for (int first = 0; first < positiveRecords || first < negativeRecords; first += FEATURE_BLOCK)
+    {
+        if (first < positiveRecords)
+        {
+            addFeatureBlock(kernel, areaWeights, weightSum, positives, first,
+                            std::min(FEATURE_BLOCK, positiveRecords - first), positiveMoments);
+        }
+        if (first < negativeRecords)
+        {
+            addFeatureBlock(kernel, areaWeights, weightSum, negatives, first,
+                            std::min(FEATURE_BLOCK, negativeRecords - first), negativeMoments);
+        }
+    }
+}
+
+
+
+template <int SIZE>
+void accumulateFeatureMoments(const HaarWavelet & wavelet,
+                              const std::vector<Integrals> & positives,
+                              const std::vector<Integrals> & negatives,
+                              FeatureMoments & positiveMoments,
+                              FeatureMoments & negativeMoments)
+{
+    switch ( wavelet.dimensions() )
+    {
+        case 2:  accumulateFeatureMoments<SIZE, 2>(wavelet, positives, negatives, positiveMoments, negativeMoments); break;
+        case 3:  accumulateFeatureMoments<SIZE, 3>(wavelet, positives, negatives, positiveMoments, negativeMoments); break;
+        case 4:  accumulateFeatureMoments<SIZE, 4>(wavelet, positives, negatives, positiveMoments, negativeMoments); break;
+        default: accumulateFeatureMoments<SIZE, 0>(wavelet, positives, negatives, positiveMoments, negativeMoments); break;
+    }
+}
+
+
+
+/**
+ * Picks the kernel specialized for the size of the samples and the amount of rectangles.
+ */
+inline void accumulateFeatureMoments(const HaarWavelet & wavelet,
+                                     const std::vector<Integrals> & positives,
+                                     const std::vector<Integrals> & negatives,
+                                     FeatureMoments & positiveMoments,
+                                     FeatureMoments & negativeMoments)
+{
+    switch ( sampleSize(positives.empty() ? negatives : positives) )
+    {
+        case 0:  break;
+        case 20: accumulateFeatureMoments<20>(wavelet, positives, negatives, positiveMoments, negativeMoments); break;
+        case 24: accumulateFeatureMoments<24>(wavelet, positives, negatives, positiveMoments, negativeMoments); break;
+        case 32: accumulateFeatureMoments<32>(wavelet, positives, negatives, positiveMoments, negativeMoments); break;
+        default: throw std::logic_error("Unsupported sample size.");
+    }
+}
+
+
+
+#endif // FEATURE_MOMENTS_H
@@ -0,0 +1,206 @@
+#include <string>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+
+#include "optimization_commons.h"
+#include "wavelet_parser.h"
+#include "packed_wavelet.h"
+#include "feature_matrix.h"
+#include "adaboost.h"
+
+#include "haarwavelet.h"
+#include "haarwaveletutilities.h"
+
+#include "sampleextractor.h"
+
+#include <tbb/tbb.h>
+
+
+
+/**
+ * Functor used by Intel TBB to compute the responses of the wavelets on the positive and
+ * the negative samples, one column per wavelet.
+ */
+class ComputeResponses
+{
+    const PackedWaveletSet * wavelets;
+    const std::vector<cv::Mat> * positivesIntegralSums;
+    const std::vector<cv::Mat> * negativesIntegralSums;
+    std::vector<float> * responses;
+
+public:
+    void operator()(const tbb::blocked_range<size_t> range) const
+    {
+        const size_t samples = positivesIntegralSums->size() + negativesIntegralSums->size();
+        for (size_t w = range.begin(); w != range.end(); ++w)
+        {
+            const HaarWavelet wavelet = wavelets->unpack(w);
+
+            double weights[MAX_RECTANGLES];
+            for (unsigned int i = 0; i < wavelet.dimensions(); ++i)
+            {
+                weights[i] = wavelet.weight(i);
+            }
+
+            float * const column = &(*responses)[w * samples];
+
+            FeatureValueRecorder positives(weights, wavelet.dimensions(), column);
+            visitSrfs(wavelet, *positivesIntegralSums, positives);
+
+            FeatureValueRecorder negatives(weights, wavelet.dimensions(), column + positivesIntegralSums->size());
+            visitSrfs(wavelet, *negativesIntegralSums, negatives);
+        }
+    }
+
+    ComputeResponses(const PackedWaveletSet * wavelets_,
+                     const std::vector<cv::Mat> * positivesIntegralSums_,
+                     const std::vector<cv::Mat> * negativesIntegralSums_,
+                     std::vector<float> * responses_) : wavelets(wavelets_),
+                                                        positivesIntegralSums(positivesIntegralSums_),
+                                                        negativesIntegralSums(negativesIntegralSums_),
+                                                        responses(responses_) {}
+};
+
+
+
+/**
+ * Boosts the wavelets, with the weights the optimizers gave them, into a strong classifier.
+ * The response of a wavelet on a sample is its feature value, the SRFS projected on its
+ * weights. Responses are computed once; each round then picks the decision stump of least
+ * weighted error over presorted responses.
+ *
+ * The wavelets are kept packed for the whole run, next to the responses, and unpacked one
+ * at a time.
+ *
+ * Responses and their presorted order take 8 bytes per wavelet and sample, so the wavelets
+ * are meant to be the output of an optimizer, already sorted and cut to the best ones, not
+ * a whole haargen set. With --top K only the first K wavelets of the file are boosted. The
+ * memory needed is checked against the memory of the machine before anything is computed.
+ *
+ * Each line of the output is a round: the wavelet, the threshold, the polarity and the
+ * vote (alpha) of its stump.
+ */
+int main(int argc, char* argv[])
+{
+    const bool singlePrecision = takeFlag(argc, argv, "--single-precision");
+    const std::string topCount = takeOption(argc, argv, "--top"); //boost only the first K wavelets
+
+    if (argc != 7)
+    {
+        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX ROUNDS OUTPUT_FILE [--single-precision] [--top K]" << std::endl;
+        std::cout << "WAVELETS_FILE is expected to be the sorted output of an optimizer: 8 bytes are kept per wavelet and sample." << std::endl;
+        return 1;
+    }
+
+    const std::string waveletsFileName = argv[1];     //load Haar wavelets from here
+    const std::string positiveSamplesImage = argv[2]; //load + samples from here
+    const std::string negativeSamplesImage = argv[3]; //load - samples from here
+    const std::string negativeSamplesIndex = argv[4]; //load - samples from here
+    const int rounds = std::atoi(argv[5]);            //amount of weak classifiers
+    const std::string classifierFileName = argv[6];   //write output here
+
+
+
+    PackedWaveletSet wavelets;
+    std::vector<cv::Mat> positivesIntegralSums, negativesIntegralSums;
+    std::ofstream outputStream;
+
+
+    {
+        //Load a list of Haar wavelets
+        std::cout << "Loading wavelets..." << std::endl;
+        if (!loadPackedWaveletsParallel(waveletsFileName, wavelets) || wavelets.empty())
+        {
+            std::cout << "Unable to load Haar wavelets from file " << waveletsFileName << std::endl;
+            return 2;
+        }
+        std::cout << wavelets.size() << " wavelets loaded." << std::endl;
+
+        if (rounds < 1)
+        {
+            std::cout << "The amount of rounds must be positive." << std::endl;
+            return 3;
+        }
+
+        outputStream.open(classifierFileName.c_str(), std::ios::trunc);
+        if ( !outputStream.is_open() )
+        {
+            std::cout << "Can't open output file." << std::endl;
+            return 5;
+        }
+
+        if ( !SampleExtractor::extractFromBigImage(positiveSamplesImage, positivesIntegralSums) || positivesIntegralSums.empty() )
+        {
+            std::cout << "Failed to load positive samples." << std::endl;
+            return 6;
+        }
+        toIntegralSums(positivesIntegralSums, singlePrecision);
+        std::cout << positivesIntegralSums.size() << " positive samples loaded." << std::endl;
+
+        if ( !isSupportedWindowSize(sampleSize(positivesIntegralSums)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(positivesIntegralSums) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
+
+        if ( !SampleExtractor::extractFromBigImage(negativeSamplesImage, negativeSamplesIndex, negativesIntegralSums) || negativesIntegralSums.empty() )
+        {
+            std::cout << "Failed to load negative samples." << std::endl;
+            return 7;
+        }
+        toIntegralSums(negativesIntegralSums, singlePrecision);
+        std::cout << negativesIntegralSums.size() << " negative samples loaded." << std::endl;
+
+        if ( sampleSize(negativesIntegralSums) != sampleSize(positivesIntegralSums) )
+        {
+            std::cout << "Negative samples are " << sampleSize(negativesIntegralSums) << " pixels wide, positive samples " << sampleSize(positivesIntegralSums) << ". Use samples of the same size." << std::endl;
+            return 8;
+        }
+    }
+
+
+
+    const size_t samples = positivesIntegralSums.size() + negativesIntegralSums.size();
+    const size_t features = topCount.empty() ? wavelets.size() : std::min<size_t>(std::atol(topCount.c_str()), wavelets.size());
+    if (features < 1)
+    {
+        std::cout << "--top must keep at least one wavelet." << std::endl;
+        return 3;
+    }
+
+    const double memory = AdaBoost::memory(features, samples);
+    if ( memory > physicalMemory() )
+    {
+        std::cout << "Boosting " << features << " wavelets over " << samples << " samples needs " << memory / (1 << 30)
+                  << " GB, more than this machine has. Boost the best wavelets of an optimizer with --top K." << std::endl;
+        return 9;
+    }
+
+    std::vector<char> labels(samples, 0);
+    std::fill(labels.begin(), labels.begin() + positivesIntegralSums.size(), 1);
+
+    std::cout << "Computing responses of " << features << " wavelets, " << memory / (1 << 30) << " GB..." << std::endl;
+    std::vector<float> responses(features * samples);
+    tbb::parallel_for( tbb::blocked_range<size_t>(0, features),
+                       ComputeResponses(&wavelets, &positivesIntegralSums, &negativesIntegralSums, &responses) );
+
+    std::cout << "Sorting responses..." << std::endl;
+    AdaBoost boost(responses, labels, features);
+
+    std::cout << "Boosting " << rounds << " rounds..." << std::endl;
+    for (int r = 0; r < rounds; ++r)
+    {
+        const WeakClassifier weak = boost.round();
+        std::cout << "Round " << r + 1 << ": wavelet " << weak.feature << ", error " << weak.error << std::endl;
+
+        wavelets.unpack(weak.feature).write(outputStream);
+        outputStream << " " << weak.threshold << " " << weak.polarity << " " << weak.alpha << std::endl;
+    }
+
+    return 0;
+}
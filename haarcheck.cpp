@@ -3,6 +3,8 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <cstdlib>
+#include <algorithm>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -12,17 +14,32 @@
 #include "haarwavelet.h"
 #include "haarwaveletutilities.h"
 
-#define SAMPLE_SIZE 20
+#include "detector_window.h"
+#include "packed_wavelet.h"
+#include "wavelet_parser.h"
 
-#define MIN_RECT_HEIGHT 3 //Minimum = 3 thanks to Pavani's restriction #6.
-#define MIN_RECT_WIDTH 3 //Minimum = 3 thanks to Pavani's restriction #6.
+#include <tbb/tbb.h>
+
+
+
+#define CHECK_BATCH_SIZE (1 << 20)   //bytes of text checked by one task, rounded to whole lines
+#define PIPELINE_TOKENS_PER_THREAD 2 //batches in flight
+
+//oneTBB renamed the modes of the pipeline filters.
+#if defined(TBB_VERSION_MAJOR) && TBB_VERSION_MAJOR >= 2021
+#define SERIAL_IN_ORDER tbb::filter_mode::serial_in_order
+#define PARALLEL_FILTER tbb::filter_mode::parallel
+#else
+#define SERIAL_IN_ORDER tbb::filter::serial_in_order
+#define PARALLEL_FILTER tbb::filter::parallel
+#endif
 
 
 
 /*
  * Pavani's restrictions on Haar wavelets generation:
- * 1) only 2 to 4 rectangles
- * 2) detector size = 20x20
+ * 1) only 2 to 4 rectangles (up to MAX_RECTANGLES are generated on request)
+ * 2) detector size = 20x20 (24x24 and 32x32 are also checked on request)
  * 3) no rotated rectangles
  * 4) disjoint rectangles are away of each other an integer multiple of rectangle sizes
  * 5) all rectangles in a HW have the same size
@@ -40,222 +57,750 @@ inline bool same(const cv::Rect &r1, const cv::Rect &r2) {
 
 
 
-inline int contains(std::vector<cv::Rect>::const_iterator it, const std::vector<cv::Rect>::const_iterator end, const cv::Rect &r)
+inline bool hasOverlappingRectangles(const WaveletRecord & w1)
 {
-    int i = 0;
-
-    for(; it != end; ++it)
+    for (int i = 0; i < w1.dimensions; ++i)
     {
-        if (same(*it, r))
+        for (int j = i + 1; j < w1.dimensions; ++j)
         {
-            i++;
+            if (same(w1.rects[i], w1.rects[j]))
+            {
+                return true;
+            }
         }
     }
 
-    return i;
+    return false;
 }
 
 
 
-inline bool same(HaarWavelet & w1, HaarWavelet & w2)
+/**
+ * The wavelet with its rectangles sorted and without weights, so that wavelets with the same
+ * rectangles in any order are equal.
+ */
+inline PackedWavelet canonicalWavelet(const PackedWavelet & w)
 {
-    if (w1.dimensions() != w2.dimensions())
+    int order[MAX_RECTANGLES];
+    for (int i = 0; i < w.dimensions; ++i)
     {
-        return false;
+        order[i] = i;
     }
-
-    const std::vector<cv::Rect>::const_iterator begin1 = w1.rects_begin();
-    const std::vector<cv::Rect>::const_iterator end1 = w1.rects_end();
-    const std::vector<cv::Rect>::const_iterator end2 = w2.rects_end();
-    std::vector<cv::Rect>::const_iterator it1 = w1.rects_begin();
-    for(; it1 != end1; ++it1)
+    for (int i = 1; i < w.dimensions; ++i) //insertion sort by rectangle key
     {
-        const int amountOfThisRectangle = contains(begin1, end1, *it1);
-
-        std::vector<cv::Rect>::const_iterator it2 = w2.rects_begin();
-        if ( contains(it2, end2, *it1) != amountOfThisRectangle)
+        for (int j = i; j > 0 && w.rectKey(order[j]) < w.rectKey(order[j - 1]); --j)
         {
-            return false;
+            std::swap(order[j], order[j - 1]);
         }
     }
 
-    return true;
+    PackedWavelet canonical = PackedWavelet();
+    canonical.dimensions = w.dimensions;
+    for (int i = 0; i < w.dimensions; ++i)
+    {
+        canonical.origins[i] = w.origins[order[i]];
+        canonical.sizes[i] = w.sizes[order[i]];
+    }
+    return canonical;
 }
 
 
 
-inline bool hasOverlappingRectangles(const HaarWavelet & w1)
+struct PackedWaveletHash
 {
-    std::vector<cv::Rect>::const_iterator it1 = w1.rects_begin();
-    const std::vector<cv::Rect>::const_iterator end1 = w1.rects_end();
-    for(; it1 != end1; ++it1)
+    size_t operator()(const PackedWavelet & w) const
     {
-        std::vector<cv::Rect>::const_iterator it2 = w1.rects_begin();
-        const std::vector<cv::Rect>::const_iterator end2 = w1.rects_end();
-        for(; it2 != end2; ++it2)
+        size_t hash = w.dimensions;
+        for (int i = 0; i < w.dimensions; ++i)
         {
-            if (it1 != it2 && same(*it1, *it2))
-            {
-                return true;
-            }
+            boost::hash_combine(hash, w.rectKey(i));
         }
+        return hash;
     }
+};
 
-    return false;
+
+
+/**
+ * Wavelets with the same rectangles have the same amount of rectangles, the same first
+ * rectangle size and come from the same lattice, the position of that rectangle modulo its
+ * size. haargen writes all the wavelets of a lattice together.
+ */
+inline uint64_t latticeKey(const PackedWavelet & canonical)
+{
+    const cv::Rect r = canonical.rect(0);
+    return (uint64_t)canonical.dimensions
+         | (uint64_t)r.width << 8
+         | (uint64_t)r.height << 16
+         | (uint64_t)(r.width > 0 ? r.x % r.width : r.x) << 24
+         | (uint64_t)(r.height > 0 ? r.y % r.height : r.y) << 32;
 }
 
 
 
 /**
- * Checks if the Haar-like features generated by haargen.cpp conform to Pavani's restrictions.
+ * Finds repeated wavelets in a stream of them. Only the wavelets of the current lattice are
+ * remembered, so memory use depends on the window size and not on the amount of wavelets.
+ * If a lattice shows up again after another one, the wavelets are not grouped by lattice
+ * and the check is given up.
  */
-int main(int argc, char * args[])
+class DuplicateFinder
 {
-    if (argc != 2) {
-        return 1;
+public:
+    DuplicateFinder() : currentLattice(~0ULL),
+                        complete_(true) {}
+
+    /**
+     * Returns true if the wavelet repeats one seen before.
+     */
+    bool repeats(const PackedWavelet & canonical)
+    {
+        if (!complete_)
+        {
+            return false;
+        }
+
+        const uint64_t lattice = latticeKey(canonical);
+        if (lattice != currentLattice)
+        {
+            closedLattices.insert(currentLattice);
+            seen.clear();
+            if (closedLattices.count(lattice))
+            {
+                complete_ = false;
+                return false;
+            }
+            currentLattice = lattice;
+        }
+
+        return !seen.insert(canonical).second;
     }
 
-    cv::Size sampleSize(SAMPLE_SIZE, SAMPLE_SIZE); //size in pixels of the trainning images
+    bool complete() const
+    {
+        return complete_;
+    }
 
+private:
+    uint64_t currentLattice;
+    bool complete_;
+    boost::unordered_set<PackedWavelet, PackedWaveletHash> seen;
+    boost::unordered_set<uint64_t> closedLattices;
+};
 
-    //load the wavelets
-    std::vector<HaarWavelet> wavelets;
-    std::cout << "Loading Haar wavelets from " << args[1] << std::endl;
-    loadHaarWavelets(args[1], wavelets);
-    std::cout << "Loaded " << wavelets.size() << " wavelets." << std::endl;
 
-    //STATS
-    int dimensions[3] = {0, 0, 0}; //2, 3 and 4 dimensions of the wavelets
-    int regionsHistogram[3][3]; //x regions are 8 - 4 - 8
-                                //y regions are 7 - 6 - 7
-    int widthHistogram[20], heightHistogram[20];
-    int totalRectangles;
+
+/**
+ * Statistics and check counts of a set of wavelets for a SIZE x SIZE detector window. Each
+ * batch gets its own, and they are added up in file order.
+ */
+template <int SIZE>
+struct WaveletSetStatistics
+{
+    typedef DetectorWindow<SIZE> Window;
+
+    long wavelets;
+    long rectangles;
+    long dimensions[MAX_RECTANGLES + 1];     //wavelets by amount of rectangles
+    long widthHistogram[SIZE], heightHistogram[SIZE];
+    long regionsHistogram[3][3]; //x regions are 8 - 4 - 8 for the 20x20 window
+                                 //y regions are 7 - 6 - 7 for the 20x20 window
+    long overlaps;
+    long sizeProblems;
+    long dimensionProblems;
+    long unreadable;
+
+    WaveletSetStatistics() : wavelets(0),
+                             rectangles(0),
+                             overlaps(0),
+                             sizeProblems(0),
+                             dimensionProblems(0),
+                             unreadable(0)
     {
-        for(int i = 0; i < 20; ++i)
+        std::fill(dimensions, dimensions + MAX_RECTANGLES + 1, 0);
+        std::fill(widthHistogram, widthHistogram + SIZE, 0);
+        std::fill(heightHistogram, heightHistogram + SIZE, 0);
+        std::fill(&regionsHistogram[0][0], &regionsHistogram[0][0] + 9, 0);
+    }
+
+    void add(const WaveletSetStatistics & other)
+    {
+        wavelets += other.wavelets;
+        rectangles += other.rectangles;
+        for (int i = 0; i <= MAX_RECTANGLES; ++i)
+        {
+            dimensions[i] += other.dimensions[i];
+        }
+        for (int i = 0; i < SIZE; ++i)
         {
-            widthHistogram[i] = heightHistogram[i] = 0;
+            widthHistogram[i] += other.widthHistogram[i];
+            heightHistogram[i] += other.heightHistogram[i];
         }
         for (int i = 0; i < 3; ++i)
         {
             for (int j = 0; j < 3; ++j)
             {
-                regionsHistogram[i][j] = 0;
+                regionsHistogram[i][j] += other.regionsHistogram[i][j];
             }
         }
+        overlaps += other.overlaps;
+        sizeProblems += other.sizeProblems;
+        dimensionProblems += other.dimensionProblems;
+        unreadable += other.unreadable;
+    }
+
+    /**
+     * Adds the rectangle to the statistics. Returns false if it breaks the window bounds or
+     * the minimum rectangle size.
+     */
+    bool addRectangle(const cv::Rect & r)
+    {
+        rectangles++;
+        if (1 <= r.width && r.width <= SIZE)
+        {
+            widthHistogram[r.width - 1]++;
+        }
+        if (1 <= r.height && r.height <= SIZE)
+        {
+            heightHistogram[r.height - 1]++;
+        }
+
+        float horizontalMean = r.x + r.width / 2.0f;
+        float verticalMean = r.y + r.height / 2.0f;
+
+        const int xIndex = horizontalMean < Window::xRegionBegin ? 0 :
+                      Window::xRegionBegin <= horizontalMean && horizontalMean < Window::xRegionEnd ? 1 :
+                                                                                                     2;
+        const int yIndex = verticalMean < Window::yRegionBegin ? 0 :
+                      Window::yRegionBegin <= verticalMean && verticalMean < Window::yRegionEnd ? 1 :
+                                                                                                 2;
+        regionsHistogram[xIndex][yIndex]++;
+
+        return !(r.x >= Window::size || r.y >= Window::size || r.x < 0 || r.y < 0 || r.x + r.width > Window::size || r.y + r.height > Window::size || r.width < Window::minRectWidth || r.height < Window::minRectHeight);
+    }
+};
+
+
+
+/**
+ * A batch of whole lines of the wavelets file going through the pipeline.
+ */
+template <int SIZE>
+struct CheckBatch
+{
+    std::string text;
+    size_t recordsEnd;                      //offset of the first empty line, or the text size
+    WaveletSetStatistics<SIZE> statistics;
+    std::vector<PackedWavelet> canonicals;  //of the wavelets, for the duplicate check
+    std::vector<size_t> canonicalLines;     //offsets of their lines in the text
+    std::string problems;                   //the wavelets that failed a check, already reported
+};
+
+
+
+/**
+ * First stage of the pipeline: reads the file in batches of about CHECK_BATCH_SIZE bytes that
+ * end at a line end. The first line decides whether the wavelets can be read by the parser
+ * or need the library; when it only has the amount of wavelets, as haargen writes, it is
+ * taken out and the next one decides.
+ */
+template <int SIZE>
+class ReadBatches
+{
+    std::istream * input;
+    std::string * carry;             //start of a line cut by the last read
+    WaveletTextParser * parser;
+    bool * useLibrary;
+    bool * layoutChecked;
+    long * declaredCount;            //from the first line, if it only has the amount of wavelets
+
+public:
+    CheckBatch<SIZE> * operator()(tbb::flow_control & control) const
+    {
+        CheckBatch<SIZE> * batch = new CheckBatch<SIZE>;
+        batch->text.swap(*carry);
+
+        size_t cut = std::string::npos;
+        while ( *input && cut == std::string::npos )
+        {
+            const size_t old = batch->text.size();
+            batch->text.resize(old + CHECK_BATCH_SIZE);
+            input->read(&batch->text[old], CHECK_BATCH_SIZE);
+            batch->text.resize(old + input->gcount());
+            cut = batch->text.rfind('\n');
+        }
 
+        if ( *input && cut != std::string::npos )
+        {
+            carry->assign(batch->text, cut + 1, std::string::npos);
+            batch->text.resize(cut + 1);
+        }
 
-        std::vector<HaarWavelet>::iterator it = wavelets.begin();
-        const std::vector<HaarWavelet>::iterator end = wavelets.end();
-        for(;it != end; ++it)
+        if ( batch->text.empty() )
         {
-            dimensions[it->dimensions() - 2]++;
+            delete batch;
+            control.stop();
+            return 0;
+        }
+
+        batch->recordsEnd = batch->text.size();
 
-            std::vector<cv::Rect>::const_iterator itr = it->rects_begin();
-            const std::vector<cv::Rect>::const_iterator endr = it->rects_end();
-            for(; itr != endr; ++itr)
+        if (!*layoutChecked)
+        {
+            const char * const e = lineEnd(batch->text.data(), batch->text.data() + batch->text.size());
+            if ( *declaredCount < 0 && countHeader(batch->text.data(), e, *declaredCount) )
             {
-                const cv::Rect r = *itr;
-                totalRectangles++;
-                widthHistogram[r.width - 1]++;
-                heightHistogram[r.height - 1]++;
-
-                float horizontalMean = r.x + r.width / 2.0f;
-                float verticalMean = r.y + r.height / 2.0f;
-
-                const int xIndex = horizontalMean < 8 ? 0 :
-                              8 <= horizontalMean && horizontalMean < 12 ? 1 :
-                                                                           2;
-                const int yIndex = verticalMean < 7 ? 0 :
-                              7 <= verticalMean && verticalMean < 13 ? 1 :
-                                                                       2;
-                regionsHistogram[xIndex][yIndex]++;
+                batch->text.erase(0, std::min<size_t>(e + 1 - batch->text.data(), batch->text.size()));
+                batch->recordsEnd = batch->text.size();
+            }
+
+            const char * const begin = batch->text.data();
+            const char * const end = begin + batch->text.size();
+            if (begin != end)
+            {
+                *layoutChecked = true;
+                *useLibrary = !isEmptyLine(begin, lineEnd(begin, end))
+                           && !parser->matchesLibrary(begin, end);
             }
         }
 
-        std::cout << "Total 2D/3D/4D wavelets: " << dimensions[0] << "/" << dimensions[1] << "/" << dimensions[2] << std::endl;
-        std::cout << "Total rectangles: " << totalRectangles << std::endl;
+        return batch;
+    }
+
+    ReadBatches(std::istream * input_,
+                std::string * carry_,
+                WaveletTextParser * parser_,
+                bool * useLibrary_,
+                bool * layoutChecked_,
+                long * declaredCount_) : input(input_),
+                                         carry(carry_),
+                                         parser(parser_),
+                                         useLibrary(useLibrary_),
+                                         layoutChecked(layoutChecked_),
+                                         declaredCount(declaredCount_) {}
+};
 
-        std::stringstream wHist, hHist;
-        wHist << "Width histogram: ";
-        hHist << "Height histogram: ";
-        for(int i = 0; i < 20; ++i)
+
+
+/**
+ * Second stage of the pipeline: checks the wavelets of several batches at once, up to the
+ * first empty line of each.
+ */
+template <int SIZE>
+class CheckLines
+{
+    const WaveletTextParser * parser;
+    const bool * useLibrary;
+
+public:
+    CheckBatch<SIZE> * operator()(CheckBatch<SIZE> * batch) const
+    {
+        const char * const begin = batch->text.data();
+        const char * const end = begin + batch->text.size();
+
+        std::vector<double> extras;
+        for (const char * p = begin; p < end; )
         {
-            wHist << widthHistogram[i] << " ";
-            hHist << heightHistogram[i] << " ";
+            const char * const e = lineEnd(p, end);
+            if ( isEmptyLine(p, e) )
+            {
+                batch->recordsEnd = p - begin;
+                break;
+            }
+
+            extras.clear();
+            checkLine(p, e, *batch, extras);
+            p = e + 1;
         }
-        std::cout << wHist.str() << std::endl;
-        std::cout << hHist.str() << std::endl;
 
-        std::cout << "Rectangles mean position 2D histogram: " << std::endl;
-        for (int i = 0; i < 3; ++i)
+        return batch;
+    }
+
+    CheckLines(const WaveletTextParser * parser_,
+               const bool * useLibrary_) : parser(parser_),
+                                           useLibrary(useLibrary_) {}
+
+private:
+    void checkLine(const char * const p, const char * const e, CheckBatch<SIZE> & batch, std::vector<double> & extras) const
+    {
+        WaveletSetStatistics<SIZE> & s = batch.statistics;
+        const std::string line = lineText(p, e);
+
+        WaveletRecord record;
+        if ( *useLibrary || !parser->parseLine(p, e, record, extras) )
         {
-            for (int j = 0; j < 3; ++j)
+            std::istringstream lineInputStream(line);
+            HaarWavelet wavelet;
+            if ( !wavelet.read(lineInputStream) )
             {
-                std::cout << regionsHistogram[j][i] << " ";
+                s.unreadable++;
+                report(batch, "Unreadable ==> ", line);
+                return;
+            }
+            if ( wavelet.dimensions() > MAX_RECTANGLES )
+            {
+                s.wavelets++;
+                s.dimensionProblems++;
+                report(batch, "Dimensions problem ==> ", line);
+                return;
+            }
+
+            record.dimensions = wavelet.dimensions();
+            for (int i = 0; i < record.dimensions; ++i)
+            {
+                record.rects[i] = wavelet.rect(i);
+                record.weights[i] = wavelet.weight(i);
             }
-            std::cout << std::endl;
         }
-    }
 
+        s.wavelets++;
+        s.dimensions[record.dimensions]++;
+        if (record.dimensions < 2)
+        {
+            s.dimensionProblems++;
+            report(batch, "Dimensions problem ==> ", line);
+        }
+
+        bool sizeProblem = false;
+        for (int i = 0; i < record.dimensions; ++i)
+        {
+            sizeProblem = !s.addRectangle(record.rects[i]) || sizeProblem;
+        }
 
+        if ( hasOverlappingRectangles(record) )
+        {
+            s.overlaps++;
+            report(batch, "Overlaps ==> ", line);
+        }
 
-    {//double checks for wavelets with overlapping rectangles
-       std::cout << "Checking for overlapped rectangles..." << std::endl;
-       std::vector<HaarWavelet>::iterator it = wavelets.begin();
-       const std::vector<HaarWavelet>::iterator end = wavelets.end();
-       for(;it != end; ++it)
-       {
-           if (hasOverlappingRectangles(*it))
-           {
-               std::cout << "Overlaps ==> ";
-               it->write(std::cout);
-               std::cout << std::endl;
-           }
-       }
+        if (sizeProblem)
+        {
+            s.sizeProblems++;
+            report(batch, "Size problem ==> ", line);
+        }
+
+        //Wavelets that can't be packed don't fit any window, and have already been reported
+        PackedWavelet packed;
+        if ( packWavelet(record.dimensions, record.rects, record.weights, packed) )
+        {
+            batch.canonicals.push_back( canonicalWavelet(packed) );
+            batch.canonicalLines.push_back(p - batch.text.data());
+        }
     }
 
+    static std::string lineText(const char * const p, const char * e)
+    {
+        while (e != p && isBlank(e[-1]))
+        {
+            --e;
+        }
+        return std::string(p, e);
+    }
+
+    static void report(CheckBatch<SIZE> & batch, const char * const problem, const std::string & line)
+    {
+        batch.problems += problem;
+        batch.problems += line;
+        batch.problems += '\n';
+    }
+};
+
+
+
+/**
+ * Whatever follows the first empty line of the file, like the amount of wavelets some files
+ * end with.
+ */
+struct Trailer
+{
+    long lines;
+    std::string firstLine;
 
+    Trailer() : lines(0) {}
 
-    {//double checks if any rect has x or y at position 20 or more
-        std::cout << "Checking for problems with rectangle sizes..." << std::endl;
-        std::vector<HaarWavelet>::iterator it = wavelets.begin();
-        const std::vector<HaarWavelet>::iterator end = wavelets.end();
-        for(;it != end; ++it)
+    void add(const char * p, const char * const end)
+    {
+        while (p < end)
         {
-            std::vector<cv::Rect>::const_iterator itr = it->rects_begin();
-            const std::vector<cv::Rect>::const_iterator endr = it->rects_end();
-            for(; itr != endr; ++itr)
+            const char * const e = lineEnd(p, end);
+            if ( !isEmptyLine(p, e) )
             {
-                if (itr->x >= 20 || itr->y >= 20 || itr->x < 0 || itr->y < 0 || itr->x + itr->width > 20 || itr->y + itr->height > 20 || itr->width < 3 || itr->height < 3)
+                if (lines == 0)
                 {
-                    std::cout << "Size problem ==> ";
-                    it->write(std::cout);
-                    std::cout << std::endl;
-                    break;
+                    firstLine.assign(p, e);
                 }
+                lines++;
             }
+            p = e + 1;
         }
     }
 
+    /**
+     * The amount of wavelets the file says it has, or -1 if it doesn't say.
+     */
+    long declaredCount() const
+    {
+        if (lines != 1)
+        {
+            return -1;
+        }
+        char * end;
+        const long count = std::strtol(firstLine.c_str(), &end, 10);
+        while (*end && (isBlank(*end) || *end == '\n'))
+        {
+            ++end;
+        }
+        return *end || count < 0 ? -1 : count;
+    }
+};
+
 
 
-    {//double checks for repeated rects in a haar wavelet through brute force
-        std::cout << "Checking duplicated rects in each haar wavelet..." << std::endl;
-        std::vector<HaarWavelet>::iterator it = wavelets.begin();
-        const std::vector<HaarWavelet>::iterator end = wavelets.end();
-        for(;it != end; ++it)
+/**
+ * Last stage of the pipeline: adds up the statistics of the batches, reports their
+ * problems and looks for repeated wavelets, in file order.
+ */
+template <int SIZE>
+class MergeBatches
+{
+    WaveletSetStatistics<SIZE> * statistics;
+    DuplicateFinder * duplicates;
+    long * repeats;
+    bool * ended;
+    Trailer * trailer;
+
+public:
+    void operator()(CheckBatch<SIZE> * batch) const
+    {
+        const char * const text = batch->text.data();
+
+        if (*ended)
         {
-            std::vector<HaarWavelet>::iterator it2 = it + 1;
-            for(;it2 != end; ++it2)
+            trailer->add(text, text + batch->text.size());
+            delete batch;
+            return;
+        }
+
+        statistics->add(batch->statistics);
+        std::cout << batch->problems;
+
+        for (size_t i = 0; i < batch->canonicals.size(); ++i)
+        {
+            if ( duplicates->repeats(batch->canonicals[i]) )
             {
-                if( same(*it, *it2) )
-                {
-                    std::cout << "Repeats ==> ";
-                    it->write(std::cout);
-                    std::cout << std::endl;
-                }
+                const char * const line = text + batch->canonicalLines[i];
+                (*repeats)++;
+                std::cout << "Repeats ==> " << std::string(line, lineEnd(line, text + batch->text.size())) << std::endl;
             }
         }
+
+        if (batch->recordsEnd != batch->text.size())
+        {
+            *ended = true;
+            trailer->add(text + batch->recordsEnd, text + batch->text.size());
+        }
+        delete batch;
+    }
+
+    MergeBatches(WaveletSetStatistics<SIZE> * statistics_,
+                 DuplicateFinder * duplicates_,
+                 long * repeats_,
+                 bool * ended_,
+                 Trailer * trailer_) : statistics(statistics_),
+                                       duplicates(duplicates_),
+                                       repeats(repeats_),
+                                       ended(ended_),
+                                       trailer(trailer_) {}
+};
+
+
+
+template <int SIZE>
+void printStatistics(const WaveletSetStatistics<SIZE> & s)
+{
+    std::cout << "Total 2D/3D/4D wavelets: " << s.dimensions[2] << "/" << s.dimensions[3] << "/" << s.dimensions[4] << std::endl;
+    for (int i = 5; i <= MAX_RECTANGLES; ++i)
+    {
+        if (s.dimensions[i] > 0)
+        {
+            std::cout << "Total " << i << "D wavelets: " << s.dimensions[i] << std::endl;
+        }
+    }
+    std::cout << "Total rectangles: " << s.rectangles << std::endl;
+
+    std::stringstream wHist, hHist;
+    wHist << "Width histogram: ";
+    hHist << "Height histogram: ";
+    for(int i = 0; i < SIZE; ++i)
+    {
+        wHist << s.widthHistogram[i] << " ";
+        hHist << s.heightHistogram[i] << " ";
+    }
+    std::cout << wHist.str() << std::endl;
+    std::cout << hHist.str() << std::endl;
+
+    std::cout << "Rectangles mean position 2D histogram: " << std::endl;
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            std::cout << s.regionsHistogram[j][i] << " ";
+        }
+        std::cout << std::endl;
+    }
+}
+
+
+
+/**
+ * Writes the results as one "key values..." line each. Histograms are flattened: the
+ * dimensions from 0 to MAX_RECTANGLES rectangles, the widths and heights from 1 to the window
+ * size, and the regions row by row from the top left one.
+ */
+template <int SIZE>
+void writeReport(std::ostream & output, const std::string & filename, const WaveletSetStatistics<SIZE> & s,
+                 const long repeats, const bool duplicatesChecked, const long declaredCount, const Trailer & trailer)
+{
+    const bool valid = s.overlaps == 0 && s.sizeProblems == 0 && s.dimensionProblems == 0 && s.unreadable == 0
+                    && repeats == 0 && (declaredCount < 0 || declaredCount == s.wavelets);
+
+    output << "file " << filename << '\n';
+    output << "window_size " << SIZE << '\n';
+    output << "wavelets " << s.wavelets << '\n';
+    output << "declared_wavelets " << declaredCount << '\n';
+    output << "rectangles " << s.rectangles << '\n';
+
+    output << "dimensions";
+    for (int i = 0; i <= MAX_RECTANGLES; ++i)
+    {
+        output << ' ' << s.dimensions[i];
+    }
+    output << "\nwidth_histogram";
+    for (int i = 0; i < SIZE; ++i)
+    {
+        output << ' ' << s.widthHistogram[i];
+    }
+    output << "\nheight_histogram";
+    for (int i = 0; i < SIZE; ++i)
+    {
+        output << ' ' << s.heightHistogram[i];
+    }
+    output << "\nregion_histogram";
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            output << ' ' << s.regionsHistogram[j][i];
+        }
+    }
+    output << '\n';
+
+    output << "overlaps " << s.overlaps << '\n';
+    output << "size_problems " << s.sizeProblems << '\n';
+    output << "dimension_problems " << s.dimensionProblems << '\n';
+    output << "unreadable_lines " << s.unreadable << '\n';
+    output << "repeats " << repeats << '\n';
+    output << "repeats_checked " << duplicatesChecked << '\n';
+    output << "trailing_lines " << trailer.lines << '\n';
+    output << "valid " << valid << '\n';
+}
+
+
+
+/**
+ * Streams the wavelets file once, checking batches of it in parallel against Pavani's
+ * restrictions for a SIZE x SIZE detector window while the statistics are added up in file
+ * order. Memory use doesn't depend on the size of the file.
+ */
+template <int SIZE>
+void checkWavelets(std::istream & input, const std::string & filename, std::ostream * report)
+{
+    WaveletTextParser parser(false);
+    std::string carry;
+    bool useLibrary = false, layoutChecked = false;
+    long headerCount = -1;
+
+    WaveletSetStatistics<SIZE> statistics;
+    DuplicateFinder duplicates;
+    long repeats = 0;
+    bool ended = false;
+    Trailer trailer;
+
+    tbb::parallel_pipeline( PIPELINE_TOKENS_PER_THREAD * tbb::this_task_arena::max_concurrency(),
+                            tbb::make_filter<void, CheckBatch<SIZE> *>(SERIAL_IN_ORDER, ReadBatches<SIZE>(&input, &carry, &parser, &useLibrary, &layoutChecked, &headerCount))
+                          & tbb::make_filter<CheckBatch<SIZE> *, CheckBatch<SIZE> *>(PARALLEL_FILTER, CheckLines<SIZE>(&parser, &useLibrary))
+                          & tbb::make_filter<CheckBatch<SIZE> *, void>(SERIAL_IN_ORDER, MergeBatches<SIZE>(&statistics, &duplicates, &repeats, &ended, &trailer)) );
+
+    std::cout << "Checked " << statistics.wavelets << " wavelets." << std::endl;
+    printStatistics(statistics);
+
+    if ( !duplicates.complete() )
+    {
+        std::cout << "The wavelets are not grouped by lattice, repeated wavelets were not looked for." << std::endl;
+    }
+
+    const long declaredCount = headerCount >= 0 ? headerCount : trailer.declaredCount();
+    if (declaredCount >= 0 && declaredCount != statistics.wavelets)
+    {
+        std::cout << "The file says it has " << declaredCount << " wavelets." << std::endl;
+    }
+    else if (declaredCount < 0 && trailer.lines > 0)
+    {
+        std::cout << trailer.lines << " lines after the first empty line were not checked." << std::endl;
+    }
+
+    if (report)
+    {
+        writeReport(*report, filename, statistics, repeats, duplicates.complete(), declaredCount, trailer);
+    }
+}
+
+
+
+/**
+ * Checks if the Haar-like features generated by haargen.cpp conform to Pavani's restrictions.
+ * With REPORT_FILE the statistics and the amount of problems of each kind are also written
+ * there, one "key values..." line each.
+ */
+int main(int argc, char * args[])
+{
+    if (argc < 2 || argc > 4) {
+        std::cout << "Usage " << args[0] << " WAVELETS_FILE [WINDOW_SIZE [REPORT_FILE]]" << std::endl;
+        return 1;
+    }
+
+    const int windowSize = argc >= 3 ? std::atoi(args[2]) : DEFAULT_WINDOW_SIZE;
+    if ( !isSupportedWindowSize(windowSize) )
+    {
+        std::cout << "Unsupported window size " << windowSize << ". Use " << SUPPORTED_WINDOW_SIZES << "." << std::endl;
+        return 2;
+    }
+
+    std::ifstream input(args[1], std::ios::binary);
+    if ( !input.is_open() )
+    {
+        std::cout << "Can't open wavelets file " << args[1] << std::endl;
+        return 3;
+    }
+
+    std::ofstream reportStream;
+    if (argc == 4)
+    {
+        reportStream.open(args[3], std::ios::trunc);
+        if ( !reportStream.is_open() )
+        {
+            std::cout << "Can't open report file." << std::endl;
+            return 4;
+        }
+    }
+
+    std::cout << "Checking Haar wavelets from " << args[1] << std::endl;
+    std::ostream * report = argc == 4 ? &reportStream : 0;
+    switch (windowSize)
+    {
+        case 20: checkWavelets<20>(input, args[1], report); break;
+        case 24: checkWavelets<24>(input, args[1], report); break;
+        case 32: checkWavelets<32>(input, args[1], report); break;
     }
 
     return 0;
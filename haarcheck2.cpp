@@ -3,84 +3,254 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include <numeric>
+#include <limits>
 #include <cmath>
 
 #include "haarwavelet.h"
 
+#include "wavelet_parser.h"
 
-#define HISTOGRAM_BUCKETS 12
+#include <tbb/tbb.h>
 
 
-class ProbabilisticClassifierData : public DualWeightHaarWavelet
+
+#define HISTOGRAM_SUM_TOLERANCE 0.000001
+#define BIN_ROUNDING 0.0000005 //most a bin below 1 is off once written with iostream's 6 significant digits
+#define MIN_STDDEV 0.000009
+#define HISTOGRAM_LANES 4     //independent partial sums, so the loop over the bins vectorizes
+#define SEPARABILITY_VALUES 3 //Bhattacharyya distance, Kullback-Leibler divergence, Fisher ratio
+
+
+
+/**
+ * Positions of the numbers haaroptimizer-norm-hist writes after the wavelet. The bins of
+ * the negative histogram follow their amount, and files written since the separability
+ * metrics end with SEPARABILITY_VALUES more numbers.
+ */
+enum ClassifierValue
 {
-public:
-    ProbabilisticClassifierData() : histogram(HISTOGRAM_BUCKETS) {}
+    POSITIVE_PRIOR = 0,
+    MEAN           = 1, //of the positive feature values
+    STDDEV         = 2,
+    NEGATIVE_PRIOR = 3,
+    BINS           = 4,
+    FIRST_BIN      = 5
+};
+
+
+
+/**
+ * Problems a classifier record can have, as bits of its error mask.
+ */
+enum ClassifierError
+{
+    BAD_LAYOUT         = 1 << 0, //the numbers after the wavelet are not laid out as in ClassifierValue
+    NON_FINITE_WEIGHT  = 1 << 1,
+    NON_FINITE_MEAN    = 1 << 2,
+    NON_FINITE_STDDEV  = 1 << 3,
+    NULL_STDDEV        = 1 << 4,
+    NEGATIVE_STDDEV    = 1 << 5,
+    NON_FINITE_BIN     = 1 << 6,
+    NEGATIVE_BIN       = 1 << 7,
+    HISTOGRAM_SUM      = 1 << 8, //the histogram doesn't add to one
+    BAD_PRIOR          = 1 << 9, //the priors are not probabilities adding to one
+    BAD_SEPARABILITY   = 1 << 10 //a separability metric is NaN, infinite or negative
+};
+
+#define CLASSIFIER_ERRORS 11
 
-    ProbabilisticClassifierData& operator=(const ProbabilisticClassifierData & c)
-    {
-        rects = c.rects;
-        weightsPositive = c.weightsPositive;
-        weightsNegative = c.weightsNegative;
-        mean = c.mean;
-        stdDev = c.stdDev;
-        histogram = c.histogram;
 
-        return *this;
-    }
 
-    bool operator < (const ProbabilisticClassifierData & rh) const
+inline const char * describe(const int error)
+{
+    switch (error)
     {
-        return stdDev < rh.stdDev;
+        case BAD_LAYOUT:        return "has no priors, mean, standard deviation and histogram after the wavelet";
+        case NON_FINITE_WEIGHT: return "has a NaN or infinite weight";
+        case NON_FINITE_MEAN:   return "mean is NaN or infinite";
+        case NON_FINITE_STDDEV: return "standard deviation is NaN or infinite";
+        case NULL_STDDEV:       return "standard deviation is 0";
+        case NEGATIVE_STDDEV:   return "standard deviation is negative";
+        case NON_FINITE_BIN:    return "histogram has a NaN or infinite bin";
+        case NEGATIVE_BIN:      return "histogram has a negative bin";
+        case HISTOGRAM_SUM:     return "histogram doesn't add to 1";
+        case BAD_PRIOR:         return "priors are not probabilities adding to 1";
+        case BAD_SEPARABILITY:  return "separability is NaN, infinite or negative";
+        default:                return "unknown error";
     }
+}
+
 
-    bool read(std::istream &input)
+
+/**
+ * Sum and smallest bin of a histogram, and whether all its bins are finite, in one pass.
+ */
+inline void histogramSummary(const double * const bins, const int buckets, double & sum, double & minimum, bool & finite)
+{
+    double sums[HISTOGRAM_LANES] = {0};
+    double minimums[HISTOGRAM_LANES];
+    double zeros[HISTOGRAM_LANES] = {0}; //bin - bin is 0 for finite bins and NaN otherwise
+    std::fill(minimums, minimums + HISTOGRAM_LANES, std::numeric_limits<double>::infinity());
+
+    int i = 0;
+    for (; i + HISTOGRAM_LANES <= buckets; i += HISTOGRAM_LANES)
     {
-        if ( !DualWeightHaarWavelet::read(input) )
+        for (int l = 0; l < HISTOGRAM_LANES; ++l)
         {
-            return false;
+            const double bin = bins[i + l];
+            sums[l] += bin;
+            minimums[l] = bin < minimums[l] ? bin : minimums[l];
+            zeros[l] += bin - bin;
         }
+    }
+    for (; i < buckets; ++i)
+    {
+        sums[0] += bins[i];
+        minimums[0] = bins[i] < minimums[0] ? bins[i] : minimums[0];
+        zeros[0] += bins[i] - bins[i];
+    }
+
+    sum = 0;
+    minimum = std::numeric_limits<double>::infinity();
+    double zero = 0;
+    for (int l = 0; l < HISTOGRAM_LANES; ++l)
+    {
+        sum += sums[l];
+        minimum = std::min(minimum, minimums[l]);
+        zero += zeros[l];
+    }
+    finite = zero == 0;
+}
+
+
+
+/**
+ * Amount of bins of the histogram of a record, or -1 when the numbers after the wavelet
+ * are not laid out as in ClassifierValue. separability tells whether the metrics follow
+ * the bins.
+ */
+inline int histogramBins(const WaveletRecord & record, const double * const values, bool & separability)
+{
+    if (record.extrasCount < FIRST_BIN)
+    {
+        return -1;
+    }
+
+    const double bins = values[BINS];
+    if ( !(bins >= 0) || bins != std::floor(bins) )
+    {
+        return -1;
+    }
+
+    separability = record.extrasCount == FIRST_BIN + bins + SEPARABILITY_VALUES;
+    return separability || record.extrasCount == FIRST_BIN + bins ? (int)bins : -1;
+}
 
-        input >> mean
-              >> stdDev;
 
-        int buckets = 0;
-        input >> buckets;
-        for (int i = 0; i < buckets; ++i)
+
+inline bool isProbability(const double p)
+{
+    return p >= 0 && p <= 1;
+}
+
+
+
+/**
+ * Checks a record written by haaroptimizer-norm-hist: a dual weight wavelet followed by the
+ * numbers of ClassifierValue, the bins of the histogram of the negative feature values and,
+ * if there are, the separability metrics. Returns its error mask.
+ */
+inline int validateClassifier(const WaveletRecord & record, const double * const values)
+{
+    int errors = 0;
+
+    for (int i = 0; i < record.dimensions; ++i)
+    {
+        if ( !std::isfinite(record.weights[i]) || !std::isfinite(record.negativeWeights[i]) )
         {
-            input >> histogram[i];
+            errors |= NON_FINITE_WEIGHT;
         }
+    }
 
-        return true;
+    bool separability;
+    const int bins = histogramBins(record, values, separability);
+    if (bins < 0)
+    {
+        return errors | BAD_LAYOUT;
     }
 
-    std::vector<double>& getHistogram()
+    const double positivePrior = values[POSITIVE_PRIOR];
+    const double negativePrior = values[NEGATIVE_PRIOR];
+    errors |= isProbability(positivePrior) && isProbability(negativePrior)
+           && std::fabs(positivePrior + negativePrior - 1.0) <= HISTOGRAM_SUM_TOLERANCE ? 0 : BAD_PRIOR;
+
+    const double mean = values[MEAN];
+    const double stdDev = values[STDDEV];
+    errors |= std::isfinite(mean) ? 0 : NON_FINITE_MEAN;
+    errors |= !std::isfinite(stdDev) ? NON_FINITE_STDDEV :
+              std::fabs(stdDev) < MIN_STDDEV ? NULL_STDDEV :
+              stdDev < 0 ? NEGATIVE_STDDEV : 0;
+
+    if (separability)
     {
-        return histogram;
+        //The Bhattacharyya distance of identical distributions can round to a tiny negative
+        const double * const metrics = values + FIRST_BIN + bins;
+        for (int m = 0; m < SEPARABILITY_VALUES; ++m)
+        {
+            errors |= std::isfinite(metrics[m]) && metrics[m] >= -HISTOGRAM_SUM_TOLERANCE ? 0 : BAD_SEPARABILITY;
+        }
     }
 
-    double getStdDev() const
+    double sum, minimum;
+    bool finite;
+    histogramSummary(values + FIRST_BIN, bins, sum, minimum, finite);
+    if (!finite)
     {
-        return stdDev;
+        return errors | NON_FINITE_BIN;
     }
+    errors |= minimum < 0 ? NEGATIVE_BIN : 0;
+    errors |= std::fabs(sum - 1.0) > HISTOGRAM_SUM_TOLERANCE + bins * BIN_ROUNDING ? HISTOGRAM_SUM : 0;
+
+    return errors;
+}
+
+
+
+/**
+ * Functor used by Intel TBB to validate the records, each into its own error mask.
+ */
+class ValidateClassifiers
+{
+    const std::vector<WaveletRecord> * records;
+    const std::vector<double> * extras;
+    std::vector<int> * errors;
 
-    double getMean() const
+public:
+    void operator()(const tbb::blocked_range<size_t> range) const
     {
-        return mean;
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            const WaveletRecord & record = (*records)[i];
+            (*errors)[i] = validateClassifier(record, extras->empty() ? 0 : &(*extras)[record.extrasBegin]);
+        }
     }
 
-private:
-    double stdDev; //statistics taken from the feature value, not directly from the SRFS
-    double mean;
-    std::vector<double> histogram;
+    ValidateClassifiers(const std::vector<WaveletRecord> * records_,
+                        const std::vector<double> * extras_,
+                        std::vector<int> * errors_) : records(records_),
+                                                      extras(extras_),
+                                                      errors(errors_) {}
 };
 
 
 
 /**
- * Loads many WeakHypothesis found in a file to a vector of HaarClassifierType.
+ * Reads the classifiers with the library, one line at a time, into the records and extras
+ * the parser would have produced. Used when the parser can't read the file.
  */
-bool loadClassifierData(const std::string &filename, std::vector<ProbabilisticClassifierData> &classifiers)
+bool loadClassifierRecordsStreamed(const std::string &filename, std::vector<WaveletRecord> &records, std::vector<double> &extras)
 {
     std::ifstream ifs;
     ifs.open(filename.c_str(), std::ifstream::in);
@@ -90,30 +260,33 @@ bool loadClassifierData(const std::string &filename, std::vector<ProbabilisticCl
         return false;
     }
 
-    do
+    std::string line;
+    while ( getline(ifs, line) && !line.empty() )
     {
-        std::string line;
-        getline(ifs, line);
-        if (line.empty())
-        {
-            break;
-        }
         std::istringstream lineInputStream(line);
 
-        ProbabilisticClassifierData classifier;
-        classifier.read(lineInputStream);
-
-        if ( !ifs.eof() )
+        DualWeightHaarWavelet wavelet;
+        if ( !wavelet.read(lineInputStream) || wavelet.dimensions() > MAX_RECTANGLES )
         {
-            classifiers.push_back( classifier );
+            return false;
         }
-        else
+
+        WaveletRecord record;
+        record.dimensions = wavelet.dimensions();
+        std::copy(wavelet.rects_begin(), wavelet.rects_end(), record.rects);
+        std::copy(wavelet.weightsPositive_begin(), wavelet.weightsPositive_end(), record.weights);
+        std::copy(wavelet.weightsNegative_begin(), wavelet.weightsNegative_end(), record.negativeWeights);
+
+        record.extrasBegin = extras.size();
+        double value;
+        while (lineInputStream >> value)
         {
-            break;
+            extras.push_back(value);
         }
-    } while (true);
+        record.extrasCount = extras.size() - record.extrasBegin;
 
-    ifs.close();
+        records.push_back(record);
+    }
 
     return true;
 }
@@ -121,49 +294,70 @@ bool loadClassifierData(const std::string &filename, std::vector<ProbabilisticCl
 
 
 /**
- * Checks if the Haar-like classifiers produced by
- * haaroptimizer2.cpp makes sense.
+ * Checks if the Haar-like classifiers produced by haaroptimizer-norm-hist make sense. The file is
+ * memory mapped and parsed in parallel, and the records are validated in parallel too. Each
+ * problem found is listed with the index of its record, followed by the amount of records
+ * with each kind of problem.
  */
 int main(int argc, char * args[])
 {
     if (argc != 2) {
+        std::cout << "Usage " << args[0] << " CLASSIFIERS_FILE" << std::endl;
         return 1;
     }
 
-    std::vector<ProbabilisticClassifierData> classifiers;
-    loadClassifierData(args[1], classifiers);
+    WaveletTextParser parser(true);
+    std::vector<WaveletRecord> streamedRecords;
+    std::vector<double> streamedExtras;
 
-    std::vector<ProbabilisticClassifierData>::iterator it = classifiers.begin();
-    const std::vector<ProbabilisticClassifierData>::iterator end = classifiers.end();
+    const bool parsed = parser.parse(args[1]);
+    if ( !parsed && !loadClassifierRecordsStreamed(args[1], streamedRecords, streamedExtras) )
+    {
+        std::cout << "Unable to load classifiers from file " << args[1] << std::endl;
+        return 2;
+    }
 
-    bool ok = true;
+    const std::vector<WaveletRecord> & records = parsed ? parser.records() : streamedRecords;
+    const std::vector<double> & extras = parsed ? parser.extras() : streamedExtras;
 
-    for(; it != end; ++it)
-    {
-        std::vector<double> histogram = it->getHistogram();
+    std::vector<int> errors(records.size(), 0);
+    tbb::parallel_for( tbb::blocked_range<size_t>(0, records.size()), ValidateClassifiers(&records, &extras, &errors) );
 
-        double sumOfHistogram = std::accumulate(histogram.begin(), histogram.end(), .0);
-        if ( std::fabs(sumOfHistogram - 1.0) > 0.000001 )
+    long counts[CLASSIFIER_ERRORS] = {0};
+    long failed = 0;
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        if (errors[i] == 0)
         {
-            ok = false;
-            std::cerr << "Haar-like feature with index " << it - classifiers.begin() << " histogram adds to " << sumOfHistogram << std::endl;
+            continue;
         }
 
-        if ( std::fabs(it->getStdDev()) < 0.000009 )
+        failed++;
+        for (int e = 0; e < CLASSIFIER_ERRORS; ++e)
         {
-            ok = false;
-            std::cerr << "Haar-like feature with index " << it - classifiers.begin() << " standard deviation is 0.";
+            if ( errors[i] & (1 << e) )
+            {
+                counts[e]++;
+                std::cerr << "Haar-like feature with index " << i << " " << describe(1 << e);
+                if ( (1 << e) == HISTOGRAM_SUM )
+                {
+                    const double * const values = &extras[records[i].extrasBegin];
+                    std::cerr << ": " << std::accumulate(values + FIRST_BIN, values + FIRST_BIN + (int)values[BINS], .0);
+                }
+                std::cerr << std::endl;
+            }
         }
     }
 
-    std::cout << "Total Haar-like features tested: " << end - classifiers.begin() << std::endl;
-
-    if (ok)
+    std::cout << "Total Haar-like features tested: " << records.size() << std::endl;
+    std::cout << "Haar-like features with problems: " << failed << std::endl;
+    for (int e = 0; e < CLASSIFIER_ERRORS; ++e)
     {
-        return 0;
-    }
-    else
-    {
-        return 1;
+        if (counts[e] > 0)
+        {
+            std::cout << "  " << describe(1 << e) << ": " << counts[e] << std::endl;
+        }
     }
+
+    return failed == 0 ? 0 : 1;
 }
@@ -0,0 +1,369 @@
+#include <string>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include "optimization_commons.h"
+#include "feature_matrix.h"
+#include "precision_verification.h"
+#include "sliding_window_detector.h"
+
+#include <tbb/tbb.h>
+
+
+
+#define PIPELINE_TOKENS_PER_THREAD 2 //frames in flight in the throughput mode
+
+//oneTBB renamed the modes of the pipeline filters.
+#if defined(TBB_VERSION_MAJOR) && TBB_VERSION_MAJOR >= 2021
+#define SERIAL_IN_ORDER tbb::filter_mode::serial_in_order
+#define PARALLEL_FILTER tbb::filter_mode::parallel
+#else
+#define SERIAL_IN_ORDER tbb::filter::serial_in_order
+#define PARALLEL_FILTER tbb::filter::parallel
+#endif
+
+
+
+/**
+ * A frame going through the throughput pipeline.
+ */
+struct Frame
+{
+    std::string filename;
+    cv::Mat image;
+    std::vector<Detection> detections;
+};
+
+
+
+/**
+ * Writes the detections of a frame, one per line: the image, the window and the score.
+ */
+void writeDetections(std::ostream & output, const std::string & filename, const std::vector<Detection> & detections)
+{
+    for (unsigned int i = 0; i < detections.size(); ++i)
+    {
+        const cv::Rect & w = detections[i].window;
+        output << filename << ' ' << w.x << ' ' << w.y << ' ' << w.width << ' ' << w.height << ' ' << detections[i].score << '\n';
+    }
+}
+
+
+
+/**
+ * Largest differences found between the detector and the training path.
+ */
+struct TrainingParity
+{
+    int windows;
+    double deviation; //of a feature value
+    int decisions;    //of stumps that decide differently
+
+    TrainingParity() : windows(0),
+                       deviation(0),
+                       decisions(0) {}
+};
+
+
+
+/**
+ * Compares the feature values the detector gives on count random windows of the image, at
+ * the training size, with those of the training path: the window is cut out as a sample,
+ * loaded with normalizedIntegralSums and evaluated with visitSrfs, as haarboost does.
+ */
+TrainingParity verifyTrainingParity(const BoostedClassifier & classifier,
+                                    const SlidingWindowDetector & detector,
+                                    const cv::Mat & image,
+                                    const int windowSize,
+                                    const int count)
+{
+    TrainingParity parity;
+    if (image.rows < windowSize || image.cols < windowSize)
+    {
+        return parity;
+    }
+
+    const int cols = image.cols - windowSize + 1;
+    const std::vector<unsigned int> indexes = verificationSubset((image.rows - windowSize + 1) * cols, count);
+
+    std::vector<float> responses;
+    for (unsigned int i = 0; i < indexes.size(); ++i)
+    {
+        const cv::Point corner(indexes[i] % cols, indexes[i] / cols);
+        detector.responses(image, corner, responses);
+
+        cv::Mat sample = image( cv::Rect(corner.x, corner.y, windowSize, windowSize) ).clone();
+        const std::vector<cv::Mat> sums(1, normalizedIntegralSums(sample, cv::DataType<double>::type));
+
+        for (int t = 0; t < classifier.size(); ++t)
+        {
+            const std::vector<cv::Rect> rects(classifier.rects.begin() + MAX_RECTANGLES * t,
+                                              classifier.rects.begin() + MAX_RECTANGLES * (t + 1));
+            const std::vector<float> weights(classifier.weights.begin() + MAX_RECTANGLES * t,
+                                             classifier.weights.begin() + MAX_RECTANGLES * (t + 1));
+            const HaarWavelet wavelet(rects, weights);
+
+            double recordedWeights[MAX_RECTANGLES];
+            std::copy(weights.begin(), weights.end(), recordedWeights);
+
+            float expected;
+            FeatureValueRecorder recorder(recordedWeights, MAX_RECTANGLES, &expected);
+            visitSrfs(wavelet, sums, recorder);
+
+            const int polarity = classifier.polarities[t];
+            const float threshold = classifier.thresholds[t];
+            parity.deviation = std::max(parity.deviation, (double)std::abs(responses[t] - expected));
+            parity.decisions += (polarity * responses[t] < polarity * threshold) != (polarity * expected < polarity * threshold);
+        }
+        ++parity.windows;
+    }
+
+    return parity;
+}
+
+
+
+/**
+ * Prints the differences found by verifyTrainingParity.
+ */
+void printTrainingParity(std::ostream & output, const TrainingParity & parity)
+{
+    output << "Deviation from training on " << parity.windows << " windows: feature values " << parity.deviation
+           << ", stump decisions differing " << parity.decisions << std::endl;
+}
+
+
+
+/**
+ * First stage of the pipeline: loads the images in order.
+ */
+class ReadFrames
+{
+    const std::vector<std::string> * filenames;
+    size_t * next;
+
+public:
+    Frame * operator()(tbb::flow_control & control) const
+    {
+        if (*next == filenames->size())
+        {
+            control.stop();
+            return 0;
+        }
+
+        Frame * frame = new Frame;
+        frame->filename = (*filenames)[(*next)++];
+        frame->image = cv::imread(frame->filename, CV_LOAD_IMAGE_GRAYSCALE);
+        return frame;
+    }
+
+    ReadFrames(const std::vector<std::string> * filenames_,
+               size_t * next_) : filenames(filenames_),
+                                 next(next_) {}
+};
+
+
+
+/**
+ * Second stage of the pipeline: scans the frames, several at a time.
+ */
+class DetectFrames
+{
+    const SlidingWindowDetector * detector;
+
+public:
+    Frame * operator()(Frame * frame) const
+    {
+        if ( !frame->image.empty() )
+        {
+            detector->detect(frame->image, frame->detections);
+        }
+        return frame;
+    }
+
+    DetectFrames(const SlidingWindowDetector * detector_) : detector(detector_) {}
+};
+
+
+
+/**
+ * Last stage of the pipeline: writes the detections in the order of the images.
+ */
+class WriteFrames
+{
+    std::ostream * output;
+    int * failures;
+
+public:
+    void operator()(Frame * frame) const
+    {
+        if ( frame->image.empty() )
+        {
+            std::cout << "Can't load image " << frame->filename << std::endl;
+            ++(*failures);
+        }
+        writeDetections(*output, frame->filename, frame->detections);
+        delete frame;
+    }
+
+    WriteFrames(std::ostream * output_,
+                int * failures_) : output(output_),
+                                   failures(failures_) {}
+};
+
+
+
+/**
+ * Runs a classifier boosted by haarboost over an image, or over every image in a directory,
+ * and writes the detections, best first within each image. With --scales the windows grow by
+ * --scale-factor from the training size; the rectangles of the classifier are scaled, the
+ * frames are not.
+ *
+ * Images of a directory go through a pipeline: they are loaded and written in order while
+ * several of them are scanned at once, each one in parallel tiles.
+ *
+ * With --verify N the feature values of N random windows of the image, or of the first image
+ * of the directory, are also computed as for a training sample, and the largest difference
+ * from the detector's and the amount of stumps that decide differently are reported.
+ */
+int main(int argc, char* argv[])
+{
+    const std::string windowSizeOption = takeOption(argc, argv, "--window-size"); //size of the training samples
+    const std::string thresholdOption = takeOption(argc, argv, "--threshold");    //fraction of the votes
+    const std::string stepOption = takeOption(argc, argv, "--step");              //pixels between windows
+    const std::string minStdDevOption = takeOption(argc, argv, "--min-stddev");   //skip flatter windows
+    const std::string scalesOption = takeOption(argc, argv, "--scales");          //amount of window sizes
+    const std::string scaleFactorOption = takeOption(argc, argv, "--scale-factor"); //between window sizes
+    const std::string verifyCount = takeOption(argc, argv, "--verify");           //windows to check against training
+
+    if (argc != 4)
+    {
+        std::cout << "Usage " << argv[0] << " " << " CLASSIFIER_FILE IMAGE_OR_DIR OUTPUT_FILE [--window-size N] [--threshold FRACTION] [--step PIXELS] [--min-stddev D] [--scales N] [--scale-factor F] [--verify N]" << std::endl;
+        return 1;
+    }
+
+    const std::string classifierFileName = argv[1]; //load the boosted classifier from here
+    const std::string imagesPath = argv[2];         //scan this image or the images in this directory
+    const std::string outputFileName = argv[3];     //write detections here
+
+    const int windowSize = windowSizeOption.empty() ? DEFAULT_WINDOW_SIZE : std::atoi(windowSizeOption.c_str());
+    const double threshold = thresholdOption.empty() ? 0.5 : std::atof(thresholdOption.c_str());
+    const int step = stepOption.empty() ? 1 : std::atoi(stepOption.c_str());
+    const double minStdDev = minStdDevOption.empty() ? 0 : std::atof(minStdDevOption.c_str());
+    const int scales = scalesOption.empty() ? 1 : std::atoi(scalesOption.c_str());
+    const double scaleFactor = scaleFactorOption.empty() ? 1.25 : std::atof(scaleFactorOption.c_str());
+
+    if ( !isSupportedWindowSize(windowSize) )
+    {
+        std::cout << "Unsupported window size " << windowSize << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide windows." << std::endl;
+        return 8;
+    }
+
+    if (step < 1)
+    {
+        std::cout << "The step must be positive." << std::endl;
+        return 3;
+    }
+
+    if (scales < 1 || scaleFactor <= 1)
+    {
+        std::cout << "Use at least one scale and a scale factor greater than one." << std::endl;
+        return 4;
+    }
+
+
+
+    BoostedClassifier classifier;
+    std::cout << "Loading classifier..." << std::endl;
+    if ( !classifier.load(classifierFileName) )
+    {
+        std::cout << "Unable to load a boosted classifier from file " << classifierFileName << std::endl;
+        return 2;
+    }
+    std::cout << classifier.size() << " weak classifiers loaded." << std::endl;
+
+    std::ofstream outputStream(outputFileName.c_str(), std::ios::trunc);
+    if ( !outputStream.is_open() )
+    {
+        std::cout << "Can't open output file." << std::endl;
+        return 5;
+    }
+
+    const SlidingWindowDetector detector(classifier, windowSize, threshold, step, minStdDev, scales, scaleFactor);
+    std::cout << "Scanning " << detector.scales() << " scales." << std::endl;
+
+    if ( !boost::filesystem::is_directory(imagesPath) )
+    {
+        const cv::Mat image = cv::imread(imagesPath, CV_LOAD_IMAGE_GRAYSCALE);
+        if ( image.empty() )
+        {
+            std::cout << "Can't load image " << imagesPath << std::endl;
+            return 6;
+        }
+
+        if ( !verifyCount.empty() )
+        {
+            printTrainingParity(std::cout, verifyTrainingParity(classifier, detector, image, windowSize, std::atoi(verifyCount.c_str())));
+        }
+
+        std::vector<Detection> detections;
+        detector.detect(image, detections);
+        writeDetections(outputStream, imagesPath, detections);
+        std::cout << detections.size() << " detections." << std::endl;
+
+        outputStream.close();
+        if ( !outputStream )
+        {
+            std::cout << "Can't write output file." << std::endl;
+            return 5;
+        }
+        return 0;
+    }
+
+    std::vector<std::string> filenames;
+    for (boost::filesystem::directory_iterator it(imagesPath); it != boost::filesystem::directory_iterator(); ++it)
+    {
+        if ( boost::filesystem::is_regular_file(it->status()) )
+        {
+            filenames.push_back(it->path().string());
+        }
+    }
+    std::sort(filenames.begin(), filenames.end());
+    if ( !verifyCount.empty() && !filenames.empty() )
+    {
+        const cv::Mat image = cv::imread(filenames.front(), CV_LOAD_IMAGE_GRAYSCALE);
+        printTrainingParity(std::cout, verifyTrainingParity(classifier, detector, image, windowSize, std::atoi(verifyCount.c_str())));
+    }
+
+    std::cout << "Scanning " << filenames.size() << " images..." << std::endl;
+
+    size_t next = 0;
+    int failures = 0;
+    tbb::parallel_pipeline( PIPELINE_TOKENS_PER_THREAD * tbb::this_task_arena::max_concurrency(),
+                            tbb::make_filter<void, Frame *>(SERIAL_IN_ORDER, ReadFrames(&filenames, &next))
+                          & tbb::make_filter<Frame *, Frame *>(PARALLEL_FILTER, DetectFrames(&detector))
+                          & tbb::make_filter<Frame *, void>(SERIAL_IN_ORDER, WriteFrames(&outputStream, &failures)) );
+
+    outputStream.close();
+    if ( !outputStream )
+    {
+        std::cout << "Can't write output file." << std::endl;
+        return 5;
+    }
+
+    if (failures > 0)
+    {
+        std::cout << failures << " images could not be loaded." << std::endl;
+        return 6;
+    }
+
+    return 0;
+}
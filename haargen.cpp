@@ -1,27 +1,31 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <vector>
+#include <cstdlib>
+#include <algorithm>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
-#include <boost/unordered_set.hpp>
-
 #include "haarwavelet.h"
 #include "haarwaveletutilities.h"
 
-#define SAMPLE_SIZE 20
+#include "detector_window.h"
+#include "packed_wavelet.h"
+
+
 
-#define MIN_RECT_HEIGHT 3 //Minimum = 3 thanks to Pavani's restriction #6.
-#define MIN_RECT_WIDTH 3 //Minimum = 3 thanks to Pavani's restriction #6.
+#define PAVANI_MAX_RECTANGLES 4 //restriction #1
+#define WAVELET_COUNT_WIDTH 20 //characters of the amount of wavelets on the first line
 
 
 
 /*
  * Pavani's restrictions on Haar wavelets generation:
- * 1) only 2 to 4 rectangles
- * 2) detector size = 20x20
+ * 1) only 2 to 4 rectangles (up to MAX_RECTANGLES are generated on request)
+ * 2) detector size = 20x20 (24x24 and 32x32 are also generated on request)
  * 3) no rotated rectangles
  * 4) disjoint rectangles are away of each other an integer multiple of rectangle sizes
  * 5) all rectangles in a HW have the same size
@@ -30,281 +34,335 @@
 
 
 
-bool same(const cv::Rect &r1, const cv::Rect &r2) {
-    return r1.x      == r2.x
-        && r1.y      == r2.y
-        && r1.width  == r2.width
-        && r1.height == r2.height;
-}
+/*
+ * Rectangles of a wavelet are away of each other an integer multiple of their size
+ * (restriction #4), so the rectangles that may share a wavelet form a lattice given by
+ * the position of any of them modulo the rectangle size. The generators walk each
+ * lattice and enumerate its positions as strictly increasing index combinations, so
+ * every set of rectangles is produced exactly once and nothing has to be deduplicated.
+ *
+ * The first rectangle of the old displacement chains was always at an even position.
+ * A set is kept if any of its rectangles could have been that first one, which keeps
+ * the generated sets the same as when every ordering was enumerated.
+ *
+ * The old generators kept the first chain of each set and weighted its rectangles +1, -1,
+ * +1... in chain order. Chains were walked from the first rectangle on, displacing x
+ * before y at each step, so that first chain is the first ordering of the set, in the
+ * x-major order of the positions, that the rules allow. Lattice positions are listed in
+ * x-major order too, so it is the first permutation of the picked indexes that chains,
+ * and the rectangles are written in that order with the alternating weights.
+ */
 
 
 
-int contains(std::vector<cv::Rect>::const_iterator it, const std::vector<cv::Rect>::const_iterator end, const cv::Rect &r)
+/**
+ * Writes each wavelet to the output file as soon as it is generated, so memory use does
+ * not depend on how many wavelets are generated. Wavelets come out ordered by dimension,
+ * then by rectangle width and height, then by lattice and position.
+ *
+ * With a count header the file starts with the amount of wavelets in it, alone on the
+ * first line. It is only known at the end, so a blank field of WAVELET_COUNT_WIDTH
+ * characters is written first and filled in by finish(). The loaders of wavelet_parser.h
+ * and haarcheck skip that line and check the count, but the library's loadHaarWavelets
+ * would read it as a wavelet, so the header is only written on request.
+ *
+ * The generators hand packed wavelets over, so no wavelet allocates memory until it is
+ * written.
+ */
+class WaveletWriter
 {
-    int i = 0;
-
-    for(; it != end; ++it)
+public:
+    WaveletWriter(std::ostream & output_, const bool countHeader_) : output(output_),
+                                                                    count(0),
+                                                                    countHeader(countHeader_),
+                                                                    header(output_.tellp())
     {
-        if (same(*it, r))
+        if (countHeader)
         {
-            i++;
+            output << std::setw(WAVELET_COUNT_WIDTH) << "" << '\n';
         }
     }
 
-    return i;
-}
-
+    void operator()(const PackedWavelet & wavelet)
+    {
+        unpackWavelet(wavelet).write(output);
+        output << '\n';
+        ++count;
+    }
 
+    long written() const
+    {
+        return count;
+    }
 
-struct wavelet_equals : std::binary_function<const HaarWavelet &, const HaarWavelet &, bool>
-{
     /**
-     * 2 Haar wavelets will be the same if their dimensions and rects are the same. The
-     * problem is that the list of rectangles are unordered and there might be repeated
-     * rectangles inside both wavelets (there should not be, though).
+     * Fills in the amount of wavelets, if there is a count header. Returns false if the file
+     * could not be written.
      */
-    bool operator()(const HaarWavelet & w1, const HaarWavelet & w2) const
+    bool finish()
     {
-        if (w1.dimensions() != w2.dimensions())
+        if (countHeader)
         {
-            return false;
+            output.seekp(header);
+            output << std::setw(WAVELET_COUNT_WIDTH) << count;
+            output.seekp(0, std::ios::end);
         }
+        output.flush();
+        return (bool)output;
+    }
 
-        const std::vector<cv::Rect>::const_iterator begin1 = w1.rects_begin();
-        const std::vector<cv::Rect>::const_iterator end1 = w1.rects_end();
-        const std::vector<cv::Rect>::const_iterator end2 = w2.rects_end();
-        std::vector<cv::Rect>::const_iterator it1 = w1.rects_begin();
-        for(; it1 != end1; ++it1)
-        {
-            const int amountOfThisRectangle = contains(begin1, end1, *it1);
+private:
+    std::ostream & output;
+    long count;
+    bool countHeader;
+    std::streampos header;
+};
+
+
+
+inline bool evenPosition(const int x, const int y)
+{
+    return x % 2 == 0 && y % 2 == 0;
+}
+
+
+
+/**
+ * Positions, in x-major order, of the w x h rectangles of one lattice that fully fit the
+ * window.
+ */
+struct Lattice
+{
+    int w, h;
+    std::vector<int> xs, ys;
+    int lastAnchor; //last position where a displacement chain could start, or -1
+
+    int size() const
+    {
+        return xs.size();
+    }
+
+    bool anchor(const int i) const
+    {
+        return evenPosition(xs[i], ys[i]);
+    }
+};
 
-            std::vector<cv::Rect>::const_iterator it2 = w2.rects_begin();
-            if ( contains(it2, end2, *it1) != amountOfThisRectangle)
+
+
+/**
+ * Lists the positions of the w x h rectangles of the lattice that starts at (rx, ry).
+ */
+template <int SIZE>
+void latticePositions(const int rx, const int ry, const int w, const int h, Lattice & lattice)
+{
+    typedef DetectorWindow<SIZE> Window;
+
+    lattice.w = w;
+    lattice.h = h;
+    lattice.xs.clear();
+    lattice.ys.clear();
+    lattice.lastAnchor = -1;
+
+    for (int x = rx; x + w <= Window::size; x += w)
+    {
+        for (int y = ry; y + h <= Window::size; y += h)
+        {
+            if ( evenPosition(x, y) )
             {
-                return false;
+                lattice.lastAnchor = lattice.xs.size();
             }
+            lattice.xs.push_back(x);
+            lattice.ys.push_back(y);
         }
-
-        return true;
     }
-};
+}
 
 
 
-struct wavelet_hash : std::unary_function<const HaarWavelet &, std::size_t>
+/**
+ * gen4d has always displaced the third and the fourth rectangles in steps of two
+ * rectangle sizes starting from -SIZE / w (and -SIZE / h), so those displacements have
+ * the parity of SIZE / w (and SIZE / h). Finds the first ordering of the rectangles in p
+ * that can be built that way from a first rectangle at an even position, if any.
+ */
+template <int SIZE>
+bool chain4d(const Lattice & lattice, const int p[4], int order[4])
 {
-    std::size_t operator()(const HaarWavelet & w) const
+    const std::vector<int> & xs = lattice.xs;
+    const std::vector<int> & ys = lattice.ys;
+    const int w = lattice.w;
+    const int h = lattice.h;
+
+    const int xParity = (SIZE / w) % 2;
+    const int yParity = (SIZE / h) % 2;
+
+    std::copy(p, p + 4, order);
+    do
     {
-        std::size_t hashval = 0;
+        if (   evenPosition(xs[order[0]], ys[order[0]])
+            && std::abs(xs[order[2]] - xs[order[1]]) / w % 2 == xParity
+            && std::abs(ys[order[2]] - ys[order[1]]) / h % 2 == yParity
+            && std::abs(xs[order[3]] - xs[order[2]]) / w % 2 == xParity
+            && std::abs(ys[order[3]] - ys[order[2]]) / h % 2 == yParity)
+        {
+            return true;
+        }
+    } while ( std::next_permutation(order, order + 4) );
+
+    return false;
+}
+
+
+
+/**
+ * Which sets of K rectangles are generated. Rectangle sizes go up in steps of sizeStep and
+ * a complete set is kept if chain() finds the order of its rectangles. Every set needs a
+ * rectangle at an even position too, which the enumeration prunes on by itself.
+ *
+ * Without further rules the chain starts at the first rectangle at an even position and
+ * goes on with the others in order. 3 rectangle wavelets have always been generated with
+ * even size steps only. Wavelets with 5 or more rectangles, which the old generators did
+ * not have, do the same as them, to keep their amount in check.
+ */
+template <int SIZE, int K>
+struct GenerationRules
+{
+    static const int sizeStep = K == 2 ? 1 : 2;
 
-        std::vector<cv::Rect>::const_iterator it = w.rects_begin();
-        const std::vector<cv::Rect>::const_iterator end = w.rects_end();
-        for(; it != end; ++it)
+    static bool chain(const Lattice & lattice, const int * p, int * order)
+    {
+        int first = 0;
+        while (first < K && !lattice.anchor(p[first]))
         {
-            hashval += it->x * it->y * it->width * it->height;
+            ++first;
+        }
+        if (first == K)
+        {
+            return false;
         }
 
-        hashval += 160000 * (w.dimensions() - 2);
-        return hashval;
+        order[0] = p[first];
+        std::copy(p, p + first, order + 1);
+        std::copy(p + first + 1, p + K, order + first + 1);
+        return true;
     }
 };
 
+template <int SIZE>
+struct GenerationRules<SIZE, 4>
+{
+    static const int sizeStep = 1;
 
+    static bool chain(const Lattice & lattice, const int * p, int * order)
+    {
+        return chain4d<SIZE>(lattice, p, order);
+    }
+};
 
-typedef boost::unordered_set<HaarWavelet, wavelet_hash, wavelet_equals> WaveletMap;
 
 
+/**
+ * A wavelet of K rectangles being assembled: the lattice its rectangles come from, the
+ * indexes of their positions in it and the alternating +1 / -1 weights of its chain.
+ */
+template <int K>
+struct WaveletCandidate
+{
+    const Lattice * lattice;
+    int p[K];
+    float weights[K];
 
-struct wavelet_comparator {
-    bool operator()(const HaarWavelet & w1, const HaarWavelet & w2) const
+    WaveletCandidate(const Lattice * lattice_) : lattice(lattice_)
     {
-        if (w1.dimensions() != w2.dimensions())
+        for (int i = 0; i < K; ++i)
         {
-            return w1.dimensions() < w2.dimensions();
+            weights[i] = i % 2 == 0 ? 1 : -1;
         }
-
-        return wavelet_hash()(w1) < wavelet_hash()(w2);
     }
 };
 
 
 
 /**
- * Generates Haar wavelets with 2 rectangles.
+ * Level D of the loop nest that picks the rectangles of a wavelet as strictly increasing
+ * lattice positions p[0] < ... < p[K - 1]; the template recursion unrolls the K levels
+ * at compile time. A level stops as soon as too few positions are left for the levels
+ * under it, or when nothing picked so far is at an even position and no position left
+ * is either, so branches that can't produce a wavelet are never walked. The last level
+ * still has to check that its set is anchored.
  */
-void gen2d(WaveletMap &wavelets)
+template <int SIZE, int K, int D>
+struct PickRectangles
 {
-    std::vector<float> weights(2);
-    weights[0] = 1;
-    weights[1] = -1;
+    static void run(WaveletCandidate<K> & candidate, const int first, const bool anchored, WaveletWriter & writer)
+    {
+        const Lattice & lattice = *candidate.lattice;
 
-    for(int w = MIN_RECT_WIDTH; w <= SAMPLE_SIZE; w++)
+        int last = lattice.size() - (K - D);
+        if (!anchored)
+        {
+            last = std::min(last, lattice.lastAnchor);
+        }
+
+        for (int i = first; i <= last; ++i)
+        {
+            candidate.p[D] = i;
+            PickRectangles<SIZE, K, D + 1>::run(candidate, i + 1, anchored || lattice.anchor(i), writer);
+        }
+    }
+};
+
+template <int SIZE, int K>
+struct PickRectangles<SIZE, K, K>
+{
+    static void run(WaveletCandidate<K> & candidate, const int, const bool anchored, WaveletWriter & writer)
     {
-        for(int h = MIN_RECT_HEIGHT; h <= SAMPLE_SIZE; h++)
+        const Lattice & lattice = *candidate.lattice;
+
+        int order[K];
+        if ( !anchored || !GenerationRules<SIZE, K>::chain(lattice, candidate.p, order) )
         {
-            for(int x = 0; x <= SAMPLE_SIZE - w; x+=2) //x position of the first rectangle
-            {
-                for(int y = 0; y <= SAMPLE_SIZE - h; y+=2) //y position of the first rectangle
-                {
-                    if (   x + w > SAMPLE_SIZE
-                        || y + h > SAMPLE_SIZE)
-                    {
-                        continue;
-                    }
-
-                    for(int dx = -SAMPLE_SIZE / w; dx < SAMPLE_SIZE / w; dx++) //dx = horizontal displacement multiplier of the second rectangle.
-                    {                                           //If bigger than 1 the rectangles will be disjoint. See Pavani's restriction #4.
-                        for(int dy = -SAMPLE_SIZE / h; dy < SAMPLE_SIZE / h; dy++) //dy is similar to dx but in the vertical direction
-                        {
-                            if (dx == 0 && dy == 0) //rectangles will overlap
-                            {
-                                continue;
-                            }
-
-                            const int xOther = x + dx * w;
-                            const int yOther = y + dy * h;
-
-                            if (   xOther < 0
-                                || yOther < 0
-                                || xOther >= SAMPLE_SIZE
-                                || yOther >= SAMPLE_SIZE
-                                || xOther + w > SAMPLE_SIZE
-                                || yOther + h > SAMPLE_SIZE)
-                            {
-                                continue;
-                            }
-
-                            //create the wavelet
-                            std::vector<cv::Rect> rects(2);
-                            rects[0] = cv::Rect(     x,      y, w, h);
-                            rects[1] = cv::Rect(xOther, yOther, w, h);
-
-                            HaarWavelet wavelet(rects, weights);
-                            wavelets.insert( wavelet );
-                        }
-                    }
-                }
-            }
+            return;
+        }
+
+        //create the wavelet, its rectangles in chain order
+        cv::Rect rects[K];
+        for (int i = 0; i < K; i++)
+        {
+            rects[i] = cv::Rect(lattice.xs[order[i]], lattice.ys[order[i]], lattice.w, lattice.h);
         }
+
+        PackedWavelet wavelet;
+        packWavelet(K, rects, candidate.weights, wavelet);
+        writer(wavelet);
     }
-}
+};
 
 
 
 /**
- * Generates Haar wavelets with 3 rectangles.
+ * Generates Haar wavelets with K rectangles.
  */
-void gen3d(WaveletMap &wavelets)
+template <int SIZE, int K>
+void generateWavelets(WaveletWriter & writer)
 {
-    const int K = 3; //number of dimensions of the generated wavelets
+    typedef DetectorWindow<SIZE> Window;
+    typedef GenerationRules<SIZE, K> Rules;
 
-    std::vector<float> weights(K);
-    weights[0] = 1;
-    weights[1] = -1;
-    weights[2] = 1;
+    Lattice lattice;
+    WaveletCandidate<K> candidate(&lattice);
 
-    for(int w = MIN_RECT_WIDTH; w <= SAMPLE_SIZE; w+=2)
+    for(int w = Window::minRectWidth; w <= Window::size; w += Rules::sizeStep)
     {
-        for(int h = MIN_RECT_HEIGHT; h <= SAMPLE_SIZE; h+=2)
+        for(int h = Window::minRectHeight; h <= Window::size; h += Rules::sizeStep)
         {
-            int x[K], //x and y positions of each rectangle.
-                y[K];
-
-            for(x[0] = 0; x[0] <= SAMPLE_SIZE - w; x[0]+=2) //for each x...
+            for(int rx = 0; rx < w; rx++) //each lattice of rectangles of this size
             {
-                for(y[0] = 0; y[0] <= SAMPLE_SIZE - h; y[0]+=2) //...and y of the first rectangle...
+                for(int ry = 0; ry < h; ry++)
                 {
-                    if (   x[0] + w > SAMPLE_SIZE
-                        || y[0] + h > SAMPLE_SIZE)
-                    {
-                        continue;
-                    }
-
-                    int dx[K - 1], //dx = horizontal displacement multiplier of the second rectangle.
-                        dy[K - 1]; //If bigger than 1 the rectangles will be disjoint. See Pavani's restriction #4.
-                                   //dy is similar to dx but in the vertical direction
-
-                    for(dx[0] = -SAMPLE_SIZE / w; dx[0] < SAMPLE_SIZE / w; dx[0]++)
-                    {
-                        for(dy[0] = -SAMPLE_SIZE / h; dy[0] < SAMPLE_SIZE / h; dy[0]++)
-                        {
-                            for(dx[1] = -SAMPLE_SIZE / w; dx[1] < SAMPLE_SIZE / w; dx[1]++)
-                            {
-                                for(dy[1] = -SAMPLE_SIZE / h; dy[1] < SAMPLE_SIZE / h; dy[1]++)
-                                {
-                                    //avoids rectangle overlapping
-                                    if (   (dx[0] == 0 && dy[0] == 0)
-                                        || (dx[1] == 0 && dy[1] == 0))
-                                    {
-                                        continue;
-                                    }
-
-                                    //sets the values of the x, y position of the rectangles
-                                    for (int i = 1; i < K; i++)
-                                    {
-                                        x[i] = x[i-1] + dx[i-1] * w;
-                                        y[i] = y[i-1] + dy[i-1] * h;
-                                    }
-
-                                    {//avoids rectangles overlapping
-                                        bool overlaps = false;
-
-                                        for (int i = 0; i < K; i++)
-                                        {
-                                            for (int j = 0; j < K; j++)
-                                            {
-                                                if (i != j && x[i] == x[j] && y[i] == y[j])
-                                                {
-                                                    overlaps = true;
-                                                    break;
-                                                }
-                                            }
-                                            if (overlaps)
-                                            {
-                                                break;
-                                            }
-                                        }
-                                        if (overlaps)
-                                        {
-                                            continue;
-                                        }
-                                    }
-
-                                    {
-                                        bool overflow = false;
-                                        for (int i = 1; i < K; i++) //...and all rectangles fit into the sampling window...
-                                        {
-                                            if (   x[i] < 0
-                                                || y[i] < 0
-                                                || x[i] >= SAMPLE_SIZE //x and y must be at least 1 pixel away from the window's last pixel
-                                                || y[i] >= SAMPLE_SIZE
-                                                || x[i] + w > SAMPLE_SIZE //and the rectangle must fully fit the window
-                                                || y[i] + h > SAMPLE_SIZE)
-                                            {
-                                                overflow = true;
-                                                break;
-                                            }
-                                        }
-                                        if(overflow)
-                                        {
-                                            continue;
-                                        }
-                                    }
-
-
-                                    //create the wavelet
-                                    std::vector<cv::Rect> rects(K);
-                                    for (int i = 0; i < K; i++)
-                                    {
-                                        rects[i] = cv::Rect(x[i], y[i], w, h);
-                                    }
-
-                                    HaarWavelet wavelet(rects, weights);
-                                    wavelets.insert( wavelet );
-                                }
-                            }
-                        }
-                    }
+                    latticePositions<SIZE>(rx, ry, w, h, lattice);
+                    PickRectangles<SIZE, K, 0>::run(candidate, 0, false, writer);
                 }
             }
         }
@@ -314,212 +372,99 @@ void gen3d(WaveletMap &wavelets)
 
 
 /**
- * Generates Haar wavelets with 4 rectangles.
+ * Generates the wavelets of K rectangles and then those of the following amounts, up to
+ * maxRectangles.
  */
-void gen4d(WaveletMap &wavelets)
+template <int SIZE, int K>
+struct GenerateFrom
 {
-    const int K = 4; //number of dimensions of the generated wavelets
-
-    std::vector<float> weights(K);
-    weights[0] = 1;
-    weights[1] = -1;
-    weights[2] = 1;
-    weights[3] = -1;
-
-    for(int w = MIN_RECT_WIDTH; w <= SAMPLE_SIZE; w++)
+    static void run(WaveletWriter & writer, const int maxRectangles)
     {
-        for(int h = MIN_RECT_HEIGHT; h <= SAMPLE_SIZE; h++)
+        if (K > maxRectangles)
         {
-            int x[K], //x and y positions of each rectangle.
-                y[K];
-
-            for(x[0] = 0; x[0] <= SAMPLE_SIZE - w; x[0]+=2) //for each x...
-            {
-                for(y[0] = 0; y[0] <= SAMPLE_SIZE - h; y[0]+=2) //...and y of the first rectangle...
-                {
-                    if (   x[0] + w > SAMPLE_SIZE
-                        || y[0] + h > SAMPLE_SIZE)
-                    {
-                        continue;
-                    }
-
-                    int dx[K - 1], //dx = horizontal displacement multiplier of the second rectangle.
-                        dy[K - 1]; //If bigger than 1 the rectangles will be disjoint. See Pavani's restriction #4.
-                                   //dy is similar to dx but in the vertical direction
-
-                    for(dx[0] = -SAMPLE_SIZE / w; dx[0] < SAMPLE_SIZE / w; dx[0]++)
-                    {
-                        for(dy[0] = -SAMPLE_SIZE / h; dy[0] < SAMPLE_SIZE / h; dy[0]++)
-                        {
-                            if (dx[0] == 0 && dy[0] == 0)
-                            {
-                                continue;
-                            }
-
-                            x[1] = x[0] + dx[0] * w;
-                            y[1] = y[0] + dy[0] * h;
-
-                            if (   x[1] < 0
-                                || y[1] < 0
-                                || x[1] >= SAMPLE_SIZE
-                                || y[1] >= SAMPLE_SIZE
-                                || x[1] + w > SAMPLE_SIZE
-                                || y[1] + h > SAMPLE_SIZE)
-                            {
-                                continue;
-                            }
-
-                            for(dx[1] = -SAMPLE_SIZE / w; dx[1] < SAMPLE_SIZE / w; dx[1]+=2)
-                            {
-                                for(dy[1] = -SAMPLE_SIZE / h; dy[1] < SAMPLE_SIZE / h; dy[1]+=2)
-                                {
-                                    if (dx[1] == 0 && dy[1] == 0)
-                                    {
-                                        continue;
-                                    }
-
-                                    x[2] = x[1] + dx[1] * w;
-                                    y[2] = y[1] + dy[1] * h;
-
-                                    if (   x[2] < 0
-                                        || y[2] < 0
-                                        || x[2] >= SAMPLE_SIZE
-                                        || y[2] >= SAMPLE_SIZE
-                                        || x[2] + w > SAMPLE_SIZE
-                                        || y[2] + h > SAMPLE_SIZE)
-                                    {
-                                        continue;
-                                    }
-
-                                    for(dx[2] = -SAMPLE_SIZE / w; dx[2] < SAMPLE_SIZE / w; dx[2]+=2)
-                                    {
-                                        for(dy[2] = -SAMPLE_SIZE / h; dy[2] < SAMPLE_SIZE / h; dy[2]+=2)
-                                        {
-                                            //avoids rectangle overlapping
-                                            if ( dx[2] == 0 && dy[2] == 0 )
-                                            {
-                                                continue;
-                                            }
-
-                                            x[3] = x[2] + dx[2] * w;
-                                            y[3] = y[2] + dy[2] * h;
-
-                                            if (   x[3] < 0
-                                                || y[3] < 0
-                                                || x[3] >= SAMPLE_SIZE
-                                                || y[3] >= SAMPLE_SIZE
-                                                || x[3] + w > SAMPLE_SIZE
-                                                || y[3] + h > SAMPLE_SIZE)
-                                            {
-                                                continue;
-                                            }
-
-
-                                            {//avoids rectangles overlapping
-                                                bool overlaps = false;
-
-                                                for (int i = 0; i < K; i++)
-                                                {
-                                                    for (int j = 0; j < K; j++)
-                                                    {
-                                                        if (i != j && x[i] == x[j] && y[i] == y[j])
-                                                        {
-                                                            overlaps = true;
-                                                            break;
-                                                        }
-                                                    }
-                                                    if (overlaps)
-                                                    {
-                                                        break;
-                                                    }
-                                                }
-                                                if (overlaps)
-                                                {
-                                                    continue;
-                                                }
-                                            }
-
-                                            {
-                                                bool overflow = false;
-                                                for (int i = 0; i < K; i++) //...and all rectangles fit into the sampling window...
-                                                {
-                                                    if(    x[i] < 0
-                                                        || y[i] < 0
-                                                        || x[i] >= SAMPLE_SIZE //x and y must be at least 1 pixel away from the window's last pixel
-                                                        || y[i] >= SAMPLE_SIZE
-                                                        || x[i] + w > SAMPLE_SIZE //and the rectangle must fully fit the window
-                                                        || y[i] + h > SAMPLE_SIZE)
-                                                    {
-                                                        overflow = true;
-                                                        break;
-                                                    }
-                                                }
-                                                if(overflow)
-                                                {
-                                                    continue;
-                                                }
-                                            }
-
-
-                                            //create the wavelet
-                                            std::vector<cv::Rect> rects(K);
-                                            for (int i = 0; i < K; i++)
-                                            {
-                                                rects[i] = cv::Rect(x[i], y[i], w, h);
-                                            }
-
-                                            HaarWavelet wavelet(rects, weights);
-                                            wavelets.insert( wavelet );
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+            return;
         }
+
+        const long before = writer.written();
+        generateWavelets<SIZE, K>(writer);
+        std::cout << "Total " << K << "D wavelets generated: " << writer.written() - before << std::endl;
+
+        GenerateFrom<SIZE, K + 1>::run(writer, maxRectangles);
     }
+};
+
+template <int SIZE>
+struct GenerateFrom<SIZE, MAX_RECTANGLES + 1>
+{
+    static void run(WaveletWriter &, const int) {}
+};
+
+
+
+template <int SIZE>
+void generate(WaveletWriter &writer, const int maxRectangles)
+{
+    GenerateFrom<SIZE, 2>::run(writer, maxRectangles);
+    std::cout << "Wavelets generated: " << writer.written() << std::endl;
 }
 
 
 
+/**
+ * With --count-header the output starts with the amount of wavelets, see WaveletWriter.
+ */
 int main(int argc, char * args[])
 {
-    if (argc != 2) {
+    bool countHeader = false;
+    for (int i = 1; i < argc && !countHeader; ++i)
+    {
+        countHeader = std::string(args[i]) == "--count-header";
+        if (countHeader)
+        {
+            std::copy(args + i + 1, args + argc, args + i);
+            --argc;
+        }
+    }
+
+    if (argc < 2 || argc > 4) {
+        std::cout << "Usage " << args[0] << " OUTPUT_FILE [WINDOW_SIZE [MAX_RECTANGLES]] [--count-header]" << std::endl;
         return 1;
     }
 
-    WaveletMap wavelets;
+    const int windowSize = argc >= 3 ? std::atoi(args[2]) : DEFAULT_WINDOW_SIZE;
+    if ( !isSupportedWindowSize(windowSize) )
     {
-        gen2d(wavelets);
-        const int d2wavelets = wavelets.size();
-        std::cout << "Total 2D wavelets generated: " << d2wavelets << std::endl;
-        gen3d(wavelets);
-        const int d3wavelets = wavelets.size() - d2wavelets;
-        std::cout << "Total 3D wavelets generated: " << d3wavelets << std::endl;
-        gen4d(wavelets);
-        const int d4wavelets = wavelets.size() - d3wavelets - d2wavelets;
-        std::cout << "Total 4D wavelets generated: " << d4wavelets << std::endl;
-        std::cout << "Wavelets generated: " << wavelets.size() << std::endl;
+        std::cout << "Unsupported window size " << windowSize << ". Use " << SUPPORTED_WINDOW_SIZES << "." << std::endl;
+        return 2;
     }
 
-    //sorts the wavelets
-    std::vector<HaarWavelet> sorted;
+    const int maxRectangles = argc == 4 ? std::atoi(args[3]) : PAVANI_MAX_RECTANGLES;
+    if (maxRectangles < 2 || maxRectangles > MAX_RECTANGLES)
     {
-        WaveletMap::iterator it = wavelets.begin();
-        const WaveletMap::iterator end = wavelets.end();
-        for(;it != end; ++it)
-        {
-            sorted.push_back(*it);
-        }
-        std::sort(sorted.begin(), sorted.end(), wavelet_comparator());
+        std::cout << "Wavelets can have from 2 to " << MAX_RECTANGLES << " rectangles." << std::endl;
+        return 4;
+    }
+
+    std::ofstream outputStream(args[1], std::ios::trunc);
+    if ( !outputStream.is_open() )
+    {
+        std::cout << "Can't open output file." << std::endl;
+        return 3;
     }
 
+    std::cout << "Writing wavelets to " << args[1] << " as they are generated..." << std::endl;
+
+    WaveletWriter writer(outputStream, countHeader);
+    switch (windowSize)
+    {
+        case 20: generate<20>(writer, maxRectangles); break;
+        case 24: generate<24>(writer, maxRectangles); break;
+        case 32: generate<32>(writer, maxRectangles); break;
+    }
+    if ( !writer.finish() )
     {
-        std::cout << "Writing wavelets to file...";
-        writeHaarWavelets(args[1], sorted);
-        std::cout << " done." << std::endl;
+        std::cout << "Can't write output file." << std::endl;
+        return 5;
     }
 
     return 0;
@@ -1,4 +1,5 @@
 #include <string>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -12,13 +13,14 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
-#include <boost/accumulators/accumulators.hpp>
-#include <boost/accumulators/statistics/stats.hpp>
-#include <boost/accumulators/statistics/mean.hpp>
-#include <boost/accumulators/statistics/variance.hpp>
-#include <boost/accumulators/statistics/count.hpp>
-
 #include "optimization_commons.h"
+#include "wavelet_parser.h"
+#include "wavelet_statistics.h"
+#include "wavelet_schedule.h"
+#include "optimizer_graph.h"
+#include "feature_moments.h"
+#include "separability.h"
+#include "precision_verification.h"
 
 #include "haarwavelet.h"
 #include "haarwaveletutilities.h"
@@ -30,29 +32,6 @@
 
 
 
-//http://www.boost.org/doc/libs/1_53_0/doc/html/accumulators/user_s_guide.html
-typedef boost::accumulators::accumulator_set<double,
-                                             boost::accumulators::stats<boost::accumulators::tag::mean,
-                                                                        boost::accumulators::tag::variance,
-                                                                        boost::accumulators::tag::count> > myaccumulator;
-
-
-
-void produceFeatureValues(myaccumulator & acc,
-                          const HaarWavelet & wavelet,
-                          const std::vector<Integrals> & integrals)
-{
-    const VarianceNormalizedWaveletEvaluator evaluator;
-
-    const unsigned int records = integrals.size();
-    for (unsigned int i = 0; i < records; ++i)
-    {
-        acc( evaluator(wavelet, integrals[i].iSum, integrals[i].iSquare) );
-    }
-}
-
-
-
 /**
  * Stores data to be used in weak classifiers that operate like Adhikari's paper
  * "Boosting-Based On-Road Obstacle Sensing Using Discriminative Weak Classifiers".
@@ -83,6 +62,7 @@ public:
 
         positiveSamplesCount = c.positiveSamplesCount;
         negativeSamplesCount = c.negativeSamplesCount;
+        separability = c.separability;
 
         return *this;
     }
@@ -117,6 +97,19 @@ public:
         negativeSamplesCount = c;
     }
 
+    /**
+     * Computes the separability of the positive and negative gaussians, once both are set.
+     */
+    void updateSeparability()
+    {
+        separability = gaussianSeparability(positiveMean, positiveVariance, negativeMean, negativeVariance);
+    }
+
+    const Separability & getSeparability() const
+    {
+        return separability;
+    }
+
     bool operator < (const ProbabilisticClassifierData & rh) const
     {
         return positiveVariance < rh.positiveVariance;
@@ -136,6 +129,7 @@ public:
                << negativeMean << ' '
                << negativeVariance << ' '
                << (negativeSamplesCount / (positiveSamplesCount + negativeSamplesCount));
+        separability.write(output);
 
         return true;
     }
@@ -146,6 +140,8 @@ private:
     double negativeMean, negativeVariance;
 
     double positiveSamplesCount, negativeSamplesCount;
+
+    Separability separability;
 };
 
 
@@ -156,60 +152,63 @@ private:
 class Optimize
 {
 private:
-    std::vector<HaarWavelet> & wavelets;
+    const PackedWaveletSet & wavelets;
     std::vector<Integrals> & positiveIntegrals;
     std::vector<Integrals> & negativeIntegrals;
     tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers;
+    std::vector<WaveletStatistics> * statistics; //null when the statistics are not kept
 
 
 
 public:
-    void operator()(const tbb::blocked_range<std::vector<HaarWavelet>::size_type> range) const
+    void operator()(const tbb::blocked_range<size_t> range) const
     {
-        for(std::vector<HaarWavelet>::size_type i = range.begin(); i != range.end(); ++i)
+        for(size_t i = range.begin(); i != range.end(); ++i)
         {
-            ProbabilisticClassifierData classifier( wavelets[i] );
+            ProbabilisticClassifierData classifier( wavelets.unpack(i) );
 
-            {
-                myaccumulator acc;
-                produceFeatureValues(acc, classifier, positiveIntegrals);
-                classifier.setPositiveMean(boost::accumulators::mean(acc));
-                classifier.setPositiveVariance(boost::accumulators::variance(acc));
-                classifier.setPositiveSamplesCount(boost::accumulators::count(acc));
-            }
+            //the moments of the new samples are merged into the kept ones, if any
+            FeatureMoments localPositive, localNegative;
+            FeatureMoments & positive = statistics ? (*statistics)[i].positiveFeature : localPositive;
+            FeatureMoments & negative = statistics ? (*statistics)[i].negativeFeature : localNegative;
+            accumulateFeatureMoments(classifier, positiveIntegrals, negativeIntegrals, positive, negative);
 
-            {
-                myaccumulator acc;
-                produceFeatureValues(acc, classifier, negativeIntegrals);
-                classifier.setNegativeMean(boost::accumulators::mean(acc));
-                classifier.setNegativeVariance(boost::accumulators::variance(acc));
-                classifier.setNegativeSamplesCount(boost::accumulators::count(acc));
-            }
+            classifier.setPositiveMean(positive.mean);
+            classifier.setPositiveVariance(positive.variance());
+            classifier.setPositiveSamplesCount(positive.count);
+
+            classifier.setNegativeMean(negative.mean);
+            classifier.setNegativeVariance(negative.variance());
+            classifier.setNegativeSamplesCount(negative.count);
+
+            classifier.updateSeparability();
 
             classifiers.push_back(classifier);
         }
     }
 
-    Optimize(std::vector<HaarWavelet> & wavelets_,
+    Optimize(const PackedWaveletSet & wavelets_,
              std::vector<Integrals> & positiveIntegrals_,
              std::vector<Integrals> & negativeIntegrals_,
-             tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers_) : wavelets(wavelets_),
-                                                                                   positiveIntegrals(positiveIntegrals_),
-                                                                                   negativeIntegrals(negativeIntegrals_),
-                                                                                   classifiers(classifiers_) {}
+             tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers_,
+             std::vector<WaveletStatistics> * statistics_) : wavelets(wavelets_),
+                                                             positiveIntegrals(positiveIntegrals_),
+                                                             negativeIntegrals(negativeIntegrals_),
+                                                             classifiers(classifiers_),
+                                                             statistics(statistics_) {}
 };
 
 
 
-void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers)
+/**
+ * Writes the first count classifiers, in order, formatting them in parallel. Returns false
+ * if the stream fails.
+ */
+bool writeClassifiersData(std::ofstream & outputStream, const tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers, const size_t count)
 {
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator it = classifiers.begin();
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator end = classifiers.end();
-    for(; it != end; ++it)
-    {
-        it->write(outputStream);
-        outputStream << '\n';
-    }
+    ClassifierWriter<tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator> writer(outputStream, true);
+    writer.putAll(classifiers.begin(), classifiers.begin() + std::min(count, classifiers.size()));
+    return writer.wait();
 }
 
 
@@ -219,12 +218,35 @@ void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<P
  * the SRFS for each Haar wavelet. Extract the principal component of least variance and use it
  * as the new weights of the respective Haar wavelet. When all is done, write the 'optimized'
  * Haar wavelets to a file.
+ *
+ * Each record ends with the Bhattacharyya distance, the Kullback-Leibler divergence and the
+ * Fisher ratio of its positive and negative gaussians. With --sort-by bhattacharyya,
+ * kullback-leibler or fisher the classifiers go from the most to the least separable instead
+ * of by positive variance, and with --top K only the first K are written.
+ *
+ * The wavelets and both sets of samples are loaded at the same time, see LoadingGraph.
+ *
+ * With --save-state the moments of the feature values of each wavelet are also written to a
+ * file. With --add-samples the samples are only the new ones (or - if there are none of a
+ * class): their moments are merged into those found in the given file, which is then updated.
+ *
+ * With --verify N the feature values of N random wavelets are also evaluated with
+ * VarianceNormalizedWaveletEvaluator, and the largest deviations of the variance normalized
+ * SRFS, of the feature values and of their moments from the library's are reported. The
+ * library needs the squared integrals of the samples, so their images are extracted again.
  */
 int main(int argc, char* argv[])
 {
-    if (argc != 6)
+    const std::string addSamplesFileName = takeOption(argc, argv, "--add-samples"); //merge into these statistics
+    const std::string saveStateFileName = takeOption(argc, argv, "--save-state");   //write statistics here
+    const std::string sortKeyName = takeOption(argc, argv, "--sort-by"); //order of the output
+    const std::string topCount = takeOption(argc, argv, "--top");        //write only the best ones
+    const std::string verifyCount = takeOption(argc, argv, "--verify");  //wavelets to check against the library
+
+    SortKey sortKey;
+    if ( argc != 6 || !parseSortKey(sortKeyName, sortKey) )
     {
-        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX OUTPUT_DIR" << std::endl;
+        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX OUTPUT_DIR [--save-state STATE_FILE] [--add-samples STATE_FILE] [--verify N] [--sort-by stddev|bhattacharyya|kullback-leibler|fisher] [--top K]" << std::endl;
         return 1;
     }
 
@@ -236,67 +258,155 @@ int main(int argc, char* argv[])
 
 
 
-    std::vector<HaarWavelet> wavelets;
-    std::vector<cv::Mat> positiveImages, negativeImages;
+    PackedWaveletSet wavelets;
     std::vector<Integrals> positivesIntegrals, negativesIntegrals;
+    std::vector<WaveletStatistics> statistics;
     std::ofstream outputStream;
 
+    const bool positivesGiven = addSamplesFileName.empty() || positiveSamplesImage != NO_SAMPLES;
+    const bool negativesGiven = addSamplesFileName.empty() || negativeSamplesImage != NO_SAMPLES;
+
 
     {
-        //Load a list of Haar wavelets
-        std::cout << "Loading wavelets..." << std::endl;
-        if (!loadHaarWavelets(waveletsFileName, wavelets))
+        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
+        if ( !outputStream.is_open() )
+        {
+            std::cout << "Can't open output file." << std::endl;
+            return 5;
+        }
+
+        //Load the Haar wavelets and the samples given at the same time
+        std::cout << "Loading wavelets and samples..." << std::endl;
+        bool waveletsLoaded, positivesLoaded = true, negativesLoaded = true;
+        LoadingGraph loading;
+        loading.loadWavelets(waveletsFileName, wavelets, waveletsLoaded);
+        if (positivesGiven)
+        {
+            loading.loadSamples(positiveSamplesImage, "", positivesIntegrals, false, positivesLoaded);
+        }
+        if (negativesGiven)
+        {
+            loading.loadSamples(negativeSamplesImage, negativeSamplesIndex, negativesIntegrals, false, negativesLoaded);
+        }
+        loading.run();
+
+        if (!waveletsLoaded)
         {
             std::cout << "Unable to load Haar wavelets from file " << waveletsFileName << std::endl;
             return 2;
         }
         std::cout << wavelets.size() << " wavelets loaded." << std::endl;
 
-        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
-        if ( !outputStream.is_open() )
+        if ( !addSamplesFileName.empty() )
         {
-            std::cout << "Can't open output file." << std::endl;
-            return 5;
+            if ( !loadWaveletStatistics(addSamplesFileName, statistics) || !matchWavelets(statistics, wavelets) )
+            {
+                std::cout << "Unable to load statistics of these wavelets from file " << addSamplesFileName << std::endl;
+                return 9;
+            }
+            std::cout << "Statistics loaded. Samples will be added to them." << std::endl;
+        }
+        else if ( !saveStateFileName.empty() )
+        {
+            statistics.resize(wavelets.size());
         }
 
-        if ( !SampleExtractor::extractFromBigImage(positiveSamplesImage, positiveImages) )
+        if (!positivesLoaded)
         {
             std::cout << "Failed to load positive samples." << std::endl;
             return 6;
         }
-        positivesIntegrals.resize(positiveImages.size());
-        std::transform(positiveImages.begin(), positiveImages.end(),
-                       positivesIntegrals.begin(),
-                       ToIntegrals());
         std::cout << positivesIntegrals.size() << " positive samples loaded." << std::endl;
 
-        if ( !SampleExtractor::extractFromBigImage(negativeSamplesImage, negativeSamplesIndex, negativeImages) )
+        if ( positivesGiven && !isSupportedWindowSize(sampleSize(positivesIntegrals)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(positivesIntegrals) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
+
+        if (!negativesLoaded)
         {
             std::cout << "Failed to load negative samples." << std::endl;
             return 7;
         }
-        negativesIntegrals.resize(negativeImages.size());
-        std::transform(negativeImages.begin(), negativeImages.end(),
-                       negativesIntegrals.begin(),
-                       ToIntegrals());
         std::cout << negativesIntegrals.size() << " negative samples loaded." << std::endl;
+
+        if ( negativesGiven && positivesGiven && sampleSize(negativesIntegrals) != sampleSize(positivesIntegrals) )
+        {
+            std::cout << "Negative samples are " << sampleSize(negativesIntegrals) << " pixels wide, positive samples " << sampleSize(positivesIntegrals) << ". Use samples of the same size." << std::endl;
+            return 8;
+        }
+
+        if ( negativesGiven && !positivesGiven && !isSupportedWindowSize(sampleSize(negativesIntegrals)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(negativesIntegrals) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
     }
 
 
 
-    std::cout << "Optimizing Haar-like features..." << std::endl;
+    if ( !verifyCount.empty() )
+    {
+        std::cout << "Verifying variance normalization..." << std::endl;
+        std::vector<cv::Mat> images;
+        if (positivesGiven)
+        {
+            if ( !SampleExtractor::extractFromBigImage(positiveSamplesImage, images) )
+            {
+                std::cout << "Failed to load positive samples." << std::endl;
+                return 6;
+            }
+            printVarianceLibraryDeviation(std::cout, "positive samples", verifyVarianceLibraryParity(wavelets, images, std::atoi(verifyCount.c_str())));
+        }
+
+        images.clear();
+        if (negativesGiven)
+        {
+            if ( !SampleExtractor::extractFromBigImage(negativeSamplesImage, negativeSamplesIndex, images) )
+            {
+                std::cout << "Failed to load negative samples." << std::endl;
+                return 7;
+            }
+            printVarianceLibraryDeviation(std::cout, "negative samples", verifyVarianceLibraryParity(wavelets, images, std::atoi(verifyCount.c_str())));
+        }
+    }
+
+
+
+    WaveletSchedule schedule(wavelets, positivesIntegrals.size() + negativesIntegrals.size());
+    if ( !schedule.grouped() )
+    {
+        std::cout << "The wavelets are not grouped by dimensions and rectangle sizes, as haargen writes them: they are scheduled in plain chunks." << std::endl;
+    }
+    std::cout << "Optimizing Haar-like features in " << schedule.buckets() << " buckets..." << std::endl;
 
     tbb::concurrent_vector<ProbabilisticClassifierData> classifiers;
-    tbb::parallel_for( tbb::blocked_range< std::vector<HaarWavelet>::size_type >(0, wavelets.size()),
-                       Optimize(wavelets, positivesIntegrals, negativesIntegrals, classifiers));
+    schedule.parallel_for( Optimize(wavelets, positivesIntegrals, negativesIntegrals, classifiers,
+                                    statistics.empty() ? 0 : &statistics) );
 
-    //sort the solutions using the variance. The smallest variance goes first
-    tbb::parallel_sort(classifiers.begin(), classifiers.end());
+    //sort the solutions using the variance, the smallest first, or the separability, the largest first
+    sortClassifiers(classifiers.begin(), classifiers.end(), sortKey);
 
     std::cout << "Done optimizing. Writing results to " <<  classifiersFileName << std::endl;
 
-    //write all haar wavelets
-    writeClassifiersData(outputStream, classifiers);
+    //write the haar wavelets
+    if ( !writeClassifiersData(outputStream, classifiers, topCount.empty() ? classifiers.size() : std::atol(topCount.c_str())) )
+    {
+        std::cout << "Can't write output file." << std::endl;
+        return 5;
+    }
+
+    if ( !statistics.empty() )
+    {
+        const std::string stateFileName = saveStateFileName.empty() ? addSamplesFileName : saveStateFileName;
+        std::cout << "Writing statistics to " << stateFileName << std::endl;
+        if ( !writeWaveletStatistics(stateFileName, statistics, wavelets) )
+        {
+            std::cout << "Can't write statistics file." << std::endl;
+            return 10;
+        }
+    }
 
     return 0;
 }
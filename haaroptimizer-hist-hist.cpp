@@ -13,6 +13,9 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "optimization_commons.h"
+#include "wavelet_parser.h"
+#include "wavelet_schedule.h"
+#include "optimizer_graph.h"
 #include "mypca.h"
 
 #include "haarwavelet.h"
@@ -134,16 +137,22 @@ private:
 
 
 
+typedef ClassifierWriter<std::vector<ProbabilisticClassifierData>::const_iterator> ClassifiersWriter;
+
+
+
 /**
  * Functor used by Intel TBB to optimize the haar-like feature based classifiers using PCA.
+ * Each range of classifiers is handed to the writer once it is optimized.
  */
 class Optimize
 {
 private:
-    std::vector<HaarWavelet> & wavelets;
+    const PackedWaveletSet & wavelets;
     std::vector<cv::Mat> & positivesIntegralSums;
     std::vector<cv::Mat> & negativesIntegralSums;
-    tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers;
+    std::vector<ProbabilisticClassifierData> & classifiers;
+    ClassifiersWriter & writer;
 
     void getOptimalsForPositiveSamples(mypca & pca, ProbabilisticClassifierData & c) const
     {
@@ -201,11 +210,11 @@ private:
     }
 
 public:
-    void operator()(const tbb::blocked_range<std::vector<HaarWavelet>::size_type> range) const
+    void operator()(const tbb::blocked_range<size_t> range) const
     {
-        for(std::vector<HaarWavelet>::size_type i = range.begin(); i != range.end(); ++i)
+        for(size_t i = range.begin(); i != range.end(); ++i)
         {
-            ProbabilisticClassifierData classifier( wavelets[i] );
+            ProbabilisticClassifierData classifier( wavelets.unpack(i) );
 
             {
                 const double positivePrior = (double)positivesIntegralSums.size() / (positivesIntegralSums.size() + negativesIntegralSums.size());
@@ -227,39 +236,32 @@ public:
                 getOptimalsForNegativeSamples(negative_samples_pca, classifier);
             }
 
-            classifiers.push_back(classifier);
+            classifiers[i] = classifier;
         }
+
+        writer.put(classifiers.begin() + range.begin(), classifiers.begin() + range.end());
     }
 
-    Optimize(std::vector<HaarWavelet> & wavelets_,
+    Optimize(const PackedWaveletSet & wavelets_,
              std::vector<cv::Mat> & positivesIntegralSums_,
              std::vector<cv::Mat> & negativesIntegralSums_,
-             tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers_) : wavelets(wavelets_),
-                                                                                   positivesIntegralSums(positivesIntegralSums_),
-                                                                                   negativesIntegralSums(negativesIntegralSums_),
-                                                                                   classifiers(classifiers_) {}
+             std::vector<ProbabilisticClassifierData> & classifiers_,
+             ClassifiersWriter & writer_) : wavelets(wavelets_),
+                                            positivesIntegralSums(positivesIntegralSums_),
+                                            negativesIntegralSums(negativesIntegralSums_),
+                                            classifiers(classifiers_),
+                                            writer(writer_) {}
 };
 
 
 
-void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers)
-{
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator it = classifiers.begin();
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator end = classifiers.end();
-    for(; it != end; ++it)
-    {
-        it->write(outputStream);
-        outputStream << '\n';
-    }
-}
-
-
-
 /**
  * Loads the Haar wavelets from a file and the image samples found in a directory, then produce
  * the SRFS for each Haar wavelet. Extract the principal component of least variance and use it
- * as the new weights of the respective Haar wavelet. When all is done, write the 'optimized'
- * Haar wavelets to a file.
+ * as the new weights of the respective Haar wavelet. The 'optimized' Haar wavelets are written
+ * to a file as they are done, in no particular order.
+ *
+ * The wavelets and both sets of samples are loaded at the same time, see LoadingGraph.
  */
 int main(int argc, char* argv[])
 {
@@ -277,21 +279,12 @@ int main(int argc, char* argv[])
 
 
 
-    std::vector<HaarWavelet> wavelets;
+    PackedWaveletSet wavelets;
     std::vector<cv::Mat> positivesIntegralSums, negativesIntegralSums;
     std::ofstream outputStream;
 
 
     {
-        //Load a list of Haar wavelets
-        std::cout << "Loading wavelets..." << std::endl;
-        if (!loadHaarWavelets(waveletsFileName, wavelets))
-        {
-            std::cout << "Unable to load Haar wavelets from file " << waveletsFileName << std::endl;
-            return 2;
-        }
-        std::cout << wavelets.size() << " wavelets loaded." << std::endl;
-
         outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
         if ( !outputStream.is_open() )
         {
@@ -299,41 +292,70 @@ int main(int argc, char* argv[])
             return 5;
         }
 
-        //TODO The second parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(positiveSamplesImage, positivesIntegralSums) )
+        //Load the Haar wavelets and both sets of samples at the same time
+        std::cout << "Loading wavelets and samples..." << std::endl;
+        bool waveletsLoaded, positivesLoaded, negativesLoaded;
+        LoadingGraph loading;
+        loading.loadWavelets(waveletsFileName, wavelets, waveletsLoaded);
+        //TODO The index parameters here do not match what is expected for the rest of the program!
+        loading.loadSamples(positiveSamplesImage, "", positivesIntegralSums, false, positivesLoaded);
+        loading.loadSamples(negativeSamplesImage, negativeSamplesIndex, negativesIntegralSums, false, negativesLoaded);
+        loading.run();
+
+        if (!waveletsLoaded)
+        {
+            std::cout << "Unable to load Haar wavelets from file " << waveletsFileName << std::endl;
+            return 2;
+        }
+        std::cout << wavelets.size() << " wavelets loaded." << std::endl;
+
+        if (!positivesLoaded)
         {
             std::cout << "Failed to load positive samples." << std::endl;
             return 6;
         }
-        std::transform(positivesIntegralSums.begin(), positivesIntegralSums.end(),
-                       positivesIntegralSums.begin(),
-                       ToIntegralSums());
         std::cout << positivesIntegralSums.size() << " positive samples loaded." << std::endl;
 
-        //TODO The third parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(negativeSamplesImage, negativeSamplesIndex, negativesIntegralSums) )
+        if ( !isSupportedWindowSize(sampleSize(positivesIntegralSums)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(positivesIntegralSums) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
+
+        if (!negativesLoaded)
         {
             std::cout << "Failed to load negative samples." << std::endl;
             return 7;
         }
-        std::transform(negativesIntegralSums.begin(), negativesIntegralSums.end(),
-                       negativesIntegralSums.begin(),
-                       ToIntegralSums());
         std::cout << negativesIntegralSums.size() << " negative samples loaded." << std::endl;
-    }
 
+        if ( sampleSize(negativesIntegralSums) != sampleSize(positivesIntegralSums) )
+        {
+            std::cout << "Negative samples are " << sampleSize(negativesIntegralSums) << " pixels wide, positive samples " << sampleSize(positivesIntegralSums) << ". Use samples of the same size." << std::endl;
+            return 8;
+        }
+    }
 
 
-    std::cout << "Optimizing Haar-like features..." << std::endl;
 
-    tbb::concurrent_vector<ProbabilisticClassifierData> classifiers;
-    tbb::parallel_for( tbb::blocked_range< std::vector<HaarWavelet>::size_type >(0, wavelets.size()),
-                       Optimize(wavelets, positivesIntegralSums, negativesIntegralSums, classifiers));
+    WaveletSchedule schedule(wavelets, positivesIntegralSums.size() + negativesIntegralSums.size());
+    if ( !schedule.grouped() )
+    {
+        std::cout << "The wavelets are not grouped by dimensions and rectangle sizes, as haargen writes them: they are scheduled in plain chunks." << std::endl;
+    }
+    std::cout << "Optimizing Haar-like features in " << schedule.buckets() << " buckets, writing them to " << classifiersFileName << " as they are done..." << std::endl;
 
-    std::cout << "Done optimizing. Writing results to " <<  classifiersFileName << std::endl;
+    //classifiers are written in the order they are optimized
+    std::vector<ProbabilisticClassifierData> classifiers(wavelets.size());
+    ClassifiersWriter writer(outputStream, false);
+    schedule.parallel_for( Optimize(wavelets, positivesIntegralSums, negativesIntegralSums, classifiers, writer) );
+    if ( !writer.wait() )
+    {
+        std::cout << "Can't write output file." << std::endl;
+        return 5;
+    }
 
-    //write all haar wavelets sorted from best to worst
-    writeClassifiersData(outputStream, classifiers);
+    std::cout << "Done optimizing." << std::endl;
 
     return 0;
 }
@@ -1,4 +1,5 @@
 #include <string>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -13,7 +14,14 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "optimization_commons.h"
-#include "mypca.h"
+#include "wavelet_parser.h"
+#include "wavelet_statistics.h"
+#include "wavelet_schedule.h"
+#include "optimizer_graph.h"
+#include "precision_verification.h"
+#include "numa_samples.h"
+#include "optimize_workspace.h"
+#include "separability.h"
 
 #include "haarwavelet.h"
 #include "haarwaveletutilities.h"
@@ -41,7 +49,8 @@ public:
                                     stdDev(1.0) {}
 
     ProbabilisticClassifierData(const HaarWavelet & wavelet) : mean(.0),
-                                                               stdDev(1.0)
+                                                               stdDev(1.0),
+                                                               histogram(HISTOGRAM_BUCKETS, .0)
     {
         for(std::vector<cv::Rect>::const_iterator it = wavelet.rects_begin(); it != wavelet.rects_end(); ++it)
         {
@@ -67,25 +76,22 @@ public:
         mean = c.mean;
         stdDev = c.stdDev;
         histogram = c.histogram;
+        separability = c.separability;
 
         return *this;
     }
 
-    void setPositiveWeights(const std::vector<double> & projection_)
+    void setPositiveWeights(const double * const projection_)
     {
-        DualWeightHaarWavelet::weightsPositive.reserve(dimensions());
-
-        for(unsigned int i = 0; i < projection_.size(); ++i)
+        for(unsigned int i = 0; i < dimensions(); ++i)
         {
             DualWeightHaarWavelet::weightsPositive[i] = projection_[i];
         }
     }
 
-    void setNegativeWeights(const std::vector<double> & projection_)
+    void setNegativeWeights(const double * const projection_)
     {
-        DualWeightHaarWavelet::weightsNegative.reserve(dimensions());
-
-        for(unsigned int i = 0; i < projection_.size(); ++i)
+        for(unsigned int i = 0; i < dimensions(); ++i)
         {
             DualWeightHaarWavelet::weightsNegative[i] = projection_[i];
         }
@@ -106,6 +112,20 @@ public:
         histogram = histogram_;
     }
 
+    /**
+     * Sets the histogram to the frequencies of the given counts, in place.
+     */
+    void setHistogramFrequencies(const std::vector<double> & counts, const double total)
+    {
+        histogram.resize(counts.size());
+
+        const double increment = 1.0/total;
+        for (unsigned int i = 0; i < counts.size(); ++i)
+        {
+            histogram[i] = counts[i] * increment;
+        }
+    }
+
     void setPositivePrior(double p)
     {
         positivePrior = p;
@@ -116,6 +136,20 @@ public:
         negativePrior = p;
     }
 
+    /**
+     * Computes the separability of the positive gaussian and the negative histogram, once
+     * both are set.
+     */
+    void updateSeparability()
+    {
+        separability = gaussianHistogramSeparability(mean, stdDev, histogram);
+    }
+
+    const Separability & getSeparability() const
+    {
+        return separability;
+    }
+
     bool operator < (const ProbabilisticClassifierData & rh) const
     {
         return stdDev < rh.stdDev;
@@ -139,6 +173,7 @@ public:
         {
             output << ' ' << histogram[i];
         }
+        separability.write(output);
 
         return true;
     }
@@ -150,6 +185,8 @@ private:
     double positivePrior, negativePrior;
 
     std::vector<double> histogram;
+
+    Separability separability;
 };
 
 
@@ -160,122 +197,183 @@ private:
 class Optimize
 {
 private:
-    std::vector<HaarWavelet> * wavelets;
+    const PackedWaveletSet * wavelets;
     std::vector<cv::Mat> * positivesIntegralSums;
     std::vector<cv::Mat> * negativesIntegralSums;
-    tbb::concurrent_vector<ProbabilisticClassifierData> * classifiers;
+    std::vector<ProbabilisticClassifierData> * classifiers; //one per wavelet, allocated before the sweep
+    std::vector<WaveletStatistics> * statistics;            //null when the statistics are not kept
+    OptimizeWorkspaces * workspaces;
+    bool tiled;                                             //evaluate batches on a tile of samples at a time
 
-    void getOptimalsForPositiveSamples(mypca & pca, ProbabilisticClassifierData & c) const
+    void getOptimalsForPositiveSamples(const SrfsMoments & moments, ProbabilisticClassifierData & c) const
     {
-        //The highest variance eigenvector is the first one.
-        //c.setPositiveWeights(pca.get_eigenvector(0));
+        //The positive weights are the ones of the wavelet, so no eigen decomposition is needed.
 
         {
             //This block sets the mean. It is acquired from the projection of the
-            //mean values of the PCA in the direction of the eigenvector (weights).
-            std::vector<double> meanSrfs = pca.get_mean_values();
+            //mean values of the SRFS in the direction of the weights.
             const double mean = std::inner_product(c.weightsPositive_begin(),
                                                    c.weightsPositive_end(),
-                                                   meanSrfs.begin(), .0);
+                                                   moments.mean, .0);
             c.setMean( mean );
         }
 
         {
             //This block sets the standard deviation. It is acquired from the projection
-            //of the covariance matrix in the directin of the eigenvector (weights).
-            std::vector<double> temp(c.dimensions());
-            for (unsigned int i = 0; i < c.dimensions(); ++i)
+            //of the covariance matrix in the direction of the weights.
+            std::vector<float>::const_iterator weights = c.weightsPositive_begin();
+            double variance = 0;
+            for (int i = 0; i < moments.dimensions; ++i)
             {
-                std::vector<double> column = stats::utils::extract_column_vector(pca.cov_mat_, i);
-                temp[i] = std::inner_product(c.weightsPositive_begin(),
-                                             c.weightsPositive_end(),
-                                             column.begin(), .0);
+                for (int j = 0; j < moments.dimensions; ++j)
+                {
+                    variance += weights[i] * moments.covariance(i, j) * weights[j];
+                }
             }
-            const double stdDev = std::sqrt( std::inner_product(c.weightsPositive_begin(),
-                                                                c.weightsPositive_end(),
-                                                                temp.begin(), .0) );
-            c.setStdDev(stdDev);
+            c.setStdDev( std::sqrt(variance) );
         }
     }
 
 
 
-    void getOptimalsForNegativeSamples(mypca & pca, ProbabilisticClassifierData & c) const
+    /**
+     * The negative instances are described by the histogram of their feature values. The
+     * histogram counts are kept by the statistics; the classifier gets their frequencies.
+     */
+    void getOptimalsForNegativeSamples(const WaveletStatistics & s, ProbabilisticClassifierData & c) const
     {
         //c.setNegativeWeights(pca.get_eigenvector(0));
 
-        std::vector<double> histogram(HISTOGRAM_BUCKETS);
-        std::fill(histogram.begin(), histogram.end(), .0);
+        c.setHistogramFrequencies(s.negativeHistogram, s.negative.count);
+    }
 
-        const double increment = 1.0/pca.get_num_records();
 
-        for (long i = 0; i < pca.get_num_records(); ++i)
-        {
-            std::vector<double> r = pca.get_record(i);
-            const double featureValue = std::inner_product(c.weightsNegative_begin(),
-                                                           c.weightsNegative_end(),
-                                                           r.begin(), .0);
-
-            //increment bin count
-            const int index = featureValue >= std::sqrt(2) ? histogram.size() :
-                              featureValue <= -std::sqrt(2) ? 0 :
-                              (int)((histogram.size()/2.0) * featureValue / std::sqrt(2)) + histogram.size()/2;
-            histogram[index] += increment;
-        }
 
-        c.setHistogram(histogram);
+    void setOptimals(const WaveletStatistics & s, ProbabilisticClassifierData & classifier) const
+    {
+        getOptimalsForPositiveSamples(s.positive, classifier);
+        getOptimalsForNegativeSamples(s, classifier);
+
+        const double positivePrior = s.positive.count / (s.positive.count + s.negative.count);
+        classifier.setPositivePrior(positivePrior);
+        classifier.setNegativePrior(1.0 - positivePrior);
+        classifier.updateSeparability();
     }
 
-public:
-    void operator()(const tbb::blocked_range<std::vector<HaarWavelet>::size_type> range) const
+
+
+    /**
+     * End of the batch that starts at begin: up to EIGEN_BATCH wavelets of the same dimensions.
+     */
+    size_t batchEnd(const size_t begin, const size_t end) const
     {
-        for(std::vector<HaarWavelet>::size_type i = range.begin(); i != range.end(); ++i)
+        size_t i = begin + 1;
+        while ( i != end && i - begin < EIGEN_BATCH && (*wavelets)[i].dimensions == (*wavelets)[begin].dimensions )
         {
-            ProbabilisticClassifierData classifier( (*wavelets)[i] );
+            ++i;
+        }
+        return i;
+    }
+
 
-            const double positivePrior = double(positivesIntegralSums->size()) / (positivesIntegralSums->size() + negativesIntegralSums->size());
-            classifier.setPositivePrior(positivePrior);
-            classifier.setNegativePrior(1.0 - positivePrior);
 
+    /**
+     * Evaluates batches of wavelets on the samples together, a tile of samples at a time.
+     */
+    void optimizeTiled(const tbb::blocked_range<size_t> range) const
+    {
+        OptimizeWorkspace & workspace = workspaces->local();
+
+        size_t begin = range.begin();
+        while (begin != range.end())
+        {
+            const size_t end = batchEnd(begin, range.end());
+
+            const AbstractHaarWavelet * batch[EIGEN_BATCH];
+            WaveletStatistics * batchStatistics[EIGEN_BATCH];
+            SrfsMoments * positiveMoments[EIGEN_BATCH];
+            SrfsMoments * negativeMoments[EIGEN_BATCH];
+            std::vector<float>::const_iterator negativeWeights[EIGEN_BATCH];
+            std::vector<double> * negativeHistograms[EIGEN_BATCH];
+            for(size_t i = begin; i != end; ++i)
             {
-                mypca positive_samples_pca;
-                produceSrfs(positive_samples_pca, &classifier, *positivesIntegralSums);
-                positive_samples_pca.solve();
-                getOptimalsForPositiveSamples(positive_samples_pca, classifier);
+                const int b = i - begin;
+                WaveletStatistics & s = statistics ? (*statistics)[i] : workspace.clearStatistics(b);
+                s.negativeHistogram.resize(HISTOGRAM_BUCKETS, .0);
+
+                batch[b] = &(*classifiers)[i];
+                batchStatistics[b] = &s;
+                positiveMoments[b] = &s.positive;
+                negativeMoments[b] = &s.negative;
+                negativeWeights[b] = (*classifiers)[i].weightsNegative_begin();
+                negativeHistograms[b] = &s.negativeHistogram;
             }
 
+            accumulateSrfsTiled(positiveMoments, batch, end - begin, *positivesIntegralSums);
+            accumulateSrfsTiled(negativeMoments, negativeWeights, negativeHistograms, batch, end - begin, *negativesIntegralSums);
+
+            for(size_t i = begin; i != end; ++i)
             {
-                mypca negative_samples_pca;
-                produceSrfs(negative_samples_pca, &classifier, *negativesIntegralSums);
-                negative_samples_pca.solve();
-                getOptimalsForNegativeSamples(negative_samples_pca, classifier);
+                setOptimals(*batchStatistics[i - begin], (*classifiers)[i]);
             }
 
-            classifiers->push_back(classifier);
+            begin = end;
         }
     }
 
-    Optimize(std::vector<HaarWavelet> * wavelets_,
-             std::vector<cv::Mat> * positivesIntegralSums_,
-             std::vector<cv::Mat> * negativesIntegralSums_,
-             tbb::concurrent_vector<ProbabilisticClassifierData> * classifiers_) : wavelets(wavelets_),
-                                                                                   positivesIntegralSums(positivesIntegralSums_),
-                                                                                   negativesIntegralSums(negativesIntegralSums_),
-                                                                                   classifiers(classifiers_) {}
-};
+public:
+    void operator()(const tbb::blocked_range<size_t> range) const
+    {
+        if (tiled)
+        {
+            optimizeTiled(range);
+            return;
+        }
 
+        OptimizeWorkspace & workspace = workspaces->local();
 
+        for(size_t i = range.begin(); i != range.end(); ++i)
+        {
+            ProbabilisticClassifierData & classifier = (*classifiers)[i];
 
-void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers)
-{
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator it = classifiers.begin();
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator end = classifiers.end();
-    for(; it != end; ++it)
+            WaveletStatistics & s = statistics ? (*statistics)[i] : workspace.clearStatistics();
+
+            accumulateSrfs(s.positive, &classifier, *positivesIntegralSums);
+
+            //The negative weights do not depend on the samples, so the histogram counts can be merged
+            s.negativeHistogram.resize(HISTOGRAM_BUCKETS, .0);
+            accumulateSrfs(s.negative, classifier.weightsNegative_begin(), s.negativeHistogram,
+                           &classifier, *negativesIntegralSums);
+
+            setOptimals(s, classifier);
+        }
+    }
+
+    /**
+     * Same functor, reading the samples from a replica of them.
+     */
+    Optimize onReplica(SampleReplica & replica) const
     {
-        it->write(outputStream);
-        outputStream << '\n';
+        Optimize o(*this);
+        o.positivesIntegralSums = replica.set(0);
+        o.negativesIntegralSums = replica.set(1);
+        return o;
     }
-}
+
+    Optimize(const PackedWaveletSet * wavelets_,
+             std::vector<cv::Mat> * positivesIntegralSums_,
+             std::vector<cv::Mat> * negativesIntegralSums_,
+             std::vector<ProbabilisticClassifierData> * classifiers_,
+             std::vector<WaveletStatistics> * statistics_,
+             OptimizeWorkspaces * workspaces_,
+             const bool tiled_) : wavelets(wavelets_),
+                                  positivesIntegralSums(positivesIntegralSums_),
+                                  negativesIntegralSums(negativesIntegralSums_),
+                                  classifiers(classifiers_),
+                                  statistics(statistics_),
+                                  workspaces(workspaces_),
+                                  tiled(tiled_) {}
+};
 
 
 
@@ -284,12 +382,46 @@ void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<P
  * the SRFS for each Haar wavelet. Extract the principal component of least variance and use it
  * as the new weights of the respective Haar wavelet. When all is done, write the 'optimized'
  * Haar wavelets to a file.
+ *
+ * The wavelets and the samples are loaded at the same time, see LoadingGraph, and the
+ * classifiers are formatted in parallel while the other output files are written.
+ *
+ * With --save-state the statistics of each wavelet are also written to a file. With
+ * --add-samples the samples are only the new ones (or - if there are none of a class):
+ * they are merged into the statistics found in the given file, which is then updated.
+ *
+ * With --single-precision the samples and their SRFS are kept in float. With --verify N
+ * the statistics of N random wavelets are also computed in double precision and the
+ * largest deviations from the single precision ones are reported, along with the largest
+ * difference between their SRFS and those of the haarcommon evaluator.
+ *
+ * With --numa the samples are replicated on every NUMA node, in huge pages when possible,
+ * and the workers of each node only read their node's replica.
+ *
+ * Each record ends with the Bhattacharyya distance, the Kullback-Leibler divergence and the
+ * Fisher ratio of its positive gaussian and negative histogram. With --sort-by bhattacharyya,
+ * kullback-leibler or fisher the classifiers go from the most to the least separable instead
+ * of by positive standard deviation, and with --top K only the first K are written.
+ *
+ * With --tiled batches of wavelets are evaluated on a tile of samples that fits in L2 before
+ * moving on to the next tile, so each set of samples is read from memory once per batch
+ * instead of once per wavelet. The statistics are the same.
  */
 int main(int argc, char* argv[])
 {
-    if (argc != 6)
+    const std::string addSamplesFileName = takeOption(argc, argv, "--add-samples"); //merge into these statistics
+    const std::string saveStateFileName = takeOption(argc, argv, "--save-state");   //write statistics here
+    const std::string verifyCount = takeOption(argc, argv, "--verify");              //wavelets to check in double
+    const bool singlePrecision = takeFlag(argc, argv, "--single-precision");
+    const bool numa = takeFlag(argc, argv, "--numa");
+    const std::string sortKeyName = takeOption(argc, argv, "--sort-by");             //order of the output
+    const std::string topCount = takeOption(argc, argv, "--top");                    //write only the best ones
+    const bool tiled = takeFlag(argc, argv, "--tiled");
+
+    SortKey sortKey;
+    if ( argc != 6 || !parseSortKey(sortKeyName, sortKey) )
     {
-        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX OUTPUT_DIR" << std::endl;
+        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX OUTPUT_DIR [--save-state STATE_FILE] [--add-samples STATE_FILE] [--single-precision] [--verify N] [--numa] [--sort-by stddev|bhattacharyya|kullback-leibler|fisher] [--top K] [--tiled]" << std::endl;
         return 1;
     }
 
@@ -301,66 +433,163 @@ int main(int argc, char* argv[])
 
 
 
-    std::vector<HaarWavelet> wavelets;
+    PackedWaveletSet wavelets;
     std::vector<cv::Mat> positivesIntegralSums, negativesIntegralSums;
+    std::vector<WaveletStatistics> statistics;
     std::ofstream outputStream;
 
 
     {
-        //Load a list of Haar wavelets
-        std::cout << "Loading wavelets..." << std::endl;
-        if (!loadHaarWavelets(waveletsFileName, wavelets))
+        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
+        if ( !outputStream.is_open() )
+        {
+            std::cout << "Can't open output file." << std::endl;
+            return 5;
+        }
+
+        //Load the Haar wavelets and the samples given at the same time
+        std::cout << "Loading wavelets and samples..." << std::endl;
+        const bool positivesGiven = addSamplesFileName.empty() || positiveSamplesImage != NO_SAMPLES;
+        const bool negativesGiven = addSamplesFileName.empty() || negativeSamplesImage != NO_SAMPLES;
+        bool waveletsLoaded, positivesLoaded = true, negativesLoaded = true;
+        LoadingGraph loading;
+        loading.loadWavelets(waveletsFileName, wavelets, waveletsLoaded);
+        //TODO The index parameters here do not match what is expected for the rest of the program!
+        if (positivesGiven)
+        {
+            loading.loadSamples(positiveSamplesImage, "", positivesIntegralSums, singlePrecision, positivesLoaded);
+        }
+        if (negativesGiven)
+        {
+            loading.loadSamples(negativeSamplesImage, negativeSamplesIndex, negativesIntegralSums, singlePrecision, negativesLoaded);
+        }
+        loading.run();
+
+        if (!waveletsLoaded)
         {
             std::cout << "Unable to load Haar wavelets from file " << waveletsFileName << std::endl;
             return 2;
         }
         std::cout << wavelets.size() << " wavelets loaded." << std::endl;
 
-        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
-        if ( !outputStream.is_open() )
+        if ( !addSamplesFileName.empty() )
         {
-            std::cout << "Can't open output file." << std::endl;
-            return 5;
+            if ( !loadWaveletStatistics(addSamplesFileName, statistics) || !matchWavelets(statistics, wavelets) )
+            {
+                std::cout << "Unable to load statistics of these wavelets from file " << addSamplesFileName << std::endl;
+                return 9;
+            }
+            std::cout << "Statistics loaded. Samples will be added to them." << std::endl;
+        }
+        else if ( !saveStateFileName.empty() )
+        {
+            statistics.resize(wavelets.size());
         }
 
-        //TODO The second parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(positiveSamplesImage, positivesIntegralSums) )
+        if (!positivesLoaded)
         {
             std::cout << "Failed to load positive samples." << std::endl;
             return 6;
         }
-        std::transform(positivesIntegralSums.begin(), positivesIntegralSums.end(),
-                       positivesIntegralSums.begin(),
-                       ToIntegralSums());
         std::cout << positivesIntegralSums.size() << " positive samples loaded." << std::endl;
 
-        //TODO The third parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(negativeSamplesImage, negativeSamplesIndex, negativesIntegralSums) )
+        if ( positivesGiven && !isSupportedWindowSize(sampleSize(positivesIntegralSums)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(positivesIntegralSums) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
+
+        if (!negativesLoaded)
         {
             std::cout << "Failed to load negative samples." << std::endl;
             return 7;
         }
-        std::transform(negativesIntegralSums.begin(), negativesIntegralSums.end(),
-                       negativesIntegralSums.begin(),
-                       ToIntegralSums());
         std::cout << negativesIntegralSums.size() << " negative samples loaded." << std::endl;
+
+        if ( negativesGiven && positivesGiven && sampleSize(negativesIntegralSums) != sampleSize(positivesIntegralSums) )
+        {
+            std::cout << "Negative samples are " << sampleSize(negativesIntegralSums) << " pixels wide, positive samples " << sampleSize(positivesIntegralSums) << ". Use samples of the same size." << std::endl;
+            return 8;
+        }
+
+        if ( negativesGiven && !positivesGiven && !isSupportedWindowSize(sampleSize(negativesIntegralSums)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(negativesIntegralSums) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
     }
 
 
 
-    std::cout << "Optimizing Haar-like features..." << std::endl;
+    if ( !verifyCount.empty() )
+    {
+        std::cout << "Verifying single precision..." << std::endl;
+        printPrecisionDeviation(std::cout, "positive samples", verifySinglePrecision(wavelets, positivesIntegralSums, std::atoi(verifyCount.c_str())));
+        printLibraryDeviation(std::cout, "positive samples", verifyLibraryParity(wavelets, positivesIntegralSums, std::atoi(verifyCount.c_str())));
+        printPrecisionDeviation(std::cout, "negative samples", verifySinglePrecision(wavelets, negativesIntegralSums, std::atoi(verifyCount.c_str())));
+        printLibraryDeviation(std::cout, "negative samples", verifyLibraryParity(wavelets, negativesIntegralSums, std::atoi(verifyCount.c_str())));
+    }
 
-    tbb::concurrent_vector<ProbabilisticClassifierData> classifiers;
-    tbb::parallel_for( tbb::blocked_range< std::vector<HaarWavelet>::size_type >(0, wavelets.size()),
-                       Optimize(&wavelets, &positivesIntegralSums, &negativesIntegralSums, &classifiers));
 
-    //sort the solutions using the variance. The smallest variance goes first
-    tbb::parallel_sort(classifiers.begin(), classifiers.end());
+
+    WaveletSchedule schedule(wavelets, positivesIntegralSums.size() + negativesIntegralSums.size());
+    if ( !schedule.grouped() )
+    {
+        std::cout << "The wavelets are not grouped by dimensions and rectangle sizes, as haargen writes them: they are scheduled in plain chunks." << std::endl;
+    }
+    std::cout << "Optimizing Haar-like features in " << schedule.buckets() << " buckets..." << std::endl;
+
+    std::vector<ProbabilisticClassifierData> classifiers;
+    unpackClassifiers(wavelets, classifiers);
+    OptimizeWorkspaces workspaces;
+    if (numa)
+    {
+        NumaSamples numaSamples;
+        std::vector< std::vector<cv::Mat> * > sets;
+        sets.push_back(&positivesIntegralSums);
+        sets.push_back(&negativesIntegralSums);
+        if ( !numaSamples.replicate(sets) )
+        {
+            std::cout << "Can't replicate the samples." << std::endl;
+            return 12;
+        }
+        std::cout << "Samples replicated on " << numaSamples.nodes() << " NUMA nodes." << std::endl;
+
+        numaSamples.parallel_for(schedule, Optimize(&wavelets, &positivesIntegralSums, &negativesIntegralSums, &classifiers,
+                                                    statistics.empty() ? 0 : &statistics, &workspaces, tiled));
+    }
+    else
+    {
+        schedule.parallel_for( Optimize(&wavelets, &positivesIntegralSums, &negativesIntegralSums, &classifiers,
+                                        statistics.empty() ? 0 : &statistics, &workspaces, tiled) );
+    }
+
+    //sort the solutions using the variance, the smallest first, or the separability, the largest first
+    sortClassifiers(classifiers.begin(), classifiers.end(), sortKey);
 
     std::cout << "Done optimizing. Writing results to " <<  classifiersFileName << std::endl;
 
-    //write all haar wavelets sorted from best to worst
-    writeClassifiersData(outputStream, classifiers);
+    //write the haar wavelets sorted from best to worst, while the statistics are written
+    const size_t count = topCount.empty() ? classifiers.size() : std::min<size_t>(std::atol(topCount.c_str()), classifiers.size());
+    ClassifierWriter<std::vector<ProbabilisticClassifierData>::const_iterator> writer(outputStream, true);
+    writer.putAll(classifiers.begin(), classifiers.begin() + count);
+
+    if ( !statistics.empty() )
+    {
+        const std::string stateFileName = saveStateFileName.empty() ? addSamplesFileName : saveStateFileName;
+        std::cout << "Writing statistics to " << stateFileName << std::endl;
+        if ( !writeWaveletStatistics(stateFileName, statistics, wavelets) )
+        {
+            std::cout << "Can't write statistics file." << std::endl;
+            return 10;
+        }
+    }
+
+    if ( !writer.wait() )
+    {
+        std::cout << "Can't write output file." << std::endl;
+        return 5;
+    }
 
     return 0;
 }
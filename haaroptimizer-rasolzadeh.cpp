@@ -13,7 +13,11 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "optimization_commons.h"
-#include "mypca.h"
+#include "wavelet_parser.h"
+#include "wavelet_statistics.h"
+#include "wavelet_schedule.h"
+#include "optimizer_graph.h"
+#include "precision_verification.h"
 
 #include "haarwavelet.h"
 #include "haarwaveletutilities.h"
@@ -131,124 +135,112 @@ private:
 
 
 
+typedef ClassifierWriter<std::vector<ProbabilisticClassifierData>::const_iterator> ClassifiersWriter;
+
+
+
 /**
  * Functor used by Intel TBB to optimize the haar-like feature based classifiers using PCA.
+ * Each range of classifiers is handed to the writer once it is optimized.
  */
 class Optimize
 {
 private:
-    std::vector<HaarWavelet> & wavelets;
+    const PackedWaveletSet & wavelets;
     std::vector<Integrals> & positivesIntegrals;
     std::vector<Integrals> & negativesIntegrals;
-    tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers;
-
-    void fillHistogram(mypca & pca, ProbabilisticClassifierData & c, std::vector<double> &histogram) const
+    std::vector<ProbabilisticClassifierData> & classifiers;
+    std::vector<WaveletStatistics> * statistics; //null when the statistics are not kept
+    ClassifiersWriter & writer;
+
+    /**
+     * Frequencies of the bin counts of a histogram of total values.
+     */
+    std::vector<double> frequencies(const std::vector<double> & counts, const double total) const
     {
-        const int buckets = histogram.size();
-        const double increment = 1.0/pca.get_num_records();
+        std::vector<double> histogram(counts.size(), .0);
 
-        for (long i = 0; i < pca.get_num_records(); ++i)
+        const double increment = total > 0 ? 1.0/total : .0;
+        for (unsigned int i = 0; i < counts.size(); ++i)
         {
-            std::vector<double> r = pca.get_record(i);
-            const double featureValue = std::inner_product(c.weights_begin(),
-                                                           c.weights_end(),
-                                                           r.begin(), .0);
-
-            //increment bin count (copy & paste from HistogramDiscriminant class)
-            const int index = featureValue >= std::sqrt(2) ? histogram.size() - 1 :
-                              featureValue <= -std::sqrt(2) ? 0 :
-                              (int)((buckets/2.0) * featureValue / std::sqrt(2.0)) + (buckets/2.0);
-            histogram[index] += increment;
+            histogram[i] = counts[i] * increment;
         }
-    }
-
-    void getOptimalsForPositiveSamples(mypca & pca, ProbabilisticClassifierData & c) const
-    {
-        std::vector<double> histogram(HISTOGRAM_BUCKETS);
-        std::fill(histogram.begin(), histogram.end(), .0);
-
-        fillHistogram(pca, c, histogram);
-        c.setPositiveHistogram(histogram);
-    }
-
 
-
-    void getOptimalsForNegativeSamples(mypca & pca, ProbabilisticClassifierData & c) const
-    {
-        std::vector<double> histogram(HISTOGRAM_BUCKETS);
-        std::fill(histogram.begin(), histogram.end(), .0);
-
-        fillHistogram(pca, c, histogram);
-        c.setNegativeHistogram(histogram);
+        return histogram;
     }
 
 public:
-    void operator()(const tbb::blocked_range<std::vector<HaarWavelet>::size_type> range) const
+    void operator()(const tbb::blocked_range<size_t> range) const
     {
-        for(std::vector<HaarWavelet>::size_type i = range.begin(); i != range.end(); ++i)
+        for(size_t i = range.begin(); i != range.end(); ++i)
         {
             //Don't set weights. Use the defaults.
-            ProbabilisticClassifierData classifier( wavelets[i] );
+            ProbabilisticClassifierData classifier( wavelets.unpack(i) );
+
+            //The histograms keep the bin counts of the feature values, which are projected
+            //on the default weights, so the counts of the new samples add to the kept ones.
+            WaveletStatistics local;
+            WaveletStatistics & s = statistics ? (*statistics)[i] : local;
+            s.positiveHistogram.resize(HISTOGRAM_BUCKETS, .0);
+            s.negativeHistogram.resize(HISTOGRAM_BUCKETS, .0);
+            accumulateSrfs(s.positive, classifier.weights_begin(), s.positiveHistogram, &classifier, positivesIntegrals);
+            accumulateSrfs(s.negative, classifier.weights_begin(), s.negativeHistogram, &classifier, negativesIntegrals);
 
             {
-                const double positivePrior = (double)positivesIntegrals.size() / (positivesIntegrals.size() + negativesIntegrals.size());
+                const double positivePrior = s.positive.count / (s.positive.count + s.negative.count);
                 classifier.setPositivePrior(positivePrior);
                 classifier.setNegativePrior(1.0 - positivePrior);
             }
 
-            {
-                mypca positive_samples_pca;
-                produceSrfs(positive_samples_pca, &classifier, positivesIntegrals);
-                positive_samples_pca.solve();
-                getOptimalsForPositiveSamples(positive_samples_pca, classifier);
-            }
-
-            {
-                mypca negative_samples_pca;
-                produceSrfs(negative_samples_pca, &classifier, negativesIntegrals);
-                negative_samples_pca.solve();
-                getOptimalsForNegativeSamples(negative_samples_pca, classifier);
-            }
+            classifier.setPositiveHistogram( frequencies(s.positiveHistogram, s.positive.count) );
+            classifier.setNegativeHistogram( frequencies(s.negativeHistogram, s.negative.count) );
 
-            classifiers.push_back(classifier);
+            classifiers[i] = classifier;
         }
+
+        writer.put(classifiers.begin() + range.begin(), classifiers.begin() + range.end());
     }
 
-    Optimize(std::vector<HaarWavelet> & wavelets_,
+    Optimize(const PackedWaveletSet & wavelets_,
              std::vector<Integrals> & positivesIntegrals_,
              std::vector<Integrals> & negativesIntegrals_,
-             tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers_) : wavelets(wavelets_),
-                                                                                   positivesIntegrals(positivesIntegrals_),
-                                                                                   negativesIntegrals(negativesIntegrals_),
-                                                                                   classifiers(classifiers_) {}
+             std::vector<ProbabilisticClassifierData> & classifiers_,
+             std::vector<WaveletStatistics> * statistics_,
+             ClassifiersWriter & writer_) : wavelets(wavelets_),
+                                            positivesIntegrals(positivesIntegrals_),
+                                            negativesIntegrals(negativesIntegrals_),
+                                            classifiers(classifiers_),
+                                            statistics(statistics_),
+                                            writer(writer_) {}
 };
 
 
 
-void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers)
-{
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator it = classifiers.begin();
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator end = classifiers.end();
-    for(; it != end; ++it)
-    {
-        it->write(outputStream);
-        outputStream << '\n';
-    }
-}
-
-
-
 /**
  * Loads the Haar wavelets from a file and the image samples found in a directory, then produce
  * the SRFS for each Haar wavelet. Extract the principal component of least variance and use it
- * as the new weights of the respective Haar wavelet. When all is done, write the 'optimized'
- * Haar wavelets to a file.
+ * as the new weights of the respective Haar wavelet. The 'optimized' Haar wavelets are written
+ * to a file as they are done, in no particular order.
+ *
+ * The wavelets and both sets of samples are loaded at the same time, see LoadingGraph.
+ *
+ * With --save-state the histogram bin counts of each wavelet are also written to a file. With
+ * --add-samples the samples are only the new ones (or - if there are none of a class): their
+ * counts are added to those found in the given file, which is then updated.
+ *
+ * With --verify N the variance normalized SRFS of N random wavelets are also evaluated with
+ * VarianceNormalizedWaveletEvaluator and the largest deviations from the library's are
+ * reported, as by haaroptimizer-adhikari.
  */
 int main(int argc, char* argv[])
 {
+    const std::string addSamplesFileName = takeOption(argc, argv, "--add-samples"); //merge into these statistics
+    const std::string saveStateFileName = takeOption(argc, argv, "--save-state");   //write statistics here
+    const std::string verifyCount = takeOption(argc, argv, "--verify"); //wavelets to check against the library
+
     if (argc != 6)
     {
-        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX OUTPUT_DIR" << std::endl;
+        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX OUTPUT_DIR [--save-state STATE_FILE] [--add-samples STATE_FILE] [--verify N]" << std::endl;
         return 1;
     }
 
@@ -260,66 +252,153 @@ int main(int argc, char* argv[])
 
 
 
-    std::vector<HaarWavelet> wavelets;
-    std::vector<cv::Mat> positiveImages, negativeImages;
+    PackedWaveletSet wavelets;
     std::vector<Integrals> positivesIntegrals, negativesIntegrals;
+    std::vector<WaveletStatistics> statistics;
     std::ofstream outputStream;
 
+    const bool positivesGiven = addSamplesFileName.empty() || positiveSamplesImage != NO_SAMPLES;
+    const bool negativesGiven = addSamplesFileName.empty() || negativeSamplesImage != NO_SAMPLES;
+
 
     {
-        //Load a list of Haar wavelets
-        std::cout << "Loading wavelets..." << std::endl;
-        if (!loadHaarWavelets(waveletsFileName, wavelets))
+        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
+        if ( !outputStream.is_open() )
+        {
+            std::cout << "Can't open output file." << std::endl;
+            return 5;
+        }
+
+        //Load the Haar wavelets and the samples given at the same time
+        std::cout << "Loading wavelets and samples..." << std::endl;
+        bool waveletsLoaded, positivesLoaded = true, negativesLoaded = true;
+        LoadingGraph loading;
+        loading.loadWavelets(waveletsFileName, wavelets, waveletsLoaded);
+        //TODO The index parameters here do not match what is expected for the rest of the program!
+        if (positivesGiven)
+        {
+            loading.loadSamples(positiveSamplesImage, "", positivesIntegrals, false, positivesLoaded);
+        }
+        if (negativesGiven)
+        {
+            loading.loadSamples(negativeSamplesImage, negativeSamplesIndex, negativesIntegrals, false, negativesLoaded);
+        }
+        loading.run();
+
+        if (!waveletsLoaded)
         {
             std::cout << "Unable to load Haar wavelets from file " << waveletsFileName << std::endl;
             return 2;
         }
         std::cout << wavelets.size() << " wavelets loaded." << std::endl;
 
-        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
-        if ( !outputStream.is_open() )
+        if ( !addSamplesFileName.empty() )
         {
-            std::cout << "Can't open output file." << std::endl;
-            return 5;
+            if ( !loadWaveletStatistics(addSamplesFileName, statistics) || !matchWavelets(statistics, wavelets) )
+            {
+                std::cout << "Unable to load statistics of these wavelets from file " << addSamplesFileName << std::endl;
+                return 9;
+            }
+            std::cout << "Statistics loaded. Samples will be added to them." << std::endl;
+        }
+        else if ( !saveStateFileName.empty() )
+        {
+            statistics.resize(wavelets.size());
         }
 
-        //TODO The second parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(positiveSamplesImage, positiveImages) )
+        if (!positivesLoaded)
         {
             std::cout << "Failed to load positive samples." << std::endl;
             return 6;
         }
-        positivesIntegrals.resize(positiveImages.size());
-        std::transform(positiveImages.begin(), positiveImages.end(),
-                       positivesIntegrals.begin(),
-                       ToIntegrals());
         std::cout << positivesIntegrals.size() << " positive samples loaded." << std::endl;
 
-        //TODO The third parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(negativeSamplesImage, negativeSamplesIndex, negativeImages) )
+        if ( positivesGiven && !isSupportedWindowSize(sampleSize(positivesIntegrals)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(positivesIntegrals) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
+
+        if (!negativesLoaded)
         {
             std::cout << "Failed to load negative samples." << std::endl;
             return 7;
         }
-        negativesIntegrals.resize(negativeImages.size());
-        std::transform(negativeImages.begin(), negativeImages.end(),
-                       negativesIntegrals.begin(),
-                       ToIntegrals());
         std::cout << negativesIntegrals.size() << " negative samples loaded." << std::endl;
+
+        if ( negativesGiven && positivesGiven && sampleSize(negativesIntegrals) != sampleSize(positivesIntegrals) )
+        {
+            std::cout << "Negative samples are " << sampleSize(negativesIntegrals) << " pixels wide, positive samples " << sampleSize(positivesIntegrals) << ". Use samples of the same size." << std::endl;
+            return 8;
+        }
+
+        if ( negativesGiven && !positivesGiven && !isSupportedWindowSize(sampleSize(negativesIntegrals)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(negativesIntegrals) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
     }
 
 
 
-    std::cout << "Optimizing Haar-like features..." << std::endl;
+    if ( !verifyCount.empty() )
+    {
+        std::cout << "Verifying variance normalization..." << std::endl;
+        std::vector<cv::Mat> images;
+        if (positivesGiven)
+        {
+            if ( !SampleExtractor::extractFromBigImage(positiveSamplesImage, images) )
+            {
+                std::cout << "Failed to load positive samples." << std::endl;
+                return 6;
+            }
+            printVarianceLibraryDeviation(std::cout, "positive samples", verifyVarianceLibraryParity(wavelets, images, std::atoi(verifyCount.c_str())));
+        }
+
+        images.clear();
+        if (negativesGiven)
+        {
+            if ( !SampleExtractor::extractFromBigImage(negativeSamplesImage, negativeSamplesIndex, images) )
+            {
+                std::cout << "Failed to load negative samples." << std::endl;
+                return 7;
+            }
+            printVarianceLibraryDeviation(std::cout, "negative samples", verifyVarianceLibraryParity(wavelets, images, std::atoi(verifyCount.c_str())));
+        }
+    }
+
 
-    tbb::concurrent_vector<ProbabilisticClassifierData> classifiers;
-    tbb::parallel_for( tbb::blocked_range< std::vector<HaarWavelet>::size_type >(0, wavelets.size()),
-                       Optimize(wavelets, positivesIntegrals, negativesIntegrals, classifiers));
 
-    std::cout << "Done optimizing. Writing results to " <<  classifiersFileName << std::endl;
+    WaveletSchedule schedule(wavelets, positivesIntegrals.size() + negativesIntegrals.size());
+    if ( !schedule.grouped() )
+    {
+        std::cout << "The wavelets are not grouped by dimensions and rectangle sizes, as haargen writes them: they are scheduled in plain chunks." << std::endl;
+    }
+    std::cout << "Optimizing Haar-like features in " << schedule.buckets() << " buckets, writing them to " << classifiersFileName << " as they are done..." << std::endl;
+
+    //classifiers are written in the order they are optimized
+    std::vector<ProbabilisticClassifierData> classifiers(wavelets.size());
+    ClassifiersWriter writer(outputStream, false);
+    schedule.parallel_for( Optimize(wavelets, positivesIntegrals, negativesIntegrals, classifiers,
+                                    statistics.empty() ? 0 : &statistics, writer) );
+    if ( !writer.wait() )
+    {
+        std::cout << "Can't write output file." << std::endl;
+        return 5;
+    }
+
+    if ( !statistics.empty() )
+    {
+        const std::string stateFileName = saveStateFileName.empty() ? addSamplesFileName : saveStateFileName;
+        std::cout << "Writing statistics to " << stateFileName << std::endl;
+        if ( !writeWaveletStatistics(stateFileName, statistics, wavelets) )
+        {
+            std::cout << "Can't write statistics file." << std::endl;
+            return 10;
+        }
+    }
 
-    //write all haar wavelets
-    writeClassifiersData(outputStream, classifiers);
+    std::cout << "Done optimizing." << std::endl;
 
     return 0;
 }
@@ -1,4 +1,5 @@
 #include <string>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -13,7 +14,18 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "optimization_commons.h"
-#include "mypca.h"
+#include "wavelet_parser.h"
+#include "wavelet_statistics.h"
+#include "wavelet_schedule.h"
+#include "optimizer_graph.h"
+#include "precision_verification.h"
+#include "numa_samples.h"
+#include "optimize_workspace.h"
+#include "symmetric_eigen.h"
+#include "batched_eigen.h"
+#include "bootstrap.h"
+#include "feature_matrix.h"
+#include "covariance_table.h"
 
 #include "haarwavelet.h"
 #include "haarwaveletutilities.h"
@@ -25,10 +37,6 @@
 
 
 
-#define SAMPLE_SIZE 20
-
-
-
 /**
  * Sets parameters to the weak classifier that creates a band over the SRFS,
  * as proposed in http://www.thinkmind.org/index.php?view=article&articleid=icons_2014_3_20_40057.
@@ -43,10 +51,11 @@ public:
     BandClassifierData() : MyHaarWavelet(),
                            stdDev(0) {}
 
-    BandClassifierData(const HaarWavelet & h)
+    BandClassifierData(const HaarWavelet & h) : stdDev(0)
     {
         rects.resize(h.dimensions());
         weights.resize(h.dimensions());
+        means.resize(h.dimensions());
         for (unsigned int i = 0; i < h.dimensions(); ++i)
         {
             rects[i] = h.rect(i);
@@ -64,19 +73,18 @@ public:
         return *this;
     }
 
-    void setMeans(const std::vector<double> & means_)
+    void setMeans(const double * const means_)
     {
-        means.resize( means_.size() );
-        for (unsigned int i = 0; i < means_.size(); ++i)
+        means.resize( dimensions() );
+        for (unsigned int i = 0; i < dimensions(); ++i)
         {
             means[i] = means_[i];
         }
     }
 
-    void setWeights(const std::vector<double> & weights_)
+    void setWeights(const double * const weights_)
     {
-        weights.reserve(weights_.size());
-        for (unsigned int i = 0; i < weights_.size(); ++i)
+        for (unsigned int i = 0; i < dimensions(); ++i)
         {
             weights[i] = weights_[i];
         }
@@ -87,6 +95,11 @@ public:
         stdDev = stdDev_;
     }
 
+    double getStdDev() const
+    {
+        return stdDev;
+    }
+
     bool operator < (const BandClassifierData & rh) const
     {
         return stdDev < rh.stdDev;
@@ -100,70 +113,128 @@ public:
  */
 class Optimize
 {
-    std::vector<HaarWavelet> * wavelets;
+    const PackedWaveletSet * wavelets;
     std::vector<cv::Mat> * integralSums;
-    tbb::concurrent_vector<BandClassifierData> * classifiers;
+    std::vector<BandClassifierData> * classifiers; //one per wavelet, allocated before the sweep
+    std::vector<WaveletStatistics> * statistics;   //null when the statistics are not kept
+    const CovarianceTable * table;                 //null when the SRFS are evaluated on every sample
+    OptimizeWorkspaces * workspaces;
+    SweepBootstrap * bootstrap;                    //null without confidence intervals
+    bool tiled;                                    //evaluate each batch on a tile of samples at a time
 
     /**
      * Returns the principal component with the smallest variance.
      */
-    void getOptimals(mypca & pca, BandClassifierData & c) const
+    void getOptimals(const SymmetricEigen & eigen, const SrfsMoments & moments, BandClassifierData & c) const
     {
         //The smallest eigenvalue is the last one
-        const std::vector<double> eigenvector = pca.get_eigenvector( pca.get_num_variables() - 1 );
+        const double * const eigenvector = eigen.vectors[eigen.dimensions - 1];
 
         c.setWeights(eigenvector);
-        c.setMeans( pca.get_mean_values() );
+        c.setMeans(moments.mean);
+        c.setStdDev( std::sqrt(eigen.projectedVariance(eigenvector)) );
+    }
 
-        double stdDev = 0;
-        std::vector<double> temp(eigenvector.size());
-        for (unsigned int i = 0; i < eigenvector.size(); ++i)
+    /**
+     * End of the batch that starts at begin: up to EIGEN_BATCH wavelets of the same dimensions.
+     */
+    size_t batchEnd(const size_t begin, const size_t end) const
+    {
+        size_t i = begin + 1;
+        while ( i != end && i - begin < EIGEN_BATCH && (*wavelets)[i].dimensions == (*wavelets)[begin].dimensions )
         {
-            std::vector<double> column = stats::utils::extract_column_vector(pca.cov_mat_, i);
-            temp[i] = std::inner_product(eigenvector.begin(), eigenvector.end(),
-                                         column.begin(), .0);
+            ++i;
         }
-        stdDev = std::sqrt( std::inner_product(eigenvector.begin(), eigenvector.end(), temp.begin(), .0) );
-
-        c.setStdDev(stdDev);
+        return i;
     }
 
 public:
-    void operator()(const tbb::blocked_range<std::vector<HaarWavelet>::size_type> range) const
+    void operator()(const tbb::blocked_range<size_t> range) const
     {
-        for(std::vector<HaarWavelet>::size_type i = range.begin(); i != range.end(); ++i)
-        {
-            BandClassifierData classifier( (*wavelets)[i] );
+        OptimizeWorkspace & workspace = workspaces->local();
 
-            mypca pca;
-            produceSrfs(pca, &classifier, *integralSums);
-            pca.solve();
-
-            getOptimals(pca, classifier);
-
-            classifiers->push_back(classifier);
+        size_t begin = range.begin();
+        while (begin != range.end())
+        {
+            const size_t end = batchEnd(begin, range.end());
+
+            //Gather the statistics of a batch of wavelets of the same dimensions
+            const SrfsMoments * moments[EIGEN_BATCH];
+            SrfsMoments * tileMoments[EIGEN_BATCH]; //of the wavelets evaluated on the samples together
+            const AbstractHaarWavelet * tileWavelets[EIGEN_BATCH];
+            int tileCount = 0;
+            for(size_t i = begin; i != end; ++i)
+            {
+                BandClassifierData & classifier = (*classifiers)[i];
+
+                WaveletStatistics & s = statistics ? (*statistics)[i] : workspace.clearStatistics(i - begin);
+                SrfsMoments tableMoments;
+                if (bootstrap)
+                {
+                    std::vector<SrfsMoments> & replicates = workspace.bootstrapReplicates(bootstrap->replicates());
+                    bootstrap->accumulate(s.positive, replicates, &classifier, *integralSums);
+                    bootstrap->solve(i, replicates, workspace.replicateValues);
+                }
+                else if ( table && table->moments(classifier, tableMoments) )
+                {
+                    s.positive.merge(tableMoments);
+                }
+                else if (tiled)
+                {
+                    tileMoments[tileCount] = &s.positive;
+                    tileWavelets[tileCount++] = &classifier;
+                }
+                else
+                {
+                    accumulateSrfs(s.positive, &classifier, *integralSums);
+                }
+                moments[i - begin] = &s.positive;
+            }
+            accumulateSrfsTiled(tileMoments, tileWavelets, tileCount, *integralSums);
+
+            //and decompose their covariances together
+            SymmetricEigen eigens[EIGEN_BATCH];
+            solveSymmetricEigens(moments, end - begin, eigens);
+
+            for(size_t i = begin; i != end; ++i)
+            {
+                getOptimals(eigens[i - begin], *moments[i - begin], (*classifiers)[i]);
+                if (bootstrap)
+                {
+                    bootstrap->setStdDev(i, (*classifiers)[i].getStdDev());
+                }
+            }
+
+            begin = end;
         }
     }
 
-    Optimize(std::vector<HaarWavelet> * wavelets_,
-             std::vector<cv::Mat> * integralSums_,
-             tbb::concurrent_vector<BandClassifierData> * classifiers_) : wavelets(wavelets_),
-                                                                      integralSums(integralSums_),
-                                                                      classifiers(classifiers_) {}
-};
-
-
-
-void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<BandClassifierData> & classifiers)
-{
-    tbb::concurrent_vector<BandClassifierData>::const_iterator it = classifiers.begin();
-    tbb::concurrent_vector<BandClassifierData>::const_iterator end = classifiers.end();
-    for(; it != end; ++it)
+    /**
+     * Same functor, reading the samples from a replica of them.
+     */
+    Optimize onReplica(SampleReplica & replica) const
     {
-        it->write(outputStream);
-        outputStream << '\n';
+        Optimize o(*this);
+        o.integralSums = replica.set(0);
+        return o;
     }
-}
+
+    Optimize(const PackedWaveletSet * wavelets_,
+             std::vector<cv::Mat> * integralSums_,
+             std::vector<BandClassifierData> * classifiers_,
+             std::vector<WaveletStatistics> * statistics_,
+             const CovarianceTable * table_,
+             OptimizeWorkspaces * workspaces_,
+             SweepBootstrap * bootstrap_,
+             const bool tiled_) : wavelets(wavelets_),
+                                  integralSums(integralSums_),
+                                  classifiers(classifiers_),
+                                  statistics(statistics_),
+                                  table(table_),
+                                  workspaces(workspaces_),
+                                  bootstrap(bootstrap_),
+                                  tiled(tiled_) {}
+};
 
 
 
@@ -172,64 +243,210 @@ void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<B
  * the SRFS for each Haar wavelet. Extract the principal component of least variance and use it
  * as the new weights of the respective Haar wavelet. When all is done, write the 'optimized'
  * Haar wavelets to a file.
+ *
+ * The wavelets and the samples are loaded at the same time, see LoadingGraph, and the
+ * classifiers are formatted in parallel while the other output files are written.
+ *
+ * With --save-state the statistics of the SRFS of each wavelet are also written to a file.
+ * With --add-samples the samples are only the new ones: they are merged into the statistics
+ * found in the given file, which is then updated.
+ *
+ * With --covariance-tables the covariance of each wavelet is looked up in a table of all
+ * same-size rectangle pairs, kept in PREFIX.positives.cov and built on the first run.
+ *
+ * With --single-precision the samples and their SRFS are kept in float. With --verify N
+ * the statistics of N random wavelets are also computed in double precision and the
+ * largest deviations from the single precision ones are reported, along with the largest
+ * difference between their SRFS and those of the haarcommon evaluator.
+ *
+ * With --numa the samples are replicated on every NUMA node, in huge pages when possible,
+ * and the workers of each node only read their node's replica.
+ *
+ * With --bootstrap the samples are resampled into BOOTSTRAP_REPLICATES Poisson bootstrap
+ * replicates, or as many as --bootstrap-replicates says, in the same pass, and the
+ * confidence intervals of the eigenvalues, of the standard deviation and of the rank of
+ * each wavelet are written to the given file. Ranking keeps 4 bytes per wavelet and
+ * replicate; the optimizer refuses to start when the bootstrap would not fit in memory.
+ *
+ * With --feature-matrix the feature values of the optimized classifiers on every sample are
+ * written, in the order of the output, to a memory mappable matrix; as floats or, with
+ * --quantize, as 16 bit integers.
+ *
+ * With --tiled each batch of wavelets is evaluated on a tile of samples that fits in L2 before
+ * moving on to the next tile, so the samples are read from memory once per batch instead of
+ * once per wavelet. The statistics are the same.
  */
 int main(int argc, char* argv[])
 {
+    const std::string addSamplesFileName = takeOption(argc, argv, "--add-samples"); //merge into these statistics
+    const std::string saveStateFileName = takeOption(argc, argv, "--save-state");   //write statistics here
+    const std::string verifyCount = takeOption(argc, argv, "--verify");              //wavelets to check in double
+    const bool singlePrecision = takeFlag(argc, argv, "--single-precision");
+    const bool numa = takeFlag(argc, argv, "--numa");
+    const std::string tablesPrefix = takeOption(argc, argv, "--covariance-tables");  //covariance tables go here
+    const std::string bootstrapFileName = takeOption(argc, argv, "--bootstrap");     //write confidence intervals here
+    const std::string replicatesCount = takeOption(argc, argv, "--bootstrap-replicates");
+    const std::string matrixFileName = takeOption(argc, argv, "--feature-matrix");   //write feature values here
+    const bool quantize = takeFlag(argc, argv, "--quantize");
+    const bool tiled = takeFlag(argc, argv, "--tiled");
+
     if (argc != 4)
     {
-        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE SAMPLES_DIR OUTPUT_DIR" << std::endl;
+        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE SAMPLES_DIR OUTPUT_DIR [--save-state STATE_FILE] [--add-samples STATE_FILE] [--covariance-tables PREFIX] [--single-precision] [--verify N] [--numa] [--bootstrap INTERVALS_FILE [--bootstrap-replicates N]] [--feature-matrix MATRIX_FILE [--quantize]] [--tiled]" << std::endl;
         return 1;
     }
 
+    if ( !bootstrapFileName.empty() && !addSamplesFileName.empty() )
+    {
+        std::cout << "The bootstrap needs every sample: --bootstrap can't be used with --add-samples." << std::endl;
+        return 13;
+    }
+
+    const int replicates = replicatesCount.empty() ? BOOTSTRAP_REPLICATES : std::atoi(replicatesCount.c_str());
+    if (replicates < 2 || replicates > BOOTSTRAP_MAX_REPLICATES)
+    {
+        std::cout << "Bootstrap replicates go from 2 to " << BOOTSTRAP_MAX_REPLICATES << "." << std::endl;
+        return 13;
+    }
+
     const std::string waveletsFileName = argv[1];    //load Haar wavelets from here
     const std::string samplesFileName = argv[2];     //load samples from here
     const std::string classifiersFileName = argv[3]; //write output here
 
 
 
-    std::vector<HaarWavelet> wavelets;
+    PackedWaveletSet wavelets;
     std::vector<cv::Mat> integralSums;
+    std::vector<WaveletStatistics> statistics;
+    CovarianceTable table;
     std::ofstream outputStream;
 
 
     {
-        //Load a list of Haar wavelets
-        std::cout << "Loading wavelets..." << std::endl;
-        if (!loadHaarWavelets(waveletsFileName, wavelets))
+        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
+        if ( !outputStream.is_open() )
+        {
+            std::cout << "Can't open output file." << std::endl;
+            return 5;
+        }
+
+        //Load the Haar wavelets and the samples at the same time
+        std::cout << "Loading wavelets and samples..." << std::endl;
+        bool waveletsLoaded, samplesLoaded;
+        LoadingGraph loading;
+        loading.loadWavelets(waveletsFileName, wavelets, waveletsLoaded);
+        //TODO The index parameter here does not match what is expected for the rest of the program!
+        loading.loadSamples(samplesFileName, "", integralSums, singlePrecision, samplesLoaded);
+        loading.run();
+
+        if (!waveletsLoaded)
         {
             std::cout << "Unable to load Haar wavelets from file " << waveletsFileName << std::endl;
             return 2;
         }
         std::cout << wavelets.size() << " wavelets loaded." << std::endl;
 
-        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
-        if ( !outputStream.is_open() )
+        if ( !addSamplesFileName.empty() )
         {
-            std::cout << "Can't open output file." << std::endl;
-            return 5;
+            if ( !loadWaveletStatistics(addSamplesFileName, statistics) || !matchWavelets(statistics, wavelets) )
+            {
+                std::cout << "Unable to load statistics of these wavelets from file " << addSamplesFileName << std::endl;
+                return 9;
+            }
+            std::cout << "Statistics loaded. Samples will be added to them." << std::endl;
+        }
+        else if ( !saveStateFileName.empty() )
+        {
+            statistics.resize(wavelets.size());
         }
 
-        //TODO The second parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(samplesFileName, integralSums) )
+        if (!samplesLoaded)
         {
             std::cout << "Failed to load positive samples." << std::endl;
             return 6;
         }
-        std::transform(integralSums.begin(), integralSums.end(),
-                       integralSums.begin(),
-                       ToIntegralSums());
         std::cout << integralSums.size() << " positive samples loaded." << std::endl;
+
+        if ( !isSupportedWindowSize(sampleSize(integralSums)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(integralSums) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
+
+        if ( !tablesPrefix.empty() )
+        {
+            std::cout << "Preparing covariance table..." << std::endl;
+            if ( !prepareCovarianceTable(table, tablesPrefix + ".positives.cov", integralSums) )
+            {
+                std::cout << "Can't build covariance table " << tablesPrefix << ".positives.cov" << std::endl;
+                return 11;
+            }
+        }
+    }
+
+
+
+    if ( !verifyCount.empty() )
+    {
+        std::cout << "Verifying single precision..." << std::endl;
+        printPrecisionDeviation(std::cout, "positive samples", verifySinglePrecision(wavelets, integralSums, std::atoi(verifyCount.c_str())));
+        printLibraryDeviation(std::cout, "positive samples", verifyLibraryParity(wavelets, integralSums, std::atoi(verifyCount.c_str())));
     }
 
 
 
-    std::cout << "Optimizing Haar-like features..." << std::endl;
+    WaveletSchedule schedule(wavelets, integralSums.size(), table.isOpen() ? integralSums.size() : 0);
+    if ( !schedule.grouped() )
+    {
+        std::cout << "The wavelets are not grouped by dimensions and rectangle sizes, as haargen writes them: they are scheduled in plain chunks." << std::endl;
+    }
+    std::cout << "Optimizing Haar-like features in " << schedule.buckets() << " buckets..." << std::endl;
+
+
+
+    SweepBootstrap bootstrap;
+    if ( !bootstrapFileName.empty() )
+    {
+        const double memory = SweepBootstrap::memory(integralSums.size(), wavelets.size(), replicates,
+                                                     tbb::this_task_arena::max_concurrency());
+        if ( memory > physicalMemory() )
+        {
+            std::cout << "The bootstrap of " << wavelets.size() << " wavelets in " << replicates << " replicates needs "
+                      << memory / (1 << 30) << " GB, more than this machine has. Use fewer replicates or wavelets." << std::endl;
+            return 16;
+        }
 
+        std::cout << "Drawing " << replicates << " bootstrap replicates, " << memory / (1 << 30) << " GB..." << std::endl;
+        bootstrap.prepare(integralSums.size(), wavelets.size(), replicates);
+    }
 
 
-    tbb::concurrent_vector<BandClassifierData> classifiers;
-    tbb::parallel_for( tbb::blocked_range< std::vector<HaarWavelet>::size_type >(0, wavelets.size()),
-                       Optimize(&wavelets, &integralSums, &classifiers));
+
+    std::vector<BandClassifierData> classifiers;
+    unpackClassifiers(wavelets, classifiers);
+    OptimizeWorkspaces workspaces;
+    if (numa)
+    {
+        NumaSamples numaSamples;
+        std::vector< std::vector<cv::Mat> * > sets;
+        sets.push_back(&integralSums);
+        if ( !numaSamples.replicate(sets) )
+        {
+            std::cout << "Can't replicate the samples." << std::endl;
+            return 12;
+        }
+        std::cout << "Samples replicated on " << numaSamples.nodes() << " NUMA nodes." << std::endl;
+
+        numaSamples.parallel_for(schedule, Optimize(&wavelets, &integralSums, &classifiers, statistics.empty() ? 0 : &statistics,
+                                                    table.isOpen() ? &table : 0, &workspaces,
+                                                    bootstrapFileName.empty() ? 0 : &bootstrap, tiled));
+    }
+    else
+    {
+        schedule.parallel_for( Optimize(&wavelets, &integralSums, &classifiers, statistics.empty() ? 0 : &statistics,
+                                        table.isOpen() ? &table : 0, &workspaces,
+                                        bootstrapFileName.empty() ? 0 : &bootstrap, tiled) );
+    }
 
     //sort the solutions using the variance. The smallest variance goes first
     tbb::parallel_sort(classifiers.begin(), classifiers.end());
@@ -238,8 +455,48 @@ int main(int argc, char* argv[])
     std::cout << "Done optimizing. Writing results to " <<  classifiersFileName << std::endl;
 
 
-    //write all haar wavelets sorted from best to worst
-    writeClassifiersData(outputStream, classifiers);
+    //write all haar wavelets sorted from best to worst, while the other files are written
+    ClassifierWriter<std::vector<BandClassifierData>::const_iterator> writer(outputStream, true);
+    writer.putAll(classifiers.begin(), classifiers.end());
+
+    if ( !matrixFileName.empty() )
+    {
+        std::cout << "Writing feature values to " << matrixFileName << std::endl;
+        if ( !writeFeatureMatrix(matrixFileName, classifiers, integralSums,
+                                 quantize ? FEATURE_MATRIX_INT16 : FEATURE_MATRIX_FLOAT32) )
+        {
+            std::cout << "Can't write feature matrix file." << std::endl;
+            return 15;
+        }
+    }
+
+    if ( !bootstrapFileName.empty() )
+    {
+        std::cout << "Writing confidence intervals to " << bootstrapFileName << std::endl;
+        bootstrap.rank();
+        if ( !bootstrap.write(bootstrapFileName) )
+        {
+            std::cout << "Can't write confidence intervals file." << std::endl;
+            return 14;
+        }
+    }
+
+    if ( !statistics.empty() )
+    {
+        const std::string stateFileName = saveStateFileName.empty() ? addSamplesFileName : saveStateFileName;
+        std::cout << "Writing statistics to " << stateFileName << std::endl;
+        if ( !writeWaveletStatistics(stateFileName, statistics, wavelets) )
+        {
+            std::cout << "Can't write statistics file." << std::endl;
+            return 10;
+        }
+    }
+
+    if ( !writer.wait() )
+    {
+        std::cout << "Can't write output file." << std::endl;
+        return 5;
+    }
 
     return 0;
 }
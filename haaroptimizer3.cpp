@@ -1,4 +1,5 @@
 #include <string>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -13,7 +14,17 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "optimization_commons.h"
-#include "mypca.h"
+#include "wavelet_parser.h"
+#include "wavelet_statistics.h"
+#include "wavelet_schedule.h"
+#include "optimizer_graph.h"
+#include "precision_verification.h"
+#include "numa_samples.h"
+#include "optimize_workspace.h"
+#include "symmetric_eigen.h"
+#include "batched_eigen.h"
+#include "covariance_table.h"
+#include "separability.h"
 
 #include "haarwavelet.h"
 #include "haarwaveletutilities.h"
@@ -62,25 +73,22 @@ public:
         positiveStdDev = c.positiveStdDev;
         negativeMean = c.negativeMean;
         negativeStdDev = c.negativeStdDev;
+        separability = c.separability;
 
         return *this;
     }
 
-    void setPositiveWeights(const std::vector<double> & projection_)
+    void setPositiveWeights(const double * const projection_)
     {
-        DualWeightHaarWavelet::weightsPositive.reserve(dimensions());
-
-        for(unsigned int i = 0; i < projection_.size(); ++i)
+        for(unsigned int i = 0; i < dimensions(); ++i)
         {
             DualWeightHaarWavelet::weightsPositive[i] = projection_[i];
         }
     }
 
-    void setNegativeWeights(const std::vector<double> & projection_)
+    void setNegativeWeights(const double * const projection_)
     {
-        DualWeightHaarWavelet::weightsNegative.reserve(dimensions());
-
-        for(unsigned int i = 0; i < projection_.size(); ++i)
+        for(unsigned int i = 0; i < dimensions(); ++i)
         {
             DualWeightHaarWavelet::weightsNegative[i] = projection_[i];
         }
@@ -106,6 +114,20 @@ public:
         negativeMean = mean_;
     }
 
+    /**
+     * Computes the separability of the positive and negative gaussians, once both are set.
+     */
+    void updateSeparability()
+    {
+        separability = gaussianSeparability(positiveMean, positiveStdDev * positiveStdDev,
+                                            negativeMean, negativeStdDev * negativeStdDev);
+    }
+
+    const Separability & getSeparability() const
+    {
+        return separability;
+    }
+
     bool operator < (const ProbabilisticClassifierData & rh) const
     {
         return positiveStdDev < rh.positiveStdDev;
@@ -123,6 +145,7 @@ public:
                << positiveStdDev << ' '
                << negativeMean << ' '
                << negativeStdDev;
+        separability.write(output);
 
         return true;
     }
@@ -133,6 +156,8 @@ private:
     double positiveStdDev;
     double negativeMean;
     double negativeStdDev;
+
+    Separability separability;
 };
 
 
@@ -143,141 +168,241 @@ private:
 class Optimize
 {
 private:
-    std::vector<HaarWavelet> * wavelets;
+    const PackedWaveletSet * wavelets;
     std::vector<cv::Mat> * positivesIntegralSums;
     std::vector<cv::Mat> * negativesIntegralSums;
-    tbb::concurrent_vector<ProbabilisticClassifierData> * classifiers;
+    std::vector<ProbabilisticClassifierData> * classifiers; //one per wavelet, allocated before the sweep
+    std::vector<WaveletStatistics> * statistics;            //null when the statistics are not kept
+    const CovarianceTable * positivesTable;                 //null when the SRFS are evaluated on every sample
+    const CovarianceTable * negativesTable;
+    OptimizeWorkspaces * workspaces;
+    bool tiled;                                             //evaluate each batch on a tile of samples at a time
+
+    /**
+     * Wavelets of a batch evaluated on a sample set together, a tile of samples at a time.
+     */
+    struct Tile
+    {
+        SrfsMoments * moments[EIGEN_BATCH];
+        const AbstractHaarWavelet * wavelets[EIGEN_BATCH];
+        int count;
+
+        Tile() : count(0) {}
+    };
+
+    /**
+     * Merges the statistics of the SRFS of the wavelet over a sample set into moments,
+     * looking them up in the covariance table of the set when there is one. In tiled mode
+     * the wavelet is added to the tile instead, to be evaluated with the rest of its batch.
+     */
+    void addSamples(SrfsMoments & moments,
+                    const CovarianceTable * table,
+                    const ProbabilisticClassifierData & classifier,
+                    const std::vector<cv::Mat> & integralSums,
+                    Tile & tile) const
+    {
+        SrfsMoments tableMoments;
+        if ( table && table->moments(classifier, tableMoments) )
+        {
+            moments.merge(tableMoments);
+        }
+        else if (tiled)
+        {
+            tile.moments[tile.count] = &moments;
+            tile.wavelets[tile.count++] = &classifier;
+        }
+        else
+        {
+            accumulateSrfs(moments, &classifier, integralSums);
+        }
+    }
 
-    void getOptimalsForPositiveSamples(mypca & pca, ProbabilisticClassifierData & c) const
+    void getOptimalsForPositiveSamples(const SymmetricEigen & eigen, const SrfsMoments & moments, ProbabilisticClassifierData & c) const
     {
         //The highest variance eigenvector is the first one.
-        c.setPositiveWeights(pca.get_eigenvector(0));
+        c.setPositiveWeights(eigen.vectors[0]);
 
         {
             //This block sets the mean. It is acquired from the projection of the
             //mean values of the PCA in the direction of the eigenvector (weights).
-            std::vector<double> meanSrfs = pca.get_mean_values();
             const double mean = std::inner_product(c.weightsPositive_begin(),
                                                    c.weightsPositive_end(),
-                                                   meanSrfs.begin(), .0);
+                                                   moments.mean, .0);
             c.setPositiveMean( mean );
         }
 
         {
             //This block sets the standard deviation. It is acquired from the projection
             //of the covariance matrix in the directin of the eigenvector (weights).
-            std::vector<double> temp(c.dimensions());
-            for (unsigned int i = 0; i < c.dimensions(); ++i)
-            {
-                std::vector<double> column = stats::utils::extract_column_vector(pca.cov_mat_, i);
-                temp[i] = std::inner_product(c.weightsPositive_begin(),
-                                             c.weightsPositive_end(),
-                                             column.begin(), .0);
-            }
-            const double stdDev = std::sqrt( std::inner_product(c.weightsPositive_begin(),
-                                                                c.weightsPositive_end(),
-                                                                temp.begin(), .0) );
+            const double stdDev = std::sqrt( eigen.projectedVariance(c.weightsPositive_begin()) );
             c.setPositiveStdDev(stdDev);
         }
     }
 
 
 
-    void getOptimalsForNegativeSamples(mypca & pca, ProbabilisticClassifierData & c) const
+    void getOptimalsForNegativeSamples(const SymmetricEigen & eigen, const SrfsMoments & moments, ProbabilisticClassifierData & c) const
     {
         //The highest variance eigenvector is the first one.
-        c.setNegativeWeights(pca.get_eigenvector(0));
+        c.setNegativeWeights(eigen.vectors[0]);
 
         {
             //This block sets the mean. It is acquired from the projection of the
             //mean values of the PCA in the direction of the eigenvector (weights).
-            std::vector<double> meanSrfs = pca.get_mean_values();
             const double mean = std::inner_product(c.weightsPositive_begin(),
                                                    c.weightsPositive_end(),
-                                                   meanSrfs.begin(), .0);
+                                                   moments.mean, .0);
             c.setNegativeMean( mean );
         }
 
         {
             //This block sets the standard deviation. It is acquired from the projection
             //of the covariance matrix in the directin of the eigenvector (weights).
-            std::vector<double> temp(c.dimensions());
-            for (unsigned int i = 0; i < c.dimensions(); ++i)
-            {
-                std::vector<double> column = stats::utils::extract_column_vector(pca.cov_mat_, i);
-                temp[i] = std::inner_product(c.weightsPositive_begin(),
-                                             c.weightsPositive_end(),
-                                             column.begin(), .0);
-            }
-            const double stdDev = std::sqrt( std::inner_product(c.weightsPositive_begin(),
-                                                                c.weightsPositive_end(),
-                                                                temp.begin(), .0) );
+            const double stdDev = std::sqrt( eigen.projectedVariance(c.weightsPositive_begin()) );
             c.setNegativeStdDev(stdDev);
         }
     }
 
 
 
+    /**
+     * End of the batch that starts at begin: up to EIGEN_BATCH wavelets of the same dimensions.
+     */
+    size_t batchEnd(const size_t begin, const size_t end) const
+    {
+        size_t i = begin + 1;
+        while ( i != end && i - begin < EIGEN_BATCH && (*wavelets)[i].dimensions == (*wavelets)[begin].dimensions )
+        {
+            ++i;
+        }
+        return i;
+    }
+
 public:
-    void operator()(const tbb::blocked_range<std::vector<HaarWavelet>::size_type> range) const
+    void operator()(const tbb::blocked_range<size_t> range) const
     {
-        for(std::vector<HaarWavelet>::size_type i = range.begin(); i != range.end(); ++i)
+        OptimizeWorkspace & workspace = workspaces->local();
+
+        size_t begin = range.begin();
+        while (begin != range.end())
         {
-            ProbabilisticClassifierData classifier( (*wavelets)[i] );
+            const size_t end = batchEnd(begin, range.end());
 
+            //Gather the statistics of a batch of wavelets of the same dimensions
+            const SrfsMoments * positiveMoments[EIGEN_BATCH];
+            const SrfsMoments * negativeMoments[EIGEN_BATCH];
+            Tile positiveTile, negativeTile;
+            for(size_t i = begin; i != end; ++i)
             {
-                mypca positive_samples_pca;
-                produceSrfs(positive_samples_pca, &classifier, *positivesIntegralSums);
-                positive_samples_pca.solve();
-                getOptimalsForPositiveSamples(positive_samples_pca, classifier);
+                ProbabilisticClassifierData & classifier = (*classifiers)[i];
+
+                WaveletStatistics & s = statistics ? (*statistics)[i] : workspace.clearStatistics(i - begin);
+                addSamples(s.positive, positivesTable, classifier, *positivesIntegralSums, positiveTile);
+                addSamples(s.negative, negativesTable, classifier, *negativesIntegralSums, negativeTile);
+                positiveMoments[i - begin] = &s.positive;
+                negativeMoments[i - begin] = &s.negative;
             }
+            accumulateSrfsTiled(positiveTile.moments, positiveTile.wavelets, positiveTile.count, *positivesIntegralSums);
+            accumulateSrfsTiled(negativeTile.moments, negativeTile.wavelets, negativeTile.count, *negativesIntegralSums);
+
+            //and decompose their covariances together
+            SymmetricEigen positiveEigens[EIGEN_BATCH], negativeEigens[EIGEN_BATCH];
+            solveSymmetricEigens(positiveMoments, end - begin, positiveEigens);
+            solveSymmetricEigens(negativeMoments, end - begin, negativeEigens);
 
+            for(size_t i = begin; i != end; ++i)
             {
-                mypca negative_samples_pca;
-                produceSrfs(negative_samples_pca, &classifier, *negativesIntegralSums);
-                negative_samples_pca.solve();
-                getOptimalsForNegativeSamples(negative_samples_pca, classifier);
+                getOptimalsForPositiveSamples(positiveEigens[i - begin], *positiveMoments[i - begin], (*classifiers)[i]);
+                getOptimalsForNegativeSamples(negativeEigens[i - begin], *negativeMoments[i - begin], (*classifiers)[i]);
+                (*classifiers)[i].updateSeparability();
             }
 
-            classifiers->push_back(classifier);
+            begin = end;
         }
     }
 
-    Optimize(std::vector<HaarWavelet> * wavelets_,
+    /**
+     * Same functor, reading the samples from a replica of them.
+     */
+    Optimize onReplica(SampleReplica & replica) const
+    {
+        Optimize o(*this);
+        o.positivesIntegralSums = replica.set(0);
+        o.negativesIntegralSums = replica.set(1);
+        return o;
+    }
+
+    Optimize(const PackedWaveletSet * wavelets_,
              std::vector<cv::Mat> * positivesIntegralSums_,
              std::vector<cv::Mat> * negativesIntegralSums_,
-             tbb::concurrent_vector<ProbabilisticClassifierData> * classifiers_) : wavelets(wavelets_),
-                                                                                   positivesIntegralSums(positivesIntegralSums_),
-                                                                                   negativesIntegralSums(negativesIntegralSums_),
-                                                                                   classifiers(classifiers_) {}
+             std::vector<ProbabilisticClassifierData> * classifiers_,
+             std::vector<WaveletStatistics> * statistics_,
+             const CovarianceTable * positivesTable_,
+             const CovarianceTable * negativesTable_,
+             OptimizeWorkspaces * workspaces_,
+             const bool tiled_) : wavelets(wavelets_),
+                                  positivesIntegralSums(positivesIntegralSums_),
+                                  negativesIntegralSums(negativesIntegralSums_),
+                                  classifiers(classifiers_),
+                                  statistics(statistics_),
+                                  positivesTable(positivesTable_),
+                                  negativesTable(negativesTable_),
+                                  workspaces(workspaces_),
+                                  tiled(tiled_) {}
 };
 
 
 
-void writeClassifiersData(std::ofstream & outputStream, tbb::concurrent_vector<ProbabilisticClassifierData> & classifiers)
-{
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator it = classifiers.begin();
-    tbb::concurrent_vector<ProbabilisticClassifierData>::const_iterator end = classifiers.end();
-    for(; it != end; ++it)
-    {
-        it->write(outputStream);
-        outputStream << '\n';
-    }
-}
-
-
-
 /**
  * Loads the Haar wavelets from a file and the image samples found in a directory, then produce
  * the SRFS for each Haar wavelet. Extract the principal component of least variance and use it
  * as the new weights of the respective Haar wavelet. When all is done, write the 'optimized'
  * Haar wavelets to a file.
+ *
+ * The wavelets and the samples are loaded at the same time, see LoadingGraph, and the
+ * classifiers are formatted in parallel while the other output files are written.
+ *
+ * With --save-state the statistics of each wavelet are also written to a file. With
+ * --add-samples the samples are only the new ones (or - if there are none of a class):
+ * they are merged into the statistics found in the given file, which is then updated.
+ *
+ * With --covariance-tables the covariances of each wavelet are looked up in tables of all
+ * same-size rectangle pairs, kept in PREFIX.positives.cov and PREFIX.negatives.cov and
+ * built on the first run.
+ *
+ * With --single-precision the samples and their SRFS are kept in float. With --verify N
+ * the statistics of N random wavelets are also computed in double precision and the
+ * largest deviations from the single precision ones are reported, along with the largest
+ * difference between their SRFS and those of the haarcommon evaluator.
+ *
+ * With --numa the samples are replicated on every NUMA node, in huge pages when possible,
+ * and the workers of each node only read their node's replica.
+ *
+ * Each record ends with the Bhattacharyya distance, the Kullback-Leibler divergence and the
+ * Fisher ratio of its positive and negative gaussians. With --sort-by bhattacharyya,
+ * kullback-leibler or fisher the classifiers go from the most to the least separable instead
+ * of by positive standard deviation, and with --top K only the first K are written.
+ *
+ * With --tiled each batch of wavelets is evaluated on a tile of samples that fits in L2 before
+ * moving on to the next tile, so each set of samples is read from memory once per batch
+ * instead of once per wavelet. The statistics are the same.
  */
 int main(int argc, char* argv[])
 {
-    if (argc != 6)
+    const std::string addSamplesFileName = takeOption(argc, argv, "--add-samples"); //merge into these statistics
+    const std::string saveStateFileName = takeOption(argc, argv, "--save-state");   //write statistics here
+    const std::string verifyCount = takeOption(argc, argv, "--verify");              //wavelets to check in double
+    const bool singlePrecision = takeFlag(argc, argv, "--single-precision");
+    const bool numa = takeFlag(argc, argv, "--numa");
+    const std::string tablesPrefix = takeOption(argc, argv, "--covariance-tables");  //covariance tables go here
+    const std::string sortKeyName = takeOption(argc, argv, "--sort-by");             //order of the output
+    const std::string topCount = takeOption(argc, argv, "--top");                    //write only the best ones
+    const bool tiled = takeFlag(argc, argv, "--tiled");
+
+    SortKey sortKey;
+    if ( argc != 6 || !parseSortKey(sortKeyName, sortKey) )
     {
-        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX OUTPUT_DIR" << std::endl;
+        std::cout << "Usage " << argv[0] << " " << " WAVELETS_FILE POSITIVE_SAMPLES_FILE NEGATIVE_SAMPLES_FILE NEGATIVE_SAMPLES_INDEX OUTPUT_DIR [--save-state STATE_FILE] [--add-samples STATE_FILE] [--covariance-tables PREFIX] [--single-precision] [--verify N] [--numa] [--sort-by stddev|bhattacharyya|kullback-leibler|fisher] [--top K] [--tiled]" << std::endl;
         return 1;
     }
 
@@ -289,68 +414,183 @@ int main(int argc, char* argv[])
 
 
 
-    std::vector<HaarWavelet> wavelets;
+    PackedWaveletSet wavelets;
     std::vector<cv::Mat> positivesIntegralSums, negativesIntegralSums;
+    std::vector<WaveletStatistics> statistics;
+    CovarianceTable positivesTable, negativesTable;
     std::ofstream outputStream;
 
 
     {
-        //Load a list of Haar wavelets
-        std::cout << "Loading wavelets..." << std::endl;
-        if (!loadHaarWavelets(waveletsFileName, wavelets))
+        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
+        if ( !outputStream.is_open() )
+        {
+            std::cout << "Can't open output file." << std::endl;
+            return 5;
+        }
+
+        //Load the Haar wavelets and the samples given at the same time
+        std::cout << "Loading wavelets and samples..." << std::endl;
+        const bool positivesGiven = addSamplesFileName.empty() || positiveSamplesImage != NO_SAMPLES;
+        const bool negativesGiven = addSamplesFileName.empty() || negativeSamplesImage != NO_SAMPLES;
+        bool waveletsLoaded, positivesLoaded = true, negativesLoaded = true;
+        LoadingGraph loading;
+        loading.loadWavelets(waveletsFileName, wavelets, waveletsLoaded);
+        //TODO The index parameters here do not match what is expected for the rest of the program!
+        if (positivesGiven)
+        {
+            loading.loadSamples(positiveSamplesImage, "", positivesIntegralSums, singlePrecision, positivesLoaded);
+        }
+        if (negativesGiven)
+        {
+            loading.loadSamples(negativeSamplesImage, negativeSamplesIndex, negativesIntegralSums, singlePrecision, negativesLoaded);
+        }
+        loading.run();
+
+        if (!waveletsLoaded)
         {
             std::cout << "Unable to load Haar wavelets from file " << waveletsFileName << std::endl;
             return 2;
         }
         std::cout << wavelets.size() << " wavelets loaded." << std::endl;
 
-        outputStream.open(classifiersFileName.c_str(), std::ios::trunc);
-        if ( !outputStream.is_open() )
+        if ( !addSamplesFileName.empty() )
         {
-            std::cout << "Can't open output file." << std::endl;
-            return 5;
+            if ( !loadWaveletStatistics(addSamplesFileName, statistics) || !matchWavelets(statistics, wavelets) )
+            {
+                std::cout << "Unable to load statistics of these wavelets from file " << addSamplesFileName << std::endl;
+                return 9;
+            }
+            std::cout << "Statistics loaded. Samples will be added to them." << std::endl;
+        }
+        else if ( !saveStateFileName.empty() )
+        {
+            statistics.resize(wavelets.size());
         }
 
-        //TODO The second parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(positiveSamplesImage, positivesIntegralSums) )
+        if (!positivesLoaded)
         {
             std::cout << "Failed to load positive samples." << std::endl;
             return 6;
         }
-        std::transform(positivesIntegralSums.begin(), positivesIntegralSums.end(),
-                       positivesIntegralSums.begin(),
-                       ToIntegralSums());
         std::cout << positivesIntegralSums.size() << " positive samples loaded." << std::endl;
 
-        //TODO The third parameter here does not match what is expected for the rest of the program!
-        if ( !SampleExtractor::extractFromBigImage(negativeSamplesImage, negativeSamplesIndex, negativesIntegralSums) )
+        if ( positivesGiven && !isSupportedWindowSize(sampleSize(positivesIntegralSums)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(positivesIntegralSums) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
+
+        if (!negativesLoaded)
         {
             std::cout << "Failed to load negative samples." << std::endl;
             return 7;
         }
-        std::transform(negativesIntegralSums.begin(), negativesIntegralSums.end(),
-                       negativesIntegralSums.begin(),
-                       ToIntegralSums());
         std::cout << negativesIntegralSums.size() << " negative samples loaded." << std::endl;
+
+        if ( negativesGiven && positivesGiven && sampleSize(negativesIntegralSums) != sampleSize(positivesIntegralSums) )
+        {
+            std::cout << "Negative samples are " << sampleSize(negativesIntegralSums) << " pixels wide, positive samples " << sampleSize(positivesIntegralSums) << ". Use samples of the same size." << std::endl;
+            return 8;
+        }
+
+        if ( negativesGiven && !positivesGiven && !isSupportedWindowSize(sampleSize(negativesIntegralSums)) )
+        {
+            std::cout << "Unsupported sample size " << sampleSize(negativesIntegralSums) << ". Use " << SUPPORTED_WINDOW_SIZES << " pixels wide samples." << std::endl;
+            return 8;
+        }
+
+        if ( !tablesPrefix.empty() )
+        {
+            std::cout << "Preparing covariance tables..." << std::endl;
+            if (   (positivesGiven && !prepareCovarianceTable(positivesTable, tablesPrefix + ".positives.cov", positivesIntegralSums))
+                || (negativesGiven && !prepareCovarianceTable(negativesTable, tablesPrefix + ".negatives.cov", negativesIntegralSums)) )
+            {
+                std::cout << "Can't build covariance tables " << tablesPrefix << ".*.cov" << std::endl;
+                return 11;
+            }
+        }
+    }
+
+
+
+    if ( !verifyCount.empty() )
+    {
+        std::cout << "Verifying single precision..." << std::endl;
+        printPrecisionDeviation(std::cout, "positive samples", verifySinglePrecision(wavelets, positivesIntegralSums, std::atoi(verifyCount.c_str())));
+        printLibraryDeviation(std::cout, "positive samples", verifyLibraryParity(wavelets, positivesIntegralSums, std::atoi(verifyCount.c_str())));
+        printPrecisionDeviation(std::cout, "negative samples", verifySinglePrecision(wavelets, negativesIntegralSums, std::atoi(verifyCount.c_str())));
+        printLibraryDeviation(std::cout, "negative samples", verifyLibraryParity(wavelets, negativesIntegralSums, std::atoi(verifyCount.c_str())));
     }
 
 
 
-    std::cout << "Optimizing Haar-like features..." << std::endl;
+    WaveletSchedule schedule(wavelets, positivesIntegralSums.size() + negativesIntegralSums.size(),
+                               (positivesTable.isOpen() ? positivesIntegralSums.size() : 0)
+                             + (negativesTable.isOpen() ? negativesIntegralSums.size() : 0));
+    if ( !schedule.grouped() )
+    {
+        std::cout << "The wavelets are not grouped by dimensions and rectangle sizes, as haargen writes them: they are scheduled in plain chunks." << std::endl;
+    }
+    std::cout << "Optimizing Haar-like features in " << schedule.buckets() << " buckets..." << std::endl;
+
+    std::vector<ProbabilisticClassifierData> classifiers;
+    unpackClassifiers(wavelets, classifiers);
+    OptimizeWorkspaces workspaces;
+    if (numa)
+    {
+        NumaSamples numaSamples;
+        std::vector< std::vector<cv::Mat> * > sets;
+        sets.push_back(&positivesIntegralSums);
+        sets.push_back(&negativesIntegralSums);
+        if ( !numaSamples.replicate(sets) )
+        {
+            std::cout << "Can't replicate the samples." << std::endl;
+            return 12;
+        }
+        std::cout << "Samples replicated on " << numaSamples.nodes() << " NUMA nodes." << std::endl;
 
-    tbb::concurrent_vector<ProbabilisticClassifierData> classifiers;
-    tbb::parallel_for( tbb::blocked_range< std::vector<HaarWavelet>::size_type >(0, wavelets.size()),
-                       Optimize(&wavelets, &positivesIntegralSums, &negativesIntegralSums, &classifiers));
+        numaSamples.parallel_for(schedule, Optimize(&wavelets, &positivesIntegralSums, &negativesIntegralSums, &classifiers,
+                                                    statistics.empty() ? 0 : &statistics,
+                                                    positivesTable.isOpen() ? &positivesTable : 0,
+                                                    negativesTable.isOpen() ? &negativesTable : 0, &workspaces, tiled));
+    }
+    else
+    {
+        schedule.parallel_for( Optimize(&wavelets, &positivesIntegralSums, &negativesIntegralSums, &classifiers,
+                                        statistics.empty() ? 0 : &statistics,
+                                        positivesTable.isOpen() ? &positivesTable : 0,
+                                        negativesTable.isOpen() ? &negativesTable : 0, &workspaces, tiled) );
+    }
 //    Optimize opt(&wavelets, &positivesIntegralSums, &negativesIntegralSums, &classifiers);
 //    opt(tbb::blocked_range< std::vector<HaarWavelet>::size_type >(0, wavelets.size()));
 
-    //sort the solutions using the variance. The smallest variance goes first
-    tbb::parallel_sort(classifiers.begin(), classifiers.end());
+    //sort the solutions using the variance, the smallest first, or the separability, the largest first
+    sortClassifiers(classifiers.begin(), classifiers.end(), sortKey);
 
     std::cout << "Done optimizing. Writing results to " <<  classifiersFileName << std::endl;
 
-    //write all haar wavelets sorted from best to worst
-    writeClassifiersData(outputStream, classifiers);
+    //write the haar wavelets sorted from best to worst, while the statistics are written
+    const size_t count = topCount.empty() ? classifiers.size() : std::min<size_t>(std::atol(topCount.c_str()), classifiers.size());
+    ClassifierWriter<std::vector<ProbabilisticClassifierData>::const_iterator> writer(outputStream, true);
+    writer.putAll(classifiers.begin(), classifiers.begin() + count);
+
+    if ( !statistics.empty() )
+    {
+        const std::string stateFileName = saveStateFileName.empty() ? addSamplesFileName : saveStateFileName;
+        std::cout << "Writing statistics to " << stateFileName << std::endl;
+        if ( !writeWaveletStatistics(stateFileName, statistics, wavelets) )
+        {
+            std::cout << "Can't write statistics file." << std::endl;
+            return 10;
+        }
+    }
+
+    if ( !writer.wait() )
+    {
+        std::cout << "Can't write output file." << std::endl;
+        return 5;
+    }
 
     return 0;
 }
@@ -1,4 +1,5 @@
 #include "mypca.h"
+#include <cmath>
 
 void mypca::solve() {
     assert_num_vars_();
@@ -14,10 +15,38 @@ void mypca::solve() {
     sigma_ = stats::utils::compute_column_rms(data_);
     if (do_normalize_) stats::utils::normalize_by_column(data_, sigma_);
 
+    cov_mat_ = stats::utils::make_covariance_matrix(data_);
+    solve_covariance_();
+
+    princomp_ = data_ * eigvec_;
+
+    if (do_bootstrap_) bootstrap_eigenvalues_();
+}
+
+void mypca::solve(const SrfsMoments & moments) {
+    set_num_variables(moments.dimensions);
+
+    if (moments.count < 2)
+        throw std::logic_error("Number of records smaller than two.");
+
+    num_records_ = moments.count;
+
+    cov_mat_.set_size(num_vars_, num_vars_);
+    for (long i=0; i<num_vars_; ++i) {
+        mean_(i) = moments.mean[i];
+        sigma_(i) = std::sqrt(moments.comoment[i][i] / moments.count);
+        for (long j=0; j<num_vars_; ++j) {
+            cov_mat_(i, j) = moments.covariance(i, j);
+        }
+    }
+
+    solve_covariance_();
+}
+
+void mypca::solve_covariance_() {
     arma::Col<double> eigval(num_vars_);
     arma::Mat<double> eigvec(num_vars_, num_vars_);
 
-    cov_mat_ = stats::utils::make_covariance_matrix(data_);
     arma::eig_sym(eigval, eigvec, cov_mat_, solver_.c_str());
     arma::uvec indices = arma::sort_index(eigval, 1);
 
@@ -29,10 +58,6 @@ void mypca::solve() {
     stats::utils::enforce_positive_sign_by_column(eigvec_);
     proj_eigvec_ = eigvec_;
 
-    princomp_ = data_ * eigvec_;
-
     energy_(0) = arma::sum(eigval_);
     eigval_ *= 1./energy_(0);
-
-    if (do_bootstrap_) bootstrap_eigenvalues_();
 }
@@ -4,6 +4,8 @@
 #include "pca.h"
 #include <armadillo>
 
+#include "srfs_moments.h"
+
 
 
 /**
@@ -15,6 +17,15 @@ class mypca : public stats::pca //99% copy and paste
 public:
     arma::Mat<double> cov_mat_;
     void solve();
+
+    /**
+     * Solves the PCA from the statistics of a sample set instead of from stored records.
+     * Records, principal components, normalization and bootstrap are not available then.
+     */
+    void solve(const SrfsMoments & moments);
+
+private:
+    void solve_covariance_();
 };
 
 
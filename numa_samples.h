@@ -0,0 +1,302 @@
+#ifndef NUMA_SAMPLES_H
+#define NUMA_SAMPLES_H
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include <opencv2/core/core.hpp>
+
+#include <tbb/tbb.h>
+
+#include "wavelet_schedule.h"
+
+
+
+#define HUGE_PAGE_SIZE (2 << 20) //replica buffers are rounded up to this size
+
+
+
+//oneTBB can pin arenas to NUMA nodes. Older TBB releases get a single replica.
+#if defined(TBB_VERSION_MAJOR) && TBB_VERSION_MAJOR >= 2021
+#define NUMA_ARENAS 1
+#endif
+
+
+
+/**
+ * Copy of some sample sets in one contiguous buffer, backed by huge pages when the system
+ * has them. The cv::Mat of each set point into the buffer, so they can be handed to the
+ * Optimize functors in place of the originals.
+ */
+class SampleReplica
+{
+public:
+    SampleReplica() : buffer(0),
+                      length(0) {}
+
+    ~SampleReplica()
+    {
+        if (buffer)
+        {
+            munmap(buffer, length);
+        }
+    }
+
+    /**
+     * Copies the sets. Pages are first touched by the threads that do the copy, so when
+     * they run on one NUMA node the replica is allocated there.
+     */
+    bool copy(const std::vector< std::vector<cv::Mat> * > & originals)
+    {
+        length = 0;
+        for (unsigned int s = 0; s < originals.size(); ++s)
+        {
+            for (unsigned int i = 0; i < originals[s]->size(); ++i)
+            {
+                length += alignedSize( (*originals[s])[i] );
+            }
+        }
+        length = std::max<size_t>(HUGE_PAGE_SIZE, (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+
+        buffer = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buffer == MAP_FAILED) //no explicit huge pages reserved, ask for transparent ones
+        {
+            buffer = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (buffer == MAP_FAILED)
+            {
+                buffer = 0;
+                return false;
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(buffer, length, MADV_HUGEPAGE);
+#endif
+        }
+
+        sets.resize(originals.size());
+        unsigned char * next = (unsigned char *)buffer;
+        for (unsigned int s = 0; s < originals.size(); ++s)
+        {
+            const std::vector<cv::Mat> & original = *originals[s];
+            sets[s].resize(original.size());
+            for (unsigned int i = 0; i < original.size(); ++i)
+            {
+                sets[s][i] = cv::Mat(original[i].rows, original[i].cols, original[i].type(), next);
+                next += alignedSize(original[i]);
+            }
+
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, original.size()), CopySamples(&original, &sets[s]));
+        }
+
+        return true;
+    }
+
+    std::vector<cv::Mat> * set(const int s)
+    {
+        return &sets[s];
+    }
+
+private:
+    void * buffer;
+    size_t length;
+    std::vector< std::vector<cv::Mat> > sets;
+
+    //Not copyable: it owns the buffer
+    SampleReplica(const SampleReplica &);
+    SampleReplica & operator=(const SampleReplica &);
+
+    static size_t alignedSize(const cv::Mat & sample)
+    {
+        return (sample.total() * sample.elemSize() + 63) / 64 * 64;
+    }
+
+    class CopySamples
+    {
+        const std::vector<cv::Mat> * from;
+        std::vector<cv::Mat> * to;
+
+    public:
+        void operator()(const tbb::blocked_range<size_t> range) const
+        {
+            for (size_t i = range.begin(); i != range.end(); ++i)
+            {
+                std::memcpy((*to)[i].data, (*from)[i].data, (*from)[i].total() * (*from)[i].elemSize());
+            }
+        }
+
+        CopySamples(const std::vector<cv::Mat> * from_,
+                    std::vector<cv::Mat> * to_) : from(from_),
+                                                  to(to_) {}
+    };
+};
+
+
+
+/**
+ * One replica of the sample sets per NUMA node and one task arena pinned to each node.
+ * The chunks of a wavelet schedule are taken by the workers of all nodes from a single
+ * counter, and the workers of a node only read the replica that lives in their node's
+ * memory.
+ *
+ * Without oneTBB, or on a single node machine, there is a single replica and a single
+ * arena, which still gets the samples into huge pages.
+ */
+class NumaSamples
+{
+public:
+    NumaSamples()
+    {
+#ifdef NUMA_ARENAS
+        const std::vector<tbb::numa_node_id> nodes = tbb::info::numa_nodes();
+        for (unsigned int i = 0; i < nodes.size(); ++i)
+        {
+            arenas.push_back( new tbb::task_arena(tbb::task_arena::constraints(nodes[i])) );
+        }
+#endif
+        if ( arenas.empty() )
+        {
+            arenas.push_back( new tbb::task_arena() );
+        }
+    }
+
+    ~NumaSamples()
+    {
+        for (unsigned int i = 0; i < replicas.size(); ++i)
+        {
+            delete replicas[i];
+        }
+        for (unsigned int i = 0; i < arenas.size(); ++i)
+        {
+            delete arenas[i];
+        }
+    }
+
+    int nodes() const
+    {
+        return arenas.size();
+    }
+
+    /**
+     * Copies the sample sets to every node, from inside the node's arena.
+     */
+    bool replicate(const std::vector< std::vector<cv::Mat> * > & originals)
+    {
+        bool replicated = true;
+        replicas.resize(arenas.size(), 0);
+        for (unsigned int i = 0; i < arenas.size(); ++i)
+        {
+            replicas[i] = new SampleReplica();
+            arenas[i]->execute( Replicate(replicas[i], &originals, &replicated) );
+        }
+        return replicated;
+    }
+
+    /**
+     * Runs body over the chunks of the schedule. The body given to the workers of a node
+     * is body.onReplica(replica of the node).
+     */
+    template <typename Body>
+    void parallel_for(const WaveletSchedule & schedule, const Body & body)
+    {
+        std::atomic<size_t> next(0);
+
+        std::vector<tbb::task_group> groups(arenas.size());
+        for (unsigned int i = 0; i < arenas.size(); ++i)
+        {
+            arenas[i]->execute( Start< NodeWork<Body> >(&groups[i], NodeWork<Body>(&schedule, body.onReplica(*replicas[i]), &next)) );
+        }
+        for (unsigned int i = 0; i < arenas.size(); ++i)
+        {
+            arenas[i]->execute( Wait(&groups[i]) );
+        }
+    }
+
+private:
+    std::vector<tbb::task_arena *> arenas;
+    std::vector<SampleReplica *> replicas;
+
+    NumaSamples(const NumaSamples &);
+    NumaSamples & operator=(const NumaSamples &);
+
+    class Replicate
+    {
+        SampleReplica * replica;
+        const std::vector< std::vector<cv::Mat> * > * originals;
+        bool * replicated;
+
+    public:
+        void operator()() const
+        {
+            if ( !replica->copy(*originals) )
+            {
+                *replicated = false;
+            }
+        }
+
+        Replicate(SampleReplica * replica_,
+                  const std::vector< std::vector<cv::Mat> * > * originals_,
+                  bool * replicated_) : replica(replica_),
+                                        originals(originals_),
+                                        replicated(replicated_) {}
+    };
+
+    /**
+     * Takes chunks of the schedule until there are none left and optimizes them with the
+     * workers of one node.
+     */
+    template <typename Body>
+    class NodeWork
+    {
+        const WaveletSchedule * schedule;
+        Body body;
+        std::atomic<size_t> * next;
+
+    public:
+        void operator()() const
+        {
+            schedule->run(body, *next);
+        }
+
+        NodeWork(const WaveletSchedule * schedule_,
+                 const Body & body_,
+                 std::atomic<size_t> * next_) : schedule(schedule_),
+                                                body(body_),
+                                                next(next_) {}
+    };
+
+    template <typename Work>
+    class Start
+    {
+        tbb::task_group * group;
+        Work work;
+
+    public:
+        void operator()() const
+        {
+            group->run(work);
+        }
+
+        Start(tbb::task_group * group_, const Work & work_) : group(group_),
+                                                              work(work_) {}
+    };
+
+    class Wait
+    {
+        tbb::task_group * group;
+
+    public:
+        void operator()() const
+        {
+            group->wait();
+        }
+
+        Wait(tbb::task_group * group_) : group(group_) {}
+    };
+};
+
+
+
+#endif // NUMA_SAMPLES_H
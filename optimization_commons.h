@@ -5,6 +5,13 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <stdexcept>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+
+#include <unistd.h>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
@@ -14,40 +21,240 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "mypca.h"
+#include "detector_window.h"
+#include "wavelet_kernels.h"
+#include "srfs_moments.h"
 
 #include "haarwavelet.h"
 #include "haarwaveletevaluators.h"
 
 
 
+/**
+ * Physical memory of the machine, in bytes.
+ */
+inline double physicalMemory()
+{
+    return (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+}
+
+
+
+/**
+ * Evaluates the SRFS of a probe wavelet on a sample with IntensityNormalizedWaveletEvaluator.
+ */
+struct IntensityProbe
+{
+    const cv::Mat & iSum;
+
+    IntensityProbe(const cv::Mat & iSum_) : iSum(iSum_) {}
+
+    inline void operator()(const HaarWavelet & probe, std::vector<double> & srfs) const
+    {
+        IntensityNormalizedWaveletEvaluator().srfs(probe, iSum, srfs);
+    }
+};
+
+
+
+/**
+ * Evaluates the SRFS of a probe wavelet on a sample with VarianceNormalizedWaveletEvaluator.
+ */
+struct VarianceProbe
+{
+    const cv::Mat & iSum;
+    const cv::Mat & iSquare;
+
+    VarianceProbe(const cv::Mat & iSum_, const cv::Mat & iSquare_) : iSum(iSum_),
+                                                                     iSquare(iSquare_) {}
+
+    inline void operator()(const HaarWavelet & probe, std::vector<double> & srfs) const
+    {
+        VarianceNormalizedWaveletEvaluator().srfs(probe, iSum, iSquare, srfs);
+    }
+};
+
+
+
+/**
+ * Finds the offset and the scale such that (mean of a rectangle - offset) * scale is the
+ * SRFS value the evaluator of the probe gives for that rectangle of the sample.
+ *
+ * The normalizations of haarcommon are affine in the means of the rectangles, so they are
+ * found from the values of two rectangles of different means: the whole sample and the
+ * quarter whose mean is the furthest from it. When every quarter has the mean of the sample
+ * (a flat sample), every rectangle gets the value of the whole sample and only the offset
+ * matters.
+ */
+template <typename Probe>
+void calibrateNormalization(const cv::Mat & iSum, const Probe & evaluate, double & offset, double & scale)
+{
+    const int rows = iSum.rows - 1, cols = iSum.cols - 1;
+
+    std::vector<cv::Rect> rects;
+    rects.push_back( cv::Rect(0, 0, cols, rows) );
+    rects.push_back( cv::Rect(0, 0, cols / 2, rows / 2) );
+    rects.push_back( cv::Rect(cols / 2, 0, cols - cols / 2, rows / 2) );
+    rects.push_back( cv::Rect(0, rows / 2, cols / 2, rows - rows / 2) );
+    rects.push_back( cv::Rect(cols / 2, rows / 2, cols - cols / 2, rows - rows / 2) );
+    const HaarWavelet probe( rects, std::vector<float>(rects.size(), 1.0f) );
+
+    std::vector<double> srfs( rects.size() );
+    evaluate(probe, srfs);
+
+    std::vector<double> means( rects.size() );
+    for (unsigned int i = 0; i < rects.size(); ++i)
+    {
+        const cv::Rect & r = rects[i];
+        means[i] = ( iSum.at<double>(r.y + r.height, r.x + r.width) - iSum.at<double>(r.y, r.x + r.width)
+                   - iSum.at<double>(r.y + r.height, r.x) + iSum.at<double>(r.y, r.x) ) / r.area();
+    }
+
+    int furthest = 1;
+    for (unsigned int i = 2; i < rects.size(); ++i)
+    {
+        if ( std::abs(means[i] - means[0]) > std::abs(means[furthest] - means[0]) )
+        {
+            furthest = i;
+        }
+    }
+
+    if (means[furthest] == means[0])
+    {
+        scale = 1;
+        offset = means[0] - srfs[0];
+    }
+    else
+    {
+        scale = (srfs[furthest] - srfs[0]) / (means[furthest] - means[0]);
+        offset = scale != 0 ? means[0] - srfs[0] / scale : 0;
+    }
+}
+
+
+
+/**
+ * Intensity normalization of a sample, calibrated against IntensityNormalizedWaveletEvaluator.
+ * Training samples get it when they are loaded and the detector's windows when they are
+ * scanned, so both score the same feature.
+ */
+inline void intensityNormalization(const cv::Mat & iSum, double & offset, double & scale)
+{
+    calibrateNormalization(iSum, IntensityProbe(iSum), offset, scale);
+}
+
+
+
+/**
+ * Integral sums of a sample, of the given type, followed by one row with the normalization
+ * factors of the sample (see SampleNormalization). The factors only depend on the sample,
+ * so they are computed here once instead of for every wavelet evaluated on it.
+ */
+inline cv::Mat normalizedIntegralSums(const cv::Mat & image, const int type)
+{
+    cv::Mat iSum, iSquare;
+    cv::integral(image, iSum, iSquare, cv::DataType<double>::type);
+
+    const double area = image.rows * image.cols;
+    const double mean = iSum.at<double>(image.rows, image.cols) / area;
+    const double variance = iSquare.at<double>(image.rows, image.cols) / area - mean * mean;
+
+    double intensityOffset, intensityScale, varianceOffset, varianceScale;
+    intensityNormalization(iSum, intensityOffset, intensityScale);
+    calibrateNormalization(iSum, VarianceProbe(iSum, iSquare), varianceOffset, varianceScale);
+
+    cv::Mat footer(1, iSum.cols, cv::DataType<double>::type, cv::Scalar(0));
+    footer.at<double>(0, SAMPLE_MEAN) = mean;
+    footer.at<double>(0, SAMPLE_STDDEV) = std::sqrt(std::max(variance, .0));
+    footer.at<double>(0, INTENSITY_SCALE) = intensityScale;
+    footer.at<double>(0, VARIANCE_SCALE) = varianceScale;
+    footer.at<double>(0, INTENSITY_OFFSET) = intensityOffset;
+    footer.at<double>(0, VARIANCE_OFFSET) = varianceOffset;
+
+    cv::Mat sums(iSum.rows + 1, iSum.cols, type);
+    cv::Mat sumsRows = sums.rowRange(0, iSum.rows);
+    cv::Mat footerRow = sums.row(iSum.rows);
+    iSum.convertTo(sumsRows, type);
+    footer.convertTo(footerRow, type);
+    return sums;
+}
+
+
+
 struct ToIntegralSums
 {
     inline cv::Mat operator()(cv::Mat & image) const
     {
-        cv::Mat iSum(image.rows, image.cols, cv::DataType<double>::type);
-        cv::integral(image, iSum, cv::DataType<double>::type);
-        return iSum;
+        return normalizedIntegralSums(image, cv::DataType<double>::type);
     }
 };
 
 
 
+/**
+ * Single precision integral sums. Sums of 8 bit pixels stay integers below 2^24 for samples
+ * up to 256 x 256, so they are exact in a float and only the SRFS lose precision.
+ */
+struct ToFloatIntegralSums
+{
+    inline cv::Mat operator()(cv::Mat & image) const
+    {
+        return normalizedIntegralSums(image, cv::DataType<float>::type);
+    }
+};
+
+
+
+/**
+ * Replaces each sample by its integral sums, in single or in double precision.
+ */
+inline void toIntegralSums(std::vector<cv::Mat> & samples, const bool singlePrecision)
+{
+    if (singlePrecision)
+    {
+        std::transform(samples.begin(), samples.end(), samples.begin(), ToFloatIntegralSums());
+    }
+    else
+    {
+        std::transform(samples.begin(), samples.end(), samples.begin(), ToIntegralSums());
+    }
+}
+
+
+
+/**
+ * Copies integral sums to another precision (cv::DataType<double>::type or
+ * cv::DataType<float>::type).
+ */
+inline void convertIntegralSums(const std::vector<cv::Mat> & from, std::vector<cv::Mat> & to, const int type)
+{
+    to.resize(from.size());
+    for (unsigned int i = 0; i < from.size(); ++i)
+    {
+        from[i].convertTo(to[i], type);
+    }
+}
+
+
+
+/**
+ * Samples evaluated with variance normalization. The integral of the squares is only needed
+ * for the standard deviation of the sample, which is kept in the footer of iSum.
+ */
 struct Integrals
 {
-    cv::Mat iSum, iSquare;
+    cv::Mat iSum;
 
     Integrals() {}
 
-    Integrals(cv::Mat & iSum_, cv::Mat & iSquare_)
+    Integrals(cv::Mat & iSum_)
     {
         iSum = iSum_;
-        iSquare = iSquare_;
     }
 
     Integrals & operator=(const Integrals & i)
     {
         iSum = i.iSum;
-        iSquare = i.iSquare;
         return *this;
     }
 };
@@ -58,53 +265,570 @@ struct ToIntegrals
 {
     inline Integrals operator()(cv::Mat & image) const
     {
-        cv::Mat iSum(image.rows + 1, image.cols + 1, cv::DataType<double>::type);
-        cv::Mat iSquare(image.rows + 1, image.cols + 1, cv::DataType<double>::type);
-        cv::integral(image, iSum, iSquare, cv::DataType<double>::type);
+        cv::Mat iSum = normalizedIntegralSums(image, cv::DataType<double>::type);
 
-        Integrals i(iSum, iSquare);
+        Integrals i(iSum);
         return i;
     }
 };
 
 
 
-void produceSrfs(mypca & pca, const AbstractHaarWavelet * const wavelet, const std::vector<cv::Mat> & integralSums)
+/**
+ * Size of the samples whose integral images are in the set. Integral sums have one more
+ * column than the samples, and one more row besides for the normalization footer.
+ */
+template <typename IntegralType>
+inline int sampleSize(const std::vector<IntegralType> & samples);
+
+template <>
+inline int sampleSize(const std::vector<cv::Mat> & integralSums)
+{
+    return integralSums.empty() ? 0 : integralSums.front().cols - 1;
+}
+
+template <>
+inline int sampleSize(const std::vector<Integrals> & integrals)
 {
-    const IntensityNormalizedWaveletEvaluator evaluator;
+    return integrals.empty() ? 0 : integrals.front().iSum.cols - 1;
+}
+
+
+
+/**
+ * Calls visitor.visit<K>(srfs) with the SRFS of the wavelet on each sample. The SRFS have
+ * the precision of the integral sums, float or double. K is the amount of rectangles of
+ * the wavelet, or 0 when it is only known at run time.
+ */
+template <int SIZE, int K, typename T, typename Visitor>
+void visitSrfs(const AbstractHaarWavelet & wavelet, const std::vector<cv::Mat> & integralSums, Visitor & visitor)
+{
+    const WaveletKernel<SIZE, K> kernel(wavelet);
 
     const int records = integralSums.size();
 
-    pca.set_num_variables(wavelet->dimensions());
+    T srfs[MAX_RECTANGLES];
+    for (int i = 0; i < records; ++i)
+    {
+        kernel.srfs(integralSums[i].ptr<T>(), srfs);
+
+        visitor.template visit<K>(srfs);
+    }
+}
+
 
-    std::vector<double> srfsVector( wavelet->dimensions() );
+
+/**
+ * Variance normalized SRFS are always evaluated in double precision.
+ */
+template <int SIZE, int K, typename T, typename Visitor>
+void visitSrfs(const AbstractHaarWavelet & wavelet, const std::vector<Integrals> & integrals, Visitor & visitor)
+{
+    const WaveletKernel<SIZE, K> kernel(wavelet);
+
+    const int records = integrals.size();
+
+    double srfs[MAX_RECTANGLES];
     for (int i = 0; i < records; ++i)
     {
-        evaluator.srfs(*wavelet, integralSums[i], srfsVector);
+        kernel.varianceNormalizedSrfs(integrals[i].iSum.ptr<double>(), srfs);
+
+        visitor.template visit<K>(srfs);
+    }
+}
+
+
+
+/**
+ * Picks the kernel specialized for the amount of rectangles of the wavelet.
+ */
+template <int SIZE, typename T, typename IntegralType, typename Visitor>
+void visitSrfsOfDimensions(const AbstractHaarWavelet & wavelet, const std::vector<IntegralType> & samples, Visitor & visitor)
+{
+    switch ( wavelet.dimensions() )
+    {
+        case 2:  visitSrfs<SIZE, 2, T>(wavelet, samples, visitor); break;
+        case 3:  visitSrfs<SIZE, 3, T>(wavelet, samples, visitor); break;
+        case 4:  visitSrfs<SIZE, 4, T>(wavelet, samples, visitor); break;
+        default: visitSrfs<SIZE, 0, T>(wavelet, samples, visitor); break;
+    }
+}
+
+
 
-        pca.add_record(srfsVector);
+template <int SIZE, typename Visitor>
+void visitSrfs(const AbstractHaarWavelet & wavelet, const std::vector<cv::Mat> & integralSums, Visitor & visitor)
+{
+    if (integralSums.front().depth() == CV_32F)
+    {
+        visitSrfsOfDimensions<SIZE, float>(wavelet, integralSums, visitor);
+    }
+    else
+    {
+        visitSrfsOfDimensions<SIZE, double>(wavelet, integralSums, visitor);
     }
 }
 
 
 
-void produceSrfs(mypca & pca, const AbstractHaarWavelet * const wavelet, const std::vector<Integrals> & integrals)
+template <int SIZE, typename Visitor>
+void visitSrfs(const AbstractHaarWavelet & wavelet, const std::vector<Integrals> & integrals, Visitor & visitor)
 {
-    const VarianceNormalizedWaveletEvaluator evaluator;
+    visitSrfsOfDimensions<SIZE, double>(wavelet, integrals, visitor);
+}
+
+
+
+/**
+ * Visits the SRFS of a wavelet over all samples with the kernel specialized for the
+ * size of the samples and for the amount of rectangles of the wavelet. Callers are
+ * expected to have refused unsupported sizes already.
+ */
+template <typename IntegralType, typename Visitor>
+void visitSrfs(const AbstractHaarWavelet & wavelet, const std::vector<IntegralType> & samples, Visitor & visitor)
+{
+    if (samples.empty())
+    {
+        return;
+    }
+
+    switch ( sampleSize(samples) )
+    {
+        case 20: visitSrfs<20>(wavelet, samples, visitor); break;
+        case 24: visitSrfs<24>(wavelet, samples, visitor); break;
+        case 32: visitSrfs<32>(wavelet, samples, visitor); break;
+        default: throw std::logic_error("Unsupported sample size.");
+    }
+}
+
+
+
+#define SAMPLE_TILE_BYTES (256 << 10) //integral sums of a tile of samples, sized to stay in L2
+#define MAX_TILE_WAVELETS 8            //most wavelets evaluated on a tile of samples, an eigen batch
+
+
+
+/**
+ * Amount of samples of a tile: as many as fit in SAMPLE_TILE_BYTES, at least one.
+ */
+inline int sampleTile(const cv::Mat & integralSums)
+{
+    return std::max<int>(1, SAMPLE_TILE_BYTES / (integralSums.total() * integralSums.elemSize()));
+}
+
+
+
+/**
+ * Cache blocked visitSrfs for a batch of wavelets of the same dimensions: the samples are
+ * taken a tile at a time, and every wavelet of the batch is evaluated on a tile while it
+ * is in the cache, calling visitors[w].visit<K>(srfs) for wavelet w. Each wavelet still
+ * sees the samples in the same order, so its visitor gets the same calls as with visitSrfs.
+ */
+template <int SIZE, int K, typename T, typename Visitor>
+void visitSrfsTiled(const AbstractHaarWavelet * const * wavelets, const int count, const std::vector<cv::Mat> & integralSums, Visitor * const visitors)
+{
+    WaveletKernel<SIZE, K> kernels[MAX_TILE_WAVELETS];
+    for (int w = 0; w < count; ++w)
+    {
+        kernels[w] = WaveletKernel<SIZE, K>(*wavelets[w]);
+    }
+
+    const int records = integralSums.size();
+    const int tile = sampleTile(integralSums.front());
+
+    T srfs[MAX_RECTANGLES];
+    for (int first = 0; first < records; first += tile)
+    {
+        const int last = std::min(records, first + tile);
+        for (int w = 0; w < count; ++w)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                kernels[w].srfs(integralSums[i].ptr<T>(), srfs);
+
+                visitors[w].template visit<K>(srfs);
+            }
+        }
+    }
+}
+
+
+
+template <int SIZE, int K, typename T, typename Visitor>
+void visitSrfsTiled(const AbstractHaarWavelet * const * wavelets, const int count, const std::vector<Integrals> & integrals, Visitor * const visitors)
+{
+    WaveletKernel<SIZE, K> kernels[MAX_TILE_WAVELETS];
+    for (int w = 0; w < count; ++w)
+    {
+        kernels[w] = WaveletKernel<SIZE, K>(*wavelets[w]);
+    }
 
     const int records = integrals.size();
+    const int tile = sampleTile(integrals.front().iSum);
+
+    double srfs[MAX_RECTANGLES];
+    for (int first = 0; first < records; first += tile)
+    {
+        const int last = std::min(records, first + tile);
+        for (int w = 0; w < count; ++w)
+        {
+            for (int i = first; i < last; ++i)
+            {
+                kernels[w].varianceNormalizedSrfs(integrals[i].iSum.ptr<double>(), srfs);
+
+                visitors[w].template visit<K>(srfs);
+            }
+        }
+    }
+}
+
+
+
+template <int SIZE, typename T, typename IntegralType, typename Visitor>
+void visitSrfsTiledOfDimensions(const AbstractHaarWavelet * const * wavelets, const int count, const std::vector<IntegralType> & samples, Visitor * const visitors)
+{
+    switch ( wavelets[0]->dimensions() )
+    {
+        case 2:  visitSrfsTiled<SIZE, 2, T>(wavelets, count, samples, visitors); break;
+        case 3:  visitSrfsTiled<SIZE, 3, T>(wavelets, count, samples, visitors); break;
+        case 4:  visitSrfsTiled<SIZE, 4, T>(wavelets, count, samples, visitors); break;
+        default: visitSrfsTiled<SIZE, 0, T>(wavelets, count, samples, visitors); break;
+    }
+}
+
+
+
+template <int SIZE, typename Visitor>
+void visitSrfsTiled(const AbstractHaarWavelet * const * wavelets, const int count, const std::vector<cv::Mat> & integralSums, Visitor * const visitors)
+{
+    if (integralSums.front().depth() == CV_32F)
+    {
+        visitSrfsTiledOfDimensions<SIZE, float>(wavelets, count, integralSums, visitors);
+    }
+    else
+    {
+        visitSrfsTiledOfDimensions<SIZE, double>(wavelets, count, integralSums, visitors);
+    }
+}
+
+
+
+template <int SIZE, typename Visitor>
+void visitSrfsTiled(const AbstractHaarWavelet * const * wavelets, const int count, const std::vector<Integrals> & integrals, Visitor * const visitors)
+{
+    visitSrfsTiledOfDimensions<SIZE, double>(wavelets, count, integrals, visitors);
+}
+
+
+
+/**
+ * Visits the SRFS of up to MAX_TILE_WAVELETS wavelets of the same dimensions over all
+ * samples, a tile of samples at a time.
+ */
+template <typename IntegralType, typename Visitor>
+void visitSrfsTiled(const AbstractHaarWavelet * const * wavelets, const int count, const std::vector<IntegralType> & samples, Visitor * const visitors)
+{
+    if (samples.empty() || count == 0)
+    {
+        return;
+    }
+
+    switch ( sampleSize(samples) )
+    {
+        case 20: visitSrfsTiled<20>(wavelets, count, samples, visitors); break;
+        case 24: visitSrfsTiled<24>(wavelets, count, samples, visitors); break;
+        case 32: visitSrfsTiled<32>(wavelets, count, samples, visitors); break;
+        default: throw std::logic_error("Unsupported sample size.");
+    }
+}
+
+
+
+/**
+ * Bin of a feature value in a histogram spanning [-sqrt(2), sqrt(2)]
+ * (copy & paste from HistogramDiscriminant class).
+ */
+inline int histogramBin(const double featureValue, const int buckets)
+{
+    return featureValue >= std::sqrt(2.0) ? buckets - 1 :
+           featureValue <= -std::sqrt(2.0) ? 0 :
+           (int)((buckets/2.0) * featureValue / std::sqrt(2.0)) + (buckets/2.0);
+}
+
+
+
+/**
+ * Adds each SRFS as a record of the PCA.
+ */
+class PcaRecorder
+{
+public:
+    PcaRecorder(mypca & pca_, const int dimensions) : pca(pca_),
+                                                      record(dimensions) {}
+
+    template <int K, typename T>
+    inline void visit(const T * const srfs)
+    {
+        std::copy(srfs, srfs + record.size(), record.begin());
+        pca.add_record(record);
+    }
+
+private:
+    mypca & pca;
+    std::vector<double> record;
+};
+
+
+
+#define FLOAT_MOMENTS_BLOCK 256 //single precision SRFS merged into the statistics at a time
+
+
+
+/**
+ * Adds each SRFS to streaming statistics and, when a histogram is given, counts the
+ * feature value obtained with the given weights in it.
+ *
+ * Single precision SRFS are accumulated in blocks of FLOAT_MOMENTS_BLOCK samples in float,
+ * then each block is merged into the double precision statistics, so rounding errors do not
+ * grow with the amount of samples. flush() must be called after the last sample.
+ *
+ * Accumulators are assignable, so a batch of them can be kept in an array, one per wavelet.
+ */
+class SrfsAccumulator
+{
+public:
+    SrfsAccumulator() : moments(0),
+                        histogram(0) {}
+
+    SrfsAccumulator(SrfsMoments & moments_) : moments(&moments_),
+                                              histogram(0),
+                                              block(moments_.dimensions) {}
+
+    SrfsAccumulator(SrfsMoments & moments_,
+                    const std::vector<float>::const_iterator weights_,
+                    std::vector<double> & histogram_) : moments(&moments_),
+                                                        weights(weights_),
+                                                        histogram(&histogram_),
+                                                        block(moments_.dimensions) {}
+
+    template <int K>
+    inline void visit(const double * const srfs)
+    {
+        moments->template add<K>(srfs);
+
+        if (histogram)
+        {
+            const double featureValue = std::inner_product(weights, weights + dimensions<K>(), srfs, .0);
+            (*histogram)[ histogramBin(featureValue, histogram->size()) ] += 1;
+        }
+    }
 
+    template <int K>
+    inline void visit(const float * const srfs)
+    {
+        block.template add<K>(srfs);
+        if (block.count == FLOAT_MOMENTS_BLOCK)
+        {
+            flush();
+        }
+
+        if (histogram)
+        {
+            const float featureValue = std::inner_product(weights, weights + dimensions<K>(), srfs, .0f);
+            (*histogram)[ histogramBin(featureValue, histogram->size()) ] += 1;
+        }
+    }
+
+    void flush()
+    {
+        moments->merge(block);
+        block.reset(moments->dimensions);
+    }
+
+private:
+    SrfsMoments * moments;
+    std::vector<float>::const_iterator weights;
+
+    template <int K>
+    inline int dimensions() const
+    {
+        return K > 0 ? K : moments->dimensions;
+    }
+
+    std::vector<double> * histogram;
+    FloatSrfsMoments block;
+};
+
+
+
+template <typename IntegralType>
+void produceSrfs(mypca & pca, const AbstractHaarWavelet * const wavelet, const std::vector<IntegralType> & samples)
+{
     pca.set_num_variables(wavelet->dimensions());
 
-    std::vector<double> srfsVector( wavelet->dimensions() );
-    for (int i = 0; i < records; ++i)
+    PcaRecorder recorder(pca, wavelet->dimensions());
+    visitSrfs(*wavelet, samples, recorder);
+}
+
+
+
+/**
+ * Adds the SRFS of a wavelet over the samples to its streaming statistics.
+ */
+template <typename IntegralType>
+void accumulateSrfs(SrfsMoments & moments, const AbstractHaarWavelet * const wavelet, const std::vector<IntegralType> & samples)
+{
+    if (moments.count == 0)
+    {
+        moments.reset(wavelet->dimensions());
+    }
+
+    SrfsAccumulator accumulator(moments);
+    visitSrfs(*wavelet, samples, accumulator);
+    accumulator.flush();
+}
+
+
+
+/**
+ * Same as above, also counting in the histogram the feature values obtained with the weights.
+ */
+template <typename IntegralType>
+void accumulateSrfs(SrfsMoments & moments,
+                    const std::vector<float>::const_iterator weights,
+                    std::vector<double> & histogram,
+                    const AbstractHaarWavelet * const wavelet,
+                    const std::vector<IntegralType> & samples)
+{
+    if (moments.count == 0)
+    {
+        moments.reset(wavelet->dimensions());
+    }
+
+    SrfsAccumulator accumulator(moments, weights, histogram);
+    visitSrfs(*wavelet, samples, accumulator);
+    accumulator.flush();
+}
+
+
+
+/**
+ * accumulateSrfs for a batch of up to MAX_TILE_WAVELETS wavelets of the same dimensions,
+ * evaluated together a tile of samples at a time. The moments are the same as the ones
+ * accumulateSrfs gives for each wavelet.
+ */
+template <typename IntegralType>
+void accumulateSrfsTiled(SrfsMoments * const * moments,
+                         const AbstractHaarWavelet * const * wavelets,
+                         const int count,
+                         const std::vector<IntegralType> & samples)
+{
+    SrfsAccumulator accumulators[MAX_TILE_WAVELETS];
+    for (int w = 0; w < count; ++w)
+    {
+        if (moments[w]->count == 0)
+        {
+            moments[w]->reset(wavelets[w]->dimensions());
+        }
+        accumulators[w] = SrfsAccumulator(*moments[w]);
+    }
+
+    visitSrfsTiled(wavelets, count, samples, accumulators);
+
+    for (int w = 0; w < count; ++w)
+    {
+        accumulators[w].flush();
+    }
+}
+
+
+
+/**
+ * Same as above, also counting in each histogram the feature values obtained with the
+ * weights of its wavelet.
+ */
+template <typename IntegralType>
+void accumulateSrfsTiled(SrfsMoments * const * moments,
+                         const std::vector<float>::const_iterator * weights,
+                         std::vector<double> * const * histograms,
+                         const AbstractHaarWavelet * const * wavelets,
+                         const int count,
+                         const std::vector<IntegralType> & samples)
+{
+    SrfsAccumulator accumulators[MAX_TILE_WAVELETS];
+    for (int w = 0; w < count; ++w)
     {
-        evaluator.srfs(*wavelet, integrals[i].iSum, integrals[i].iSquare, srfsVector);
+        if (moments[w]->count == 0)
+        {
+            moments[w]->reset(wavelets[w]->dimensions());
+        }
+        accumulators[w] = SrfsAccumulator(*moments[w], weights[w], *histograms[w]);
+    }
 
-        pca.add_record(srfsVector);
+    visitSrfsTiled(wavelets, count, samples, accumulators);
+
+    for (int w = 0; w < count; ++w)
+    {
+        accumulators[w].flush();
     }
 }
 
 
 
+/**
+ * Sample file name meaning that no new samples of a class are given to an --add-samples run.
+ */
+#define NO_SAMPLES "-"
+
+
+
+/**
+ * Removes an option and its value (as in --name VALUE) from the command line, leaving
+ * only the positional arguments behind. Returns the value, or an empty string if the
+ * option was not given.
+ */
+inline std::string takeOption(int & argc, char * argv[], const std::string & name)
+{
+    for (int i = 1; i < argc - 1; ++i)
+    {
+        if (name == argv[i])
+        {
+            const std::string value = argv[i + 1];
+            for (int j = i; j < argc - 2; ++j)
+            {
+                argv[j] = argv[j + 2];
+            }
+            argc -= 2;
+            return value;
+        }
+    }
+
+    return std::string();
+}
+
+
+
+/**
+ * Removes a flag (as in --name) from the command line. Returns true if it was given.
+ */
+inline bool takeFlag(int & argc, char * argv[], const std::string & name)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (name == argv[i])
+        {
+            for (int j = i; j < argc - 1; ++j)
+            {
+                argv[j] = argv[j + 1];
+            }
+            argc -= 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+
 #endif // OPTIMIZATION_COMMONS_H
@@ -0,0 +1,63 @@
+#ifndef OPTIMIZE_WORKSPACE_H
+#define OPTIMIZE_WORKSPACE_H
+
+#include <vector>
+
+#include <tbb/tbb.h>
+
+#include "wavelet_statistics.h"
+#include "batched_eigen.h"
+
+
+
+#define MAX_HISTOGRAM_BUCKETS 128
+
+
+
+/**
+ * Scratch space of one worker of the Optimize functors, allocated the first time the
+ * worker runs and reused for every wavelet after that. Together with the classifiers being
+ * allocated before the sweep and the eigen decomposition living on the stack, the sweep
+ * does not touch the heap once every worker has its workspace.
+ */
+struct OptimizeWorkspace
+{
+    WaveletStatistics statistics[EIGEN_BATCH]; //of the current batch of wavelets, when the statistics are not kept
+    std::vector<SrfsMoments> replicates;       //bootstrap replicates of the current wavelet
+    std::vector<double> replicateValues;       //eigenvalues and deviations of the replicates
+
+    OptimizeWorkspace()
+    {
+        for (int b = 0; b < EIGEN_BATCH; ++b)
+        {
+            statistics[b].negativeHistogram.reserve(MAX_HISTOGRAM_BUCKETS);
+        }
+    }
+
+    WaveletStatistics & clearStatistics(const int b = 0)
+    {
+        statistics[b].positive.reset(0);
+        statistics[b].negative.reset(0);
+        statistics[b].positiveHistogram.clear();
+        statistics[b].negativeHistogram.clear();
+        statistics[b].positiveFeature = FeatureMoments();
+        statistics[b].negativeFeature = FeatureMoments();
+        return statistics[b];
+    }
+
+    /**
+     * Sized for the given amount of bootstrap replicates, which only allocates the first time.
+     */
+    std::vector<SrfsMoments> & bootstrapReplicates(const int count)
+    {
+        replicates.resize(count);
+        replicateValues.resize((MAX_RECTANGLES + 1) * count);
+        return replicates;
+    }
+};
+
+typedef tbb::enumerable_thread_specific<OptimizeWorkspace> OptimizeWorkspaces;
+
+
+
+#endif // OPTIMIZE_WORKSPACE_H
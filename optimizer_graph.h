@@ -0,0 +1,390 @@
+#ifndef OPTIMIZER_GRAPH_H
+#define OPTIMIZER_GRAPH_H
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+
+#include <tbb/tbb.h>
+#include <tbb/flow_graph.h>
+
+#include "optimization_commons.h"
+#include "wavelet_parser.h"
+
+#include "haarwavelet.h"
+
+#include "sampleextractor.h"
+
+
+
+#define WRITE_BLOCK 4096 //most classifiers formatted by one task
+
+
+
+/**
+ * Functor used by Intel TBB to replace images by their integral sums, or by their
+ * variance normalized integrals, with one of the transforms of optimization_commons.h.
+ */
+template <typename Transform, typename IntegralType>
+class TransformSamples
+{
+    std::vector<cv::Mat> * images;
+    std::vector<IntegralType> * samples;
+
+public:
+    void operator()(const tbb::blocked_range<size_t> range) const
+    {
+        const Transform transform;
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            (*samples)[i] = transform( (*images)[i] );
+        }
+    }
+
+    TransformSamples(std::vector<cv::Mat> * images_,
+                     std::vector<IntegralType> * samples_) : images(images_),
+                                                             samples(samples_) {}
+};
+
+
+
+/**
+ * Parallel toIntegralSums: the images are replaced in place.
+ */
+inline void toIntegralsInParallel(std::vector<cv::Mat> & images, std::vector<cv::Mat> & integralSums, const bool singlePrecision)
+{
+    integralSums.swap(images);
+    if (singlePrecision)
+    {
+        tbb::parallel_for( tbb::blocked_range<size_t>(0, integralSums.size()),
+                           TransformSamples<ToFloatIntegralSums, cv::Mat>(&integralSums, &integralSums) );
+    }
+    else
+    {
+        tbb::parallel_for( tbb::blocked_range<size_t>(0, integralSums.size()),
+                           TransformSamples<ToIntegralSums, cv::Mat>(&integralSums, &integralSums) );
+    }
+}
+
+
+
+/**
+ * Variance normalized integrals are always in double precision.
+ */
+inline void toIntegralsInParallel(std::vector<cv::Mat> & images, std::vector<Integrals> & integrals, const bool)
+{
+    integrals.resize(images.size());
+    tbb::parallel_for( tbb::blocked_range<size_t>(0, images.size()),
+                       TransformSamples<ToIntegrals, Integrals>(&images, &integrals) );
+    images.clear();
+}
+
+
+
+/**
+ * Body of the node loading the wavelets, packed. The load fails when a wavelet can't be
+ * packed, since the kernels would not take it either.
+ */
+class LoadWavelets
+{
+    std::string filename;
+    PackedWaveletSet * wavelets;
+    bool * loaded;
+
+public:
+    tbb::flow::continue_msg operator()(const tbb::flow::continue_msg) const
+    {
+        *loaded = loadPackedWaveletsParallel(filename, *wavelets);
+        return tbb::flow::continue_msg();
+    }
+
+    LoadWavelets(const std::string & filename_,
+                 PackedWaveletSet * wavelets_,
+                 bool * loaded_) : filename(filename_),
+                                   wavelets(wavelets_),
+                                   loaded(loaded_) {}
+};
+
+
+
+/**
+ * Body of a node loading a set of samples: the images are extracted from a big image,
+ * with the index of the negative samples when there is one, then turned into integrals
+ * in parallel.
+ */
+template <typename IntegralType>
+class LoadSamples
+{
+    std::string image, index;
+    std::vector<IntegralType> * samples;
+    bool singlePrecision;
+    bool * loaded;
+
+public:
+    tbb::flow::continue_msg operator()(const tbb::flow::continue_msg) const
+    {
+        std::vector<cv::Mat> images;
+        *loaded = index.empty() ? SampleExtractor::extractFromBigImage(image, images)
+                                : SampleExtractor::extractFromBigImage(image, index, images);
+        if (*loaded)
+        {
+            toIntegralsInParallel(images, *samples, singlePrecision);
+        }
+        return tbb::flow::continue_msg();
+    }
+
+    LoadSamples(const std::string & image_,
+                const std::string & index_,
+                std::vector<IntegralType> * samples_,
+                const bool singlePrecision_,
+                bool * loaded_) : image(image_),
+                                  index(index_),
+                                  samples(samples_),
+                                  singlePrecision(singlePrecision_),
+                                  loaded(loaded_) {}
+};
+
+
+
+/**
+ * Loads the inputs of an optimizer at the same time: each load is a node of a flow graph,
+ * so the wavelets are parsed while the samples are decoded, and the integrals of one set
+ * of samples are computed while the other set is still being decoded. Nothing is printed
+ * from the nodes; the callers check what was loaded once run() returns.
+ */
+class LoadingGraph
+{
+public:
+    LoadingGraph() : start(graph) {}
+
+    void loadWavelets(const std::string & filename, PackedWaveletSet & wavelets, bool & loaded)
+    {
+        addNode( LoadWavelets(filename, &wavelets, &loaded) );
+    }
+
+    /**
+     * Loads samples from a big image. Negative samples are given with their index, positive
+     * ones with an empty index.
+     */
+    template <typename IntegralType>
+    void loadSamples(const std::string & image, const std::string & index, std::vector<IntegralType> & samples, const bool singlePrecision, bool & loaded)
+    {
+        addNode( LoadSamples<IntegralType>(image, index, &samples, singlePrecision, &loaded) );
+    }
+
+    /**
+     * Runs every load and waits for all of them.
+     */
+    void run()
+    {
+        start.try_put( tbb::flow::continue_msg() );
+        graph.wait_for_all();
+    }
+
+private:
+    typedef tbb::flow::continue_node<tbb::flow::continue_msg> LoadNode;
+
+    tbb::flow::graph graph;
+    tbb::flow::broadcast_node<tbb::flow::continue_msg> start;
+    std::vector< std::unique_ptr<LoadNode> > nodes; //destroyed before the graph
+
+    template <typename Body>
+    void addNode(const Body & body)
+    {
+        nodes.push_back( std::unique_ptr<LoadNode>(new LoadNode(graph, body)) );
+        tbb::flow::make_edge(start, *nodes.back());
+    }
+};
+
+
+
+/**
+ * Functor used by Intel TBB to build the classifier of each packed wavelet before the
+ * sweep, so the sweep only fills in classifiers it does not have to allocate.
+ */
+template <typename Classifier>
+class UnpackClassifiers
+{
+    const PackedWaveletSet * wavelets;
+    std::vector<Classifier> * classifiers;
+
+public:
+    void operator()(const tbb::blocked_range<size_t> range) const
+    {
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            (*classifiers)[i] = Classifier( wavelets->unpack(i) );
+        }
+    }
+
+    UnpackClassifiers(const PackedWaveletSet * wavelets_,
+                      std::vector<Classifier> * classifiers_) : wavelets(wavelets_),
+                                                                classifiers(classifiers_) {}
+};
+
+
+
+/**
+ * One classifier per wavelet, built from the unpacked wavelets in parallel.
+ */
+template <typename Classifier>
+inline void unpackClassifiers(const PackedWaveletSet & wavelets, std::vector<Classifier> & classifiers)
+{
+    classifiers.resize(wavelets.size());
+    tbb::parallel_for( tbb::blocked_range<size_t>(0, wavelets.size()),
+                       UnpackClassifiers<Classifier>(&wavelets, &classifiers) );
+}
+
+
+
+/**
+ * Writes classifiers to a stream from a flow graph. Blocks of classifiers are formatted
+ * into text in parallel, as they are put, and a serial node writes the text.
+ *
+ * In order, the text of the blocks is written in the order they were put, through a
+ * sequencer node. Otherwise it is written as soon as it is formatted, so a caller can put
+ * each block of classifiers as it is optimized and writing overlaps the optimization.
+ *
+ * The classifiers of a block must stay where they are until wait() returns. wait() tells
+ * whether all the text reached the stream.
+ */
+template <typename Iterator>
+class ClassifierWriter
+{
+public:
+    ClassifierWriter(std::ostream & output_, const bool ordered) : output(output_),
+                                                                   format(graph, tbb::flow::unlimited, FormatBlock()),
+                                                                   sequencer(graph, TextSequence()),
+                                                                   write(graph, tbb::flow::serial, WriteText(&output_, &failed)),
+                                                                   nextSequence(0),
+                                                                   failed(false)
+    {
+        if (ordered)
+        {
+            tbb::flow::make_edge(format, sequencer);
+            tbb::flow::make_edge(sequencer, write);
+        }
+        else
+        {
+            tbb::flow::make_edge(format, write);
+        }
+    }
+
+    ~ClassifierWriter()
+    {
+        wait();
+    }
+
+    /**
+     * Puts one block. Can be called from several threads at once.
+     */
+    void put(const Iterator begin, const Iterator end)
+    {
+        Block block;
+        block.begin = begin;
+        block.end = end;
+        block.sequence = nextSequence.fetch_add(1);
+        format.try_put(block);
+    }
+
+    /**
+     * Puts a range of classifiers split in blocks of up to WRITE_BLOCK.
+     */
+    void putAll(const Iterator begin, const Iterator end)
+    {
+        for (Iterator b = begin; b != end; )
+        {
+            const Iterator e = b + std::min<size_t>(WRITE_BLOCK, end - b);
+            put(b, e);
+            b = e;
+        }
+    }
+
+    /**
+     * Waits until every block put has been written, then flushes the stream. Returns false
+     * if any write or the flush failed, like on a full disk.
+     */
+    bool wait()
+    {
+        graph.wait_for_all();
+        output.flush();
+        failed = failed || !output;
+        return !failed;
+    }
+
+private:
+    struct Block
+    {
+        Iterator begin, end;
+        size_t sequence;
+    };
+
+    struct Text
+    {
+        std::string text;
+        size_t sequence;
+    };
+
+    struct FormatBlock
+    {
+        Text operator()(const Block & block) const
+        {
+            std::ostringstream stream;
+            for (Iterator it = block.begin; it != block.end; ++it)
+            {
+                it->write(stream);
+                stream << '\n';
+            }
+
+            Text text;
+            text.text = stream.str();
+            text.sequence = block.sequence;
+            return text;
+        }
+    };
+
+    struct TextSequence
+    {
+        size_t operator()(const Text & text) const
+        {
+            return text.sequence;
+        }
+    };
+
+    class WriteText
+    {
+        std::ostream * output;
+        bool * failed; //only written from this serial node
+
+    public:
+        tbb::flow::continue_msg operator()(const Text & text) const
+        {
+            if ( !output->write(text.text.data(), text.text.size()) )
+            {
+                *failed = true;
+            }
+            return tbb::flow::continue_msg();
+        }
+
+        WriteText(std::ostream * output_,
+                  bool * failed_) : output(output_),
+                                    failed(failed_) {}
+    };
+
+    std::ostream & output;
+    tbb::flow::graph graph;
+    tbb::flow::function_node<Block, Text> format;
+    tbb::flow::sequencer_node<Text> sequencer;
+    tbb::flow::function_node<Text> write;
+    std::atomic<size_t> nextSequence;
+    bool failed;
+};
+
+
+
+#endif // OPTIMIZER_GRAPH_H
@@ -0,0 +1,300 @@
+#ifndef PACKED_WAVELET_H
+#define PACKED_WAVELET_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+
+#include "haarwavelet.h"
+#include "haarwaveletutilities.h"
+
+#include "wavelet_kernels.h"
+
+
+
+#define PACKED_COORDINATE_LIMIT 256 //coordinates and sizes are kept in 8 bits
+
+
+
+/**
+ * A Haar wavelet in a fixed amount of plain memory, for sets of millions of wavelets. Each
+ * rectangle takes two 16 bit fields, its origin and its size, with 8 bits per coordinate.
+ * Weights are implied: +1, or -1 where the bit of the rectangle is set in negativeWeights,
+ * which is all haargen ever writes. Optimized weights are kept apart by PackedWaveletSet.
+ *
+ * Unused rectangles are zero, so two packed wavelets with the same rectangles in the same
+ * order have the same bytes.
+ */
+struct PackedWavelet
+{
+    uint8_t dimensions;
+    uint8_t negativeWeights;           //bit i is set when the weight of rectangle i is -1
+    uint16_t origins[MAX_RECTANGLES];  //x | y << 8
+    uint16_t sizes[MAX_RECTANGLES];    //width | height << 8
+
+    cv::Rect rect(const int i) const
+    {
+        return cv::Rect(origins[i] & 0xFF, origins[i] >> 8, sizes[i] & 0xFF, sizes[i] >> 8);
+    }
+
+    float impliedWeight(const int i) const
+    {
+        return (negativeWeights >> i) & 1 ? -1.0f : 1.0f;
+    }
+
+    /**
+     * Rectangle i as one number that orders and compares rectangles.
+     */
+    uint32_t rectKey(const int i) const
+    {
+        return (uint32_t)origins[i] << 16 | sizes[i];
+    }
+};
+
+
+
+inline bool operator==(const PackedWavelet & a, const PackedWavelet & b)
+{
+    return a.dimensions == b.dimensions
+        && a.negativeWeights == b.negativeWeights
+        && std::equal(a.origins, a.origins + MAX_RECTANGLES, b.origins)
+        && std::equal(a.sizes, a.sizes + MAX_RECTANGLES, b.sizes);
+}
+
+
+
+inline bool isPackable(const cv::Rect & r)
+{
+    return r.x >= 0 && r.x < PACKED_COORDINATE_LIMIT
+        && r.y >= 0 && r.y < PACKED_COORDINATE_LIMIT
+        && r.width >= 0 && r.width < PACKED_COORDINATE_LIMIT
+        && r.height >= 0 && r.height < PACKED_COORDINATE_LIMIT;
+}
+
+
+
+inline bool isImpliedWeight(const float weight)
+{
+    return weight == 1.0f || weight == -1.0f;
+}
+
+
+
+/**
+ * Packs the rectangles of a wavelet and the signs of its weights. Fails when the wavelet
+ * has more than MAX_RECTANGLES rectangles or a rectangle out of the 8 bit coordinates;
+ * neither fits any detector window.
+ */
+inline bool packWavelet(const int dimensions, const cv::Rect * rects, const float * weights, PackedWavelet & packed)
+{
+    packed = PackedWavelet();
+
+    if (dimensions < 1 || dimensions > MAX_RECTANGLES)
+    {
+        return false;
+    }
+
+    packed.dimensions = dimensions;
+    for (int i = 0; i < dimensions; ++i)
+    {
+        if ( !isPackable(rects[i]) )
+        {
+            return false;
+        }
+        packed.origins[i] = rects[i].x | rects[i].y << 8;
+        packed.sizes[i] = rects[i].width | rects[i].height << 8;
+        packed.negativeWeights |= (uint8_t)((weights[i] < 0) << i);
+    }
+
+    return true;
+}
+
+
+
+inline bool packWavelet(const HaarWavelet & wavelet, PackedWavelet & packed)
+{
+    if (wavelet.dimensions() > MAX_RECTANGLES)
+    {
+        packed = PackedWavelet();
+        return false;
+    }
+
+    cv::Rect rects[MAX_RECTANGLES];
+    float weights[MAX_RECTANGLES];
+    for (unsigned int i = 0; i < wavelet.dimensions(); ++i)
+    {
+        rects[i] = wavelet.rect(i);
+        weights[i] = wavelet.weight(i);
+    }
+
+    return packWavelet(wavelet.dimensions(), rects, weights, packed);
+}
+
+
+
+/**
+ * Unpacks a wavelet with the given weights, or with its implied ones when there are none.
+ */
+inline HaarWavelet unpackWavelet(const PackedWavelet & packed, const float * weights = 0)
+{
+    std::vector<cv::Rect> rects(packed.dimensions);
+    std::vector<float> unpackedWeights(packed.dimensions);
+    for (int i = 0; i < packed.dimensions; ++i)
+    {
+        rects[i] = packed.rect(i);
+        unpackedWeights[i] = weights ? weights[i] : packed.impliedWeight(i);
+    }
+
+    return HaarWavelet(rects, unpackedWeights);
+}
+
+
+
+/**
+ * A set of packed wavelets. Weights are only stored, MAX_RECTANGLES per wavelet, once a
+ * wavelet with a weight other than +1 or -1 is added; until then every weight is implied.
+ */
+class PackedWaveletSet
+{
+public:
+    PackedWaveletSet() {}
+
+    size_t size() const
+    {
+        return wavelets.size();
+    }
+
+    bool empty() const
+    {
+        return wavelets.empty();
+    }
+
+    void reserve(const size_t n)
+    {
+        wavelets.reserve(n);
+    }
+
+    void clear()
+    {
+        wavelets.clear();
+        weights.clear();
+    }
+
+    const PackedWavelet & operator[](const size_t i) const
+    {
+        return wavelets[i];
+    }
+
+    bool hasExplicitWeights() const
+    {
+        return !weights.empty();
+    }
+
+    float weight(const size_t w, const int i) const
+    {
+        return weights.empty() ? wavelets[w].impliedWeight(i) : weights[w * MAX_RECTANGLES + i];
+    }
+
+    /**
+     * Adds a wavelet, unless it can't be packed.
+     */
+    bool add(const int dimensions, const cv::Rect * rects, const float * waveletWeights)
+    {
+        PackedWavelet packed;
+        if ( !packWavelet(dimensions, rects, waveletWeights, packed) )
+        {
+            return false;
+        }
+
+        if ( weights.empty() && !std::all_of(waveletWeights, waveletWeights + dimensions, isImpliedWeight) )
+        {
+            makeWeightsExplicit();
+        }
+
+        wavelets.push_back(packed);
+        if ( !weights.empty() )
+        {
+            weights.resize(weights.size() + MAX_RECTANGLES, 0);
+            std::copy(waveletWeights, waveletWeights + dimensions, weights.end() - MAX_RECTANGLES);
+        }
+        return true;
+    }
+
+    bool add(const HaarWavelet & wavelet)
+    {
+        if (wavelet.dimensions() > MAX_RECTANGLES)
+        {
+            return false;
+        }
+
+        cv::Rect rects[MAX_RECTANGLES];
+        float waveletWeights[MAX_RECTANGLES];
+        for (unsigned int i = 0; i < wavelet.dimensions(); ++i)
+        {
+            rects[i] = wavelet.rect(i);
+            waveletWeights[i] = wavelet.weight(i);
+        }
+
+        return add(wavelet.dimensions(), rects, waveletWeights);
+    }
+
+    HaarWavelet unpack(const size_t w) const
+    {
+        return unpackWavelet(wavelets[w], weights.empty() ? 0 : &weights[w * MAX_RECTANGLES]);
+    }
+
+    /**
+     * Bytes taken by the wavelets and their weights.
+     */
+    size_t memoryUsage() const
+    {
+        return wavelets.size() * sizeof(PackedWavelet) + weights.size() * sizeof(float);
+    }
+
+private:
+    std::vector<PackedWavelet> wavelets;
+    std::vector<float> weights; //empty while all weights are implied
+
+    void makeWeightsExplicit()
+    {
+        weights.assign(wavelets.size() * MAX_RECTANGLES, 0);
+        for (size_t w = 0; w < wavelets.size(); ++w)
+        {
+            for (int i = 0; i < wavelets[w].dimensions; ++i)
+            {
+                weights[w * MAX_RECTANGLES + i] = wavelets[w].impliedWeight(i);
+            }
+        }
+    }
+};
+
+
+
+/**
+ * Packs loaded wavelets. Wavelets that can't be packed are handed back in rejected, or make
+ * the packing fail when rejected is not given.
+ */
+inline bool packWavelets(const std::vector<HaarWavelet> & wavelets, PackedWaveletSet & packed, std::vector<HaarWavelet> * rejected = 0)
+{
+    packed.clear();
+    packed.reserve(wavelets.size());
+    for (size_t i = 0; i < wavelets.size(); ++i)
+    {
+        if ( !packed.add(wavelets[i]) )
+        {
+            if (!rejected)
+            {
+                return false;
+            }
+            rejected->push_back(wavelets[i]);
+        }
+    }
+    return true;
+}
+
+
+
+#endif // PACKED_WAVELET_H
@@ -0,0 +1,326 @@
+#ifndef PRECISION_VERIFICATION_H
+#define PRECISION_VERIFICATION_H
+
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cmath>
+
+#include <opencv2/core/core.hpp>
+
+#include "haarwavelet.h"
+
+#include "optimization_commons.h"
+#include "feature_moments.h"
+#include "packed_wavelet.h"
+
+
+
+#define VERIFICATION_HISTOGRAM_BUCKETS 128
+
+
+
+/**
+ * Largest differences found between the single and the double precision statistics.
+ */
+struct PrecisionDeviation
+{
+    int wavelets;
+    double mean;      //of the SRFS
+    double stdDev;    //of the SRFS and of the feature value
+    double histogram; //of the frequency of a feature value bin
+
+    PrecisionDeviation() : wavelets(0),
+                           mean(0),
+                           stdDev(0),
+                           histogram(0) {}
+};
+
+
+
+/**
+ * Indexes of a random subset of count out of size wavelets, the same on every run.
+ */
+inline std::vector<unsigned int> verificationSubset(const size_t size, const int count)
+{
+    std::vector<unsigned int> indexes(size);
+    for (unsigned int i = 0; i < indexes.size(); ++i)
+    {
+        indexes[i] = i;
+    }
+    std::mt19937 generator(5489u);
+    std::shuffle(indexes.begin(), indexes.end(), generator);
+    indexes.resize( std::min<unsigned int>(count, indexes.size()) );
+    return indexes;
+}
+
+
+
+/**
+ * Standard deviation of the feature value obtained with the weights of the wavelet.
+ */
+inline double featureStdDev(const SrfsMoments & moments, const HaarWavelet & wavelet)
+{
+    double variance = 0;
+    for (int i = 0; i < moments.dimensions; ++i)
+    {
+        for (int j = 0; j < moments.dimensions; ++j)
+        {
+            variance += wavelet.weight(i) * wavelet.weight(j) * moments.covariance(i, j);
+        }
+    }
+    return std::sqrt(std::max(variance, .0));
+}
+
+
+
+/**
+ * Evaluates a random subset of the wavelets over the samples both in single and in double
+ * precision and returns the largest deviations of the means, the standard deviations and
+ * the histograms (of the feature values obtained with the weights of the wavelets).
+ * The subset is the same on every run.
+ */
+inline PrecisionDeviation verifySinglePrecision(const PackedWaveletSet & wavelets,
+                                                const std::vector<cv::Mat> & integralSums,
+                                                const int count)
+{
+    PrecisionDeviation deviation;
+    if ( wavelets.empty() || integralSums.empty() )
+    {
+        return deviation;
+    }
+
+    std::vector<cv::Mat> singleSums, doubleSums;
+    convertIntegralSums(integralSums, singleSums, cv::DataType<float>::type);
+    convertIntegralSums(integralSums, doubleSums, cv::DataType<double>::type);
+
+    const std::vector<unsigned int> indexes = verificationSubset(wavelets.size(), count);
+
+    for (unsigned int w = 0; w < indexes.size(); ++w)
+    {
+        const HaarWavelet wavelet = wavelets.unpack( indexes[w] );
+
+        SrfsMoments singleMoments, doubleMoments;
+        std::vector<double> singleHistogram(VERIFICATION_HISTOGRAM_BUCKETS, .0),
+                            doubleHistogram(VERIFICATION_HISTOGRAM_BUCKETS, .0);
+        accumulateSrfs(singleMoments, wavelet.weights_begin(), singleHistogram, &wavelet, singleSums);
+        accumulateSrfs(doubleMoments, wavelet.weights_begin(), doubleHistogram, &wavelet, doubleSums);
+
+        for (int i = 0; i < doubleMoments.dimensions; ++i)
+        {
+            deviation.mean = std::max(deviation.mean,
+                                      std::abs(singleMoments.mean[i] - doubleMoments.mean[i]));
+            deviation.stdDev = std::max(deviation.stdDev,
+                                        std::abs(std::sqrt(singleMoments.covariance(i, i))
+                                               - std::sqrt(doubleMoments.covariance(i, i))));
+        }
+        deviation.stdDev = std::max(deviation.stdDev,
+                                    std::abs(featureStdDev(singleMoments, wavelet) - featureStdDev(doubleMoments, wavelet)));
+
+        for (int b = 0; b < VERIFICATION_HISTOGRAM_BUCKETS; ++b)
+        {
+            deviation.histogram = std::max(deviation.histogram,
+                                           std::abs(singleHistogram[b] - doubleHistogram[b]) / doubleMoments.count);
+        }
+
+        ++deviation.wavelets;
+    }
+
+    return deviation;
+}
+
+
+
+/**
+ * Compares the SRFS of the kernels, visited in the order of the samples, with the SRFS
+ * IntensityNormalizedWaveletEvaluator gives on the same samples. When the squared integrals
+ * of the samples are given, the SRFS are the variance normalized ones and are compared with
+ * VarianceNormalizedWaveletEvaluator's; the feature value of the weights of the wavelet is
+ * compared with VarianceNormalizedWaveletEvaluator::operator() too, and the moments of the
+ * library's feature values are kept.
+ */
+class LibraryParity
+{
+public:
+    LibraryParity(const HaarWavelet & wavelet_,
+                  const std::vector<cv::Mat> & integralSums_,
+                  const std::vector<cv::Mat> * squares_ = 0) : wavelet(wavelet_),
+                                                               integralSums(integralSums_),
+                                                               squares(squares_),
+                                                               expected(wavelet_.dimensions()),
+                                                               sample(0),
+                                                               deviation(0) {}
+
+    template <int K, typename T>
+    inline void visit(const T * const srfs)
+    {
+        const cv::Mat & iSum = integralSums[sample];
+        const cv::Mat sums = iSum.rowRange(0, iSum.rows - 1);
+        if (squares)
+        {
+            varianceEvaluator.srfs(wavelet, sums, (*squares)[sample], expected);
+
+            double value = 0;
+            for (unsigned int i = 0; i < expected.size(); ++i)
+            {
+                value += wavelet.weight(i) * srfs[i];
+            }
+            const double libraryValue = varianceEvaluator(wavelet, sums, (*squares)[sample]);
+            deviation = std::max(deviation, std::abs(value - libraryValue));
+            libraryMoments_.addBlock(&libraryValue, 1);
+        }
+        else
+        {
+            evaluator.srfs(wavelet, sums, expected);
+        }
+        ++sample;
+
+        for (unsigned int i = 0; i < expected.size(); ++i)
+        {
+            deviation = std::max(deviation, std::abs(srfs[i] - expected[i]));
+        }
+    }
+
+    double largestDeviation() const
+    {
+        return deviation;
+    }
+
+    /**
+     * Moments of the feature values VarianceNormalizedWaveletEvaluator gave.
+     */
+    const FeatureMoments & libraryMoments() const
+    {
+        return libraryMoments_;
+    }
+
+private:
+    IntensityNormalizedWaveletEvaluator evaluator;
+    VarianceNormalizedWaveletEvaluator varianceEvaluator;
+    const HaarWavelet & wavelet;
+    const std::vector<cv::Mat> & integralSums; //in double precision
+    const std::vector<cv::Mat> * squares;      //null for intensity normalization
+    std::vector<double> expected;
+    FeatureMoments libraryMoments_;
+    int sample;
+    double deviation;
+};
+
+
+
+/**
+ * Largest difference between the SRFS of the kernels, in double precision, and those of
+ * haarcommon, over the same random subset of the wavelets as verifySinglePrecision.
+ */
+inline double verifyLibraryParity(const PackedWaveletSet & wavelets,
+                                  const std::vector<cv::Mat> & integralSums,
+                                  const int count)
+{
+    if ( wavelets.empty() || integralSums.empty() )
+    {
+        return 0;
+    }
+
+    std::vector<cv::Mat> doubleSums;
+    convertIntegralSums(integralSums, doubleSums, cv::DataType<double>::type);
+
+    const std::vector<unsigned int> indexes = verificationSubset(wavelets.size(), count);
+
+    double deviation = 0;
+    for (unsigned int w = 0; w < indexes.size(); ++w)
+    {
+        const HaarWavelet wavelet = wavelets.unpack( indexes[w] );
+        LibraryParity parity(wavelet, doubleSums);
+        visitSrfs(wavelet, doubleSums, parity);
+        deviation = std::max(deviation, parity.largestDeviation());
+    }
+
+    return deviation;
+}
+
+
+
+/**
+ * Largest difference between the variance normalized SRFS and feature values of the kernels
+ * and those of haarcommon, over the same random subset of the wavelets as the other checks.
+ * The library needs the squared integrals of the samples, which the optimizers don't keep,
+ * so the samples are given as images. The mean and the standard deviation of the feature
+ * values, as accumulateFeatureMoments takes them for the Adhikari optimizer, are compared
+ * with those of the library's values too.
+ */
+inline double verifyVarianceLibraryParity(const PackedWaveletSet & wavelets,
+                                          const std::vector<cv::Mat> & images,
+                                          const int count)
+{
+    if ( wavelets.empty() || images.empty() )
+    {
+        return 0;
+    }
+
+    std::vector<Integrals> integrals(images.size());
+    std::vector<cv::Mat> integralSums(images.size()), squares(images.size());
+    for (unsigned int i = 0; i < images.size(); ++i)
+    {
+        cv::Mat image = images[i], iSum;
+        cv::integral(image, iSum, squares[i], cv::DataType<double>::type);
+        integrals[i] = ToIntegrals()(image);
+        integralSums[i] = integrals[i].iSum;
+    }
+
+    const std::vector<unsigned int> indexes = verificationSubset(wavelets.size(), count);
+
+    double deviation = 0;
+    for (unsigned int w = 0; w < indexes.size(); ++w)
+    {
+        const HaarWavelet wavelet = wavelets.unpack( indexes[w] );
+        LibraryParity parity(wavelet, integralSums, &squares);
+        visitSrfs(wavelet, integrals, parity);
+
+        FeatureMoments moments, none;
+        accumulateFeatureMoments(wavelet, integrals, std::vector<Integrals>(), moments, none);
+
+        const FeatureMoments & expected = parity.libraryMoments();
+        deviation = std::max(deviation, parity.largestDeviation());
+        deviation = std::max(deviation, std::abs(moments.mean - expected.mean));
+        deviation = std::max(deviation, std::abs(std::sqrt(moments.variance()) - std::sqrt(expected.variance())));
+    }
+
+    return deviation;
+}
+
+
+
+/**
+ * Prints the deviations found by verifySinglePrecision.
+ */
+inline void printPrecisionDeviation(std::ostream & output, const std::string & samples, const PrecisionDeviation & deviation)
+{
+    output << "Single precision deviation on " << samples << " over " << deviation.wavelets << " wavelets:"
+           << " means " << deviation.mean
+           << ", standard deviations " << deviation.stdDev
+           << ", histograms " << deviation.histogram << std::endl;
+}
+
+
+
+/**
+ * Prints the deviation found by verifyLibraryParity.
+ */
+inline void printLibraryDeviation(std::ostream & output, const std::string & samples, const double deviation)
+{
+    output << "Deviation from haarcommon on " << samples << ": SRFS " << deviation << std::endl;
+}
+
+
+
+/**
+ * Prints the deviation found by verifyVarianceLibraryParity.
+ */
+inline void printVarianceLibraryDeviation(std::ostream & output, const std::string & samples, const double deviation)
+{
+    output << "Deviation from haarcommon on " << samples << ": variance normalized SRFS and feature values " << deviation << std::endl;
+}
+
+
+
+#endif // PRECISION_VERIFICATION_H
@@ -0,0 +1,287 @@
+#ifndef SEPARABILITY_H
+#define SEPARABILITY_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <iterator>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+#include <tbb/tbb.h>
+
+
+
+#define SEPARABILITY_EPSILON 1e-10 //floor of the variances and of the bin probabilities
+
+
+
+/**
+ * Keys the optimizers can sort their classifiers by. The standard deviation of the positive
+ * feature values goes smallest first, the separability metrics largest first.
+ */
+enum SortKey
+{
+    SORT_BY_STDDEV,
+    SORT_BY_BHATTACHARYYA,
+    SORT_BY_KULLBACK_LEIBLER,
+    SORT_BY_FISHER
+};
+
+
+
+inline bool parseSortKey(const std::string & name, SortKey & key)
+{
+    if (name.empty() || name == "stddev")
+    {
+        key = SORT_BY_STDDEV;
+    }
+    else if (name == "bhattacharyya")
+    {
+        key = SORT_BY_BHATTACHARYYA;
+    }
+    else if (name == "kullback-leibler")
+    {
+        key = SORT_BY_KULLBACK_LEIBLER;
+    }
+    else if (name == "fisher")
+    {
+        key = SORT_BY_FISHER;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+
+
+/**
+ * How far apart the distributions of the positive and the negative feature values of a
+ * classifier are: the Bhattacharyya distance, the Kullback-Leibler divergence of the
+ * negative distribution from the positive one and the Fisher ratio.
+ */
+struct Separability
+{
+    double bhattacharyya;
+    double kullbackLeibler;
+    double fisher;
+
+    Separability() : bhattacharyya(0),
+                     kullbackLeibler(0),
+                     fisher(0) {}
+
+    double get(const SortKey key) const
+    {
+        switch (key)
+        {
+            case SORT_BY_BHATTACHARYYA:    return bhattacharyya;
+            case SORT_BY_KULLBACK_LEIBLER: return kullbackLeibler;
+            case SORT_BY_FISHER:           return fisher;
+            default:                       return 0;
+        }
+    }
+
+    void write(std::ostream & output) const
+    {
+        output << ' ' << bhattacharyya
+               << ' ' << kullbackLeibler
+               << ' ' << fisher;
+    }
+};
+
+
+
+/**
+ * Separability of two normal distributions.
+ */
+inline Separability gaussianSeparability(const double positiveMean, const double positiveVariance,
+                                         const double negativeMean, const double negativeVariance)
+{
+    const double vp = std::max(positiveVariance, SEPARABILITY_EPSILON);
+    const double vn = std::max(negativeVariance, SEPARABILITY_EPSILON);
+    const double distance = (positiveMean - negativeMean) * (positiveMean - negativeMean);
+
+    Separability s;
+    s.bhattacharyya = distance / (4 * (vp + vn)) + 0.5 * std::log( (vp + vn) / (2 * std::sqrt(vp * vn)) );
+    s.kullbackLeibler = 0.5 * (std::log(vn / vp) + (vp + distance) / vn - 1);
+    s.fisher = distance / (vp + vn);
+    return s;
+}
+
+
+
+/**
+ * Edges of a bin of histogramBin(). Feature values are truncated towards zero, so the middle
+ * bin spans (-width, width); the first bin holds everything up to -sqrt(2) and the last one
+ * everything from sqrt(2) - width on.
+ */
+inline void histogramBinEdges(const int bin, const int buckets, double & low, double & high)
+{
+    const double width = std::sqrt(2.0) / (buckets / 2);
+    const int half = buckets / 2;
+
+    if (bin == 0)
+    {
+        low = -std::numeric_limits<double>::infinity();
+        high = -std::sqrt(2.0);
+    }
+    else if (bin < half)
+    {
+        low = -(half - bin + 1) * width;
+        high = -(half - bin) * width;
+    }
+    else if (bin == half)
+    {
+        low = -width;
+        high = width;
+    }
+    else
+    {
+        low = (bin - half) * width;
+        high = bin == buckets - 1 ? std::numeric_limits<double>::infinity() : (bin - half + 1) * width;
+    }
+}
+
+
+
+/**
+ * Mean and variance of the feature values of a histogram, each bin taken at its center and
+ * the unbounded ones half a bin past their edge.
+ */
+inline void histogramMoments(const std::vector<double> & frequencies, double & mean, double & variance)
+{
+    const int buckets = frequencies.size();
+    const double width = std::sqrt(2.0) / (buckets / 2);
+
+    double total = 0, sum = 0, squares = 0;
+    for (int b = 0; b < buckets; ++b)
+    {
+        double low, high;
+        histogramBinEdges(b, buckets, low, high);
+        const double center = b == 0 ? high - width / 2 :
+                              b == buckets - 1 ? low + width / 2 :
+                              (low + high) / 2;
+
+        total += frequencies[b];
+        sum += frequencies[b] * center;
+        squares += frequencies[b] * center * center;
+    }
+
+    mean = total > 0 ? sum / total : 0;
+    variance = total > 0 ? squares / total - mean * mean : 0;
+}
+
+
+
+/**
+ * Bhattacharyya distance and Kullback-Leibler divergence of two discrete distributions over
+ * the same bins; the Fisher ratio is left to the caller.
+ */
+inline void discreteSeparability(const std::vector<double> & positive, const std::vector<double> & negative, Separability & s)
+{
+    double positiveTotal = 0, negativeTotal = 0;
+    for (unsigned int b = 0; b < positive.size(); ++b)
+    {
+        positiveTotal += positive[b];
+        negativeTotal += negative[b];
+    }
+
+    double coefficient = 0, divergence = 0;
+    for (unsigned int b = 0; b < positive.size(); ++b)
+    {
+        const double p = positiveTotal > 0 ? positive[b] / positiveTotal : 0;
+        const double q = negativeTotal > 0 ? negative[b] / negativeTotal : 0;
+
+        coefficient += std::sqrt(p * q);
+        if (p > 0)
+        {
+            divergence += p * std::log( p / std::max(q, SEPARABILITY_EPSILON) );
+        }
+    }
+
+    s.bhattacharyya = -std::log( std::max(coefficient, SEPARABILITY_EPSILON) );
+    s.kullbackLeibler = divergence;
+}
+
+
+
+/**
+ * Separability of two histograms laid out by histogramBin().
+ */
+inline Separability histogramSeparability(const std::vector<double> & positive, const std::vector<double> & negative)
+{
+    Separability s;
+    discreteSeparability(positive, negative, s);
+
+    double positiveMean, positiveVariance, negativeMean, negativeVariance;
+    histogramMoments(positive, positiveMean, positiveVariance);
+    histogramMoments(negative, negativeMean, negativeVariance);
+    s.fisher = gaussianSeparability(positiveMean, positiveVariance, negativeMean, negativeVariance).fisher;
+    return s;
+}
+
+
+
+/**
+ * Separability of a normal distribution of positive feature values and a histogram of the
+ * negative ones. The normal distribution is integrated over the bins of the histogram.
+ */
+inline Separability gaussianHistogramSeparability(const double positiveMean,
+                                                  const double positiveStdDev,
+                                                  const std::vector<double> & negative)
+{
+    const int buckets = negative.size();
+    const double scale = 1.0 / (std::max(positiveStdDev, std::sqrt(SEPARABILITY_EPSILON)) * std::sqrt(2.0));
+
+    std::vector<double> positive(buckets);
+    for (int b = 0; b < buckets; ++b)
+    {
+        double low, high;
+        histogramBinEdges(b, buckets, low, high);
+        positive[b] = 0.5 * ( std::erfc((positiveMean - high) * scale) - std::erfc((positiveMean - low) * scale) );
+    }
+
+    Separability s;
+    discreteSeparability(positive, negative, s);
+
+    double negativeMean, negativeVariance;
+    histogramMoments(negative, negativeMean, negativeVariance);
+    s.fisher = gaussianSeparability(positiveMean, positiveStdDev * positiveStdDev, negativeMean, negativeVariance).fisher;
+    return s;
+}
+
+
+
+/**
+ * Orders classifiers by a key: their own operator < for the standard deviation, their
+ * separability otherwise.
+ */
+template <typename Classifier>
+class BySortKey
+{
+    SortKey key;
+
+public:
+    bool operator()(const Classifier & a, const Classifier & b) const
+    {
+        return key == SORT_BY_STDDEV ? a < b
+                                     : a.getSeparability().get(key) > b.getSeparability().get(key);
+    }
+
+    BySortKey(const SortKey key_) : key(key_) {}
+};
+
+
+
+template <typename Iterator>
+inline void sortClassifiers(const Iterator begin, const Iterator end, const SortKey key)
+{
+    tbb::parallel_sort(begin, end, BySortKey<typename std::iterator_traits<Iterator>::value_type>(key));
+}
+
+
+
+#endif // SEPARABILITY_H
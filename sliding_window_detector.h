@@ -0,0 +1,497 @@
+#ifndef SLIDING_WINDOW_DETECTOR_H
+#define SLIDING_WINDOW_DETECTOR_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <tbb/tbb.h>
+
+#include "haarwavelet.h"
+
+#include "wavelet_kernels.h"
+#include "optimization_commons.h"
+
+
+
+#define DETECTOR_TILE 32 //window positions per side of the tiles scanned in parallel
+
+
+
+/**
+ * Window found by a detector and its score, the sum of the votes of the weak classifiers
+ * that accepted it.
+ */
+struct Detection
+{
+    cv::Rect window;
+    double score;
+
+    //Best detections first
+    bool operator < (const Detection & rh) const
+    {
+        return score > rh.score
+            || (score == rh.score && (window.y < rh.window.y || (window.y == rh.window.y && window.x < rh.window.x)));
+    }
+};
+
+
+
+/**
+ * Strong classifier written by haarboost, kept as a structure of arrays: the rectangles and
+ * weights of every weak classifier are padded to MAX_RECTANGLES, with null weights, so the
+ * loops over them have constant bounds.
+ */
+class BoostedClassifier
+{
+public:
+    std::vector<cv::Rect> rects;        //MAX_RECTANGLES per weak classifier
+    std::vector<float> weights;         //MAX_RECTANGLES per weak classifier
+    std::vector<float> thresholds;
+    std::vector<int> polarities;
+    std::vector<double> alphas;
+
+    BoostedClassifier() {}
+
+    /**
+     * Loads a file with one weak classifier per line: the wavelet, the threshold, the
+     * polarity and the vote of its stump.
+     */
+    bool load(const std::string & filename)
+    {
+        std::ifstream input(filename.c_str());
+        if ( !input.is_open() )
+        {
+            return false;
+        }
+
+        std::string line;
+        while ( std::getline(input, line) )
+        {
+            if (line.empty())
+            {
+                continue;
+            }
+
+            std::istringstream lineInputStream(line);
+            HaarWavelet wavelet;
+            float threshold;
+            int polarity;
+            double alpha;
+            if ( !wavelet.read(lineInputStream)
+                 || !(lineInputStream >> threshold >> polarity >> alpha)
+                 || wavelet.dimensions() < 1 || wavelet.dimensions() > MAX_RECTANGLES )
+            {
+                return false;
+            }
+
+            add(wavelet, threshold, polarity, alpha);
+        }
+
+        return !alphas.empty();
+    }
+
+    void add(const HaarWavelet & wavelet, const float threshold, const int polarity, const double alpha)
+    {
+        for (int i = 0; i < MAX_RECTANGLES; ++i)
+        {
+            const bool used = i < (int)wavelet.dimensions();
+            rects.push_back( used ? wavelet.rect(i) : cv::Rect(0, 0, 1, 1) );
+            weights.push_back( used ? wavelet.weight(i) : 0 );
+        }
+        thresholds.push_back(threshold);
+        polarities.push_back(polarity);
+        alphas.push_back(alpha);
+    }
+
+    int size() const
+    {
+        return alphas.size();
+    }
+
+    double totalAlpha() const
+    {
+        double total = 0;
+        for (unsigned int t = 0; t < alphas.size(); ++t)
+        {
+            total += alphas[t];
+        }
+        return total;
+    }
+};
+
+
+
+/**
+ * Table of a boosted classifier for windows scale times the size of the training samples:
+ * the rectangles are scaled, and their weights divided by their scaled areas, so that any
+ * scale is scanned over the integral image of the frame itself instead of a resized frame.
+ * Rectangles are rounded to whole pixels and kept inside the window.
+ */
+class ScaledClassifier
+{
+public:
+    int windowSize;
+    int step;                        //pixels between windows at this scale
+    std::vector<cv::Rect> rects;     //MAX_RECTANGLES per weak classifier
+    std::vector<double> areaWeights; //1 per rectangle
+
+    ScaledClassifier(const BoostedClassifier & classifier,
+                     const int trainingWindowSize,
+                     const int trainingStep,
+                     const double scale) : windowSize(round(trainingWindowSize * scale)),
+                                           step(std::max(1, round(trainingStep * scale))),
+                                           rects(classifier.rects.size()),
+                                           areaWeights(classifier.rects.size())
+    {
+        for (unsigned int r = 0; r < rects.size(); ++r)
+        {
+            const cv::Rect & rect = classifier.rects[r];
+            const int x = std::min(round(rect.x * scale), windowSize - 1);
+            const int y = std::min(round(rect.y * scale), windowSize - 1);
+            const int width = std::max(1, std::min(round(rect.width * scale), windowSize - x));
+            const int height = std::max(1, std::min(round(rect.height * scale), windowSize - y));
+            rects[r] = cv::Rect(x, y, width, height);
+            areaWeights[r] = classifier.weights[r] / rects[r].area();
+        }
+    }
+
+private:
+    static int round(const double value)
+    {
+        return (int)std::floor(value + 0.5);
+    }
+};
+
+
+
+/**
+ * Copies the integral of the size x size window whose corner is at x, y out of the integral
+ * of a frame, rebased so it starts at zero as the integral of a training sample does.
+ */
+inline void windowIntegral(const cv::Mat & iSum, const int x, const int y, const int size, cv::Mat & windowSum)
+{
+    const double * const top = iSum.ptr<double>(y) + x;
+    for (int r = 0; r <= size; ++r)
+    {
+        const double * const row = iSum.ptr<double>(y + r) + x;
+        double * const sums = windowSum.ptr<double>(r);
+        for (int c = 0; c <= size; ++c)
+        {
+            sums[c] = row[c] - top[c] - row[0] + top[0];
+        }
+    }
+}
+
+
+
+/**
+ * A scaled classifier laid over the integral image of a frame: the corner offsets of every
+ * rectangle, relative to the corner of the window, for the stride of the frame.
+ */
+class FrameKernel
+{
+public:
+    FrameKernel(const BoostedClassifier & classifier,
+                const ScaledClassifier & scaled,
+                const int stride) : windowSize(scaled.windowSize),
+                                    weakClassifiers(classifier.size()),
+                                    corners(weakClassifiers * MAX_RECTANGLES * 4),
+                                    areaWeights(scaled.areaWeights),
+                                    thresholds(classifier.thresholds),
+                                    polarities(classifier.polarities),
+                                    alphas(classifier.alphas),
+                                    remainingAlphas(weakClassifiers + 1, 0),
+                                    weightSums(weakClassifiers, 0)
+    {
+        for (int r = 0; r < weakClassifiers * MAX_RECTANGLES; ++r)
+        {
+            const cv::Rect & rect = scaled.rects[r];
+            corners[4 * r]     = rect.y * stride + rect.x;
+            corners[4 * r + 1] = rect.y * stride + rect.x + rect.width;
+            corners[4 * r + 2] = (rect.y + rect.height) * stride + rect.x;
+            corners[4 * r + 3] = (rect.y + rect.height) * stride + rect.x + rect.width;
+        }
+
+        for (int t = weakClassifiers - 1; t >= 0; --t)
+        {
+            remainingAlphas[t] = remainingAlphas[t + 1] + alphas[t];
+            for (int i = 0; i < MAX_RECTANGLES; ++i)
+            {
+                weightSums[t] += classifier.weights[MAX_RECTANGLES * t + i];
+            }
+        }
+
+        windowCorners[0] = 0;
+        windowCorners[1] = windowSize;
+        windowCorners[2] = windowSize * stride;
+        windowCorners[3] = windowSize * stride + windowSize;
+    }
+
+    /**
+     * Sum of the pixels of the window whose integral starts at the given pointer.
+     */
+    inline double windowSum(const double * const integral) const
+    {
+        return integral[windowCorners[3]] - integral[windowCorners[1]]
+             - integral[windowCorners[2]] + integral[windowCorners[0]];
+    }
+
+    /**
+     * Feature value of weak classifier t on the window: its weights on the intensity
+     * normalized SRFS, (mean of each rectangle - offset) * scale with the factors of the
+     * window, as in training.
+     */
+    inline float response(const double * const integral, const double offset, const double scale, const int t) const
+    {
+        const int * const c = &corners[4 * MAX_RECTANGLES * t];
+        const double * const w = &areaWeights[MAX_RECTANGLES * t];
+
+        double value = 0;
+        for (int i = 0; i < MAX_RECTANGLES; ++i)
+        {
+            value += (integral[c[4 * i + 3]] - integral[c[4 * i + 1]]
+                    - integral[c[4 * i + 2]] + integral[c[4 * i]]) * w[i];
+        }
+
+        return (value - offset * weightSums[t]) * scale;
+    }
+
+    /**
+     * Score of a window: the votes of the weak classifiers that accept it. Gives up,
+     * returning a negative score, once the remaining votes can't reach the given score.
+     */
+    inline double score(const double * const integral, const double offset, const double scale, const double minScore) const
+    {
+        double score = 0;
+        for (int t = 0; t < weakClassifiers; ++t)
+        {
+            if (score + remainingAlphas[t] < minScore)
+            {
+                return -1;
+            }
+
+            if (polarities[t] * response(integral, offset, scale, t) < polarities[t] * thresholds[t])
+            {
+                score += alphas[t];
+            }
+        }
+        return score;
+    }
+
+    int getWindowSize() const
+    {
+        return windowSize;
+    }
+
+private:
+    int windowSize;
+    int weakClassifiers;
+    std::vector<int> corners;        //4 per rectangle
+    std::vector<double> areaWeights; //1 per rectangle
+    std::vector<float> thresholds;
+    std::vector<int> polarities;
+    std::vector<double> alphas;
+    std::vector<double> remainingAlphas; //votes of the weak classifiers from t on
+    std::vector<double> weightSums;      //1 per weak classifier
+    int windowCorners[4];
+};
+
+
+
+/**
+ * Functor used by Intel TBB to scan tiles of window positions of a frame.
+ */
+class ScanTiles
+{
+    const FrameKernel * kernel;
+    const cv::Mat * iSum;
+    const cv::Mat * iSquare;     //empty when flat windows are not skipped
+    int step;
+    double minScore;
+    double minVariance;
+    tbb::concurrent_vector<Detection> * detections;
+
+public:
+    void operator()(const tbb::blocked_range2d<int> & range) const
+    {
+        const int size = kernel->getWindowSize();
+        const double inverseArea = 1.0 / (size * size);
+        cv::Mat windowSum(size + 1, size + 1, cv::DataType<double>::type);
+
+        for (int r = range.rows().begin(); r != range.rows().end(); ++r)
+        {
+            for (int c = range.cols().begin(); c != range.cols().end(); ++c)
+            {
+                const int x = c * step, y = r * step;
+
+                if ( !iSquare->empty() )
+                {
+                    const double mean = kernel->windowSum(iSum->ptr<double>(y) + x) * inverseArea;
+                    const double variance = kernel->windowSum(iSquare->ptr<double>(y) + x) * inverseArea - mean * mean;
+                    if (variance < minVariance)
+                    {
+                        continue;
+                    }
+                }
+
+                double offset, scale;
+                windowIntegral(*iSum, x, y, size, windowSum);
+                intensityNormalization(windowSum, offset, scale);
+
+                const double score = kernel->score(iSum->ptr<double>(y) + x, offset, scale, minScore);
+                if (score >= minScore)
+                {
+                    Detection detection;
+                    detection.window = cv::Rect(x, y, size, size);
+                    detection.score = score;
+                    detections->push_back(detection);
+                }
+            }
+        }
+    }
+
+    ScanTiles(const FrameKernel * kernel_,
+              const cv::Mat * iSum_,
+              const cv::Mat * iSquare_,
+              const int step_,
+              const double minScore_,
+              const double minVariance_,
+              tbb::concurrent_vector<Detection> * detections_) : kernel(kernel_),
+                                                                 iSum(iSum_),
+                                                                 iSquare(iSquare_),
+                                                                 step(step_),
+                                                                 minScore(minScore_),
+                                                                 minVariance(minVariance_),
+                                                                 detections(detections_) {}
+};
+
+
+
+/**
+ * Scans gray level frames with a boosted classifier at scales 1, scaleFactor, scaleFactor^2...
+ * times the training window, one window position every step pixels scaled as well. A window
+ * is detected when its score reaches threshold times the sum of the votes, 0.5 as in Viola &
+ * Jones. Windows whose standard deviation is below minStdDev are skipped without evaluating
+ * the classifier.
+ *
+ * The scaled tables of the classifier are computed once, when the detector is built. Each
+ * frame then gets a single integral image, plus the integral of the squares when flat windows
+ * are skipped, and every scale is scanned over it; the window positions of a scale in
+ * parallel, DETECTOR_TILE x DETECTOR_TILE at a time. Scales whose window doesn't fit in the
+ * frame are skipped.
+ *
+ * Each window is normalized with the intensity normalization the training samples got when
+ * they were loaded (intensityNormalization), calibrated on the integral of the window. This
+ * takes a probe evaluation per window, which the windows skipped for their standard deviation
+ * don't pay.
+ */
+class SlidingWindowDetector
+{
+public:
+    SlidingWindowDetector(const BoostedClassifier & classifier_,
+                          const int windowSize,
+                          const double threshold,
+                          const int step,
+                          const double minStdDev,
+                          const int scales = 1,
+                          const double scaleFactor = 1.25) : classifier(classifier_),
+                                                             minScore(threshold * classifier_.totalAlpha()),
+                                                             minVariance(minStdDev * minStdDev)
+    {
+        double scale = 1;
+        for (int s = 0; s < scales; ++s)
+        {
+            scaledClassifiers.push_back( ScaledClassifier(classifier, windowSize, step, scale) );
+            scale *= scaleFactor;
+        }
+    }
+
+    int scales() const
+    {
+        return scaledClassifiers.size();
+    }
+
+    /**
+     * Detections on the frame, at every scale, best first.
+     */
+    void detect(const cv::Mat & image, std::vector<Detection> & detections) const
+    {
+        detections.clear();
+        if (image.rows < scaledClassifiers.front().windowSize || image.cols < scaledClassifiers.front().windowSize)
+        {
+            return;
+        }
+
+        cv::Mat iSum, iSquare;
+        if (minVariance > 0)
+        {
+            cv::integral(image, iSum, iSquare, cv::DataType<double>::type);
+        }
+        else
+        {
+            cv::integral(image, iSum, cv::DataType<double>::type);
+        }
+
+        tbb::concurrent_vector<Detection> found;
+        for (unsigned int s = 0; s < scaledClassifiers.size(); ++s)
+        {
+            const ScaledClassifier & scaled = scaledClassifiers[s];
+            if (image.rows < scaled.windowSize || image.cols < scaled.windowSize)
+            {
+                break;
+            }
+
+            const FrameKernel kernel(classifier, scaled, iSum.cols);
+
+            const int rows = (image.rows - scaled.windowSize) / scaled.step + 1;
+            const int cols = (image.cols - scaled.windowSize) / scaled.step + 1;
+
+            tbb::parallel_for( tbb::blocked_range2d<int>(0, rows, DETECTOR_TILE, 0, cols, DETECTOR_TILE),
+                               ScanTiles(&kernel, &iSum, &iSquare, scaled.step, minScore, minVariance, &found) );
+        }
+
+        detections.assign(found.begin(), found.end());
+        std::sort(detections.begin(), detections.end());
+    }
+
+    /**
+     * Feature values of every weak classifier on the window of the first scale whose corner
+     * is at the given point, normalized as when the frame is scanned.
+     */
+    void responses(const cv::Mat & image, const cv::Point & corner, std::vector<float> & values) const
+    {
+        const ScaledClassifier & scaled = scaledClassifiers.front();
+
+        cv::Mat iSum;
+        cv::integral(image, iSum, cv::DataType<double>::type);
+
+        cv::Mat windowSum(scaled.windowSize + 1, scaled.windowSize + 1, cv::DataType<double>::type);
+        windowIntegral(iSum, corner.x, corner.y, scaled.windowSize, windowSum);
+        double offset, scale;
+        intensityNormalization(windowSum, offset, scale);
+
+        const FrameKernel kernel(classifier, scaled, iSum.cols);
+        values.resize(classifier.size());
+        for (int t = 0; t < classifier.size(); ++t)
+        {
+            values[t] = kernel.response(iSum.ptr<double>(corner.y) + corner.x, offset, scale, t);
+        }
+    }
+
+private:
+    const BoostedClassifier & classifier;
+    std::vector<ScaledClassifier> scaledClassifiers; //one per scale, growing
+    double minScore;
+    double minVariance;
+};
+
+
+
+#endif // SLIDING_WINDOW_DETECTOR_H
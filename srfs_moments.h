@@ -0,0 +1,149 @@
+#ifndef SRFS_MOMENTS_H
+#define SRFS_MOMENTS_H
+
+#include <algorithm>
+
+#include "wavelet_kernels.h"
+
+
+
+/**
+ * Streaming sufficient statistics of the SRFS of one wavelet over a sample set: the amount
+ * of samples, their mean and their co-moment matrix (the sum of the outer products of the
+ * deviations from the mean). Samples are added one at a time with Welford's update and two
+ * sets of statistics merge exactly with Chan et al.'s formulas, so the covariance of a
+ * sample set can be updated without going through the samples that were already seen.
+ *
+ * The single precision flavour only accumulates short blocks of samples, which are then
+ * merged into double precision statistics.
+ */
+template <typename T>
+struct BasicSrfsMoments
+{
+    int dimensions;
+    T count;
+    T mean[MAX_RECTANGLES];
+    T comoment[MAX_RECTANGLES][MAX_RECTANGLES];
+
+    BasicSrfsMoments(const int dimensions_ = 0)
+    {
+        reset(dimensions_);
+    }
+
+    void reset(const int dimensions_)
+    {
+        dimensions = dimensions_;
+        count = 0;
+        std::fill(&mean[0], &mean[0] + MAX_RECTANGLES, T(0));
+        std::fill(&comoment[0][0], &comoment[0][0] + MAX_RECTANGLES * MAX_RECTANGLES, T(0));
+    }
+
+    /**
+     * K is the amount of dimensions when it is known at compile time, 0 otherwise.
+     */
+    template <int K>
+    inline void add(const T * const srfs)
+    {
+        const int n = K > 0 ? K : dimensions;
+
+        count += 1;
+
+        T delta[MAX_RECTANGLES];
+        for (int i = 0; i < n; ++i)
+        {
+            delta[i] = srfs[i] - mean[i];
+            mean[i] += delta[i] / count;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                comoment[i][j] += delta[i] * (srfs[j] - mean[j]);
+            }
+        }
+    }
+
+    inline void add(const T * const srfs)
+    {
+        add<0>(srfs);
+    }
+
+    /**
+     * Adds a sample that counts weight times (West's weighted update), as the bootstrap
+     * replicates do with their Poisson weights.
+     */
+    template <int K>
+    inline void add(const T * const srfs, const T weight)
+    {
+        const int n = K > 0 ? K : dimensions;
+
+        count += weight;
+
+        T delta[MAX_RECTANGLES];
+        for (int i = 0; i < n; ++i)
+        {
+            delta[i] = srfs[i] - mean[i];
+            mean[i] += delta[i] * weight / count;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                comoment[i][j] += weight * delta[i] * (srfs[j] - mean[j]);
+            }
+        }
+    }
+
+    template <typename U>
+    void merge(const BasicSrfsMoments<U> & other)
+    {
+        if (other.count == 0)
+        {
+            return;
+        }
+        if (count == 0)
+        {
+            dimensions = other.dimensions;
+            count = other.count;
+            std::copy(&other.mean[0], &other.mean[0] + MAX_RECTANGLES, &mean[0]);
+            std::copy(&other.comoment[0][0], &other.comoment[0][0] + MAX_RECTANGLES * MAX_RECTANGLES, &comoment[0][0]);
+            return;
+        }
+
+        const T total = count + other.count;
+
+        T delta[MAX_RECTANGLES];
+        for (int i = 0; i < dimensions; ++i)
+        {
+            delta[i] = other.mean[i] - mean[i];
+            mean[i] += delta[i] * other.count / total;
+        }
+
+        for (int i = 0; i < dimensions; ++i)
+        {
+            for (int j = 0; j < dimensions; ++j)
+            {
+                comoment[i][j] += other.comoment[i][j] + delta[i] * delta[j] * count * other.count / total;
+            }
+        }
+
+        count = total;
+    }
+
+    /**
+     * Sample covariance, with the same n - 1 denominator libpca uses.
+     */
+    inline T covariance(const int i, const int j) const
+    {
+        return comoment[i][j] / (count - 1);
+    }
+};
+
+typedef BasicSrfsMoments<double> SrfsMoments;
+typedef BasicSrfsMoments<float> FloatSrfsMoments;
+
+
+
+#endif // SRFS_MOMENTS_H
@@ -0,0 +1,193 @@
+#ifndef SYMMETRIC_EIGEN_H
+#define SYMMETRIC_EIGEN_H
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include "wavelet_kernels.h"
+#include "srfs_moments.h"
+
+
+
+#define JACOBI_MAX_SWEEPS 50
+
+
+
+/**
+ * Eigen decomposition of the covariance matrix of a wavelet's SRFS, with cyclic Jacobi
+ * rotations on fixed-size arrays. It never touches the heap, unlike libpca and armadillo,
+ * so it can run once per wavelet in the optimizers' hot loop.
+ *
+ * Results follow libpca: eigenvalues in descending order and each eigenvector signed so
+ * that its component of largest magnitude is positive. Eigenvalues are not normalized.
+ */
+struct SymmetricEigen
+{
+    int dimensions;
+    double covariance[MAX_RECTANGLES][MAX_RECTANGLES];
+    double values[MAX_RECTANGLES];
+    double vectors[MAX_RECTANGLES][MAX_RECTANGLES]; //vectors[k] is the k-th eigenvector
+
+    void solve(const SrfsMoments & moments)
+    {
+        if (moments.count < 2)
+        {
+            throw std::logic_error("Number of records smaller than two.");
+        }
+
+        dimensions = moments.dimensions;
+        for (int i = 0; i < dimensions; ++i)
+        {
+            for (int j = 0; j < dimensions; ++j)
+            {
+                covariance[i][j] = moments.covariance(i, j);
+            }
+        }
+
+        solve();
+    }
+
+    /**
+     * Variance of the projection of the SRFS on the given weights.
+     */
+    template <typename Iterator>
+    double projectedVariance(const Iterator weights) const
+    {
+        double variance = 0;
+        for (int i = 0; i < dimensions; ++i)
+        {
+            for (int j = 0; j < dimensions; ++j)
+            {
+                variance += weights[i] * covariance[i][j] * weights[j];
+            }
+        }
+        return variance;
+    }
+
+    /**
+     * Sets the eigenvalues and eigenvectors from the diagonal left by the rotations and
+     * their accumulated product v (whose columns are the eigenvectors), sorted and signed.
+     */
+    void arrange(const double diagonal[MAX_RECTANGLES], const double v[MAX_RECTANGLES][MAX_RECTANGLES])
+    {
+        const int n = dimensions;
+
+        //Sort descending, as libpca does
+        int order[MAX_RECTANGLES];
+        for (int i = 0; i < n; ++i)
+        {
+            order[i] = i;
+        }
+        for (int i = 1; i < n; ++i)
+        {
+            for (int j = i; j > 0 && diagonal[order[j]] > diagonal[order[j - 1]]; --j)
+            {
+                std::swap(order[j], order[j - 1]);
+            }
+        }
+
+        for (int k = 0; k < n; ++k)
+        {
+            values[k] = diagonal[order[k]];
+
+            double largest = 0, smallest = 0;
+            for (int i = 0; i < n; ++i)
+            {
+                vectors[k][i] = v[i][order[k]];
+                largest = std::max(largest, vectors[k][i]);
+                smallest = std::min(smallest, vectors[k][i]);
+            }
+
+            //libpca's enforce_positive_sign_by_column
+            if ( std::abs(largest) >= std::abs(smallest) ? largest < 0 : smallest < 0 )
+            {
+                for (int i = 0; i < n; ++i)
+                {
+                    vectors[k][i] = -vectors[k][i];
+                }
+            }
+        }
+    }
+
+private:
+    void solve()
+    {
+        const int n = dimensions;
+
+        double a[MAX_RECTANGLES][MAX_RECTANGLES];
+        double v[MAX_RECTANGLES][MAX_RECTANGLES];
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                a[i][j] = covariance[i][j];
+                v[i][j] = i == j ? 1 : 0;
+            }
+        }
+
+        for (int sweep = 0; sweep < JACOBI_MAX_SWEEPS; ++sweep)
+        {
+            double diagonal = 0, offDiagonal = 0;
+            for (int p = 0; p < n; ++p)
+            {
+                diagonal += a[p][p] * a[p][p];
+                for (int q = p + 1; q < n; ++q)
+                {
+                    offDiagonal += a[p][q] * a[p][q];
+                }
+            }
+            if (offDiagonal <= 1e-30 * diagonal)
+            {
+                break;
+            }
+
+            for (int p = 0; p < n; ++p)
+            {
+                for (int q = p + 1; q < n; ++q)
+                {
+                    if (a[p][q] == 0)
+                    {
+                        continue;
+                    }
+
+                    //Rotation that zeroes a[p][q] (Numerical Recipes, 11.1)
+                    const double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+                    const double t = (theta >= 0 ? 1 : -1) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+                    const double c = 1 / std::sqrt(t * t + 1);
+                    const double s = t * c;
+
+                    for (int k = 0; k < n; ++k)
+                    {
+                        const double akp = a[k][p], akq = a[k][q];
+                        a[k][p] = c * akp - s * akq;
+                        a[k][q] = s * akp + c * akq;
+                    }
+                    for (int k = 0; k < n; ++k)
+                    {
+                        const double apk = a[p][k], aqk = a[q][k];
+                        a[p][k] = c * apk - s * aqk;
+                        a[q][k] = s * apk + c * aqk;
+                    }
+                    for (int k = 0; k < n; ++k)
+                    {
+                        const double vkp = v[k][p], vkq = v[k][q];
+                        v[k][p] = c * vkp - s * vkq;
+                        v[k][q] = s * vkp + c * vkq;
+                    }
+                }
+            }
+        }
+
+        double diagonal[MAX_RECTANGLES];
+        for (int i = 0; i < n; ++i)
+        {
+            diagonal[i] = a[i][i];
+        }
+        arrange(diagonal, v);
+    }
+};
+
+
+
+#endif // SYMMETRIC_EIGEN_H
@@ -0,0 +1,188 @@
+#ifndef WAVELET_KERNELS_H
+#define WAVELET_KERNELS_H
+
+#include <cmath>
+
+#include "haarwavelet.h"
+
+#include "detector_window.h"
+
+
+
+#define MAX_RECTANGLES 6
+
+
+
+/**
+ * Normalization factors of a sample, computed once when it is loaded and stored in the row
+ * that follows its integral sums (DetectorWindow::footer), in the same precision.
+ *
+ * The SRFS value of a rectangle is (mean of the rectangle - offset) * scale. Offsets and
+ * scales are calibrated against the evaluators of haarcommon when the sample is loaded
+ * (see calibrateNormalization), so the kernels give the values the library would give.
+ */
+enum SampleNormalization
+{
+    SAMPLE_MEAN = 0,
+    SAMPLE_STDDEV = 1,
+    INTENSITY_SCALE = 2,  //IntensityNormalizedWaveletEvaluator
+    VARIANCE_SCALE = 3,   //VarianceNormalizedWaveletEvaluator
+    INTENSITY_OFFSET = 4,
+    VARIANCE_OFFSET = 5
+};
+
+
+
+/**
+ * Evaluates the single rectangle feature space (SRFS) of one wavelet directly on the
+ * continuous integral images of SIZE x SIZE samples, either in double or in single
+ * precision.
+ *
+ * The four corner offsets of each rectangle are computed once per wavelet. The window
+ * stride and the corners of the whole sample are compile-time constants, so each
+ * supported window size gets its own specialized code. When K, the amount of rectangles,
+ * is given too, the loops over the rectangles have constant bounds as well.
+ */
+template <int SIZE, int K = 0>
+class WaveletKernel
+{
+public:
+    typedef DetectorWindow<SIZE> Window;
+
+    WaveletKernel() : dimensions_(0) {}
+
+    WaveletKernel(const AbstractHaarWavelet & wavelet) : dimensions_(wavelet.dimensions())
+    {
+        for (int i = 0; i < dimensions_; ++i)
+        {
+            const cv::Rect r = wavelet.rect(i);
+            corners[i][0] = Window::offset(r.x,           r.y);
+            corners[i][1] = Window::offset(r.x + r.width, r.y);
+            corners[i][2] = Window::offset(r.x,           r.y + r.height);
+            corners[i][3] = Window::offset(r.x + r.width, r.y + r.height);
+            inverseAreas[i] = 1.0 / r.area();
+        }
+    }
+
+    inline int dimensions() const
+    {
+        return K > 0 ? K : dimensions_;
+    }
+
+    template <typename T>
+    inline T rectangleSum(const T * const integral, const int i) const
+    {
+        return integral[corners[i][3]] - integral[corners[i][1]]
+             - integral[corners[i][2]] + integral[corners[i][0]];
+    }
+
+    /**
+     * Intensity normalized SRFS, as IntensityNormalizedWaveletEvaluator::srfs.
+     */
+    template <typename T>
+    inline void srfs(const T * const iSum, T * const srfs) const
+    {
+        const T offset = normalization(iSum, INTENSITY_OFFSET);
+        const T scale = normalization(iSum, INTENSITY_SCALE);
+
+        for (int i = 0; i < dimensions(); ++i)
+        {
+            srfs[i] = (rectangleSum(iSum, i) * (T)inverseAreas[i] - offset) * scale;
+        }
+    }
+
+    /**
+     * Variance normalized SRFS, as VarianceNormalizedWaveletEvaluator::srfs.
+     */
+    inline void varianceNormalizedSrfs(const double * const iSum, double * const srfs) const
+    {
+        const double offset = normalization(iSum, VARIANCE_OFFSET);
+        const double scale = normalization(iSum, VARIANCE_SCALE);
+
+        for (int i = 0; i < dimensions(); ++i)
+        {
+            srfs[i] = (rectangleSum(iSum, i) * inverseAreas[i] - offset) * scale;
+        }
+    }
+
+    /**
+     * Feature value of the variance normalized SRFS with the given weights. The weights
+     * are expected to be divided by the areas of the rectangles already (areaWeights).
+     */
+    inline double varianceNormalizedFeature(const double * const iSum,
+                                            const double * const areaWeights,
+                                            const double weightSum) const
+    {
+        double value = 0;
+        for (int i = 0; i < dimensions(); ++i)
+        {
+            value += rectangleSum(iSum, i) * areaWeights[i];
+        }
+        return (value - normalization(iSum, VARIANCE_OFFSET) * weightSum) * normalization(iSum, VARIANCE_SCALE);
+    }
+
+    /**
+     * varianceNormalizedFeature of a block of n samples. The loops over the samples are the
+     * inner ones, with the same operations on every sample, so the compiler vectorizes them
+     * (gathering the corners of the samples). The values are the same as one at a time.
+     */
+    inline void varianceNormalizedFeatures(const double * const * const iSums,
+                                           const int n,
+                                           const double * const areaWeights,
+                                           const double weightSum,
+                                           double * const values) const
+    {
+        for (int s = 0; s < n; ++s)
+        {
+            values[s] = 0;
+        }
+
+        for (int i = 0; i < dimensions(); ++i)
+        {
+            const double weight = areaWeights[i];
+            const int c0 = corners[i][0], c1 = corners[i][1], c2 = corners[i][2], c3 = corners[i][3];
+            for (int s = 0; s < n; ++s)
+            {
+                const double * const iSum = iSums[s];
+                values[s] += (iSum[c3] - iSum[c1] - iSum[c2] + iSum[c0]) * weight;
+            }
+        }
+
+        for (int s = 0; s < n; ++s)
+        {
+            const double * const footer = iSums[s] + Window::footer;
+            values[s] = (values[s] - footer[VARIANCE_OFFSET] * weightSum) * footer[VARIANCE_SCALE];
+        }
+    }
+
+    /**
+     * Weights divided by the areas of the rectangles, for varianceNormalizedFeature; returns
+     * the sum of the weights.
+     */
+    template <typename Iterator>
+    inline double areaWeights(const Iterator weights, double * const areaWeights) const
+    {
+        double weightSum = 0;
+        for (int i = 0; i < dimensions(); ++i)
+        {
+            areaWeights[i] = weights[i] * inverseAreas[i];
+            weightSum += weights[i];
+        }
+        return weightSum;
+    }
+
+    template <typename T>
+    static inline T normalization(const T * const integral, const SampleNormalization factor)
+    {
+        return integral[Window::footer + factor];
+    }
+
+private:
+    int dimensions_;
+    int corners[MAX_RECTANGLES][4];
+    double inverseAreas[MAX_RECTANGLES];
+};
+
+
+
+#endif // WAVELET_KERNELS_H
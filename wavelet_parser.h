@@ -0,0 +1,746 @@
+#ifndef WAVELET_PARSER_H
+#define WAVELET_PARSER_H
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+
+#include <tbb/tbb.h>
+
+#include "haarwavelet.h"
+#include "haarwaveletutilities.h"
+
+#include "wavelet_kernels.h"
+#include "packed_wavelet.h"
+
+
+
+#define PARSER_CHUNK_SIZE (4 << 20) //bytes of text parsed by one task, rounded to whole lines
+
+#define BAD_RECORD 1                //a chunk has a line that is not a wavelet
+#define TOO_MANY_RECTANGLES 2       //a chunk has a wavelet with more than MAX_RECTANGLES rectangles
+
+
+
+/**
+ * Read only memory mapping of a whole file.
+ */
+class MappedTextFile
+{
+public:
+    MappedTextFile() : mapping(0),
+                       length(0) {}
+
+    ~MappedTextFile()
+    {
+        if (mapping)
+        {
+            munmap(mapping, length);
+        }
+    }
+
+    bool open(const std::string & filename)
+    {
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat status;
+        if ( fstat(fd, &status) != 0 )
+        {
+            ::close(fd);
+            return false;
+        }
+
+        length = status.st_size;
+        if (length > 0)
+        {
+            mapping = mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                mapping = 0;
+                ::close(fd);
+                return false;
+            }
+            madvise(mapping, length, MADV_SEQUENTIAL);
+        }
+
+        ::close(fd);
+        return true;
+    }
+
+    const char * begin() const
+    {
+        return (const char *)mapping;
+    }
+
+    const char * end() const
+    {
+        return (const char *)mapping + length;
+    }
+
+private:
+    void * mapping;
+    size_t length;
+
+    //Not copyable: it owns the mapping
+    MappedTextFile(const MappedTextFile &);
+    MappedTextFile & operator=(const MappedTextFile &);
+};
+
+
+
+inline bool isBlank(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+
+/**
+ * End of the line that starts at p: its newline, or end.
+ */
+inline const char * lineEnd(const char * const p, const char * const end)
+{
+    const char * const newline = (const char *)std::memchr(p, '\n', end - p);
+    return newline ? newline : end;
+}
+
+
+
+inline bool isEmptyLine(const char * p, const char * const end)
+{
+    while (p != end && isBlank(*p))
+    {
+        ++p;
+    }
+    return p == end;
+}
+
+
+
+/**
+ * Parses the number at p, after any blanks of the same line, without streams or locales:
+ * decimal notation with an optional exponent, and nan and inf as written by iostream.
+ * Returns the end of the number, or null when there is none before the end of the line.
+ *
+ * Up to 19 significant digits with a power of ten within +-22 are converted exactly
+ * (Clinger's fast path); anything longer goes through strtod on a copy of the token.
+ */
+inline const char * parseNumber(const char * p, const char * const end, double & value)
+{
+    static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    while (p != end && isBlank(*p))
+    {
+        ++p;
+    }
+
+    const char * const start = p;
+    const bool negative = p != end && *p == '-';
+    if ( p != end && (*p == '-' || *p == '+') )
+    {
+        ++p;
+    }
+
+    if ( end - p >= 3 && (std::strncmp(p, "nan", 3) == 0 || std::strncmp(p, "inf", 3) == 0) )
+    {
+        value = p[0] == 'n' ? std::numeric_limits<double>::quiet_NaN() : std::numeric_limits<double>::infinity();
+        value = negative ? -value : value;
+        return p + 3;
+    }
+
+    unsigned long long mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; p != end && *p >= '0' && *p <= '9'; ++p, any = true)
+    {
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa > 0;
+        }
+        else
+        {
+            ++exponent;
+            ++digits;
+        }
+    }
+    if (p != end && *p == '.')
+    {
+        for (++p; p != end && *p >= '0' && *p <= '9'; ++p, any = true)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa > 0;
+                --exponent;
+            }
+            else
+            {
+                ++digits;
+            }
+        }
+    }
+    if (!any)
+    {
+        return 0;
+    }
+
+    if ( p != end && (*p == 'e' || *p == 'E') )
+    {
+        const char * q = p + 1;
+        const bool negativeExponent = q != end && *q == '-';
+        if ( q != end && (*q == '-' || *q == '+') )
+        {
+            ++q;
+        }
+        int e = 0;
+        const char * const digitsBegin = q;
+        for (; q != end && *q >= '0' && *q <= '9'; ++q)
+        {
+            e = std::min(e * 10 + (*q - '0'), 100000);
+        }
+        if (q != digitsBegin)
+        {
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
+    }
+
+    if ( digits <= 19 && mantissa < (1ULL << 53) && exponent >= -22 && exponent <= 22 )
+    {
+        value = exponent < 0 ? mantissa / powers[-exponent] : mantissa * powers[exponent];
+        value = negative ? -value : value;
+        return p;
+    }
+
+    char token[128];
+    const size_t length = std::min<size_t>(p - start, sizeof(token) - 1);
+    std::memcpy(token, start, length);
+    token[length] = 0;
+    value = std::strtod(token, 0);
+    return p;
+}
+
+
+
+/**
+ * True when the line from p to end is the header haargen writes first: the amount of
+ * wavelets of the file alone. A wavelet line always has more than one number.
+ */
+inline bool countHeader(const char * p, const char * const end, long & count)
+{
+    double value;
+    if ( !(p = parseNumber(p, end, value)) || !isEmptyLine(p, end) || value < 0 || value != (long)value )
+    {
+        return false;
+    }
+    count = (long)value;
+    return true;
+}
+
+
+
+/**
+ * Wavelet of one line of a text file, in fixed size arrays, followed by the amount of numbers
+ * that came after it on the line; the numbers themselves go to WaveletTextParser::extras().
+ */
+struct WaveletRecord
+{
+    int dimensions;
+    cv::Rect rects[MAX_RECTANGLES];
+    float weights[MAX_RECTANGLES];
+    float negativeWeights[MAX_RECTANGLES]; //dual weight records only
+    size_t extrasBegin;
+    int extrasCount;
+};
+
+
+
+/**
+ * Parses a text file of wavelets, one per line, in parallel. The file is memory mapped and
+ * split in chunks of about PARSER_CHUNK_SIZE bytes that end at line ends. A first parallel
+ * pass counts the records of each chunk, so that the second one parses every chunk straight
+ * into its place of a preallocated array of records.
+ *
+ * Records are expected in the layout of HaarWavelet::write: the amount of rectangles, the x,
+ * y, width and height of each rectangle and then their weights, the positive ones and then
+ * the negative ones for DualWeightHaarWavelet::write. Numbers after the wavelet are kept as
+ * the extras of the record. Since the layout is the library's, the first record is also read
+ * with the library and parse() fails with layoutMismatch() when they disagree, or when a
+ * record has more than MAX_RECTANGLES rectangles, so that the caller can go back to the
+ * stream based loaders. Any other failure means the file itself is bad.
+ *
+ * A first line with the amount of wavelets alone, as haargen writes, is skipped, and parse()
+ * fails when the file doesn't have that many records, as when it was cut short. Records end
+ * at the first empty line; whatever follows it is not parsed.
+ */
+class WaveletTextParser
+{
+public:
+    WaveletTextParser(const bool dualWeights_) : dualWeights(dualWeights_),
+                                                 mismatch(false) {}
+
+    bool parse(const std::string & filename)
+    {
+        records_.clear();
+        extras_.clear();
+        mismatch = false;
+
+        MappedTextFile file;
+        if ( !file.open(filename) )
+        {
+            return false;
+        }
+
+        long declaredCount = -1;
+        const char * const firstLineEnd = lineEnd(file.begin(), file.end());
+        const char * const first = countHeader(file.begin(), firstLineEnd, declaredCount) ? std::min(firstLineEnd + 1, file.end())
+                                                                                            : file.begin();
+
+        //Chunks end after a line end, or at the end of the file
+        std::vector<const char *> bounds(1, first);
+        while (bounds.back() != file.end())
+        {
+            const char * next = std::min(bounds.back() + PARSER_CHUNK_SIZE, file.end());
+            next = next == file.end() ? next : (const char *)std::memchr(next, '\n', file.end() - next);
+            bounds.push_back(next ? std::min(next + 1, file.end()) : file.end());
+        }
+
+        int chunks = bounds.size() - 1;
+        std::vector<size_t> firstRecords(chunks + 1, 0);
+        std::vector<const char *> emptyLines(chunks, (const char *)0);
+        tbb::parallel_for( tbb::blocked_range<int>(0, chunks), CountRecords(&bounds, &firstRecords, &emptyLines) );
+
+        //Drop everything from the first empty line on
+        for (int c = 0; c < chunks; ++c)
+        {
+            if (emptyLines[c])
+            {
+                bounds[c + 1] = emptyLines[c];
+                chunks = c + 1;
+                bounds.resize(chunks + 1);
+                firstRecords.resize(chunks + 1);
+                break;
+            }
+        }
+
+        for (int c = 0; c < chunks; ++c)
+        {
+            firstRecords[c + 1] += firstRecords[c];
+        }
+
+        if ( declaredCount >= 0 && firstRecords[chunks] != (size_t)declaredCount )
+        {
+            return false;
+        }
+
+        records_.resize(firstRecords[chunks]);
+        if ( records_.empty() || !matchesLibrary(bounds.front(), file.end()) )
+        {
+            return !mismatch;
+        }
+
+        std::vector< std::vector<double> > chunkExtras(chunks);
+        std::vector<char> failed(chunks, 0);
+        tbb::parallel_for( tbb::blocked_range<int>(0, chunks),
+                           ParseChunks(this, &bounds, &firstRecords, &chunkExtras, &failed) );
+        if ( std::find(failed.begin(), failed.end(), BAD_RECORD) != failed.end() )
+        {
+            records_.clear();
+            return false;
+        }
+        if ( std::find(failed.begin(), failed.end(), TOO_MANY_RECTANGLES) != failed.end() )
+        {
+            records_.clear();
+            mismatch = true;
+            return false;
+        }
+
+        //Gather the extras of the chunks, making their offsets absolute
+        size_t extrasSize = 0;
+        for (int c = 0; c < chunks; ++c)
+        {
+            for (size_t r = firstRecords[c]; r != firstRecords[c + 1]; ++r)
+            {
+                records_[r].extrasBegin += extrasSize;
+            }
+            extrasSize += chunkExtras[c].size();
+        }
+        extras_.reserve(extrasSize);
+        for (int c = 0; c < chunks; ++c)
+        {
+            extras_.insert(extras_.end(), chunkExtras[c].begin(), chunkExtras[c].end());
+        }
+
+        return true;
+    }
+
+    const std::vector<WaveletRecord> & records() const
+    {
+        return records_;
+    }
+
+    const std::vector<double> & extras() const
+    {
+        return extras_;
+    }
+
+    /**
+     * True when the file could be read but is not laid out the way the parser takes it: its
+     * first record reads otherwise with the library, or a record has too many rectangles.
+     */
+    bool layoutMismatch() const
+    {
+        return mismatch;
+    }
+
+    /**
+     * Parses one line into a record; its extras are appended to the given vector.
+     */
+    bool parseLine(const char * p, const char * const end, WaveletRecord & record, std::vector<double> & extras) const
+    {
+        double value;
+        if ( !(p = parseNumber(p, end, value)) || value < 1 || value > MAX_RECTANGLES )
+        {
+            return false;
+        }
+        record.dimensions = (int)value;
+
+        for (int i = 0; i < record.dimensions; ++i)
+        {
+            double x, y, width, height;
+            if (   !(p = parseNumber(p, end, x))     || !(p = parseNumber(p, end, y))
+                || !(p = parseNumber(p, end, width)) || !(p = parseNumber(p, end, height)) )
+            {
+                return false;
+            }
+            record.rects[i] = cv::Rect((int)x, (int)y, (int)width, (int)height);
+        }
+
+        for (int i = 0; i < record.dimensions; ++i)
+        {
+            if ( !(p = parseNumber(p, end, value)) )
+            {
+                return false;
+            }
+            record.weights[i] = (float)value;
+        }
+
+        for (int i = 0; dualWeights && i < record.dimensions; ++i)
+        {
+            if ( !(p = parseNumber(p, end, value)) )
+            {
+                return false;
+            }
+            record.negativeWeights[i] = (float)value;
+        }
+
+        record.extrasBegin = extras.size();
+        while ( (p = parseNumber(p, end, value)) )
+        {
+            extras.push_back(value);
+        }
+        record.extrasCount = extras.size() - record.extrasBegin;
+        return true;
+    }
+
+    /**
+     * Reads the first record from p on with the library too, and compares both. There must
+     * be a line that isn't empty before end.
+     */
+    bool matchesLibrary(const char * p, const char * const end)
+    {
+        const char * e = lineEnd(p, end);
+        while ( isEmptyLine(p, e) )
+        {
+            p = e + 1;
+            e = lineEnd(p, end);
+        }
+
+        WaveletRecord record;
+        std::vector<double> extras;
+        std::istringstream input( std::string(p, e) );
+
+        bool same = parseLine(p, e, record, extras);
+        if (dualWeights)
+        {
+            DualWeightHaarWavelet wavelet;
+            same = same && wavelet.read(input) && matches(wavelet, wavelet.weightsPositive_begin(), record, record.weights)
+                                               && matches(wavelet, wavelet.weightsNegative_begin(), record, record.negativeWeights);
+        }
+        else
+        {
+            HaarWavelet wavelet;
+            same = same && wavelet.read(input) && matches(wavelet, wavelet.weights_begin(), record, record.weights);
+        }
+
+        mismatch = !same;
+        return same;
+    }
+
+private:
+    bool dualWeights;
+    bool mismatch;
+    std::vector<WaveletRecord> records_;
+    std::vector<double> extras_;
+
+    template <typename Iterator>
+    static bool matches(const AbstractHaarWavelet & wavelet, const Iterator weights, const WaveletRecord & record, const float * const recordWeights)
+    {
+        if ( (int)wavelet.dimensions() != record.dimensions )
+        {
+            return false;
+        }
+
+        for (int i = 0; i < record.dimensions; ++i)
+        {
+            const cv::Rect r = wavelet.rect(i);
+            if (   r.x != record.rects[i].x || r.y != record.rects[i].y
+                || r.width != record.rects[i].width || r.height != record.rects[i].height
+                || std::abs(weights[i] - recordWeights[i]) > 1e-6f * std::max(1.0f, std::abs(recordWeights[i])) )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Functor used by Intel TBB to count the records of each chunk, up to its first empty
+     * line.
+     */
+    class CountRecords
+    {
+        const std::vector<const char *> * bounds;
+        std::vector<size_t> * firstRecords;      //the count of chunk c goes to c + 1
+        std::vector<const char *> * emptyLines;  //first empty line of each chunk, if any
+
+    public:
+        void operator()(const tbb::blocked_range<int> range) const
+        {
+            for (int c = range.begin(); c != range.end(); ++c)
+            {
+                size_t count = 0;
+                const char * const end = (*bounds)[c + 1];
+                for (const char * p = (*bounds)[c]; p < end; )
+                {
+                    const char * const e = lineEnd(p, end);
+                    if ( isEmptyLine(p, e) )
+                    {
+                        (*emptyLines)[c] = p;
+                        break;
+                    }
+                    ++count;
+                    p = e + 1;
+                }
+                (*firstRecords)[c + 1] = count;
+            }
+        }
+
+        CountRecords(const std::vector<const char *> * bounds_,
+                     std::vector<size_t> * firstRecords_,
+                     std::vector<const char *> * emptyLines_) : bounds(bounds_),
+                                                                firstRecords(firstRecords_),
+                                                                emptyLines(emptyLines_) {}
+    };
+
+    /**
+     * Functor used by Intel TBB to parse each chunk into its records.
+     */
+    class ParseChunks
+    {
+        WaveletTextParser * parser;
+        const std::vector<const char *> * bounds;
+        const std::vector<size_t> * firstRecords;
+        std::vector< std::vector<double> > * chunkExtras;
+        std::vector<char> * failed;
+
+    public:
+        void operator()(const tbb::blocked_range<int> range) const
+        {
+            for (int c = range.begin(); c != range.end(); ++c)
+            {
+                size_t r = (*firstRecords)[c];
+                const char * const end = (*bounds)[c + 1];
+                for (const char * p = (*bounds)[c]; p < end; )
+                {
+                    const char * const e = lineEnd(p, end);
+                    if ( !isEmptyLine(p, e) && !parser->parseLine(p, e, parser->records_[r++], (*chunkExtras)[c]) )
+                    {
+                        double dimensions;
+                        (*failed)[c] = parseNumber(p, e, dimensions) && dimensions > MAX_RECTANGLES ? TOO_MANY_RECTANGLES : BAD_RECORD;
+                        break;
+                    }
+                    p = e + 1;
+                }
+            }
+        }
+
+        ParseChunks(WaveletTextParser * parser_,
+                    const std::vector<const char *> * bounds_,
+                    const std::vector<size_t> * firstRecords_,
+                    std::vector< std::vector<double> > * chunkExtras_,
+                    std::vector<char> * failed_) : parser(parser_),
+                                                   bounds(bounds_),
+                                                   firstRecords(firstRecords_),
+                                                   chunkExtras(chunkExtras_),
+                                                   failed(failed_) {}
+    };
+};
+
+
+
+/**
+ * Functor used by Intel TBB to turn parsed records into wavelets.
+ */
+class ToHaarWavelets
+{
+    const std::vector<WaveletRecord> * records;
+    std::vector<HaarWavelet> * wavelets;
+
+public:
+    void operator()(const tbb::blocked_range<size_t> range) const
+    {
+        for (size_t i = range.begin(); i != range.end(); ++i)
+        {
+            const WaveletRecord & record = (*records)[i];
+            (*wavelets)[i] = HaarWavelet( std::vector<cv::Rect>(record.rects, record.rects + record.dimensions),
+                                          std::vector<float>(record.weights, record.weights + record.dimensions) );
+        }
+    }
+
+    ToHaarWavelets(const std::vector<WaveletRecord> * records_,
+                   std::vector<HaarWavelet> * wavelets_) : records(records_),
+                                                           wavelets(wavelets_) {}
+};
+
+
+
+/**
+ * Same as loadHaarWavelets, one line at a time with HaarWavelet::read, but taking the files
+ * of WaveletTextParser: the count header is skipped and checked, and the wavelets end at the
+ * first empty line.
+ */
+inline bool loadHaarWaveletsStream(const std::string & filename, std::vector<HaarWavelet> & wavelets)
+{
+    std::ifstream input(filename.c_str());
+    if ( !input.is_open() )
+    {
+        return false;
+    }
+
+    wavelets.clear();
+    long declaredCount = -1;
+    std::string line;
+    for (bool first = true; std::getline(input, line); first = false)
+    {
+        const char * const p = line.data();
+        const char * const e = p + line.size();
+        if ( first && countHeader(p, e, declaredCount) )
+        {
+            continue;
+        }
+        if ( isEmptyLine(p, e) )
+        {
+            break;
+        }
+
+        std::istringstream lineInputStream(line);
+        HaarWavelet wavelet;
+        if ( !wavelet.read(lineInputStream) )
+        {
+            return false;
+        }
+        wavelets.push_back(wavelet);
+    }
+
+    return declaredCount < 0 || wavelets.size() == (size_t)declaredCount;
+}
+
+
+
+/**
+ * Loads wavelets with loadHaarWaveletsStream and packs them. Wavelets that can't be packed
+ * are handed back in rejected, or make the load fail when rejected is not given.
+ */
+inline bool loadPackedWavelets(const std::string & filename, PackedWaveletSet & packed, std::vector<HaarWavelet> * rejected = 0)
+{
+    std::vector<HaarWavelet> wavelets;
+    return loadHaarWaveletsStream(filename, wavelets) && packWavelets(wavelets, packed, rejected);
+}
+
+
+
+/**
+ * Same as loadHaarWavelets, parsing the file in parallel. Falls back to loadHaarWaveletsStream
+ * when the file is laid out in a way the parser doesn't take; a file that is cut short or has
+ * a bad record fails.
+ */
+inline bool loadHaarWaveletsParallel(const std::string & filename, std::vector<HaarWavelet> & wavelets)
+{
+    WaveletTextParser parser(false);
+    if ( !parser.parse(filename) )
+    {
+        return parser.layoutMismatch() && loadHaarWaveletsStream(filename, wavelets);
+    }
+
+    wavelets.resize( parser.records().size() );
+    tbb::parallel_for( tbb::blocked_range<size_t>(0, wavelets.size()), ToHaarWavelets(&parser.records(), &wavelets) );
+    return true;
+}
+
+
+
+/**
+ * Same as loadPackedWavelets, parsing the file in parallel. The records are packed as they
+ * are, without going through HaarWavelet. Falls back to loadPackedWavelets in the same cases
+ * as loadHaarWaveletsParallel.
+ */
+inline bool loadPackedWaveletsParallel(const std::string & filename, PackedWaveletSet & packed, std::vector<HaarWavelet> * rejected = 0)
+{
+    WaveletTextParser parser(false);
+    if ( !parser.parse(filename) )
+    {
+        return parser.layoutMismatch() && loadPackedWavelets(filename, packed, rejected);
+    }
+
+    const std::vector<WaveletRecord> & records = parser.records();
+    packed.clear();
+    packed.reserve(records.size());
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        const WaveletRecord & record = records[i];
+        if ( !packed.add(record.dimensions, record.rects, record.weights) )
+        {
+            if (!rejected)
+            {
+                return false;
+            }
+            rejected->push_back( HaarWavelet( std::vector<cv::Rect>(record.rects, record.rects + record.dimensions),
+                                              std::vector<float>(record.weights, record.weights + record.dimensions) ) );
+        }
+    }
+    return true;
+}
+
+
+
+#endif // WAVELET_PARSER_H
@@ -0,0 +1,208 @@
+#ifndef WAVELET_SCHEDULE_H
+#define WAVELET_SCHEDULE_H
+
+#include <vector>
+#include <set>
+#include <atomic>
+#include <numeric>
+#include <algorithm>
+
+#include <tbb/tbb.h>
+
+#include "packed_wavelet.h"
+
+
+
+#define SCHEDULE_CHUNK 64 //most wavelets in a chunk
+#define EIGEN_COST 10     //relative cost of the eigen decomposition of a wavelet, per K^3
+
+
+
+/**
+ * Relative cost of optimizing a wavelet of K rectangles: on each sample its SRFS are
+ * evaluated, four integral lookups per rectangle, and added to the K x K co-moments; then
+ * the co-moments are decomposed once. Samples whose statistics are looked up in a
+ * covariance table only cost the lookup of the K x K entries.
+ *
+ * The size of the rectangles does not change the work done on an integral image, so it
+ * only counts through the covariance tables, which only serve wavelets whose rectangles
+ * all have the same size.
+ */
+inline double waveletCost(const PackedWavelet & wavelet, const double samples, const double tabledSamples)
+{
+    const int k = wavelet.dimensions;
+    const bool sameSize = std::count(wavelet.sizes, wavelet.sizes + k, wavelet.sizes[0]) == k;
+    const double evaluated = sameSize ? samples - tabledSamples : samples;
+
+    return evaluated * (4.0 * k + k * k) + (tabledSamples > 0 && sameSize ? k * k : 0) + EIGEN_COST * k * k * k;
+}
+
+
+
+/**
+ * A run of consecutive wavelets with the same dimensions and rectangle sizes.
+ */
+struct WaveletChunk
+{
+    size_t begin, end;
+    double cost;
+
+    bool operator < (const WaveletChunk & rh) const
+    {
+        return cost > rh.cost;
+    }
+};
+
+
+
+/**
+ * Splits the wavelets in buckets of the same dimensions and rectangle sizes, and the
+ * buckets in chunks of up to SCHEDULE_CHUNK wavelets. Chunks are ordered longest
+ * processing time first, by the waveletCost of their wavelets, and handed to the workers
+ * one at a time as they become free.
+ *
+ * Buckets are runs of consecutive wavelets, which is what haargen writes; the wavelets
+ * are never reordered, so classifiers and statistics keep their indexes. When the wavelets
+ * are not grouped that way (a bucket shows up again after another one), buckets would be
+ * too small to be worth scheduling, so the wavelets are cut in plain chunks of
+ * SCHEDULE_CHUNK instead and grouped() is false. Either way the optimizers batch the
+ * wavelets of a chunk by dimensions, so the kernels specialized on them are used.
+ */
+class WaveletSchedule
+{
+public:
+    /**
+     * samples is the amount of samples the wavelets are optimized over, and tabledSamples
+     * how many of them have a covariance table.
+     */
+    WaveletSchedule(const PackedWaveletSet & wavelets,
+                    const double samples,
+                    const double tabledSamples = 0) : bucketCount(0),
+                                                      grouped_(true)
+    {
+        std::vector<double> costs(wavelets.size());
+        for (size_t i = 0; i < wavelets.size(); ++i)
+        {
+            costs[i] = waveletCost(wavelets[i], samples, tabledSamples);
+        }
+
+        std::set<BucketKey> seen;
+        std::vector<size_t> bounds(1, 0);
+        while (bounds.back() < wavelets.size())
+        {
+            const size_t begin = bounds.back();
+            size_t end = begin + 1;
+            while ( end < wavelets.size() && sameBucket(wavelets[begin], wavelets[end]) )
+            {
+                ++end;
+            }
+            grouped_ = grouped_ && seen.insert( bucketKey(wavelets[begin]) ).second;
+            bounds.push_back(end);
+        }
+
+        if (!grouped_)
+        {
+            bounds.clear();
+            for (size_t b = 0; b < wavelets.size(); b += SCHEDULE_CHUNK)
+            {
+                bounds.push_back(b);
+            }
+            bounds.push_back(wavelets.size());
+        }
+        bucketCount = bounds.size() - 1;
+
+        for (size_t i = 0; i + 1 < bounds.size(); ++i)
+        {
+            for (size_t b = bounds[i]; b < bounds[i + 1]; b += SCHEDULE_CHUNK)
+            {
+                WaveletChunk chunk;
+                chunk.begin = b;
+                chunk.end = std::min<size_t>(b + SCHEDULE_CHUNK, bounds[i + 1]);
+                chunk.cost = std::accumulate(costs.begin() + chunk.begin, costs.begin() + chunk.end, .0);
+                chunks.push_back(chunk);
+            }
+        }
+
+        std::stable_sort(chunks.begin(), chunks.end());
+    }
+
+    /**
+     * False when the wavelets were not grouped in runs of the same dimensions and rectangle
+     * sizes, as haargen writes them, and were scheduled in plain chunks.
+     */
+    bool grouped() const
+    {
+        return grouped_;
+    }
+
+    size_t buckets() const
+    {
+        return bucketCount;
+    }
+
+    /**
+     * Runs body, which takes tbb::blocked_range<size_t> as tbb::parallel_for bodies do,
+     * over every chunk, taking the next chunk from the shared counter next.
+     */
+    template <typename Body>
+    void run(const Body & body, std::atomic<size_t> & next) const
+    {
+        tbb::parallel_for( tbb::blocked_range<int>(0, tbb::this_task_arena::max_concurrency(), 1),
+                           TakeChunks<Body>(this, body, &next),
+                           tbb::simple_partitioner() );
+    }
+
+    template <typename Body>
+    void parallel_for(const Body & body) const
+    {
+        std::atomic<size_t> next(0);
+        run(body, next);
+    }
+
+private:
+    typedef std::vector<uint16_t> BucketKey; //dimensions, then the packed size of each rectangle
+
+    std::vector<WaveletChunk> chunks;
+    size_t bucketCount;
+    bool grouped_;
+
+    static BucketKey bucketKey(const PackedWavelet & wavelet)
+    {
+        BucketKey key(1, wavelet.dimensions);
+        key.insert(key.end(), wavelet.sizes, wavelet.sizes + wavelet.dimensions);
+        return key;
+    }
+
+    static bool sameBucket(const PackedWavelet & a, const PackedWavelet & b)
+    {
+        return a.dimensions == b.dimensions && std::equal(a.sizes, a.sizes + a.dimensions, b.sizes);
+    }
+
+    template <typename Body>
+    class TakeChunks
+    {
+        const WaveletSchedule * schedule;
+        Body body;
+        std::atomic<size_t> * next;
+
+    public:
+        void operator()(const tbb::blocked_range<int>) const
+        {
+            for (size_t c = next->fetch_add(1); c < schedule->chunks.size(); c = next->fetch_add(1))
+            {
+                const WaveletChunk & chunk = schedule->chunks[c];
+                body( tbb::blocked_range<size_t>(chunk.begin, chunk.end) );
+            }
+        }
+
+        TakeChunks(const WaveletSchedule * schedule_,
+                   const Body & body_,
+                   std::atomic<size_t> * next_) : schedule(schedule_),
+                                                  body(body_),
+                                                  next(next_) {}
+    };
+};
+
+
+
+#endif // WAVELET_SCHEDULE_H
@@ -0,0 +1,281 @@
+#ifndef WAVELET_STATISTICS_H
+#define WAVELET_STATISTICS_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+#include "haarwavelet.h"
+
+#include "srfs_moments.h"
+#include "feature_moments.h"
+#include "packed_wavelet.h"
+
+
+
+#define STATISTICS_FILE_MAGIC "HAARSTATS3"
+
+
+
+/**
+ * Everything an optimizer needs to know about a wavelet to produce its classifier, kept
+ * so that new samples can be merged in later without going through the old ones again.
+ * The histograms hold bin counts instead of frequencies, so they can be merged as well;
+ * they are only kept by optimizers whose histogram projection does not depend on the data.
+ * Optimizers that model the feature values instead of the SRFS keep their moments.
+ */
+struct WaveletStatistics
+{
+    SrfsMoments positive, negative;
+    std::vector<double> positiveHistogram, negativeHistogram;
+    FeatureMoments positiveFeature, negativeFeature;
+    unsigned long long wavelet; //waveletHash of the wavelet, as loaded from a file
+
+    WaveletStatistics() : wavelet(0) {}
+};
+
+
+
+/**
+ * FNV-1a hash of the rectangles and the weights of wavelet w, which is everything its
+ * statistics depend on. The rectangles are hashed as ints and the weights as floats, so
+ * the hash does not depend on how the wavelet is packed.
+ */
+inline unsigned long long waveletHash(const PackedWaveletSet & wavelets, const size_t w)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    const int dimensions = wavelets[w].dimensions;
+
+    int values[1 + 4 * MAX_RECTANGLES];
+    float weights[MAX_RECTANGLES];
+    int count = 0;
+    values[count++] = dimensions;
+    for (int i = 0; i < dimensions; ++i)
+    {
+        const cv::Rect r = wavelets[w].rect(i);
+        values[count++] = r.x;
+        values[count++] = r.y;
+        values[count++] = r.width;
+        values[count++] = r.height;
+        weights[i] = wavelets.weight(w, i);
+    }
+
+    const unsigned char * bytes = (const unsigned char *)values;
+    for (size_t i = 0; i < count * sizeof(int); ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    bytes = (const unsigned char *)weights;
+    for (size_t i = 0; i < dimensions * sizeof(float); ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+
+inline void writeMoments(std::ostream & output, const SrfsMoments & moments)
+{
+    output.write((const char *)&moments.dimensions, sizeof(moments.dimensions));
+    output.write((const char *)&moments.count, sizeof(moments.count));
+    output.write((const char *)moments.mean, moments.dimensions * sizeof(double));
+    for (int i = 0; i < moments.dimensions; ++i)
+    {
+        output.write((const char *)moments.comoment[i], moments.dimensions * sizeof(double));
+    }
+}
+
+
+
+inline bool readMoments(std::istream & input, SrfsMoments & moments)
+{
+    int dimensions = 0;
+    input.read((char *)&dimensions, sizeof(dimensions));
+    if ( !input || dimensions < 0 || dimensions > MAX_RECTANGLES )
+    {
+        return false;
+    }
+
+    moments.reset(dimensions);
+    input.read((char *)&moments.count, sizeof(moments.count));
+    input.read((char *)moments.mean, dimensions * sizeof(double));
+    for (int i = 0; i < dimensions; ++i)
+    {
+        input.read((char *)moments.comoment[i], dimensions * sizeof(double));
+    }
+
+    return (bool)input;
+}
+
+
+
+inline void writeHistogram(std::ostream & output, const std::vector<double> & histogram)
+{
+    const int buckets = histogram.size();
+    output.write((const char *)&buckets, sizeof(buckets));
+    if (buckets > 0)
+    {
+        output.write((const char *)&histogram[0], buckets * sizeof(double));
+    }
+}
+
+
+
+inline bool readHistogram(std::istream & input, std::vector<double> & histogram)
+{
+    int buckets = 0;
+    input.read((char *)&buckets, sizeof(buckets));
+    if ( !input || buckets < 0 )
+    {
+        return false;
+    }
+
+    histogram.resize(buckets);
+    if (buckets > 0)
+    {
+        input.read((char *)&histogram[0], buckets * sizeof(double));
+    }
+
+    return (bool)input;
+}
+
+
+
+inline void writeFeatureMoments(std::ostream & output, const FeatureMoments & moments)
+{
+    output.write((const char *)&moments.count, sizeof(moments.count));
+    output.write((const char *)&moments.mean, sizeof(moments.mean));
+    output.write((const char *)&moments.m2, sizeof(moments.m2));
+}
+
+
+
+inline bool readFeatureMoments(std::istream & input, FeatureMoments & moments)
+{
+    input.read((char *)&moments.count, sizeof(moments.count));
+    input.read((char *)&moments.mean, sizeof(moments.mean));
+    input.read((char *)&moments.m2, sizeof(moments.m2));
+
+    return (bool)input;
+}
+
+
+
+/**
+ * Writes the statistics of all wavelets, in the same order as the wavelets file they
+ * were produced from, to a binary file. Each record starts with the waveletHash of its
+ * wavelet.
+ */
+inline bool writeWaveletStatistics(const std::string & filename,
+                                   const std::vector<WaveletStatistics> & statistics,
+                                   const PackedWaveletSet & wavelets)
+{
+    if ( statistics.size() != wavelets.size() )
+    {
+        return false;
+    }
+
+    std::ofstream output(filename.c_str(), std::ios::binary | std::ios::trunc);
+    if ( !output.is_open() )
+    {
+        return false;
+    }
+
+    output.write(STATISTICS_FILE_MAGIC, std::strlen(STATISTICS_FILE_MAGIC));
+    const long long records = statistics.size();
+    output.write((const char *)&records, sizeof(records));
+
+    std::vector<WaveletStatistics>::const_iterator it = statistics.begin();
+    const std::vector<WaveletStatistics>::const_iterator end = statistics.end();
+    for(size_t w = 0; it != end; ++it, ++w)
+    {
+        const unsigned long long hash = waveletHash(wavelets, w);
+        output.write((const char *)&hash, sizeof(hash));
+        writeMoments(output, it->positive);
+        writeMoments(output, it->negative);
+        writeHistogram(output, it->positiveHistogram);
+        writeHistogram(output, it->negativeHistogram);
+        writeFeatureMoments(output, it->positiveFeature);
+        writeFeatureMoments(output, it->negativeFeature);
+    }
+
+    return (bool)output;
+}
+
+
+
+/**
+ * Loads statistics written by writeWaveletStatistics.
+ */
+inline bool loadWaveletStatistics(const std::string & filename, std::vector<WaveletStatistics> & statistics)
+{
+    std::ifstream input(filename.c_str(), std::ios::binary);
+    if ( !input.is_open() )
+    {
+        return false;
+    }
+
+    char magic[sizeof(STATISTICS_FILE_MAGIC)] = {0};
+    input.read(magic, std::strlen(STATISTICS_FILE_MAGIC));
+    if ( !input || std::strcmp(magic, STATISTICS_FILE_MAGIC) != 0 )
+    {
+        return false;
+    }
+
+    long long records = 0;
+    input.read((char *)&records, sizeof(records));
+    if ( !input || records < 0 )
+    {
+        return false;
+    }
+
+    statistics.resize(records);
+    for (long long i = 0; i < records; ++i)
+    {
+        WaveletStatistics & s = statistics[i];
+        input.read((char *)&s.wavelet, sizeof(s.wavelet));
+        if (   !input
+            || !readMoments(input, s.positive) || !readMoments(input, s.negative)
+            || !readHistogram(input, s.positiveHistogram) || !readHistogram(input, s.negativeHistogram)
+            || !readFeatureMoments(input, s.positiveFeature) || !readFeatureMoments(input, s.negativeFeature) )
+        {
+            return false;
+        }
+    }
+
+    return (bool)input;
+}
+
+
+
+/**
+ * Checks that the statistics were produced from the same wavelets, in the same order:
+ * same rectangles and same weights.
+ */
+inline bool matchWavelets(const std::vector<WaveletStatistics> & statistics, const PackedWaveletSet & wavelets)
+{
+    if ( statistics.size() != wavelets.size() )
+    {
+        return false;
+    }
+
+    for (unsigned int i = 0; i < statistics.size(); ++i)
+    {
+        const int dimensions = wavelets[i].dimensions;
+        if (   statistics[i].wavelet != waveletHash(wavelets, i)
+            || (statistics[i].positive.count > 0 && statistics[i].positive.dimensions != dimensions)
+            || (statistics[i].negative.count > 0 && statistics[i].negative.dimensions != dimensions) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+#endif // WAVELET_STATISTICS_H